@@ -8,12 +8,41 @@
 //  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
 //
 
+#ifndef INCLUDE_LIBJPCNN_H
+#define INCLUDE_LIBJPCNN_H
+
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
 
 #define JPCNN_MULTISAMPLE      (1 << 0)
 #define JPCNN_RANDOM_SAMPLE    (1 << 1)
+// Only used by the top-k calls, and ignored along with JPCNN_MULTISAMPLE.
+#define JPCNN_SKIP_SOFTMAX     (1 << 2)
+
+#define JPCNN_MAX_DIMENSIONS   (5)
+
+#define JPCNN_WEIGHTS_DEFAULT  (0)
+#define JPCNN_WEIGHTS_FLOAT16  (1)
+#define JPCNN_WEIGHTS_BFLOAT16 (2)
+
+typedef struct JPCNNLayerStatsStruct {
+  const char* name;
+  float milliseconds;
+  double flops;
+  double bytesRead;
+  double bytesWritten;
+  int outputDims[JPCNN_MAX_DIMENSIONS];
+  int outputDimsLength;
+} JPCNNLayerStats;
+
+typedef struct JPCNNPredictionStruct {
+  int index;
+  float value;
+  const char* name;
+} JPCNNPrediction;
 
 void* jpcnn_create_network(const char* filename);
 void jpcnn_destroy_network(void* networkHandle);
@@ -21,8 +50,40 @@ void* jpcnn_create_image_buffer_from_file(const char* filename);
 void jpcnn_destroy_image_buffer(void* imageHandle);
 void* jpcnn_create_image_buffer_from_uint8_data(unsigned char* pixelData, int width, int height, int channels, int rowBytes, int reverseOrder, int doRotate);
 void jpcnn_classify_image(void* networkHandle, void* inputHandle, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+void jpcnn_classify_images(void* networkHandle, void** inputHandles, int inputsCount, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+int jpcnn_classify_image_topk(void* networkHandle, void* inputHandle, unsigned int flags, int layerOffset, int k, JPCNNPrediction* outPredictions);
 void jpcnn_print_network(void* networkHandle);
 
+void* jpcnn_create_session(void* networkHandle);
+void jpcnn_destroy_session(void* sessionHandle);
+void jpcnn_classify_image_in_session(void* sessionHandle, void* inputHandle, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+void jpcnn_classify_images_in_session(void* sessionHandle, void** inputHandles, int inputsCount, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+int jpcnn_classify_image_topk_in_session(void* sessionHandle, void* inputHandle, unsigned int flags, int layerOffset, int k, JPCNNPrediction* outPredictions);
+size_t jpcnn_get_planned_memory_size(void* networkHandle, int inputsCount, unsigned int flags, int layerOffset);
+
+void jpcnn_set_thread_count(int threadCount);
+int jpcnn_get_thread_count();
+const char* jpcnn_get_instruction_set();
+
+void jpcnn_enable_profiling(void* networkHandle, int enabled);
+void jpcnn_get_layer_stats(void* networkHandle, JPCNNLayerStats** outStats, int* outStatsLength);
+void jpcnn_get_layer_stats_in_session(void* sessionHandle, JPCNNLayerStats** outStats, int* outStatsLength);
+int jpcnn_get_layer_offset(void* networkHandle, const char* layerName, int* outLayerOffset);
+void jpcnn_classify_image_with_taps(void* networkHandle, void* inputHandle, unsigned int flags, const int* layerOffsets, int tapsCount, float** outTapsValues, int* outTapsLengths);
+void jpcnn_classify_image_with_taps_in_session(void* sessionHandle, void* inputHandle, unsigned int flags, const int* layerOffsets, int tapsCount, float** outTapsValues, int* outTapsLengths);
+void* jpcnn_create_activations_from_image(void* networkHandle, void* inputHandle, unsigned int flags, int layerOffset);
+void jpcnn_destroy_activations(void* activationsHandle);
+int jpcnn_save_activations(const char* filename, void* activationsHandle, int bitsPerFloat);
+void* jpcnn_load_activations(const char* filename);
+void jpcnn_classify_activations(void* networkHandle, void* activationsHandle, int startLayerOffset, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+void jpcnn_classify_activations_in_session(void* sessionHandle, void* activationsHandle, int startLayerOffset, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+void jpcnn_calibrate_image(void* networkHandle, void* inputHandle, unsigned int flags);
+int jpcnn_save_network(const char* filename, void* networkHandle);
+int jpcnn_set_winograd_tolerance(void* networkHandle, const char* layerName, float tolerance);
+int jpcnn_set_layer_weights_format(void* networkHandle, const char* layerName, int format);
+int jpcnn_prune_layer(void* networkHandle, const char* layerName, float sparsity);
+int jpcnn_factorize_layer(void* networkHandle, const char* layerName, int rank, float energy);
+
 void* jpcnn_create_trainer();
 void jpcnn_destroy_trainer(void* trainerHandle);
 void jpcnn_train(void* trainerHandle, float expectedLabel, float* predictions, int predictionsLength);
@@ -36,3 +97,5 @@ float jpcnn_predict(void* predictorHandle, float* predictions, int predictionsLe
 #ifdef __cplusplus
 }
 #endif // __cplusplus
+
+#endif // INCLUDE_LIBJPCNN_H
@@ -0,0 +1,1174 @@
+//
+//  bench.cpp
+//  jpcnn
+//
+//  Times the library's core kernels on the shapes the Jetpac network uses,
+//  and writes the results out as JSON so runs from different commits can be
+//  diffed. Given a network file, it also measures every layer with and
+//  without fusion, and the throughput at a range of batch sizes.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "jpcnn.h"
+#include "libjpcnn.h"
+#include "binary_format.h"
+#include "buffer.h"
+#include "dimensions.h"
+#include "matrix_ops.h"
+#include "prepareinput.h"
+#include "thread_pool.h"
+
+#define STATIC_ARRAY_LEN(x) ((int)(sizeof(x) / sizeof(x[0])))
+
+// Very quick kernels are called several times within each timed sample, so
+// that the clock's resolution doesn't swamp the results.
+static const double kMinSampleMilliseconds = 2.0;
+static const int kMaxCallsPerSample = 10000;
+// Long enough for the longest weights type name, "bfloat16".
+static const int kMaxTypeNameLength = 16;
+
+typedef struct SBenchArgumentValuesStruct {
+  const char* filter;
+  int warmupCount;
+  int iterationsCount;
+  int threadCount;
+  int doPin;
+  const char* networkFilename;
+  const char* imageFilename;
+  int networkIterationsCount;
+  int maxBatchSize;
+  const char* outputFilename;
+} SBenchArgumentValues;
+
+typedef struct SToolOptionStruct {
+  const char* longName;
+  const char shortName;
+  const char* defaultValue;
+  const char* description;
+} SToolOption;
+
+typedef struct SBenchContextStruct {
+  SBenchArgumentValues* args;
+  FILE* output;
+  int resultsCount;
+} SBenchContext;
+
+// Everything a kernel needs for one call. Each benchmark only fills in the
+// members it uses, and the rest stay zero.
+typedef struct SKernelBenchStruct {
+  Buffer* input;
+  Buffer* weights;
+  Buffer* output;
+  Buffer* scratch;
+  int m;
+  int n;
+  int k;
+  int kernelWidth;
+  int kernelCount;
+  int stride;
+  SBinaryTag* tag;
+  int32_t* rowSums;
+  SSparseMatrix* sparseWeights;
+} SKernelBench;
+
+typedef void (*KernelBenchFunction)(SKernelBench* bench);
+
+// All timings are in milliseconds.
+typedef struct STimingStatsStruct {
+  double min;
+  double mean;
+  double p50;
+  double p90;
+  double p99;
+  double max;
+} STimingStats;
+
+// Convolutions are measured one group at a time, since that's what the
+// grouped layers pass to matrix_correlate(). Input sizes include the margin.
+typedef struct SConvShapeStruct {
+  const char* name;
+  int inputSize;
+  int inputChannels;
+  int kernelWidth;
+  int kernelCount;
+  int stride;
+} SConvShape;
+
+typedef struct SGemmShapeStruct {
+  const char* name;
+  int m;
+  int n;
+  int k;
+} SGemmShape;
+
+// The width and channels of square activations.
+typedef struct SImageShapeStruct {
+  const char* name;
+  int size;
+  int channels;
+} SImageShape;
+
+static SToolOption g_toolOptions[] = {
+  {"filter", 'f', "", "Only run kernels whose name or shape contains this text."},
+  {"warmup", 'w', "3", "How many untimed calls to make before measuring each kernel."},
+  {"iterations", 'i', "30", "How many timed samples to take of each kernel."},
+  {"threads", 'r', "0", "How many threads to use. Zero uses the JPCNN_THREADS environment variable if it's set, or one thread per processor."},
+  {"pin", 'p', "1", "Whether to bind each thread to its own processor."},
+  {"network", 'n', NULL, "A network file to measure per-layer stats, fusion and batch throughput with."},
+  {"image", 'm', NULL, "An image to run the network on. A synthetic one is used if this isn't given."},
+  {"network_iterations", 't', "3", "How many timed runs of the whole network to make for each measurement."},
+  {"max_batch", 'b', "32", "The largest batch size to measure network throughput at."},
+  {"output", 'o', NULL, "Where to write the JSON results. They go to stdout if this isn't given."},
+};
+static const int g_toolOptionsLength = STATIC_ARRAY_LEN(g_toolOptions);
+
+static SConvShape g_convShapes[] = {
+  {"conv1 11x11/4", 227, 3, 11, 96, 4},
+  {"conv2 5x5 grouped", 31, 48, 5, 128, 1},
+  {"conv3 3x3", 15, 256, 3, 384, 1},
+  {"conv4 3x3 grouped", 15, 192, 3, 192, 1},
+  {"conv5 3x3 grouped", 15, 192, 3, 128, 1},
+};
+
+static SGemmShape g_fullyConnectedShapes[] = {
+  {"fc6", 4096, 1, 9216},
+  {"fc6 batch 16", 4096, 16, 9216},
+  {"fc7", 4096, 1, 4096},
+  {"fc8", 1000, 1, 4096},
+};
+
+static SImageShape g_poolShapes[] = {
+  {"pool1", 55, 96},
+  {"pool2", 27, 256},
+  {"pool5", 13, 256},
+};
+
+static SImageShape g_normalizeShapes[] = {
+  {"norm1", 27, 96},
+  {"norm2", 13, 256},
+};
+
+static void parse_command_line_args(int argc, const char* argv[], SBenchArgumentValues* outValues);
+static void print_usage_and_exit(int argc, const char* argv[]);
+static double current_milliseconds();
+static void calculate_timing_stats(double* samples, int samplesCount, STimingStats* outStats);
+static void print_json_string(FILE* output, const char* value);
+static void print_json_timing_stats(FILE* output, const STimingStats* stats);
+static SGemmShape gemm_shape_for_conv(const SConvShape* convShape);
+static Buffer* new_random_buffer(const Dimensions& dims, int bitsPerElement, int elementFormat = JPElementFormatLinear);
+static void weights_type_name(int bitsPerElement, int elementFormat, char* outName, size_t nameSize);
+static void delete_kernel_bench(SKernelBench* bench);
+static void run_kernel_bench(SBenchContext* context, const char* name, const char* shape, double flops, double bytes, KernelBenchFunction function, SKernelBench* bench);
+static void bench_gemm(SBenchContext* context, const SGemmShape* shape, int bitsPerElement, int elementFormat = JPElementFormatLinear);
+static void bench_dot_int8(SBenchContext* context, const SGemmShape* shape);
+static void bench_gemv(SBenchContext* context, const SGemmShape* shape, int bitsPerElement, int elementFormat);
+static void bench_dot_sparse(SBenchContext* context, const SGemmShape* shape, jpfloat_t density);
+static void bench_correlate(SBenchContext* context, const SConvShape* shape);
+static void bench_correlate_direct(SBenchContext* context, const SConvShape* shape);
+static void bench_correlate_winograd(SBenchContext* context, const SConvShape* shape);
+#if defined(USE_NATIVE_GEMM)
+static void bench_correlate_implicit(SBenchContext* context, const SConvShape* shape);
+#endif // USE_NATIVE_GEMM
+static void bench_max_patch(SBenchContext* context, const SImageShape* shape);
+static void bench_average_patch(SBenchContext* context, const SImageShape* shape);
+static void bench_local_response(SBenchContext* context, const SImageShape* shape);
+static void bench_softmax(SBenchContext* context, int imagesCount);
+static void bench_rescale(SBenchContext* context, int inputWidth, int inputHeight, int outputSize);
+static void bench_tag_dict(SBenchContext* context, const char* shape, const Dimensions& dims, int bitsPerElement);
+static void bench_dequantize(SBenchContext* context, const char* shape, const Dimensions& dims, int bitsPerElement, int elementFormat = JPElementFormatLinear);
+static void call_gemm(SKernelBench* bench);
+static void call_gemm_fixed(SKernelBench* bench);
+static void call_dot_int8(SKernelBench* bench);
+static void call_dot_sparse(SKernelBench* bench);
+static void call_gemv(SKernelBench* bench);
+static void call_correlate(SKernelBench* bench);
+static void call_correlate_direct(SKernelBench* bench);
+static void call_correlate_winograd(SKernelBench* bench);
+#if defined(USE_NATIVE_GEMM)
+static void call_correlate_implicit(SKernelBench* bench);
+#endif // USE_NATIVE_GEMM
+static void call_max_patch(SKernelBench* bench);
+static void call_average_patch(SKernelBench* bench);
+static void call_local_response(SKernelBench* bench);
+static void call_softmax(SKernelBench* bench);
+static void call_rescale(SKernelBench* bench);
+static void call_tag_dict(SKernelBench* bench);
+static void call_dequantize(SKernelBench* bench);
+static void* create_bench_image(const char* imageFilename);
+static void bench_network_layers(SBenchContext* context, void* network, void* image, const char* key);
+static void bench_network_batches(SBenchContext* context, void* network, void* image);
+static void bench_network(SBenchContext* context);
+
+int main(int argc, const char* argv[]) {
+  SBenchArgumentValues argValues;
+  parse_command_line_args(argc, argv, &argValues);
+
+  if (argValues.threadCount > 0) {
+    jpcnn_set_thread_count(argValues.threadCount);
+  }
+  thread_pool_set_pinned(argValues.doPin);
+
+  FILE* output = stdout;
+  if (argValues.outputFilename != NULL) {
+    output = fopen(argValues.outputFilename, "w");
+    if (output == NULL) {
+      fprintf(stderr, "Couldn't open '%s' for writing\n", argValues.outputFilename);
+      return 1;
+    }
+  }
+
+  SBenchContext context;
+  context.args = &argValues;
+  context.output = output;
+  context.resultsCount = 0;
+
+  fprintf(output, "{\n");
+  fprintf(output, "  \"threads\": %d,\n", jpcnn_get_thread_count());
+  fprintf(output, "  \"instruction_set\": \"%s\",\n", jpcnn_get_instruction_set());
+  fprintf(output, "  \"pinned\": %s,\n", (argValues.doPin ? "true" : "false"));
+  fprintf(output, "  \"warmup\": %d,\n", argValues.warmupCount);
+  fprintf(output, "  \"iterations\": %d,\n", argValues.iterationsCount);
+  fprintf(output, "  \"kernels\": [");
+
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_convShapes); index += 1) {
+    const SGemmShape gemmShape = gemm_shape_for_conv(&g_convShapes[index]);
+    bench_gemm(&context, &gemmShape, 32);
+  }
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_fullyConnectedShapes); index += 1) {
+    bench_gemm(&context, &g_fullyConnectedShapes[index], 32);
+  }
+  // The network stores convolution weights as 16-bit, and fully-connected
+  // weights as 8-bit.
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_convShapes); index += 1) {
+    const SGemmShape gemmShape = gemm_shape_for_conv(&g_convShapes[index]);
+    bench_gemm(&context, &gemmShape, 16);
+  }
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_fullyConnectedShapes); index += 1) {
+    bench_gemm(&context, &g_fullyConnectedShapes[index], 8);
+  }
+  // Layers can also be saved with half-precision weights instead.
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_convShapes); index += 1) {
+    const SGemmShape gemmShape = gemm_shape_for_conv(&g_convShapes[index]);
+    bench_gemm(&context, &gemmShape, 16, JPElementFormatHalf);
+  }
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_fullyConnectedShapes); index += 1) {
+    bench_dot_int8(&context, &g_fullyConnectedShapes[index]);
+  }
+  const int gemvBitsPerElement[] = {32, 16, 8, 16, 16};
+  const int gemvElementFormats[] = {JPElementFormatLinear, JPElementFormatLinear, JPElementFormatLinear, JPElementFormatHalf, JPElementFormatBFloat16};
+  for (int typeIndex = 0; typeIndex < STATIC_ARRAY_LEN(gemvBitsPerElement); typeIndex += 1) {
+    for (int index = 0; index < STATIC_ARRAY_LEN(g_fullyConnectedShapes); index += 1) {
+      bench_gemv(&context, &g_fullyConnectedShapes[index], gemvBitsPerElement[typeIndex], gemvElementFormats[typeIndex]);
+    }
+  }
+  // Pruned layers at a typical density, and at the highest one that still
+  // runs sparse.
+  const jpfloat_t sparseDensities[] = {0.1f, 0.3f};
+  for (int densityIndex = 0; densityIndex < STATIC_ARRAY_LEN(sparseDensities); densityIndex += 1) {
+    for (int index = 0; index < STATIC_ARRAY_LEN(g_fullyConnectedShapes); index += 1) {
+      bench_dot_sparse(&context, &g_fullyConnectedShapes[index], sparseDensities[densityIndex]);
+    }
+  }
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_convShapes); index += 1) {
+    bench_correlate(&context, &g_convShapes[index]);
+  }
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_convShapes); index += 1) {
+    bench_correlate_direct(&context, &g_convShapes[index]);
+  }
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_convShapes); index += 1) {
+    bench_correlate_winograd(&context, &g_convShapes[index]);
+  }
+#if defined(USE_NATIVE_GEMM)
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_convShapes); index += 1) {
+    bench_correlate_implicit(&context, &g_convShapes[index]);
+  }
+#endif // USE_NATIVE_GEMM
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_poolShapes); index += 1) {
+    bench_max_patch(&context, &g_poolShapes[index]);
+  }
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_poolShapes); index += 1) {
+    bench_average_patch(&context, &g_poolShapes[index]);
+  }
+  for (int index = 0; index < STATIC_ARRAY_LEN(g_normalizeShapes); index += 1) {
+    bench_local_response(&context, &g_normalizeShapes[index]);
+  }
+  bench_softmax(&context, 1);
+  bench_softmax(&context, 16);
+  bench_rescale(&context, 640, 480, 256);
+  bench_tag_dict(&context, "conv2 16-bit", Dimensions(128, 1200), 16);
+  bench_tag_dict(&context, "fc6 8-bit", Dimensions(4096, 9216), 8);
+  bench_dequantize(&context, "conv2 16-bit", Dimensions(128, 1200), 16);
+  bench_dequantize(&context, "fc6 8-bit", Dimensions(4096, 9216), 8);
+  bench_dequantize(&context, "fc6 half", Dimensions(4096, 9216), 16, JPElementFormatHalf);
+  bench_dequantize(&context, "fc6 bfloat16", Dimensions(4096, 9216), 16, JPElementFormatBFloat16);
+
+  fprintf(output, "\n  ]");
+  if (argValues.networkFilename != NULL) {
+    fprintf(output, ",\n");
+    bench_network(&context);
+  }
+  fprintf(output, "\n}\n");
+
+  if (output != stdout) {
+    fclose(output);
+  }
+  return 0;
+}
+
+void parse_command_line_args(int argc, const char* argv[], SBenchArgumentValues* outValues) {
+
+  const char* optionStringValues[g_toolOptionsLength];
+  for (int index = 0; index < g_toolOptionsLength; index += 1) {
+    optionStringValues[index] = g_toolOptions[index].defaultValue;
+  }
+
+  int argIndex = 1;
+  while (argIndex < argc) {
+    const char* fullArg = argv[argIndex];
+    const size_t fullArgLength = strlen(fullArg);
+    if ((strcmp(fullArg, "-h") == 0) || (strcmp(fullArg, "--help") == 0)) {
+      print_usage_and_exit(argc, argv);
+    }
+    if ((fullArg[0] != '-') || (fullArgLength < 2)) {
+      fprintf(stderr, "Unexpected argument '%s'\n", fullArg);
+      print_usage_and_exit(argc, argv);
+    }
+    int foundIndex = -1;
+    for (int index = 0; index < g_toolOptionsLength; index += 1) {
+      SToolOption* toolOption = &g_toolOptions[index];
+      const bool isLongMatch = ((fullArg[1] == '-') && (strcasecmp(toolOption->longName, (fullArg + 2)) == 0));
+      const bool isShortMatch = ((fullArgLength == 2) && (fullArg[1] == toolOption->shortName));
+      if (isLongMatch || isShortMatch) {
+        foundIndex = index;
+        break;
+      }
+    }
+    if (foundIndex == -1) {
+      fprintf(stderr, "Unknown option '%s'\n", fullArg);
+      print_usage_and_exit(argc, argv);
+    }
+    if (argIndex == (argc - 1)) {
+      fprintf(stderr, "Missing argument for '%s'\n", fullArg);
+      print_usage_and_exit(argc, argv);
+    }
+    optionStringValues[foundIndex] = argv[argIndex + 1];
+    argIndex += 2;
+  }
+
+  for (int index = 0; index < g_toolOptionsLength; index += 1) {
+    const char* optionStringValue = optionStringValues[index];
+    const char* longName = g_toolOptions[index].longName;
+    if (strcmp("filter", longName) == 0) {
+      outValues->filter = optionStringValue;
+    } else if (strcmp("warmup", longName) == 0) {
+      outValues->warmupCount = MAX(0, atoi(optionStringValue));
+    } else if (strcmp("iterations", longName) == 0) {
+      outValues->iterationsCount = MAX(1, atoi(optionStringValue));
+    } else if (strcmp("threads", longName) == 0) {
+      outValues->threadCount = atoi(optionStringValue);
+    } else if (strcmp("pin", longName) == 0) {
+      outValues->doPin = atoi(optionStringValue);
+    } else if (strcmp("network", longName) == 0) {
+      outValues->networkFilename = optionStringValue;
+    } else if (strcmp("image", longName) == 0) {
+      outValues->imageFilename = optionStringValue;
+    } else if (strcmp("network_iterations", longName) == 0) {
+      outValues->networkIterationsCount = MAX(1, atoi(optionStringValue));
+    } else if (strcmp("max_batch", longName) == 0) {
+      outValues->maxBatchSize = MAX(1, atoi(optionStringValue));
+    } else if (strcmp("output", longName) == 0) {
+      outValues->outputFilename = optionStringValue;
+    } else {
+      assert(false); // Should never get here
+    }
+  }
+}
+
+void print_usage_and_exit(int argc, const char* argv[]) {
+  fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+  for (int index = 0; index < g_toolOptionsLength; index += 1) {
+    SToolOption* toolOption = &g_toolOptions[index];
+    fprintf(stderr, "  --%s/-%c <value> : %s", toolOption->longName, toolOption->shortName, toolOption->description);
+    if (toolOption->defaultValue != NULL) {
+      fprintf(stderr, " Defaults to '%s'.", toolOption->defaultValue);
+    }
+    fprintf(stderr, "\n");
+  }
+  exit(1);
+}
+
+double current_milliseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((now.tv_sec * 1000.0) + (now.tv_nsec / 1000000.0));
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  const double aValue = *(const double*)(a);
+  const double bValue = *(const double*)(b);
+  if (aValue < bValue) {
+    return -1;
+  } else if (aValue > bValue) {
+    return 1;
+  }
+  return 0;
+}
+
+static double sorted_percentile(double* sortedSamples, int samplesCount, double percentile) {
+  const int index = (int)(((percentile / 100.0) * (samplesCount - 1)) + 0.5);
+  return sortedSamples[index];
+}
+
+void calculate_timing_stats(double* samples, int samplesCount, STimingStats* outStats) {
+  assert(samplesCount > 0);
+  qsort(samples, samplesCount, sizeof(double), compare_doubles);
+  double total = 0.0;
+  for (int index = 0; index < samplesCount; index += 1) {
+    total += samples[index];
+  }
+  outStats->min = samples[0];
+  outStats->mean = (total / samplesCount);
+  outStats->p50 = sorted_percentile(samples, samplesCount, 50.0);
+  outStats->p90 = sorted_percentile(samples, samplesCount, 90.0);
+  outStats->p99 = sorted_percentile(samples, samplesCount, 99.0);
+  outStats->max = samples[samplesCount - 1];
+}
+
+void print_json_string(FILE* output, const char* value) {
+  fputc('"', output);
+  for (const char* current = value; *current != 0; current += 1) {
+    const char character = *current;
+    if ((character == '"') || (character == '\\')) {
+      fputc('\\', output);
+      fputc(character, output);
+    } else if ((unsigned char)(character) < 0x20) {
+      fprintf(output, "\\u%04x", character);
+    } else {
+      fputc(character, output);
+    }
+  }
+  fputc('"', output);
+}
+
+void print_json_timing_stats(FILE* output, const STimingStats* stats) {
+  fprintf(output, "{\"min\": %.4f, \"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+    stats->min, stats->mean, stats->p50, stats->p90, stats->p99, stats->max);
+}
+
+SGemmShape gemm_shape_for_conv(const SConvShape* convShape) {
+  const Dimensions inputDims(1, convShape->inputSize, convShape->inputSize, convShape->inputChannels);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputDims, convShape->kernelWidth, convShape->kernelCount, convShape->stride);
+  SGemmShape result;
+  result.name = convShape->name;
+  result.m = convShape->kernelCount;
+  result.n = (outputDims[1] * outputDims[2]);
+  result.k = (convShape->kernelWidth * convShape->kernelWidth * convShape->inputChannels);
+  return result;
+}
+
+Buffer* new_random_buffer(const Dimensions& dims, int bitsPerElement, int elementFormat) {
+  Buffer* result;
+  if (bitsPerElement == 32) {
+    result = new Buffer(dims);
+  } else {
+    result = new Buffer(dims, -1.0f, 1.0f, bitsPerElement, elementFormat);
+  }
+  result->populateWithRandomValues(-0.99f, 0.99f);
+  return result;
+}
+
+void weights_type_name(int bitsPerElement, int elementFormat, char* outName, size_t nameSize) {
+  if (elementFormat == JPElementFormatHalf) {
+    snprintf(outName, nameSize, "half");
+  } else if (elementFormat == JPElementFormatBFloat16) {
+    snprintf(outName, nameSize, "bfloat16");
+  } else {
+    snprintf(outName, nameSize, "%d-bit", bitsPerElement);
+  }
+}
+
+void delete_kernel_bench(SKernelBench* bench) {
+  Buffer* buffers[] = {bench->input, bench->weights, bench->output, bench->scratch};
+  for (int index = 0; index < STATIC_ARRAY_LEN(buffers); index += 1) {
+    if (buffers[index] != NULL) {
+      delete buffers[index];
+    }
+  }
+  if (bench->tag != NULL) {
+    free(bench->tag);
+  }
+  if (bench->rowSums != NULL) {
+    free(bench->rowSums);
+  }
+  if (bench->sparseWeights != NULL) {
+    matrix_sparse_destroy(bench->sparseWeights);
+  }
+}
+
+void run_kernel_bench(SBenchContext* context, const char* name, const char* shape, double flops, double bytes, KernelBenchFunction function, SKernelBench* bench) {
+  SBenchArgumentValues* args = context->args;
+  const char* filter = args->filter;
+  if ((filter[0] != 0) && (strstr(name, filter) == NULL) && (strstr(shape, filter) == NULL)) {
+    return;
+  }
+
+  for (int index = 0; index < args->warmupCount; index += 1) {
+    function(bench);
+  }
+  const double probeStart = current_milliseconds();
+  function(bench);
+  const double probeDuration = (current_milliseconds() - probeStart);
+  int callsPerSample = 1;
+  if (probeDuration < kMinSampleMilliseconds) {
+    callsPerSample = (int)(ceil(kMinSampleMilliseconds / fmax(probeDuration, 0.0001)));
+    callsPerSample = MIN(callsPerSample, kMaxCallsPerSample);
+  }
+
+  const int samplesCount = args->iterationsCount;
+  double* samples = (double*)(malloc(sizeof(double) * samplesCount));
+  for (int index = 0; index < samplesCount; index += 1) {
+    const double start = current_milliseconds();
+    for (int call = 0; call < callsPerSample; call += 1) {
+      function(bench);
+    }
+    samples[index] = ((current_milliseconds() - start) / callsPerSample);
+  }
+  STimingStats stats;
+  calculate_timing_stats(samples, samplesCount, &stats);
+  free(samples);
+
+  const double seconds = (stats.p50 / 1000.0);
+  const double gflopsPerSecond = ((flops / 1000000000.0) / seconds);
+  const double gbytesPerSecond = ((bytes / 1000000000.0) / seconds);
+  fprintf(stderr, "%-26s %-40s %10.4f ms %8.2f GFLOP/s %8.2f GB/s\n",
+    name, shape, stats.p50, gflopsPerSecond, gbytesPerSecond);
+
+  FILE* output = context->output;
+  fprintf(output, "%s\n    {\"name\": ", ((context->resultsCount > 0) ? "," : ""));
+  print_json_string(output, name);
+  fprintf(output, ", \"shape\": ");
+  print_json_string(output, shape);
+  fprintf(output, ", \"flops\": %.0f, \"bytes\": %.0f, \"calls_per_sample\": %d, \"ms\": ",
+    flops, bytes, callsPerSample);
+  print_json_timing_stats(output, &stats);
+  fprintf(output, ", \"gflops_per_second\": %.3f, \"gbytes_per_second\": %.3f}", gflopsPerSecond, gbytesPerSecond);
+  context->resultsCount += 1;
+}
+
+void bench_gemm(SBenchContext* context, const SGemmShape* shape, int bitsPerElement, int elementFormat) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.m = shape->m;
+  bench.n = shape->n;
+  bench.k = shape->k;
+  bench.weights = new_random_buffer(Dimensions(shape->m, shape->k), bitsPerElement, elementFormat);
+  bench.input = new_random_buffer(Dimensions(shape->n, shape->k), 32);
+  bench.output = new Buffer(Dimensions(shape->n, shape->m));
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s m=%d n=%d k=%d", shape->name, shape->m, shape->n, shape->k);
+  const double flops = (2.0 * shape->m * shape->n * shape->k);
+  const double bytes = (bench.weights->storageBytes() + bench.input->storageBytes() + bench.output->storageBytes());
+  if (bitsPerElement == 32) {
+    run_kernel_bench(context, "matrix_gemm", shapeString, flops, bytes, call_gemm, &bench);
+  } else {
+    char typeName[kMaxTypeNameLength];
+    weights_type_name(bitsPerElement, elementFormat, typeName, sizeof(typeName));
+    char name[MAX_DEBUG_STRING_LEN];
+    snprintf(name, sizeof(name), "matrix_gemm_fixed %s", typeName);
+    run_kernel_bench(context, name, shapeString, flops, bytes, call_gemm_fixed, &bench);
+  }
+  delete_kernel_bench(&bench);
+}
+
+// Calibrated fully-connected layers run on their 8-bit weights directly, and
+// this includes quantizing the input.
+void bench_dot_int8(SBenchContext* context, const SGemmShape* shape) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.m = shape->m;
+  bench.n = shape->n;
+  bench.k = shape->k;
+  bench.weights = new_random_buffer(Dimensions(shape->m, shape->k), 8);
+  bench.input = new_random_buffer(Dimensions(shape->n, shape->k), 32);
+  bench.output = new Buffer(Dimensions(shape->n, shape->m));
+  const size_t scratchBytes = matrix_dot_int8_scratch_bytes(bench.input->_dims);
+  bench.scratch = new Buffer(Dimensions((int)(scratchBytes / sizeof(jpfloat_t))));
+  bench.rowSums = (int32_t*)(malloc(sizeof(int32_t) * shape->m));
+  matrix_int8_row_sums((const uint8_t*)(bench.weights->_quantizedData), shape->m, shape->k, shape->k, bench.rowSums);
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s m=%d n=%d k=%d", shape->name, shape->m, shape->n, shape->k);
+  const double flops = (2.0 * shape->m * shape->n * shape->k);
+  const double bytes = (bench.weights->storageBytes() + bench.input->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_dot_int8", shapeString, flops, bytes, call_dot_int8, &bench);
+  delete_kernel_bench(&bench);
+}
+
+// Pruned fully-connected layers. The weights that are kept are spread at
+// random, which is close to what magnitude pruning leaves behind.
+void bench_dot_sparse(SBenchContext* context, const SGemmShape* shape, jpfloat_t density) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.m = shape->m;
+  bench.n = shape->n;
+  bench.k = shape->k;
+  bench.input = new_random_buffer(Dimensions(shape->n, shape->k), 32);
+  bench.output = new Buffer(Dimensions(shape->n, shape->m));
+  const size_t scratchBytes = matrix_dot_sparse_scratch_bytes(bench.input->_dims);
+  if (scratchBytes > 0) {
+    bench.scratch = new Buffer(Dimensions((int)(scratchBytes / sizeof(jpfloat_t))));
+  }
+
+  // Each row keeps the same number of weights, with the columns picked by
+  // selection sampling so that every set of them is equally likely.
+  const int rowCount = MAX(1, (int)(shape->k * density));
+  SSparseMatrix* sparseWeights = matrix_sparse_create(shape->m, shape->k, (shape->m * rowCount));
+  int current = 0;
+  for (int row = 0; row < shape->m; row += 1) {
+    sparseWeights->rowStarts[row] = current;
+    int remaining = rowCount;
+    for (int column = 0; column < shape->k; column += 1) {
+      if ((rand() % (shape->k - column)) < remaining) {
+        sparseWeights->columnIndices[current] = (uint16_t)(column);
+        sparseWeights->values[current] = (((rand() / (jpfloat_t)(RAND_MAX)) * 2.0f) - 1.0f);
+        current += 1;
+        remaining -= 1;
+      }
+    }
+  }
+  sparseWeights->rowStarts[shape->m] = current;
+  bench.sparseWeights = sparseWeights;
+
+  char name[MAX_DEBUG_STRING_LEN];
+  snprintf(name, sizeof(name), "matrix_dot_sparse %d%%", (int)(lrintf(density * 100.0f)));
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s m=%d n=%d k=%d", shape->name, shape->m, shape->n, shape->k);
+  const double flops = (2.0 * shape->n * sparseWeights->nonZeroCount);
+  const double bytes = (matrix_sparse_storage_bytes(sparseWeights) + bench.input->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, name, shapeString, flops, bytes, call_dot_sparse, &bench);
+  delete_kernel_bench(&bench);
+}
+
+// Single images go through matrix_gemv() rather than the GEMM, so this is only
+// measured for the shapes with one column.
+void bench_gemv(SBenchContext* context, const SGemmShape* shape, int bitsPerElement, int elementFormat) {
+  if (shape->n != 1) {
+    return;
+  }
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.m = shape->m;
+  bench.n = shape->n;
+  bench.k = shape->k;
+  bench.weights = new_random_buffer(Dimensions(shape->m, shape->k), bitsPerElement, elementFormat);
+  bench.input = new_random_buffer(Dimensions(shape->n, shape->k), 32);
+  bench.output = new Buffer(Dimensions(shape->n, shape->m));
+
+  char typeName[kMaxTypeNameLength];
+  weights_type_name(bitsPerElement, elementFormat, typeName, sizeof(typeName));
+  char name[MAX_DEBUG_STRING_LEN];
+  snprintf(name, sizeof(name), "matrix_gemv %s", typeName);
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s m=%d k=%d", shape->name, shape->m, shape->k);
+  const double flops = (2.0 * shape->m * shape->k);
+  const double bytes = (bench.weights->storageBytes() + bench.input->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, name, shapeString, flops, bytes, call_gemv, &bench);
+  delete_kernel_bench(&bench);
+}
+
+void bench_correlate(SBenchContext* context, const SConvShape* shape) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.kernelWidth = shape->kernelWidth;
+  bench.kernelCount = shape->kernelCount;
+  bench.stride = shape->stride;
+  const Dimensions inputDims(1, shape->inputSize, shape->inputSize, shape->inputChannels);
+  const int valuesPerKernel = (shape->kernelWidth * shape->kernelWidth * shape->inputChannels);
+  bench.input = new_random_buffer(inputDims, 32);
+  bench.weights = new_random_buffer(Dimensions(shape->kernelCount, valuesPerKernel), 16);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputDims, shape->kernelWidth, shape->kernelCount, shape->stride);
+  bench.output = new Buffer(outputDims);
+  const size_t scratchBytes = matrix_correlate_scratch_bytes(inputDims, 0, shape->kernelWidth, shape->stride);
+  bench.scratch = new Buffer(Dimensions((int)(scratchBytes / sizeof(jpfloat_t))));
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s %dx%dx%d", shape->name, shape->inputSize, shape->inputSize, shape->inputChannels);
+  const double flops = (2.0 * outputDims.elementCount() * valuesPerKernel);
+  const double bytes = (bench.input->storageBytes() + bench.weights->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_correlate", shapeString, flops, bytes, call_correlate, &bench);
+  delete_kernel_bench(&bench);
+}
+
+// The same shapes as bench_correlate(), with the kernels packed for the direct
+// version and the input used as it is, without a margin.
+void bench_correlate_direct(SBenchContext* context, const SConvShape* shape) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.kernelWidth = shape->kernelWidth;
+  bench.kernelCount = shape->kernelCount;
+  bench.stride = shape->stride;
+  const Dimensions inputDims(1, shape->inputSize, shape->inputSize, shape->inputChannels);
+  const int valuesPerKernel = (shape->kernelWidth * shape->kernelWidth * shape->inputChannels);
+  bench.input = new_random_buffer(inputDims, 32);
+  Buffer* kernels = new_random_buffer(Dimensions(shape->kernelCount, valuesPerKernel), 16);
+  bench.weights = new Buffer(matrix_correlate_direct_packed_kernels_dims(shape->kernelWidth, shape->inputChannels, shape->kernelCount));
+  matrix_correlate_direct_pack_kernels(kernels, shape->kernelWidth, shape->kernelCount, true, bench.weights);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputDims, shape->kernelWidth, shape->kernelCount, shape->stride);
+  bench.output = new Buffer(outputDims);
+  const size_t scratchBytes = matrix_correlate_direct_scratch_bytes(inputDims);
+  bench.scratch = new Buffer(Dimensions((int)(scratchBytes / sizeof(jpfloat_t))));
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s %dx%dx%d", shape->name, shape->inputSize, shape->inputSize, shape->inputChannels);
+  const double flops = (2.0 * outputDims.elementCount() * valuesPerKernel);
+  const double bytes = (bench.input->storageBytes() + kernels->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_correlate_direct", shapeString, flops, bytes, call_correlate_direct, &bench);
+  delete kernels;
+  delete_kernel_bench(&bench);
+}
+
+// The 3x3, stride 1 shapes, with the kernels transformed for Winograd. The
+// FLOP/s are for the multiplies the ordinary version does, so they can be
+// compared with the others.
+void bench_correlate_winograd(SBenchContext* context, const SConvShape* shape) {
+  if ((shape->kernelWidth != 3) || (shape->stride != 1)) {
+    return;
+  }
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.kernelWidth = shape->kernelWidth;
+  bench.kernelCount = shape->kernelCount;
+  bench.stride = shape->stride;
+  const Dimensions inputDims(1, shape->inputSize, shape->inputSize, shape->inputChannels);
+  const int valuesPerKernel = (shape->kernelWidth * shape->kernelWidth * shape->inputChannels);
+  bench.input = new_random_buffer(inputDims, 32);
+  Buffer* kernels = new_random_buffer(Dimensions(shape->kernelCount, valuesPerKernel), 16);
+  bench.weights = new Buffer(matrix_correlate_winograd_kernels_dims(shape->inputChannels, shape->kernelCount));
+  matrix_correlate_winograd_transform_kernels(kernels, shape->kernelCount, true, bench.weights);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputDims, shape->kernelWidth, shape->kernelCount, shape->stride);
+  bench.output = new Buffer(outputDims);
+  const size_t scratchBytes = matrix_correlate_winograd_scratch_bytes(inputDims, 0, shape->kernelCount);
+  bench.scratch = new Buffer(Dimensions((int)(scratchBytes / sizeof(jpfloat_t))));
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s %dx%dx%d", shape->name, shape->inputSize, shape->inputSize, shape->inputChannels);
+  const double flops = (2.0 * outputDims.elementCount() * valuesPerKernel);
+  const double bytes = (bench.input->storageBytes() + bench.weights->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_correlate_winograd", shapeString, flops, bytes, call_correlate_winograd, &bench);
+  delete kernels;
+  delete_kernel_bench(&bench);
+}
+
+#if defined(USE_NATIVE_GEMM)
+// The same shapes as bench_correlate(), with the patches gathered by the GEMM's
+// packing rather than copied out first, so no scratch space is needed.
+void bench_correlate_implicit(SBenchContext* context, const SConvShape* shape) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.kernelWidth = shape->kernelWidth;
+  bench.kernelCount = shape->kernelCount;
+  bench.stride = shape->stride;
+  const Dimensions inputDims(1, shape->inputSize, shape->inputSize, shape->inputChannels);
+  const int valuesPerKernel = (shape->kernelWidth * shape->kernelWidth * shape->inputChannels);
+  bench.input = new_random_buffer(inputDims, 32);
+  bench.weights = new_random_buffer(Dimensions(shape->kernelCount, valuesPerKernel), 16);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputDims, shape->kernelWidth, shape->kernelCount, shape->stride);
+  bench.output = new Buffer(outputDims);
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s %dx%dx%d", shape->name, shape->inputSize, shape->inputSize, shape->inputChannels);
+  const double flops = (2.0 * outputDims.elementCount() * valuesPerKernel);
+  const double bytes = (bench.input->storageBytes() + bench.weights->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_correlate_implicit", shapeString, flops, bytes, call_correlate_implicit, &bench);
+  delete_kernel_bench(&bench);
+}
+#endif // USE_NATIVE_GEMM
+
+void bench_max_patch(SBenchContext* context, const SImageShape* shape) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.kernelWidth = 3;
+  bench.stride = 2;
+  const Dimensions inputDims(1, shape->size, shape->size, shape->channels);
+  bench.input = new_random_buffer(inputDims, 32);
+  const Dimensions outputDims = matrix_max_patch_output_dims(inputDims, bench.kernelWidth, bench.stride);
+  bench.output = new Buffer(outputDims);
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s %dx%dx%d 3x3/2", shape->name, shape->size, shape->size, shape->channels);
+  const double flops = ((double)(outputDims.elementCount()) * bench.kernelWidth * bench.kernelWidth);
+  const double bytes = (bench.input->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_max_patch", shapeString, flops, bytes, call_max_patch, &bench);
+  delete_kernel_bench(&bench);
+}
+
+void bench_average_patch(SBenchContext* context, const SImageShape* shape) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.kernelWidth = 3;
+  bench.stride = 2;
+  const Dimensions inputDims(1, shape->size, shape->size, shape->channels);
+  bench.input = new_random_buffer(inputDims, 32);
+  const Dimensions outputDims = matrix_max_patch_output_dims(inputDims, bench.kernelWidth, bench.stride);
+  bench.output = new Buffer(outputDims);
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s %dx%dx%d 3x3/2", shape->name, shape->size, shape->size, shape->channels);
+  const double flops = ((double)(outputDims.elementCount()) * bench.kernelWidth * bench.kernelWidth);
+  const double bytes = (bench.input->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_average_patch", shapeString, flops, bytes, call_average_patch, &bench);
+  delete_kernel_bench(&bench);
+}
+
+void bench_local_response(SBenchContext* context, const SImageShape* shape) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  const Dimensions inputDims(1, shape->size, shape->size, shape->channels);
+  bench.input = new_random_buffer(inputDims, 32);
+  bench.output = new Buffer(inputDims);
+  const size_t scratchBytes = matrix_local_response_scratch_bytes(inputDims);
+  bench.scratch = new Buffer(Dimensions((int)(MAX(scratchBytes, sizeof(jpfloat_t)) / sizeof(jpfloat_t))));
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%s %dx%dx%d", shape->name, shape->size, shape->size, shape->channels);
+  const double flops = (6.0 * inputDims.elementCount());
+  const double bytes = (bench.input->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_local_response", shapeString, flops, bytes, call_local_response, &bench);
+  delete_kernel_bench(&bench);
+}
+
+void bench_softmax(SBenchContext* context, int imagesCount) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  const Dimensions inputDims(imagesCount, 1000);
+  bench.input = new_random_buffer(inputDims, 32);
+  bench.output = new Buffer(inputDims);
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%dx1000", imagesCount);
+  const double flops = (5.0 * inputDims.elementCount());
+  const double bytes = (bench.input->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_softmax", shapeString, flops, bytes, call_softmax, &bench);
+  delete_kernel_bench(&bench);
+}
+
+void bench_rescale(SBenchContext* context, int inputWidth, int inputHeight, int outputSize) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.input = new_random_buffer(Dimensions(inputHeight, inputWidth, 3), 32);
+  bench.output = new Buffer(Dimensions(outputSize, outputSize, 3));
+
+  char shapeString[MAX_DEBUG_STRING_LEN];
+  snprintf(shapeString, sizeof(shapeString), "%dx%dx3 to %dx%dx3", inputHeight, inputWidth, outputSize, outputSize);
+  // Each bilinear sample takes four weighted reads.
+  const double flops = (8.0 * bench.output->_dims.elementCount());
+  const double bytes = (bench.input->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "rescale_image_to_fit", shapeString, flops, bytes, call_rescale, &bench);
+  delete_kernel_bench(&bench);
+}
+
+void bench_tag_dict(SBenchContext* context, const char* shape, const Dimensions& dims, int bitsPerElement) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  Buffer* source = new_random_buffer(dims, 32);
+  bench.tag = buffer_to_tag_dict(source, bitsPerElement);
+  const double storageBytes = ((double)(dims.elementCount()) * bitsPerElement / 8);
+  delete source;
+
+  // The data's read out of the tag and copied into the new buffer.
+  run_kernel_bench(context, "buffer_from_tag_dict", shape, 0.0, (2.0 * storageBytes), call_tag_dict, &bench);
+  delete_kernel_bench(&bench);
+}
+
+void bench_dequantize(SBenchContext* context, const char* shape, const Dimensions& dims, int bitsPerElement, int elementFormat) {
+  SKernelBench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.weights = new_random_buffer(dims, bitsPerElement, elementFormat);
+  bench.output = new Buffer(dims);
+
+  // One multiply and one add for every value.
+  const double flops = (2.0 * dims.elementCount());
+  const double bytes = (bench.weights->storageBytes() + bench.output->storageBytes());
+  run_kernel_bench(context, "matrix_dequantize", shape, flops, bytes, call_dequantize, &bench);
+  delete_kernel_bench(&bench);
+}
+
+void call_gemm(SKernelBench* bench) {
+  matrix_gemm(
+    JPCblasColMajor,
+    JPCblasTrans,
+    JPCblasNoTrans,
+    bench->m,
+    bench->n,
+    bench->k,
+    1.0f,
+    bench->weights->_data,
+    bench->k,
+    bench->input->_data,
+    bench->k,
+    0.0f,
+    bench->output->_data,
+    bench->m);
+}
+
+void call_gemm_fixed(SKernelBench* bench) {
+  Buffer* weights = bench->weights;
+  matrix_gemm_fixed(
+    JPCblasColMajor,
+    JPCblasTrans,
+    JPCblasNoTrans,
+    bench->m,
+    bench->n,
+    bench->k,
+    1.0f,
+    weights->_quantizedData,
+    weights->_min,
+    weights->_max,
+    weights->_rowMins,
+    weights->_rowScales,
+    weights->_bitsPerElement,
+    weights->_elementFormat,
+    bench->k,
+    bench->input->_data,
+    bench->k,
+    0.0f,
+    bench->output->_data,
+    bench->m);
+}
+
+void call_dot_int8(SKernelBench* bench) {
+  matrix_dot_int8_into(bench->input, -1.0f, 1.0f, bench->weights, bench->rowSums, bench->output, bench->scratch);
+}
+
+void call_dot_sparse(SKernelBench* bench) {
+  matrix_dot_sparse_into(bench->input, bench->sparseWeights, bench->output, bench->scratch);
+}
+
+void call_gemv(SKernelBench* bench) {
+  Buffer* weights = bench->weights;
+  void* weightsData;
+  if (weights->_bitsPerElement == 32) {
+    weightsData = weights->_data;
+  } else {
+    weightsData = weights->_quantizedData;
+  }
+  matrix_gemv(
+    bench->m,
+    bench->k,
+    weightsData,
+    weights->_min,
+    weights->_max,
+    weights->_rowMins,
+    weights->_rowScales,
+    weights->_bitsPerElement,
+    weights->_elementFormat,
+    bench->k,
+    bench->input->_data,
+    bench->output->_data);
+}
+
+void call_correlate(SKernelBench* bench) {
+  matrix_correlate_into(bench->input, 0, bench->weights, bench->kernelWidth, bench->kernelCount, bench->stride, true, bench->output, bench->scratch);
+}
+
+void call_correlate_direct(SKernelBench* bench) {
+  matrix_correlate_direct_into(bench->input, 0, bench->weights, bench->kernelWidth, bench->kernelCount, bench->stride, bench->output, bench->scratch);
+}
+
+void call_correlate_winograd(SKernelBench* bench) {
+  matrix_correlate_winograd_into(bench->input, 0, bench->weights, bench->kernelCount, bench->output, bench->scratch);
+}
+
+#if defined(USE_NATIVE_GEMM)
+void call_correlate_implicit(SKernelBench* bench) {
+  matrix_correlate_implicit_into(bench->input, 0, bench->weights, bench->kernelWidth, bench->kernelCount, bench->stride, true, bench->output);
+}
+#endif // USE_NATIVE_GEMM
+
+void call_max_patch(SKernelBench* bench) {
+  matrix_max_patch_into(bench->input, bench->kernelWidth, bench->stride, bench->output);
+}
+
+void call_average_patch(SKernelBench* bench) {
+  matrix_average_patch_into(bench->input, bench->kernelWidth, bench->stride, bench->output);
+}
+
+void call_local_response(SKernelBench* bench) {
+  matrix_local_response_into(bench->input, 5, 1.0f, 0.0001f, 0.75f, bench->output, bench->scratch);
+}
+
+void call_softmax(SKernelBench* bench) {
+  matrix_softmax_into(bench->input, bench->output);
+}
+
+void call_rescale(SKernelBench* bench) {
+  rescale_image_to_fit(bench->input, bench->output, false);
+}
+
+void call_tag_dict(SKernelBench* bench) {
+  Buffer* buffer = buffer_from_tag_dict(bench->tag, false);
+  delete buffer;
+}
+
+void call_dequantize(SKernelBench* bench) {
+  Buffer* weights = bench->weights;
+  const int elementCount = weights->_dims.elementCount();
+  const jpfloat_t range = ((weights->_max - weights->_min) / (1 << weights->_bitsPerElement));
+  if (weights->_elementFormat != JPElementFormatLinear) {
+    matrix_dequantize_half((uint16_t*)(weights->_quantizedData), elementCount, weights->_elementFormat, bench->output->_data);
+  } else if (weights->_bitsPerElement == 16) {
+    matrix_dequantize_uint16((uint16_t*)(weights->_quantizedData), elementCount, weights->_min, range, bench->output->_data);
+  } else {
+    matrix_dequantize_uint8((uint8_t*)(weights->_quantizedData), elementCount, weights->_min, range, bench->output->_data);
+  }
+}
+
+void* create_bench_image(const char* imageFilename) {
+  if (imageFilename != NULL) {
+    return jpcnn_create_image_buffer_from_file(imageFilename);
+  }
+  const int width = 640;
+  const int height = 480;
+  const int channels = 3;
+  unsigned char* pixels = (unsigned char*)(malloc(width * height * channels));
+  unsigned int seed = 1;
+  for (int index = 0; index < (width * height * channels); index += 1) {
+    pixels[index] = (rand_r(&seed) & 0xff);
+  }
+  void* result = jpcnn_create_image_buffer_from_uint8_data(pixels, width, height, channels, (width * channels), 0, 0);
+  free(pixels);
+  return result;
+}
+
+void bench_network_layers(SBenchContext* context, void* network, void* image, const char* key) {
+  SBenchArgumentValues* args = context->args;
+  float* predictions;
+  int predictionsLength;
+  char** predictionsNames;
+  int predictionsNamesLength;
+
+  jpcnn_enable_profiling(network, 1);
+  jpcnn_classify_image(network, image, 0, 0, &predictions, &predictionsLength, &predictionsNames, &predictionsNamesLength);
+  JPCNNLayerStats* stats;
+  int statsLength;
+  jpcnn_get_layer_stats(network, &stats, &statsLength);
+  double* totalMilliseconds = (double*)(calloc(MAX(1, statsLength), sizeof(double)));
+  for (int iteration = 0; iteration < args->networkIterationsCount; iteration += 1) {
+    jpcnn_classify_image(network, image, 0, 0, &predictions, &predictionsLength, &predictionsNames, &predictionsNamesLength);
+    for (int index = 0; index < statsLength; index += 1) {
+      totalMilliseconds[index] += stats[index].milliseconds;
+    }
+  }
+  jpcnn_enable_profiling(network, 0);
+
+  FILE* output = context->output;
+  double trafficBytes = 0.0;
+  double networkMilliseconds = 0.0;
+  fprintf(output, "    ");
+  print_json_string(output, key);
+  fprintf(output, ": {\n      \"layers\": [");
+  for (int index = 0; index < statsLength; index += 1) {
+    const JPCNNLayerStats* layer = &stats[index];
+    const double milliseconds = (totalMilliseconds[index] / args->networkIterationsCount);
+    trafficBytes += (layer->bytesRead + layer->bytesWritten);
+    networkMilliseconds += milliseconds;
+    fprintf(output, "%s\n        {\"name\": ", ((index > 0) ? "," : ""));
+    print_json_string(output, layer->name);
+    fprintf(output, ", \"ms\": %.4f, \"flops\": %.0f, \"bytes_read\": %.0f, \"bytes_written\": %.0f, \"output\": [",
+      milliseconds, layer->flops, layer->bytesRead, layer->bytesWritten);
+    for (int dimIndex = 0; dimIndex < layer->outputDimsLength; dimIndex += 1) {
+      fprintf(output, "%s%d", ((dimIndex > 0) ? ", " : ""), layer->outputDims[dimIndex]);
+    }
+    fprintf(output, "]}");
+  }
+  fprintf(output, "\n      ],\n");
+  fprintf(output, "      \"ms\": %.4f,\n", networkMilliseconds);
+  fprintf(output, "      \"traffic_bytes\": %.0f\n", trafficBytes);
+  fprintf(output, "    }");
+  fprintf(stderr, "network %-18s %d steps %10.4f ms %10.2f MB of traffic\n",
+    key, statsLength, networkMilliseconds, (trafficBytes / (1024.0 * 1024.0)));
+  free(totalMilliseconds);
+}
+
+void bench_network_batches(SBenchContext* context, void* network, void* image) {
+  SBenchArgumentValues* args = context->args;
+  const int maxBatchSize = args->maxBatchSize;
+  void** inputs = (void**)(malloc(sizeof(void*) * maxBatchSize));
+  for (int index = 0; index < maxBatchSize; index += 1) {
+    inputs[index] = image;
+  }
+  const int samplesCount = args->networkIterationsCount;
+  double* samples = (double*)(malloc(sizeof(double) * samplesCount));
+
+  FILE* output = context->output;
+  fprintf(output, "    \"batches\": [");
+  bool isFirst = true;
+  for (int batchSize = 1; batchSize <= maxBatchSize; batchSize *= 2) {
+    float* predictions;
+    int predictionsLength;
+    char** predictionsNames;
+    int predictionsNamesLength;
+    jpcnn_classify_images(network, inputs, batchSize, 0, 0, &predictions, &predictionsLength, &predictionsNames, &predictionsNamesLength);
+    for (int index = 0; index < samplesCount; index += 1) {
+      const double start = current_milliseconds();
+      jpcnn_classify_images(network, inputs, batchSize, 0, 0, &predictions, &predictionsLength, &predictionsNames, &predictionsNamesLength);
+      samples[index] = (current_milliseconds() - start);
+    }
+    STimingStats stats;
+    calculate_timing_stats(samples, samplesCount, &stats);
+    const double imagesPerSecond = (batchSize / (stats.p50 / 1000.0));
+    fprintf(stderr, "network batch %-12d %10.4f ms %8.2f images/s\n", batchSize, stats.p50, imagesPerSecond);
+    fprintf(output, "%s\n      {\"batch\": %d, \"ms\": ", (isFirst ? "" : ","), batchSize);
+    print_json_timing_stats(output, &stats);
+    fprintf(output, ", \"images_per_second\": %.3f}", imagesPerSecond);
+    isFirst = false;
+  }
+  fprintf(output, "\n    ]");
+
+  free(samples);
+  free(inputs);
+}
+
+void bench_network(SBenchContext* context) {
+  SBenchArgumentValues* args = context->args;
+  FILE* output = context->output;
+
+  // Fusion is decided when a network is loaded, so a second copy is loaded
+  // with it switched off to measure what it saves.
+  setenv("JPCNN_DISABLE_FUSION", "0", 1);
+  void* network = jpcnn_create_network(args->networkFilename);
+  setenv("JPCNN_DISABLE_FUSION", "1", 1);
+  void* unfusedNetwork = jpcnn_create_network(args->networkFilename);
+  unsetenv("JPCNN_DISABLE_FUSION");
+  void* image = create_bench_image(args->imageFilename);
+  if ((network == NULL) || (unfusedNetwork == NULL) || (image == NULL)) {
+    fprintf(stderr, "Couldn't load the network from '%s' or the input image\n", args->networkFilename);
+    exit(1);
+  }
+
+  fprintf(output, "  \"network\": {\n");
+  fprintf(output, "    \"path\": ");
+  print_json_string(output, args->networkFilename);
+  fprintf(output, ",\n");
+  bench_network_layers(context, network, image, "fused");
+  fprintf(output, ",\n");
+  bench_network_layers(context, unfusedNetwork, image, "unfused");
+  fprintf(output, ",\n");
+  bench_network_batches(context, network, image);
+  fprintf(output, "\n  }");
+
+  jpcnn_destroy_image_buffer(image);
+  jpcnn_destroy_network(unfusedNetwork);
+  jpcnn_destroy_network(network);
+}
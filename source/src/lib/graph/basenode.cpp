@@ -8,19 +8,16 @@
 
 #include "basenode.h"
 
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "buffer.h"
 
-BaseNode::BaseNode() : _output(NULL), _className(NULL), _name(NULL), _debugString(NULL) {
-  _output = NULL;
+BaseNode::BaseNode() : _className(NULL), _name(NULL), _debugString(NULL) {
 }
 
 BaseNode::~BaseNode() {
-  if (_output != NULL) {
-    delete _output;
-  }
   if (_className != NULL) {
     free(_className);
   }
@@ -44,6 +41,54 @@ void BaseNode::setName(const char* name) {
   strncpy(_name, name, length);
 }
 
+Buffer* BaseNode::run(Buffer* input) {
+  const Dimensions inputDims = input->_dims;
+  Buffer* output = new Buffer(outputDimensions(inputDims));
+  const size_t scratchByteCount = scratchBytes(inputDims);
+  Buffer* scratch = new Buffer(Dimensions((int)(scratchByteCount / sizeof(jpfloat_t))));
+  runInto(input, output, scratch);
+  delete scratch;
+  return output;
+}
+
+size_t BaseNode::scratchBytes(const Dimensions& inputDims) {
+  return 0;
+}
+
+bool BaseNode::canRunInPlace() {
+  return false;
+}
+
+bool BaseNode::canFuse(PoolNode* pool) {
+  return false;
+}
+
+size_t BaseNode::fusedScratchBytes(const Dimensions& inputDims, PoolNode* pool) {
+  assert(false); // Only nodes that return true from canFuse() should get here
+  return 0;
+}
+
+void BaseNode::runFusedInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRelu, PoolNode* pool) {
+  assert(false); // Only nodes that return true from canFuse() should get here
+}
+
+size_t BaseNode::memoryTrafficBytes(const Dimensions& inputDims) {
+  return (inputDims.byteCount() + outputDimensions(inputDims).byteCount());
+}
+
+size_t BaseNode::fusedMemoryTrafficBytes(const Dimensions& inputDims, PoolNode* pool) {
+  assert(false); // Only nodes that return true from canFuse() should get here
+  return 0;
+}
+
+double BaseNode::flopCount(const Dimensions& inputDims) {
+  return 0.0;
+}
+
+size_t BaseNode::weightBytes() {
+  return 0;
+}
+
 char* BaseNode::debugString() {
   return this->debugStringWithMessage("");
 }
@@ -9,10 +9,14 @@
 #ifndef INCLUDE_BASENODE_H
 #define INCLUDE_BASENODE_H
 
+#include <stddef.h>
+
 #include "jpcnn.h"
 #include "binary_format.h"
+#include "dimensions.h"
 
 class Buffer;
+class PoolNode;
 
 class BaseNode
 {
@@ -21,15 +25,43 @@ public:
   BaseNode();
   virtual ~BaseNode();
 
-  virtual Buffer* run(Buffer* input) = 0;
+  // Returns a new buffer owned by the caller, nodes don't hold on to any
+  // per-run state so they can be shared between sessions.
+  virtual Buffer* run(Buffer* input);
   virtual SBinaryTag* toTag() = 0;
 
+  // These let a session plan all of the memory for a run up front. runInto()
+  // writes to an output buffer of outputDimensions() size, and may use
+  // scratchBytes() of temporary space. If canRunInPlace() is true, output may
+  // share its data with input.
+  virtual Dimensions outputDimensions(const Dimensions& inputDims) = 0;
+  virtual size_t scratchBytes(const Dimensions& inputDims);
+  virtual bool canRunInPlace();
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch) = 0;
+
+  // Nodes whose work ends in a GEMM can apply a ReLU, and optionally a max
+  // pool, to each block of their results while it's still in the cache,
+  // rather than leaving them to separate passes. The pool may be NULL. See
+  // FusedNode for how these get used.
+  virtual bool canFuse(PoolNode* pool);
+  virtual size_t fusedScratchBytes(const Dimensions& inputDims, PoolNode* pool);
+  virtual void runFusedInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRelu, PoolNode* pool);
+
+  // Estimates how many bytes of activations a run reads and writes, leaving
+  // out the weights. This is the memory traffic that fusing layers saves.
+  virtual size_t memoryTrafficBytes(const Dimensions& inputDims);
+  virtual size_t fusedMemoryTrafficBytes(const Dimensions& inputDims, PoolNode* pool);
+
+  // Rough counts of the arithmetic a run does, and of the weight memory it
+  // reads, for the per-layer profiling stats.
+  virtual double flopCount(const Dimensions& inputDims);
+  virtual size_t weightBytes();
+
   void setClassName(const char* name);
   void setName(const char* name);
   virtual char* debugString();
   virtual char* debugStringWithMessage(const char* subclassMessage);
 
-  Buffer* _output;
   char* _className;
   char* _name;
   char* _debugString;
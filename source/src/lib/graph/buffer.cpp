@@ -27,6 +27,8 @@
 #endif // USE_OS_IMAGE
 #include "binary_format.h"
 #include "cstring_helpers.h"
+#include "matrix_ops.h"
+#include "half_float.h"
 #ifdef TARGET_PI
 #include "mailbox.h"
 #endif // TARGET_PI
@@ -36,6 +38,8 @@
 #endif // USE_EIGEN_GEMM
 
 static void buffer_do_save_to_image_file(Buffer* buffer, const char* filename);
+static Buffer* buffer_with_row_ranges_from_tag_dict(SBinaryTag* mainDict, const Dimensions& dims, int bitsPerFloat, bool skipCopy);
+static void quantize_values(const jpfloat_t* input, int count, int howManyBits, jpfloat_t min, jpfloat_t max, void* output);
 
 Buffer::Buffer(const Dimensions& dims) :
   _dims(dims),
@@ -44,7 +48,10 @@ Buffer::Buffer(const Dimensions& dims) :
   _quantizedData(NULL),
   _min(0.0f),
   _max(1.0f),
-  _bitsPerElement(32)
+  _rowMins(NULL),
+  _rowScales(NULL),
+  _bitsPerElement(32),
+  _elementFormat(JPElementFormatLinear)
 {
   const int elementCount = _dims.elementCount();
   const size_t byteCount = (elementCount * sizeof(jpfloat_t));
@@ -61,7 +68,6 @@ Buffer::Buffer(const Dimensions& dims) :
   _data = (jpfloat_t*)(malloc(byteCount * 1));
 #endif // TARGET_PI
   _doesOwnData = true;
-  setName("None");
 }
 
 Buffer::Buffer(const Dimensions& dims, jpfloat_t* data) :
@@ -75,14 +81,16 @@ Buffer::Buffer(const Dimensions& dims, jpfloat_t* data) :
 #endif // TARGET_PI
   _min(0.0f),
   _max(1.0f),
-  _bitsPerElement(32)
+  _rowMins(NULL),
+  _rowScales(NULL),
+  _bitsPerElement(32),
+  _elementFormat(JPElementFormatLinear)
 {
   _data = data;
   _doesOwnData = false;
-  setName("None");
 }
 
-Buffer::Buffer(const Dimensions& dims, void* quantizedData, jpfloat_t min, jpfloat_t max, int bitsPerElement) :
+Buffer::Buffer(const Dimensions& dims, void* quantizedData, jpfloat_t min, jpfloat_t max, int bitsPerElement, int elementFormat) :
   _dims(dims),
   _name(NULL),
   _debugString(NULL),
@@ -93,22 +101,29 @@ Buffer::Buffer(const Dimensions& dims, void* quantizedData, jpfloat_t min, jpflo
 #endif // TARGET_PI
   _min(min),
   _max(max),
-  _bitsPerElement(bitsPerElement)
+  _rowMins(NULL),
+  _rowScales(NULL),
+  _bitsPerElement(bitsPerElement),
+  _elementFormat(elementFormat)
 {
+  assert((elementFormat == JPElementFormatLinear) || (bitsPerElement == 16));
   _quantizedData = quantizedData;
   _doesOwnData = false;
-  setName("None");
 }
 
-Buffer::Buffer(const Dimensions& dims, jpfloat_t min, jpfloat_t max, int bitsPerElement) :
+Buffer::Buffer(const Dimensions& dims, jpfloat_t min, jpfloat_t max, int bitsPerElement, int elementFormat) :
   _dims(dims),
   _name(NULL),
   _debugString(NULL),
   _data(NULL),
   _min(min),
   _max(max),
-  _bitsPerElement(bitsPerElement)
+  _rowMins(NULL),
+  _rowScales(NULL),
+  _bitsPerElement(bitsPerElement),
+  _elementFormat(elementFormat)
 {
+  assert((elementFormat == JPElementFormatLinear) || (bitsPerElement == 16));
   const int elementCount = _dims.elementCount();
   const int sizeofElement = (_bitsPerElement / 8);
   const size_t byteCount = (elementCount * sizeofElement);
@@ -126,7 +141,6 @@ Buffer::Buffer(const Dimensions& dims, jpfloat_t min, jpfloat_t max, int bitsPer
   _quantizedData = (void*)(malloc(byteCount));
 #endif // TARGET_PI
   _doesOwnData = true;
-  setName("None");
 }
 
 Buffer::~Buffer()
@@ -153,6 +167,8 @@ Buffer::~Buffer()
     free(_quantizedData);
 #endif // TARGET_PI
   }
+  free(_rowMins);
+  free(_rowScales);
   if (_debugString)
   {
     free(_debugString);
@@ -163,16 +179,64 @@ Buffer::~Buffer()
   }
 }
 
+Buffer::Buffer(const Dimensions& dims, Buffer* parent, int elementOffset) :
+  _dims(dims),
+  _name(NULL),
+  _debugString(NULL),
+  _quantizedData(NULL),
+  _min(0.0f),
+  _max(1.0f),
+  _rowMins(NULL),
+  _rowScales(NULL),
+  _bitsPerElement(32),
+  _elementFormat(JPElementFormatLinear)
+{
+  assert((elementOffset + dims.elementCount()) <= parent->_dims.elementCount());
+  _data = (parent->_data + elementOffset);
+#if defined(TARGET_PI)
+  _gpuMemoryHandle = parent->_gpuMemoryHandle;
+  _gpuMemoryBase = (parent->_gpuMemoryBase + (elementOffset * sizeof(jpfloat_t)));
+#endif // TARGET_PI
+  _doesOwnData = false;
+}
+
+static const char* buffer_display_name(const char* name) {
+  // Names are only set for debugging, so we avoid allocating one for every
+  // buffer we create.
+  if (name == NULL) {
+    return "None";
+  }
+  return name;
+}
+
 char* Buffer::debugString() {
   if (!_debugString) {
     _debugString = (char*)(malloc(MAX_DEBUG_STRING_LEN));
   }
-  snprintf(_debugString, MAX_DEBUG_STRING_LEN, "Buffer %s - %s, %d bits per element, range (%f-%f)",
-    _name, _dims.debugString(), _bitsPerElement, _min, _max);
+  if (_elementFormat == JPElementFormatHalf) {
+    snprintf(_debugString, MAX_DEBUG_STRING_LEN, "Buffer %s - %s, half-precision",
+      buffer_display_name(_name), _dims.debugString());
+  } else if (_elementFormat == JPElementFormatBFloat16) {
+    snprintf(_debugString, MAX_DEBUG_STRING_LEN, "Buffer %s - %s, bfloat16",
+      buffer_display_name(_name), _dims.debugString());
+  } else {
+    snprintf(_debugString, MAX_DEBUG_STRING_LEN, "Buffer %s - %s, %d bits per element, range (%f-%f)%s",
+      buffer_display_name(_name), _dims.debugString(), _bitsPerElement, _min, _max,
+      ((_rowMins != NULL) ? " split by row" : ""));
+  }
   return _debugString;
 }
 
 void Buffer::printContents(int maxElements) {
+  // The values are converted below with a single range, so buffers with one
+  // for each row are printed from a float copy instead.
+  if (_rowMins != NULL) {
+    Buffer* floatCopy = dequantize_buffer(this);
+    floatCopy->setName(buffer_display_name(_name));
+    floatCopy->printContents(maxElements);
+    delete floatCopy;
+    return;
+  }
   FILE* output = stderr;
   fprintf(output, "%s : \n", debugString());
   Dimensions dims = _dims;
@@ -388,8 +452,36 @@ void Buffer::setName(const char* name) {
   strncpy(_name, name, byteCount);
 }
 
+void Buffer::setRowRanges(const jpfloat_t* rowMins, const jpfloat_t* rowScales) {
+  free(_rowMins);
+  free(_rowScales);
+  _rowMins = NULL;
+  _rowScales = NULL;
+  if (rowMins == NULL) {
+    return;
+  }
+  assert((_bitsPerElement != 32) && (_elementFormat == JPElementFormatLinear));
+  const int rowsCount = _dims[0];
+  assert(rowsCount > 0);
+  const size_t byteCount = (rowsCount * sizeof(jpfloat_t));
+  _rowMins = (jpfloat_t*)(malloc(byteCount));
+  _rowScales = (jpfloat_t*)(malloc(byteCount));
+  memcpy(_rowMins, rowMins, byteCount);
+  memcpy(_rowScales, rowScales, byteCount);
+
+  jpfloat_t min = FLT_MAX;
+  jpfloat_t max = -FLT_MAX;
+  const int levels = (1 << _bitsPerElement);
+  for (int row = 0; row < rowsCount; row += 1) {
+    min = fminf(min, rowMins[row]);
+    max = fmaxf(max, (rowMins[row] + (rowScales[row] * levels)));
+  }
+  _min = min;
+  _max = max;
+}
+
 void Buffer::saveDebugImage() {
-  buffer_save_to_image_file(this, this->_name);
+  buffer_save_to_image_file(this, buffer_display_name(_name));
 }
 
 bool Buffer::canReshapeTo(const Dimensions& newDims) {
@@ -407,7 +499,7 @@ void Buffer::reshape(const Dimensions& newDims) {
 Buffer* Buffer::view() {
   Buffer* result = new Buffer(_dims, _data);
   char copyName[MAX_DEBUG_STRING_LEN];
-  snprintf(copyName, MAX_DEBUG_STRING_LEN, "%s (view)", _name);
+  snprintf(copyName, MAX_DEBUG_STRING_LEN, "%s (view)", buffer_display_name(_name));
   result->setName(copyName);
 #if defined(TARGET_PI)
   result->_gpuMemoryHandle = _gpuMemoryHandle;
@@ -416,6 +508,18 @@ Buffer* Buffer::view() {
   return result;
 }
 
+size_t Buffer::storageBytes() {
+  const size_t elementCount = _dims.elementCount();
+  if (_quantizedData != NULL) {
+    size_t result = ((elementCount * _bitsPerElement) / 8);
+    if (_rowMins != NULL) {
+      result += (2 * _dims[0] * sizeof(jpfloat_t));
+    }
+    return result;
+  }
+  return (elementCount * sizeof(jpfloat_t));
+}
+
 void Buffer::copyDataFrom(const Buffer* other) {
   const Dimensions& myDims = _dims;
   const Dimensions& otherDims = other->_dims;
@@ -479,6 +583,15 @@ void Buffer::populateWithRandomValues(jpfloat_t min, jpfloat_t max) {
       *data = (((max - min) * ((float)rand() / RAND_MAX)) + min);
       data += 1;
     }
+  } else if (_elementFormat != JPElementFormatLinear) {
+    uint16_t* dataStart = (uint16_t*)(_quantizedData);
+    uint16_t* dataEnd = (dataStart + elementCount);
+    uint16_t* data = dataStart;
+    while (data < dataEnd) {
+      const jpfloat_t value = (((max - min) * ((float)rand() / RAND_MAX)) + min);
+      *data = float_to_half_format(value, _elementFormat);
+      data += 1;
+    }
   } else if (bitsPerElement == 16) {
     uint16_t* dataStart = (uint16_t*)(_quantizedData);
     uint16_t* dataEnd = (dataStart + elementCount);
@@ -542,6 +655,8 @@ void Buffer::quantize(int bits) {
 }
 
 void Buffer::transpose() {
+  // The ranges would have to become columns, which nothing can run with.
+  assert(_rowMins == NULL);
   const Dimensions& originalDims = _dims;
   assert(originalDims._length == 2); // expecting width x height
   const int originalHeight = originalDims[0];
@@ -690,15 +805,7 @@ Buffer* buffer_from_image_file(const char* filename)
   Buffer* buffer = new Buffer(dims);
   buffer->setName(filename);
 
-  jpfloat_t* bufferCurrent = buffer->_data;
-  jpfloat_t* bufferEnd = (buffer->_data + buffer->_dims.elementCount());
-  uint8_t* imageCurrent = imageData;
-  while (bufferCurrent != bufferEnd)
-  {
-    *bufferCurrent = *imageCurrent;
-    bufferCurrent += 1;
-    imageCurrent += 1;
-  }
+  matrix_dequantize_uint8(imageData, buffer->_dims.elementCount(), 0.0f, 1.0f, buffer->_data);
 
   if (isRaw) {
     free(imageData);
@@ -735,6 +842,27 @@ Buffer* buffer_from_tag_dict(SBinaryTag* mainDict, bool skipCopy) {
     return NULL;
   }
 
+  // Sixteen-bit values are fixed-point unless there's a format saying
+  // they're floats.
+  int elementFormat = JPElementFormatLinear;
+  SBinaryTag* formatTag = get_tag_from_dict(mainDict, "float_format");
+  if (formatTag != NULL) {
+    assert(formatTag->type == JP_CHAR);
+    const char* formatName = formatTag->payload.jpchar;
+    if (strcmp(formatName, "half") == 0) {
+      elementFormat = JPElementFormatHalf;
+    } else if (strcmp(formatName, "bfloat16") == 0) {
+      elementFormat = JPElementFormatBFloat16;
+    } else if (strcmp(formatName, "linear") != 0) {
+      fprintf(stderr, "jpcnn doesn't know the float format '%s'\n", formatName);
+      return NULL;
+    }
+    if ((elementFormat != JPElementFormatLinear) && (bitsPerFloat != 16)) {
+      fprintf(stderr, "jpcnn found a %s format with %d bits per float\n", formatName, bitsPerFloat);
+      return NULL;
+    }
+  }
+
   SBinaryTag* dimsTag = get_tag_from_dict(mainDict, "dims");
   assert(dimsTag->type == JP_LIST);
   int32_t dimensions[DIMENSIONS_MAX_LENGTH];
@@ -764,6 +892,26 @@ Buffer* buffer_from_tag_dict(SBinaryTag* mainDict, bool skipCopy) {
       buffer = new Buffer(dims);
       memcpy(buffer->_data, dataTag->payload.jpchar, dataTag->length);
     }
+  } else if (elementFormat != JPElementFormatLinear) {
+    SBinaryTag* halfDataTag = get_tag_from_dict(mainDict, "quantized_data");
+    assert(halfDataTag->type == JP_BLOB);
+    assert(halfDataTag->length == (elementCount * sizeof(uint16_t)));
+    uint16_t* tagDataArray = (uint16_t*)(halfDataTag->payload.jpchar);
+#if defined(LOAD_BUFFERS_AS_FLOAT) || defined(USE_OPENGL) || defined(USE_QPU_GEMM)
+    // The GPU GEMMs only understand fixed-point weights, so these builds
+    // expand half-precision ones as they load.
+    buffer = new Buffer(dims);
+    matrix_dequantize_half(tagDataArray, elementCount, elementFormat, buffer->_data);
+#else // LOAD_BUFFERS_AS_FLOAT || USE_OPENGL || USE_QPU_GEMM
+    if (skipCopy) {
+      buffer = new Buffer(dims, tagDataArray, 0.0f, 0.0f, 16, elementFormat);
+    } else {
+      buffer = new Buffer(dims, 0.0f, 0.0f, 16, elementFormat);
+      memcpy(buffer->_quantizedData, tagDataArray, halfDataTag->length);
+    }
+#endif // LOAD_BUFFERS_AS_FLOAT || USE_OPENGL || USE_QPU_GEMM
+  } else if (get_tag_from_dict(mainDict, "row_mins") != NULL) {
+    buffer = buffer_with_row_ranges_from_tag_dict(mainDict, dims, bitsPerFloat, skipCopy);
   } else {
     SBinaryTag* quantizedDataTag = get_tag_from_dict(mainDict, "quantized_data");
     const size_t sizeofElement = (bitsPerFloat / 8);
@@ -799,14 +947,7 @@ Buffer* buffer_from_tag_dict(SBinaryTag* mainDict, bool skipCopy) {
           elementsCount
         );
 #else // USE_ACCELERATE_GEMM
-        jpfloat_t* current = floatData;
-        jpfloat_t* end = (current + elementsCount);
-        uint16_t* quantized = quantizedData;
-        while (current < end) {
-          *current = (min + ((*quantized) * range));
-          current += 1;
-          quantized += 1;
-        }
+        matrix_dequantize_uint16(quantizedData, elementsCount, min, range, floatData);
 #endif // USE_ACCELERATE_GEMM
     } else if (bitsPerFloat == 8) {
         uint8_t* quantizedData = (uint8_t*)tagDataArray;
@@ -828,14 +969,7 @@ Buffer* buffer_from_tag_dict(SBinaryTag* mainDict, bool skipCopy) {
           elementsCount
         );
 #else // USE_ACCELERATE_GEMM
-        jpfloat_t* current = floatData;
-        jpfloat_t* end = (current + elementsCount);
-        uint8_t* quantized = quantizedData;
-        while (current < end) {
-          *current = (min + ((*quantized) * range));
-          current += 1;
-          quantized += 1;
-        }
+        matrix_dequantize_uint8(quantizedData, elementsCount, min, range, floatData);
 #endif // USE_ACCELERATE_GEMM
       } else {
         assert(false); // Should never get here, only 8 or 16 bit supported
@@ -850,45 +984,131 @@ Buffer* buffer_from_tag_dict(SBinaryTag* mainDict, bool skipCopy) {
   return buffer;
 }
 
-SBinaryTag* buffer_to_tag_dict(Buffer* buffer, int floatBits) {
-  SBinaryTag* mainDict = create_dict_tag();
-  mainDict = add_uint_to_dict(mainDict, "float_bits", floatBits);
+// Fixed-point values with their own range for each row. The GPU GEMMs only
+// know about a single range, so those builds expand them to floats as they
+// load, as do builds that want every buffer as floats.
+Buffer* buffer_with_row_ranges_from_tag_dict(SBinaryTag* mainDict, const Dimensions& dims, int bitsPerFloat, bool skipCopy) {
+  SBinaryTag* quantizedDataTag = get_tag_from_dict(mainDict, "quantized_data");
+  SBinaryTag* rowMinsTag = get_tag_from_dict(mainDict, "row_mins");
+  SBinaryTag* rowScalesTag = get_tag_from_dict(mainDict, "row_scales");
+  const size_t sizeofElement = (bitsPerFloat / 8);
+  const size_t sizeofRanges = (dims[0] * sizeof(jpfloat_t));
+  assert(quantizedDataTag->type == JP_BLOB);
+  assert(quantizedDataTag->length == (dims.elementCount() * sizeofElement));
+  assert((rowMinsTag->type == JP_FARY) && (rowMinsTag->length == sizeofRanges));
+  assert((rowScalesTag != NULL) && (rowScalesTag->type == JP_FARY) && (rowScalesTag->length == sizeofRanges));
 
+  Buffer* buffer;
+  void* tagDataArray = quantizedDataTag->payload.jpchar;
+  if (skipCopy) {
+    buffer = new Buffer(dims, tagDataArray, 0.0f, 0.0f, bitsPerFloat);
+  } else {
+    buffer = new Buffer(dims, 0.0f, 0.0f, bitsPerFloat);
+    memcpy(buffer->_quantizedData, tagDataArray, quantizedDataTag->length);
+  }
+  buffer->setRowRanges(rowMinsTag->payload.jpfary, rowScalesTag->payload.jpfary);
+
+#if defined(LOAD_BUFFERS_AS_FLOAT) || defined(USE_OPENGL) || defined(USE_QPU_GEMM)
+  Buffer* floatBuffer = dequantize_buffer(buffer);
+  delete buffer;
+  buffer = floatBuffer;
+#endif // LOAD_BUFFERS_AS_FLOAT || USE_OPENGL || USE_QPU_GEMM
+
+  return buffer;
+}
+
+SBinaryTag* buffer_to_tag_dict(Buffer* buffer, int floatBits, int elementFormat, bool isPerRow) {
   assert((floatBits == 32) || (floatBits == 16) || (floatBits == 8));
+  assert((elementFormat == JPElementFormatLinear) || (floatBits == 16));
+  const bool isFixedPoint = ((floatBits != 32) && (elementFormat == JPElementFormatLinear));
+  const bool wantsRowRanges = (isFixedPoint && isPerRow && (buffer->_dims._length > 1));
+
+  // Values that are stored differently from how they're wanted are converted
+  // from a float copy.
+  Buffer* source = buffer;
+  const bool isSameFormat = (
+    (buffer->_bitsPerElement == floatBits) &&
+    (buffer->_elementFormat == elementFormat) &&
+    ((buffer->_rowMins != NULL) == wantsRowRanges));
+  if ((buffer->_bitsPerElement != 32) && !isSameFormat) {
+    source = dequantize_buffer(buffer);
+  }
+
+  SBinaryTag* mainDict = create_dict_tag();
+  mainDict = add_uint_to_dict(mainDict, "float_bits", floatBits);
+  if (elementFormat == JPElementFormatHalf) {
+    mainDict = add_string_to_dict(mainDict, "float_format", "half");
+  } else if (elementFormat == JPElementFormatBFloat16) {
+    mainDict = add_string_to_dict(mainDict, "float_format", "bfloat16");
+  }
 
   SBinaryTag* dimsTag = create_list_tag();
-  for (int index = 0; index < buffer->_dims._length; index += 1) {
-    dimsTag = add_uint_to_list(dimsTag, buffer->_dims[index]);
+  for (int index = 0; index < source->_dims._length; index += 1) {
+    dimsTag = add_uint_to_list(dimsTag, source->_dims[index]);
   }
   mainDict = add_tag_to_dict(mainDict, "dims", dimsTag);
   free(dimsTag);
 
-  if ((floatBits == 8) || (floatBits == 16)) {
+  const int elementCount = source->_dims.elementCount();
+  if (elementFormat != JPElementFormatLinear) {
+    if (source->_bitsPerElement == 32) {
+      const size_t sizeofHalfData = (elementCount * sizeof(uint16_t));
+      uint16_t* halfData = (uint16_t*)(malloc(sizeofHalfData));
+      for (int index = 0; index < elementCount; index += 1) {
+        halfData[index] = float_to_half_format(source->_data[index], elementFormat);
+      }
+      mainDict = add_blob_to_dict(mainDict, "quantized_data", halfData, (int)sizeofHalfData);
+      free(halfData);
+    } else {
+      const size_t sizeofHalfData = (elementCount * sizeof(uint16_t));
+      mainDict = add_blob_to_dict(mainDict, "quantized_data", source->_quantizedData, (int)sizeofHalfData);
+    }
+  } else if ((floatBits == 8) || (floatBits == 16)) {
     jpfloat_t min;
     jpfloat_t max;
     void* quantizedData;
     size_t sizeofQuantizedData;
-    if (buffer->_bitsPerElement == 32) {
-      quantize_buffer(buffer, floatBits, &min, &max, &quantizedData, &sizeofQuantizedData);
+    jpfloat_t* rowMins = NULL;
+    jpfloat_t* rowScales = NULL;
+    if (source->_bitsPerElement == 32) {
+      if (wantsRowRanges) {
+        rowMins = (jpfloat_t*)(malloc(source->_dims[0] * sizeof(jpfloat_t)));
+        rowScales = (jpfloat_t*)(malloc(source->_dims[0] * sizeof(jpfloat_t)));
+      }
+      quantize_buffer(source, floatBits, &min, &max, &quantizedData, &sizeofQuantizedData, rowMins, rowScales);
     } else {
-      assert(floatBits == buffer->_bitsPerElement);
-      quantizedData = buffer->_quantizedData;
-      min = buffer->_min;
-      max = buffer->_max;
-      const int bytesPerElement = (buffer->_bitsPerElement / 8);
-      const int elementCount = buffer->_dims.elementCount();
+      quantizedData = source->_quantizedData;
+      min = source->_min;
+      max = source->_max;
+      rowMins = source->_rowMins;
+      rowScales = source->_rowScales;
+      const int bytesPerElement = (source->_bitsPerElement / 8);
       sizeofQuantizedData = (bytesPerElement * elementCount);
     }
 
-    mainDict = add_float_to_dict(mainDict, "min", min);
-    mainDict = add_float_to_dict(mainDict, "max", max);
+    // Buffers with a range for each row leave out the single one, so that
+    // versions of the library that don't know about row ranges fail to load
+    // them rather than reading the values with the wrong scale.
+    if (wantsRowRanges) {
+      mainDict = add_float_array_to_dict(mainDict, "row_mins", rowMins, source->_dims[0]);
+      mainDict = add_float_array_to_dict(mainDict, "row_scales", rowScales, source->_dims[0]);
+    } else {
+      mainDict = add_float_to_dict(mainDict, "min", min);
+      mainDict = add_float_to_dict(mainDict, "max", max);
+    }
     mainDict = add_blob_to_dict(mainDict, "quantized_data", quantizedData, (int)sizeofQuantizedData);
 
-    if (buffer->_bitsPerElement == 32) {
+    if (source->_bitsPerElement == 32) {
       free(quantizedData);
+      free(rowMins);
+      free(rowScales);
     }
   } else if (floatBits == 32) {
-    mainDict = add_float_array_to_dict(mainDict, "data", buffer->_data, buffer->_dims.elementCount());
+    mainDict = add_float_array_to_dict(mainDict, "data", source->_data, elementCount);
+  }
+
+  if (source != buffer) {
+    delete source;
   }
 
   return mainDict;
@@ -1154,11 +1374,14 @@ Buffer* extract_subregion(Buffer* input, const Offset& origin, const Dimensions&
   const int bitsPerElement = (input->_bitsPerElement);
   const int bytesPerElement = (bitsPerElement / 8);
 
+  // Images never have separate ranges for each row.
+  assert(input->_rowMins == NULL);
+
   Buffer* output;
   if (bitsPerElement == 32) {
     output = new Buffer(size);
   } else {
-    output = new Buffer(size, input->_min, input->_max, bitsPerElement);
+    output = new Buffer(size, input->_min, input->_max, bitsPerElement, input->_elementFormat);
   }
 
   const size_t elementsPerInputRow = (inputWidth * inputChannels);
@@ -1190,71 +1413,108 @@ Buffer* extract_subregion(Buffer* input, const Offset& origin, const Dimensions&
   return output;
 }
 
-void quantize_buffer(Buffer* input, int howManyBits, jpfloat_t* outMin, jpfloat_t* outMax, void** outData, size_t* outSizeofData) {
+void quantize_buffer(Buffer* input, int howManyBits, jpfloat_t* outMin, jpfloat_t* outMax, void** outData, size_t* outSizeofData, jpfloat_t* outRowMins, jpfloat_t* outRowScales) {
   assert((howManyBits == 8) || (howManyBits == 16));
+  assert((outRowMins == NULL) == (outRowScales == NULL));
+
+  const int elementCount = input->_dims.elementCount();
+  const bool isPerRow = (outRowMins != NULL);
+  const int rowsCount = (isPerRow ? input->_dims[0] : 1);
+  const int valuesPerRow = (elementCount / rowsCount);
+  const int levels = (1 << howManyBits);
+  const size_t bytesPerElement = (howManyBits / 8);
+  const size_t sizeofQuantizedData = (elementCount * bytesPerElement);
+  uint8_t* quantizedData = (uint8_t*)(malloc(sizeofQuantizedData));
 
   jpfloat_t min = FLT_MAX;
   jpfloat_t max = -FLT_MAX;
-
-  const int elementCount = input->_dims.elementCount();
-  jpfloat_t* dataStart = input->_data;
-  jpfloat_t* dataEnd = (input->_data + elementCount);
-  jpfloat_t* data = dataStart;
-  while (data < dataEnd) {
-    const jpfloat_t value = *data;
-    min = fminf(min, value);
-    max = fmaxf(max, value);
-    data += 1;
+  for (int row = 0; row < rowsCount; row += 1) {
+    const jpfloat_t* rowData = (input->_data + (row * valuesPerRow));
+    jpfloat_t rowMin = FLT_MAX;
+    jpfloat_t rowMax = -FLT_MAX;
+    for (int index = 0; index < valuesPerRow; index += 1) {
+      const jpfloat_t value = rowData[index];
+      rowMin = fminf(rowMin, value);
+      rowMax = fmaxf(rowMax, value);
+    }
+    // Rows with their own ranges are widened slightly so that zero falls
+    // exactly on one of the levels, and the largest value still fits below
+    // the top one. Otherwise every zero in a pruned layer would come back as
+    // the same small value, and their errors would all add up.
+    if (isPerRow && (rowMin < 0.0f) && (rowMax > 0.0f)) {
+      const int topLevel = (levels - 1);
+      const jpfloat_t fittedSpread = ((rowMax - rowMin) / topLevel);
+      const int zeroLevel = MIN((topLevel - 1), MAX(1, (int)(roundf(-rowMin / fittedSpread))));
+      const jpfloat_t spread = fmaxf((-rowMin / zeroLevel), (rowMax / (topLevel - zeroLevel)));
+      rowMin = -(zeroLevel * spread);
+      rowMax = (rowMin + (spread * levels));
+    }
+    quantize_values(rowData, valuesPerRow, howManyBits, rowMin, rowMax, (quantizedData + (row * valuesPerRow * bytesPerElement)));
+    if (isPerRow) {
+      outRowMins[row] = rowMin;
+      outRowScales[row] = ((rowMax - rowMin) / levels);
+    }
+    min = fminf(min, rowMin);
+    max = fmaxf(max, rowMax);
   }
 
+  *outData = quantizedData;
+  *outSizeofData = sizeofQuantizedData;
+  *outMin = min;
+  *outMax = max;
+}
+
+void quantize_values(const jpfloat_t* input, int count, int howManyBits, jpfloat_t min, jpfloat_t max, void* output) {
   const int levels = (1 << howManyBits);
 
   const jpfloat_t spread = ((max - min) / levels);
   const jpfloat_t recipSpread = (1.0f / fmaxf(0.00000001f, spread));
 
-  if (howManyBits == 8) {
-    const size_t sizeofQuantizedData = elementCount * sizeof(uint8_t);
-    uint8_t* quantizedDataStart = (uint8_t*)(malloc(sizeofQuantizedData));
-    data = dataStart;
-    uint8_t* quantizedData = quantizedDataStart;
-    while (data < dataEnd) {
-      const jpfloat_t value = *data;
-      int quantized = (int)roundf((value - min) * recipSpread);
-      if (quantized < 0) {
-        quantized = 0;
-      } else if (quantized >= levels) {
-        quantized = (levels - 1);
-      }
-      *quantizedData = (uint8_t)(quantized);
-      data += 1;
-      quantizedData += 1;
+  for (int index = 0; index < count; index += 1) {
+    int quantized = (int)roundf((input[index] - min) * recipSpread);
+    if (quantized < 0) {
+      quantized = 0;
+    } else if (quantized >= levels) {
+      quantized = (levels - 1);
     }
-    *outData = quantizedDataStart;
-    *outSizeofData = sizeofQuantizedData;
-  } else if (howManyBits == 16) {
-    const size_t sizeofQuantizedData = elementCount * sizeof(uint16_t);
-    uint16_t* quantizedDataStart = (uint16_t*)(malloc(sizeofQuantizedData));
-    data = dataStart;
-    uint16_t* quantizedData = quantizedDataStart;
-    while (data < dataEnd) {
-      const jpfloat_t value = *data;
-      int quantized = (int)roundf((value - min) * recipSpread);
-      if (quantized < 0) {
-        quantized = 0;
-      } else if (quantized >= levels) {
-        quantized = (levels - 1);
-      }
-      *quantizedData = (uint16_t)(quantized);
-      data += 1;
-      quantizedData += 1;
+    if (howManyBits == 8) {
+      ((uint8_t*)(output))[index] = (uint8_t)(quantized);
+    } else {
+      ((uint16_t*)(output))[index] = (uint16_t)(quantized);
     }
-    *outData = quantizedDataStart;
-    *outSizeofData = sizeofQuantizedData;
-  } else {
-    assert(false); // should never get here
-    *outData = NULL;
-    *outSizeofData = 0;
   }
-  *outMin = min;
-  *outMax = max;
+}
+
+Buffer* dequantize_buffer(Buffer* input) {
+  Buffer* result = new Buffer(input->_dims);
+  const int elementCount = input->_dims.elementCount();
+  if (input->_bitsPerElement == 32) {
+    result->copyDataFrom(input);
+    return result;
+  }
+
+  if (input->_elementFormat != JPElementFormatLinear) {
+    matrix_dequantize_half((uint16_t*)(input->_quantizedData), elementCount, input->_elementFormat, result->_data);
+    return result;
+  }
+
+  const int rowsCount = ((input->_rowMins != NULL) ? input->_dims[0] : 1);
+  const int valuesPerRow = (elementCount / rowsCount);
+  for (int row = 0; row < rowsCount; row += 1) {
+    jpfloat_t min = input->_min;
+    jpfloat_t range = ((input->_max - min) / (1 << input->_bitsPerElement));
+    if (input->_rowMins != NULL) {
+      min = input->_rowMins[row];
+      range = input->_rowScales[row];
+    }
+    const int offset = (row * valuesPerRow);
+    if (input->_bitsPerElement == 16) {
+      matrix_dequantize_uint16(((uint16_t*)(input->_quantizedData) + offset), valuesPerRow, min, range, (result->_data + offset));
+    } else if (input->_bitsPerElement == 8) {
+      matrix_dequantize_uint8(((uint8_t*)(input->_quantizedData) + offset), valuesPerRow, min, range, (result->_data + offset));
+    } else {
+      assert(false); // should never get here
+    }
+  }
+  return result;
 }
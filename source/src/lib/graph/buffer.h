@@ -20,8 +20,11 @@ public:
 
   Buffer(const Dimensions& dims);
   Buffer(const Dimensions& dims, jpfloat_t* data);
-  Buffer(const Dimensions& dims, void* quantizedData, jpfloat_t min, jpfloat_t max, int bitsPerElement);
-  Buffer(const Dimensions& dims, jpfloat_t min, jpfloat_t max, int bitsPerElement);
+  // Half-precision buffers have 16 bits per element, and ignore min and max.
+  Buffer(const Dimensions& dims, void* quantizedData, jpfloat_t min, jpfloat_t max, int bitsPerElement, int elementFormat = JPElementFormatLinear);
+  Buffer(const Dimensions& dims, jpfloat_t min, jpfloat_t max, int bitsPerElement, int elementFormat = JPElementFormatLinear);
+  // A view into part of another buffer's data, starting at elementOffset.
+  Buffer(const Dimensions& dims, Buffer* parent, int elementOffset);
   virtual ~Buffer();
 
   Dimensions _dims;
@@ -33,7 +36,16 @@ public:
 #endif // USE_QPU_GEMM
   jpfloat_t _min;
   jpfloat_t _max;
+  // Fixed-point buffers can have their own range for each of the _dims[0]
+  // rows, which for transposed weights means one per output channel. When
+  // these are set, values in row i stand for (_rowMins[i] + (value *
+  // _rowScales[i])), and _min and _max just cover all of the rows. The arrays
+  // always belong to the buffer, even when its values don't.
+  jpfloat_t* _rowMins;
+  jpfloat_t* _rowScales;
   int _bitsPerElement;
+  // One of the JPELEMENT_FORMAT values, for buffers that aren't 32-bit.
+  int _elementFormat;
   bool _doesOwnData;
   char* _debugString;
   char* _name;
@@ -48,11 +60,17 @@ public:
   void populateWithRandomValues(jpfloat_t min, jpfloat_t max);
   void quantize(int bits);
   void transpose();
+  // Copies in a min and scale for each row, or goes back to a single range
+  // for the whole buffer if they're NULL.
+  void setRowRanges(const jpfloat_t* rowMins, const jpfloat_t* rowScales);
 
   // Creates a new buffer object that shares the underlying data array,
   // but has independent shape and other meta-data.
   Buffer* view();
 
+  // How much memory the values take up, allowing for quantization.
+  size_t storageBytes();
+
   char* debugString();
   void printContents(int maxElements=8);
   void saveDebugImage();
@@ -68,8 +86,17 @@ extern Buffer* buffer_view_at_top_index(Buffer* input, int index);
 extern Buffer* convert_from_channeled_rgb_image(Buffer* input);
 extern Buffer* convert_to_channeled_rgb_image(Buffer* input);
 extern Buffer* extract_subregion(Buffer* input, const Offset& origin, const Dimensions& size);
-SBinaryTag* buffer_to_tag_dict(Buffer* buffer, int floatBits = 32);
+// Half-precision formats are written with 16 float bits. Fixed-point values
+// are given a range for each row when isPerRow is set, which has no effect on
+// the other formats.
+SBinaryTag* buffer_to_tag_dict(Buffer* buffer, int floatBits = 32, int elementFormat = JPElementFormatLinear, bool isPerRow = false);
 void buffer_dump_to_file(Buffer* buffer, const char* filename);
-void quantize_buffer(Buffer* input, int howManyBits, jpfloat_t* outMin, jpfloat_t* outMax, void** outData, size_t* outSizeofData);
+// Passing arrays with room for every row in outRowMins and outRowScales
+// quantizes each row with its own range. outMin and outMax always get the
+// range of the whole buffer.
+void quantize_buffer(Buffer* input, int howManyBits, jpfloat_t* outMin, jpfloat_t* outMax, void** outData, size_t* outSizeofData, jpfloat_t* outRowMins = NULL, jpfloat_t* outRowScales = NULL);
+// Returns a new float buffer holding the values of an 8, 16 or 32 bit one, in
+// any of the formats.
+Buffer* dequantize_buffer(Buffer* input);
 
 #endif // INCLUDE_BUFFER_H
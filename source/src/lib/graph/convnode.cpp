@@ -9,14 +9,34 @@
 #include "convnode.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 
 #include "buffer.h"
 #include "binary_format.h"
+#include "cpu_features.h"
 #include "matrix_ops.h"
+#include "poolnode.h"
 
-ConvNode::ConvNode() : BaseNode(), _kernels(NULL), _bias(NULL), _areKernelsTransposed(false) {
+// How many rows of pooled output are calculated at once when a pool is fused
+// onto the convolution. The band of convolution rows behind them needs to
+// stay in the cache until it has been pooled.
+static const int kPooledRowsPerBand = 4;
+// Direct convolution is used for filters up to this size, where copying the
+// patches out would inflate the input the most compared to the work done on
+// it. Each tap also needs enough input channels to keep the micro-kernels'
+// inner loop busy, which rules out layers on the raw image.
+static const int kMaxDirectKernelWidth = 5;
+static const int kMinDirectInputChannels = 16;
+// The size of the random input that Winograd results are checked against.
+static const int kWinogradTestInputSize = 7;
+
+static bool can_use_direct_convolution(ConvNode* node);
+static bool can_use_winograd_convolution(ConvNode* node);
+static bool uses_implicit_patches(ConvNode* node);
+
+ConvNode::ConvNode() : BaseNode(), _kernels(NULL), _bias(NULL), _areKernelsTransposed(false), _directKernels(NULL), _winogradKernels(NULL), _winogradTolerance(0.0f), _savedKernelsFormat(JPElementFormatLinear) {
   setClassName("ConvNode");
 }
 
@@ -27,13 +47,71 @@ ConvNode::~ConvNode() {
   if (_bias != NULL) {
     delete _bias;
   }
+  if (_directKernels != NULL) {
+    delete _directKernels;
+  }
+  if (_winogradKernels != NULL) {
+    delete _winogradKernels;
+  }
+}
+
+Dimensions ConvNode::outputDimensions(const Dimensions& inputDims) {
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, _marginSize, _marginSize);
+  return matrix_correlate_output_dims(inputWithMarginDims, _kernelWidth, _kernelCount, _sampleStride);
+}
+
+size_t ConvNode::scratchBytes(const Dimensions& inputDims) {
+  return fusedScratchBytes(inputDims, NULL);
+}
+
+void ConvNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  runFusedInto(input, output, scratch, false, NULL);
+}
+
+bool ConvNode::canFuse(PoolNode* pool) {
+  return ((pool == NULL) || (pool->_mode == PoolNode::EModeMax));
 }
 
-Buffer* ConvNode::run(Buffer* input) {
-  if (_output != NULL) {
-    delete _output;
+Dimensions ConvNode::poolBandDimensions(const Dimensions& inputDims, PoolNode* pool) {
+  const Dimensions outputDims = outputDimensions(inputDims);
+  const int bandRows = MIN(outputDims[1], (((kPooledRowsPerBand - 1) * pool->_stride) + pool->_patchWidth));
+  const Dimensions result(1, bandRows, outputDims[2], outputDims[3]);
+  return result;
+}
+
+size_t ConvNode::fusedScratchBytes(const Dimensions& inputDims, PoolNode* pool) {
+  if (_winogradKernels != NULL) {
+    if (pool == NULL) {
+      return matrix_correlate_winograd_scratch_bytes(inputDims, _marginSize, _kernelCount);
+    }
+    const Dimensions bandDims = poolBandDimensions(inputDims, pool);
+    return (bandDims.byteCount() + matrix_correlate_winograd_rows_scratch_bytes(inputDims, _marginSize, _kernelCount, bandDims[1]));
+  }
+
+  // The direct version reads the input in place, so it only needs its row
+  // of zeros, and the band of rows when pooling.
+  if (_directKernels != NULL) {
+    size_t result = matrix_correlate_direct_scratch_bytes(inputDims);
+    if (pool != NULL) {
+      result += poolBandDimensions(inputDims, pool).byteCount();
+    }
+    return result;
+  }
+
+  // The implicit version gathers its patches while packing them for the GEMM,
+  // so it needs no space of its own.
+  if (uses_implicit_patches(this)) {
+    return ((pool != NULL) ? poolBandDimensions(inputDims, pool).byteCount() : 0);
   }
 
+  if (pool == NULL) {
+    return matrix_correlate_scratch_bytes(inputDims, _marginSize, _kernelWidth, _sampleStride);
+  }
+  const Dimensions bandDims = poolBandDimensions(inputDims, pool);
+  return (bandDims.byteCount() + matrix_correlate_rows_scratch_bytes(inputDims, _marginSize, _kernelWidth, _sampleStride, bandDims[1]));
+}
+
+void ConvNode::runFusedInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRelu, PoolNode* pool) {
   Dimensions inputDims = input->_dims;
   const int inputChannels = inputDims[inputDims._length - 1];
   const int valuesPerKernel = (inputChannels * _kernelWidth * _kernelWidth);
@@ -45,23 +123,194 @@ Buffer* ConvNode::run(Buffer* input) {
     assert(expectedKernelsDims == _kernels->_dims);
   }
 
-  Buffer* inputWithMargin;
-  if (_marginSize == 0) {
-    inputWithMargin = input;
+  // Every version of the correlation treats the margin as zeros as it reads
+  // the input, so it never has to be copied into a larger buffer.
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, _marginSize, _marginSize);
+  const bool isWinograd = (_winogradKernels != NULL);
+  const bool isDirect = (!isWinograd && (_directKernels != NULL));
+  const bool isImplicit = uses_implicit_patches(this);
+
+  SGemmEpilogue epilogue;
+  epilogue.bias = ((_bias != NULL) ? _bias->_data : NULL);
+  epilogue.scale = 1.0f;
+  epilogue.doRelu = doRelu;
+
+  if (pool == NULL) {
+    if (isWinograd) {
+      matrix_correlate_winograd_into(input, _marginSize, _winogradKernels, _kernelCount, output, scratch, &epilogue);
+    } else if (isDirect) {
+      matrix_correlate_direct_into(input, _marginSize, _directKernels, _kernelWidth, _kernelCount, _sampleStride, output, scratch, &epilogue);
+#if defined(USE_NATIVE_GEMM)
+    } else if (isImplicit) {
+      matrix_correlate_implicit_into(input, _marginSize, _kernels, _kernelWidth, _kernelCount, _sampleStride, _areKernelsTransposed, output, &epilogue);
+#endif // USE_NATIVE_GEMM
+    } else {
+      matrix_correlate_into(input, _marginSize, _kernels, _kernelWidth, _kernelCount, _sampleStride, _areKernelsTransposed, output, scratch, &epilogue);
+    }
+    return;
+  }
+
+  // Work down the image in bands of rows, pooling each one as soon as it's
+  // been calculated so the full-sized result never gets written to memory.
+  const Dimensions convDims = matrix_correlate_output_dims(inputWithMarginDims, _kernelWidth, _kernelCount, _sampleStride);
+  const int imageCount = convDims[0];
+  const int convWidth = convDims[2];
+  const int convChannels = convDims[3];
+  const int valuesPerConvRow = (convWidth * convChannels);
+  const Dimensions outputDims = output->_dims;
+  const int pooledHeight = outputDims[1];
+  const int pooledWidth = outputDims[2];
+  const int patchWidth = pool->_patchWidth;
+  const int poolStride = pool->_stride;
+
+  const Dimensions maxBandDims = poolBandDimensions(inputDims, pool);
+  Buffer band(maxBandDims, scratch, 0);
+  const int rowsScratchOffset = maxBandDims.elementCount();
+  const int rowsScratchCount = (scratch->_dims.elementCount() - rowsScratchOffset);
+  Buffer rowsScratch(Dimensions(rowsScratchCount), scratch, rowsScratchOffset);
+
+  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
+    int bandStartRow = 0;
+    int bandRowsCount = 0;
+    for (int pooledY = 0; pooledY < pooledHeight; pooledY += kPooledRowsPerBand) {
+      const int pooledRowsCount = MIN(kPooledRowsPerBand, (pooledHeight - pooledY));
+      const int startRow = (pooledY * poolStride);
+      const int endRow = ((((pooledY + pooledRowsCount) - 1) * poolStride) + patchWidth);
+
+      // Overlapping pools need some rows from the end of the last band, so
+      // move those to the front rather than calculating them again.
+      int keptRowsCount = 0;
+      const int bandEndRow = (bandStartRow + bandRowsCount);
+      if ((bandRowsCount > 0) && (startRow < bandEndRow)) {
+        keptRowsCount = (bandEndRow - startRow);
+        const jpfloat_t* keptRowsStart = (band._data + ((startRow - bandStartRow) * valuesPerConvRow));
+        memmove(band._data, keptRowsStart, (keptRowsCount * valuesPerConvRow * sizeof(jpfloat_t)));
+      }
+
+      const int newRowsCount = ((endRow - startRow) - keptRowsCount);
+      Buffer newRows(Dimensions(1, newRowsCount, convWidth, convChannels), &band, (keptRowsCount * valuesPerConvRow));
+      if (isWinograd) {
+        matrix_correlate_winograd_rows_into(input, _marginSize, imageIndex, (startRow + keptRowsCount), newRowsCount,
+          _winogradKernels, _kernelCount, &newRows, &rowsScratch, &epilogue);
+      } else if (isDirect) {
+        matrix_correlate_direct_rows_into(input, _marginSize, imageIndex, (startRow + keptRowsCount), newRowsCount,
+          _directKernels, _kernelWidth, _kernelCount, _sampleStride, &newRows, &rowsScratch, &epilogue);
+#if defined(USE_NATIVE_GEMM)
+      } else if (isImplicit) {
+        matrix_correlate_implicit_rows_into(input, _marginSize, imageIndex, (startRow + keptRowsCount), newRowsCount,
+          _kernels, _kernelWidth, _kernelCount, _sampleStride, _areKernelsTransposed, &newRows, &epilogue);
+#endif // USE_NATIVE_GEMM
+      } else {
+        matrix_correlate_rows_into(input, _marginSize, imageIndex, (startRow + keptRowsCount), newRowsCount,
+          _kernels, _kernelWidth, _kernelCount, _sampleStride, _areKernelsTransposed, &newRows, &rowsScratch, &epilogue);
+      }
+      bandStartRow = startRow;
+      bandRowsCount = (endRow - startRow);
+
+      Buffer bandRows(Dimensions(1, bandRowsCount, convWidth, convChannels), &band, 0);
+      const int pooledOffset = outputDims.offset(imageIndex, pooledY, 0, 0);
+      Buffer pooledRows(Dimensions(1, pooledRowsCount, pooledWidth, convChannels), output, pooledOffset);
+      matrix_max_patch_into(&bandRows, patchWidth, poolStride, &pooledRows);
+    }
+  }
+}
+
+size_t ConvNode::memoryTrafficBytes(const Dimensions& inputDims) {
+  return fusedMemoryTrafficBytes(inputDims, NULL);
+}
+
+size_t ConvNode::fusedMemoryTrafficBytes(const Dimensions& inputDims, PoolNode* pool) {
+  size_t result = 0;
+  if (_winogradKernels != NULL) {
+    // The transformed tiles are written out and read back by the GEMMs, as
+    // are the GEMMs' results.
+    result += inputDims.byteCount();
+    const size_t transformedBytes = matrix_correlate_winograd_scratch_bytes(inputDims, _marginSize, _kernelCount);
+    result += (2 * transformedBytes);
+  } else if (_directKernels != NULL) {
+    // The direct version reads the input once, where it is.
+    result += inputDims.byteCount();
+  } else if (uses_implicit_patches(this)) {
+    // The patches only ever exist as packed panels in the cache, gathered
+    // straight from the input.
+    result += inputDims.byteCount();
+  } else {
+    // The patches are written out and then read back in by the GEMM.
+    result += inputDims.byteCount();
+    result += (2 * matrix_correlate_scratch_bytes(inputDims, _marginSize, _kernelWidth, _sampleStride));
+  }
+  // When pooling, each band of results stays in the cache and only the pooled
+  // values are written.
+  const Dimensions outputDims = outputDimensions(inputDims);
+  if (pool == NULL) {
+    result += outputDims.byteCount();
   } else {
-    inputWithMargin = matrix_insert_margin(input, _marginSize, _marginSize);
+    result += pool->outputDimensions(outputDims).byteCount();
+  }
+  return result;
+}
+
+double ConvNode::flopCount(const Dimensions& inputDims) {
+  const Dimensions outputDims = outputDimensions(inputDims);
+  const double outputCount = outputDims.elementCount();
+  const double kernelSize = (_kernelWidth * _kernelWidth * inputDims[inputDims._length - 1]);
+  // A multiply and an add for every kernel value, plus the bias.
+  return ((2.0 * outputCount * kernelSize) + outputCount);
+}
+
+bool ConvNode::setWinogradTolerance(jpfloat_t tolerance) {
+  if (_winogradKernels != NULL) {
+    delete _winogradKernels;
+    _winogradKernels = NULL;
+  }
+  _winogradTolerance = 0.0f;
+  if ((tolerance <= 0.0f) || !can_use_winograd_convolution(this)) {
+    return false;
+  }
+
+  const int inputChannels = (_kernels->_dims.elementCount() / (_kernelWidth * _kernelWidth * _kernelCount));
+  Buffer* winogradKernels = new Buffer(matrix_correlate_winograd_kernels_dims(inputChannels, _kernelCount));
+  matrix_correlate_winograd_transform_kernels(_kernels, _kernelCount, _areKernelsTransposed, winogradKernels);
+
+  // Compare against the ordinary version on a small random image, with an
+  // odd size so the partial tiles at the edges are covered too.
+  const Dimensions testInputDims(1, kWinogradTestInputSize, kWinogradTestInputSize, inputChannels);
+  Buffer* testInput = new Buffer(testInputDims);
+  unsigned int seed = 1;
+  for (int index = 0; index < testInputDims.elementCount(); index += 1) {
+    testInput->_data[index] = (((rand_r(&seed) / (jpfloat_t)(RAND_MAX)) * 2.0f) - 1.0f);
   }
 
-  _output = matrix_correlate(inputWithMargin, _kernels, _kernelWidth, _kernelCount, _sampleStride, _areKernelsTransposed);
-  _output->setName(_name);
+  Buffer* expected = matrix_correlate(testInput, _marginSize, _kernels, _kernelWidth, _kernelCount, _sampleStride, _areKernelsTransposed);
+  Buffer* actual = new Buffer(expected->_dims);
+  const size_t scratchBytes = matrix_correlate_winograd_scratch_bytes(testInputDims, _marginSize, _kernelCount);
+  Buffer* scratch = new Buffer(Dimensions((int)(scratchBytes / sizeof(jpfloat_t))));
+  matrix_correlate_winograd_into(testInput, _marginSize, winogradKernels, _kernelCount, actual, scratch);
 
-  matrix_add_inplace(_output, _bias, 1.0);
+  const bool isClose = buffer_are_all_close(expected, actual, tolerance);
+  delete scratch;
+  delete actual;
+  delete expected;
+  delete testInput;
 
-  if (_marginSize != 0) {
-    delete inputWithMargin;
+  if (!isClose) {
+    fprintf(stderr, "Winograd results for layer '%s' aren't within %g of the originals, so it's not being used\n",
+      _name, tolerance);
+    delete winogradKernels;
+    return false;
   }
 
-  return _output;
+  _winogradKernels = winogradKernels;
+  _winogradTolerance = tolerance;
+  return true;
+}
+
+size_t ConvNode::weightBytes() {
+  size_t result = _kernels->storageBytes();
+  if (_bias != NULL) {
+    result += _bias->storageBytes();
+  }
+  return result;
 }
 
 char* ConvNode::debugString() {
@@ -119,12 +368,19 @@ SBinaryTag* ConvNode::toTag() {
   free(specDict);
 
   const bool wantTransposedOutput = true;
-  const int outputBitDepth = 16;
+  int outputFormat = _savedKernelsFormat;
+  if (outputFormat == JPElementFormatLinear) {
+    outputFormat = _kernels->_elementFormat;
+  }
+  // Fixed-point kernels get a separate range for each output channel, which
+  // keeps enough resolution at 8 bits even when a few kernels have much larger
+  // values than the rest.
+  const int outputBitDepth = ((outputFormat == JPElementFormatLinear) ? 8 : 16);
 
   if (wantTransposedOutput != _areKernelsTransposed) {
     _kernels->transpose(); // First transpose so they match
   }
-  SBinaryTag* kernelsTag = buffer_to_tag_dict(_kernels, outputBitDepth);
+  SBinaryTag* kernelsTag = buffer_to_tag_dict(_kernels, outputBitDepth, outputFormat, true);
   resultDict = add_tag_to_dict(resultDict, "kernels", kernelsTag);
   free(kernelsTag);
   if (wantTransposedOutput != _areKernelsTransposed) {
@@ -146,6 +402,10 @@ SBinaryTag* ConvNode::toTag() {
 
   resultDict = add_uint_to_dict(resultDict, "padding", _marginSize);
 
+  if (_winogradKernels != NULL) {
+    resultDict = add_float_to_dict(resultDict, "winograd_tolerance", _winogradTolerance);
+  }
+
   return resultDict;
 }
 
@@ -175,5 +435,53 @@ BaseNode* new_convnode_from_tag(SBinaryTag* tag, bool skipCopy) {
     result->_areKernelsTransposed = get_uint_from_dict(tag, "are_kernels_transposed");
   }
 
+  // Setting the JPCNN_DISABLE_DIRECT_CONV environment variable runs every
+  // convolution through GEMM, for comparing the two.
+  const char* disableDirect = getenv("JPCNN_DISABLE_DIRECT_CONV");
+  const bool allowDirect = ((disableDirect == NULL) || (strcmp(disableDirect, "0") == 0));
+  if (allowDirect && can_use_direct_convolution(result)) {
+    const int inputChannels = (result->_kernels->_dims.elementCount() / (result->_kernelWidth * result->_kernelWidth * result->_kernelCount));
+    result->_directKernels = new Buffer(matrix_correlate_direct_packed_kernels_dims(result->_kernelWidth, inputChannels, result->_kernelCount));
+    matrix_correlate_direct_pack_kernels(result->_kernels, result->_kernelWidth, result->_kernelCount, result->_areKernelsTransposed, result->_directKernels);
+  }
+
+  // Layers only use Winograd if they've been switched over to it with
+  // jpcnn_set_winograd_tolerance() before the network was saved.
+  if (get_tag_from_dict(tag, "winograd_tolerance")) {
+    result->setWinogradTolerance(get_float_from_dict(tag, "winograd_tolerance"));
+  }
+
   return result;
 }
+
+// The GPU builds keep convolutions on the GPU through their GEMM, and the
+// direct micro-kernels are only vectorized for x86.
+bool can_use_direct_convolution(ConvNode* node) {
+#if defined(USE_CPU_DISPATCH) && !defined(USE_QPU_GEMM) && !defined(USE_OPENGL)
+  const int inputChannels = (node->_kernels->_dims.elementCount() / (node->_kernelWidth * node->_kernelWidth * node->_kernelCount));
+  return ((node->_kernelWidth <= kMaxDirectKernelWidth) && (inputChannels >= kMinDirectInputChannels));
+#else
+  return false;
+#endif
+}
+
+// Winograd's transforms only fit the 3x3 kernels and single steps that
+// F(2x2, 3x3) is built for. It needs a CPU GEMM for its batches too.
+bool can_use_winograd_convolution(ConvNode* node) {
+#if !defined(USE_QPU_GEMM) && !defined(USE_OPENGL)
+  return ((node->_kernelWidth == 3) && (node->_sampleStride == 1));
+#else
+  return false;
+#endif
+}
+
+// With the native GEMM, layers that aren't using one of the specialized
+// versions gather their patches from the input as the GEMM packs them, rather
+// than copying them out into a matrix first.
+bool uses_implicit_patches(ConvNode* node) {
+#if defined(USE_NATIVE_GEMM)
+  return ((node->_winogradKernels == NULL) && (node->_directKernels == NULL));
+#else
+  return false;
+#endif
+}
@@ -20,11 +20,25 @@ public:
   ConvNode();
   ~ConvNode();
 
-  virtual Buffer* run(Buffer* input);
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual size_t scratchBytes(const Dimensions& inputDims);
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+  virtual bool canFuse(PoolNode* pool);
+  virtual size_t fusedScratchBytes(const Dimensions& inputDims, PoolNode* pool);
+  virtual void runFusedInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRelu, PoolNode* pool);
+  virtual size_t memoryTrafficBytes(const Dimensions& inputDims);
+  virtual size_t fusedMemoryTrafficBytes(const Dimensions& inputDims, PoolNode* pool);
+  virtual double flopCount(const Dimensions& inputDims);
+  virtual size_t weightBytes();
   virtual SBinaryTag* toTag();
   virtual char* debugString();
 
   void saveDebugImage();
+  Dimensions poolBandDimensions(const Dimensions& inputDims, PoolNode* pool);
+  // Switches a 3x3, stride 1 layer over to Winograd convolution, if its
+  // results on a test input are all within tolerance of the ordinary ones.
+  // A tolerance of zero switches it back. Returns whether Winograd is in use.
+  bool setWinogradTolerance(jpfloat_t tolerance);
 
   uint32_t _kernelCount;
   uint32_t _kernelWidth;
@@ -34,6 +48,17 @@ public:
   Buffer* _bias;
   uint32_t _marginSize;
   bool _areKernelsTransposed;
+  // Set when the layer's shape suits direct convolution, holding the kernels
+  // rearranged by matrix_correlate_direct_pack_kernels().
+  Buffer* _directKernels;
+  // Set for layers that have opted into Winograd convolution, holding the
+  // kernels from matrix_correlate_winograd_transform_kernels().
+  Buffer* _winogradKernels;
+  jpfloat_t _winogradTolerance;
+  // How toTag() stores the kernels. Linear means they're written as 8-bit
+  // fixed point with a range for each output channel, unless they were loaded
+  // as 16-bit floats, in which case they stay that way.
+  int _savedKernelsFormat;
 };
 
 BaseNode* new_convnode_from_tag(SBinaryTag* tag, bool skipCopy);
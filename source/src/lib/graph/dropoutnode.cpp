@@ -23,7 +23,29 @@ DropoutNode::~DropoutNode() {
 }
 
 Buffer* DropoutNode::run(Buffer* input) {
-  return input;
+  // Dropout is only used during training, so at inference time this is just
+  // a view onto the input.
+  Buffer* output = input->view();
+  return output;
+}
+
+Dimensions DropoutNode::outputDimensions(const Dimensions& inputDims) {
+  return inputDims;
+}
+
+bool DropoutNode::canRunInPlace() {
+  return true;
+}
+
+void DropoutNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  if (output->_data != input->_data) {
+    output->copyDataFrom(input);
+  }
+}
+
+size_t DropoutNode::memoryTrafficBytes(const Dimensions& inputDims) {
+  // Planned runs always share the input's data, so nothing gets touched.
+  return 0;
 }
 
 SBinaryTag* DropoutNode::toTag() {
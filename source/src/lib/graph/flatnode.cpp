@@ -23,7 +23,15 @@ FlatNode::~FlatNode() {
 }
 
 Buffer* FlatNode::run(Buffer* input) {
-  const Dimensions inputDims = input->_dims;
+  const Dimensions outputDims = outputDimensions(input->_dims);
+
+  // Doesn't do a data copy, just returns a new view with a different shape.
+  Buffer* output = new Buffer(outputDims, input->_data);
+
+  return output;
+}
+
+Dimensions FlatNode::outputDimensions(const Dimensions& inputDims) {
   // We're expecting (# of images, height, width, # of channels)
   assert(inputDims._length == 4);
 
@@ -34,11 +42,24 @@ Buffer* FlatNode::run(Buffer* input) {
 
   const int outputElementCount = (inputHeight * inputWidth * inputChannels);
   const Dimensions outputDims(imageCount, outputElementCount);
+  return outputDims;
+}
 
-  // Doesn't do a data copy, just returns a new view with a different shape.
-  _output = new Buffer(outputDims, input->_data);
+bool FlatNode::canRunInPlace() {
+  return true;
+}
+
+void FlatNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  // When planned in place there's nothing to do, the output is just the same
+  // data with a different shape.
+  if (output->_data != input->_data) {
+    output->copyDataFrom(input);
+  }
+}
 
-  return _output;
+size_t FlatNode::memoryTrafficBytes(const Dimensions& inputDims) {
+  // Planned runs always share the input's data, so nothing gets touched.
+  return 0;
 }
 
 SBinaryTag* FlatNode::toTag() {
@@ -21,6 +21,10 @@ public:
   ~FlatNode();
 
   virtual Buffer* run(Buffer* input);
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual bool canRunInPlace();
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+  virtual size_t memoryTrafficBytes(const Dimensions& inputDims);
   virtual SBinaryTag* toTag();
 };
 
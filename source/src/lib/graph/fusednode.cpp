@@ -0,0 +1,115 @@
+//
+//  fusednode.cpp
+//  jpcnn
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "fusednode.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "poolnode.h"
+#include "relunode.h"
+
+static bool is_node_class(BaseNode* node, const char* className);
+
+FusedNode::FusedNode(BaseNode* node, ReluNode* relu, PoolNode* pool) :
+  BaseNode(),
+  _node(node),
+  _relu(relu),
+  _pool(pool),
+  _layersCount(0) {
+  assert(node != NULL);
+  assert(relu != NULL);
+  setClassName("FusedNode");
+
+  _layersCount = ((_pool != NULL) ? 3 : 2);
+  char name[MAX_DEBUG_STRING_LEN];
+  if (_pool != NULL) {
+    snprintf(name, sizeof(name), "%s+%s+%s", _node->_name, _relu->_name, _pool->_name);
+  } else {
+    snprintf(name, sizeof(name), "%s+%s", _node->_name, _relu->_name);
+  }
+  setName(name);
+}
+
+FusedNode::~FusedNode() {
+  // Do nothing, the graph owns the original layers
+}
+
+Dimensions FusedNode::outputDimensions(const Dimensions& inputDims) {
+  const Dimensions nodeOutputDims = _node->outputDimensions(inputDims);
+  if (_pool == NULL) {
+    return nodeOutputDims;
+  }
+  return _pool->outputDimensions(nodeOutputDims);
+}
+
+size_t FusedNode::scratchBytes(const Dimensions& inputDims) {
+  return _node->fusedScratchBytes(inputDims, _pool);
+}
+
+void FusedNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  _node->runFusedInto(input, output, scratch, true, _pool);
+}
+
+size_t FusedNode::memoryTrafficBytes(const Dimensions& inputDims) {
+  return _node->fusedMemoryTrafficBytes(inputDims, _pool);
+}
+
+double FusedNode::flopCount(const Dimensions& inputDims) {
+  const Dimensions nodeOutputDims = _node->outputDimensions(inputDims);
+  double result = _node->flopCount(inputDims);
+  result += _relu->flopCount(nodeOutputDims);
+  if (_pool != NULL) {
+    result += _pool->flopCount(nodeOutputDims);
+  }
+  return result;
+}
+
+size_t FusedNode::weightBytes() {
+  return _node->weightBytes();
+}
+
+SBinaryTag* FusedNode::toTag() {
+  assert(false); // Graphs are saved from their original layers, so this should never be called
+  return NULL;
+}
+
+char* FusedNode::debugString() {
+  char additionalInfo[MAX_DEBUG_STRING_LEN];
+  snprintf(additionalInfo, sizeof(additionalInfo),
+    "_layersCount=%d, _node=%s", _layersCount, _node->debugString());
+  return this->debugStringWithMessage(additionalInfo);
+}
+
+bool is_node_class(BaseNode* node, const char* className) {
+  return ((node->_className != NULL) && (strcmp(node->_className, className) == 0));
+}
+
+FusedNode* new_fusednode_from_layers(BaseNode** layers, int layersLength, int startIndex) {
+  if ((startIndex + 1) >= layersLength) {
+    return NULL;
+  }
+  BaseNode* node = layers[startIndex];
+  if (!is_node_class(layers[startIndex + 1], "ReluNode") || !node->canFuse(NULL)) {
+    return NULL;
+  }
+  ReluNode* relu = (ReluNode*)(layers[startIndex + 1]);
+
+  PoolNode* pool = NULL;
+  if (((startIndex + 2) < layersLength) && is_node_class(layers[startIndex + 2], "PoolNode")) {
+    PoolNode* candidatePool = (PoolNode*)(layers[startIndex + 2]);
+    if (node->canFuse(candidatePool)) {
+      pool = candidatePool;
+    }
+  }
+
+  FusedNode* result = new FusedNode(node, relu, pool);
+  return result;
+}
@@ -0,0 +1,52 @@
+//
+//  fusednode.h
+//  jpcnn
+//
+//  Runs a convolution or fully-connected layer together with the ReLU, and
+//  optionally the max pool, that follow it. The activation is applied to each
+//  block of GEMM results while it's still in the cache, instead of each layer
+//  making its own full pass over memory.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#ifndef INCLUDE_FUSEDNODE_H
+#define INCLUDE_FUSEDNODE_H
+
+#include "basenode.h"
+#include "binary_format.h"
+
+class Buffer;
+class PoolNode;
+class ReluNode;
+
+class FusedNode : public BaseNode {
+public:
+
+  // The layers still belong to the graph, since it saves them out as they
+  // were loaded.
+  FusedNode(BaseNode* node, ReluNode* relu, PoolNode* pool);
+  ~FusedNode();
+
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual size_t scratchBytes(const Dimensions& inputDims);
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+  virtual size_t memoryTrafficBytes(const Dimensions& inputDims);
+  virtual double flopCount(const Dimensions& inputDims);
+  virtual size_t weightBytes();
+  virtual SBinaryTag* toTag();
+  virtual char* debugString();
+
+  BaseNode* _node;
+  ReluNode* _relu;
+  PoolNode* _pool;
+  // How many of the graph's original layers this replaces.
+  int _layersCount;
+};
+
+// Returns a node that runs the layers starting at startIndex in a single
+// pass, or NULL if they don't follow a pattern that can be fused.
+FusedNode* new_fusednode_from_layers(BaseNode** layers, int layersLength, int startIndex);
+
+#endif // INCLUDE_FUSEDNODE_H
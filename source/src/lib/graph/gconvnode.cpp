@@ -15,6 +15,7 @@
 #include "binary_format.h"
 #include "nodefactory.h"
 #include "matrix_ops.h"
+#include "poolnode.h"
 
 GConvNode::GConvNode() : BaseNode() {
   setClassName("GConvNode");
@@ -29,41 +30,149 @@ GConvNode::~GConvNode() {
   }
 }
 
-Buffer* GConvNode::run(Buffer* input) {
-  if (_output != NULL) {
-    delete _output;
+Dimensions GConvNode::subnodeInputDimensions(const Dimensions& inputDims) {
+  assert(inputDims._length == 4);
+  const int inputChannels = inputDims[3];
+  assert((inputChannels % _subnodesCount) == 0);
+  const int subnodeChannels = (inputChannels / _subnodesCount);
+  const Dimensions result(inputDims[0], inputDims[1], inputDims[2], subnodeChannels);
+  return result;
+}
+
+Dimensions GConvNode::subnodeOutputDimensions(const Dimensions& subnodeInputDims, PoolNode* pool) {
+  const Dimensions result = _subnodes[0]->outputDimensions(subnodeInputDims);
+  if (pool == NULL) {
+    return result;
   }
+  return pool->outputDimensions(result);
+}
 
-  const Dimensions inputDims = input->_dims;
+Dimensions GConvNode::outputDimensions(const Dimensions& inputDims) {
+  const Dimensions subnodeInputDims = subnodeInputDimensions(inputDims);
+  Dimensions result = subnodeOutputDimensions(subnodeInputDims, NULL);
+  result._dims[result._length - 1] *= _subnodesCount;
+  return result;
+}
 
-  assert(inputDims._length == 4);
+size_t GConvNode::scratchBytes(const Dimensions& inputDims) {
+  return groupsScratchBytes(inputDims, false, NULL);
+}
 
-  const int imageCount = inputDims[0];
-  const int inputWidth = inputDims[2];
-  const int inputHeight = inputDims[1];
-  const int inputChannels = inputDims[3];
+void GConvNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  runGroupsInto(input, output, scratch, false, false, NULL);
+}
 
-  assert((inputChannels % _subnodesCount) == 0);
-  const int subnodeChannels = (inputChannels / _subnodesCount);
+bool GConvNode::canFuse(PoolNode* pool) {
+  for (int index = 0; index < _subnodesCount; index += 1) {
+    if (!_subnodes[index]->canFuse(pool)) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  const Dimensions subnodeInputDimensions(imageCount, inputHeight, inputWidth, subnodeChannels);
-  Buffer** subnodeOutputBuffers = (Buffer**)(malloc(sizeof(Buffer*) * _subnodesCount));
+size_t GConvNode::fusedScratchBytes(const Dimensions& inputDims, PoolNode* pool) {
+  return groupsScratchBytes(inputDims, true, pool);
+}
+
+void GConvNode::runFusedInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRelu, PoolNode* pool) {
+  runGroupsInto(input, output, scratch, true, doRelu, pool);
+}
+
+size_t GConvNode::memoryTrafficBytes(const Dimensions& inputDims) {
+  return groupsMemoryTrafficBytes(inputDims, false, NULL);
+}
+
+size_t GConvNode::fusedMemoryTrafficBytes(const Dimensions& inputDims, PoolNode* pool) {
+  return groupsMemoryTrafficBytes(inputDims, true, pool);
+}
+
+size_t GConvNode::groupsScratchBytes(const Dimensions& inputDims, bool isFused, PoolNode* pool) {
+  const Dimensions subnodeInputDims = subnodeInputDimensions(inputDims);
+  size_t subnodeScratchBytes = 0;
+  for (int index = 0; index < _subnodesCount; index += 1) {
+    BaseNode* subnode = _subnodes[index];
+    size_t currentBytes;
+    if (isFused) {
+      currentBytes = subnode->fusedScratchBytes(subnodeInputDims, pool);
+    } else {
+      currentBytes = subnode->scratchBytes(subnodeInputDims);
+    }
+    subnodeScratchBytes = MAX(subnodeScratchBytes, currentBytes);
+  }
+  const Dimensions subnodeOutputDims = subnodeOutputDimensions(subnodeInputDims, pool);
+  return (subnodeInputDims.byteCount() + subnodeOutputDims.byteCount() + subnodeScratchBytes);
+}
+
+void GConvNode::runGroupsInto(Buffer* input, Buffer* output, Buffer* scratch, bool isFused, bool doRelu, PoolNode* pool) {
+  const Dimensions inputDims = input->_dims;
+  const Dimensions subnodeInputDims = subnodeInputDimensions(inputDims);
+  const Dimensions subnodeOutputDims = subnodeOutputDimensions(subnodeInputDims, pool);
+  const int subnodeChannels = subnodeInputDims[3];
+  const int subnodeOutputChannels = subnodeOutputDims[3];
+
+  // Each group is run in turn through the same scratch area, which is laid
+  // out as the group's input, then its output, then the subnode's own scratch.
+  // Pooling only works within a channel, so each group can be pooled by its
+  // subnode before it's inserted into the output.
+  const int subnodeInputCount = subnodeInputDims.elementCount();
+  const int subnodeOutputCount = subnodeOutputDims.elementCount();
+  Buffer subnodeInput(subnodeInputDims, scratch, 0);
+  Buffer subnodeOutput(subnodeOutputDims, scratch, subnodeInputCount);
+  const int subnodeScratchOffset = (subnodeInputCount + subnodeOutputCount);
+  const int subnodeScratchCount = (scratch->_dims.elementCount() - subnodeScratchOffset);
+  Buffer subnodeScratch(Dimensions(subnodeScratchCount), scratch, subnodeScratchOffset);
 
   for (int index = 0; index < _subnodesCount; index += 1) {
     const int startChannel = (index * subnodeChannels);
     const int endChannel = ((index + 1) * subnodeChannels);
-    Buffer* subnodeInputBuffer = matrix_extract_channels(input, startChannel, endChannel);
+    matrix_extract_channels_into(input, startChannel, endChannel, &subnodeInput);
 
     BaseNode* subnode = _subnodes[index];
-    Buffer* subnodeOutputBuffer = subnode->run(subnodeInputBuffer);
-    subnodeOutputBuffers[index] = subnodeOutputBuffer;
+    if (isFused) {
+      subnode->runFusedInto(&subnodeInput, &subnodeOutput, &subnodeScratch, doRelu, pool);
+    } else {
+      subnode->runInto(&subnodeInput, &subnodeOutput, &subnodeScratch);
+    }
 
-    delete subnodeInputBuffer;
+    matrix_insert_channels(&subnodeOutput, output, (index * subnodeOutputChannels));
   }
+}
 
-  _output = matrix_join_channels(subnodeOutputBuffers, _subnodesCount);
+size_t GConvNode::groupsMemoryTrafficBytes(const Dimensions& inputDims, bool isFused, PoolNode* pool) {
+  const Dimensions subnodeInputDims = subnodeInputDimensions(inputDims);
+  const Dimensions subnodeOutputDims = subnodeOutputDimensions(subnodeInputDims, pool);
+  size_t result = 0;
+  for (int index = 0; index < _subnodesCount; index += 1) {
+    BaseNode* subnode = _subnodes[index];
+    // Extracting a group reads through the whole input, and inserting the
+    // result reads it back and writes it into the output.
+    result += (inputDims.byteCount() + subnodeInputDims.byteCount());
+    if (isFused) {
+      result += subnode->fusedMemoryTrafficBytes(subnodeInputDims, pool);
+    } else {
+      result += subnode->memoryTrafficBytes(subnodeInputDims);
+    }
+    result += (2 * subnodeOutputDims.byteCount());
+  }
+  return result;
+}
 
-  return _output;
+double GConvNode::flopCount(const Dimensions& inputDims) {
+  const Dimensions subnodeInputDims = subnodeInputDimensions(inputDims);
+  double result = 0.0;
+  for (int index = 0; index < _subnodesCount; index += 1) {
+    result += _subnodes[index]->flopCount(subnodeInputDims);
+  }
+  return result;
+}
+
+size_t GConvNode::weightBytes() {
+  size_t result = 0;
+  for (int index = 0; index < _subnodesCount; index += 1) {
+    result += _subnodes[index]->weightBytes();
+  }
+  return result;
 }
 
 char* GConvNode::debugString() {
@@ -20,7 +20,22 @@ public:
   GConvNode();
   ~GConvNode();
 
-  virtual Buffer* run(Buffer* input);
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual size_t scratchBytes(const Dimensions& inputDims);
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+  virtual bool canFuse(PoolNode* pool);
+  virtual size_t fusedScratchBytes(const Dimensions& inputDims, PoolNode* pool);
+  virtual void runFusedInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRelu, PoolNode* pool);
+  virtual size_t memoryTrafficBytes(const Dimensions& inputDims);
+  virtual size_t fusedMemoryTrafficBytes(const Dimensions& inputDims, PoolNode* pool);
+  virtual double flopCount(const Dimensions& inputDims);
+  virtual size_t weightBytes();
+
+  Dimensions subnodeInputDimensions(const Dimensions& inputDims);
+  Dimensions subnodeOutputDimensions(const Dimensions& subnodeInputDims, PoolNode* pool);
+  size_t groupsScratchBytes(const Dimensions& inputDims, bool isFused, PoolNode* pool);
+  void runGroupsInto(Buffer* input, Buffer* output, Buffer* scratch, bool isFused, bool doRelu, PoolNode* pool);
+  size_t groupsMemoryTrafficBytes(const Dimensions& inputDims, bool isFused, PoolNode* pool);
   virtual SBinaryTag* toTag();
   virtual char* debugString();
 
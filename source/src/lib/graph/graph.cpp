@@ -11,12 +11,17 @@
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/time.h>
 
 #include "buffer.h"
 #include "binary_format.h"
 #include "basenode.h"
+#include "fusednode.h"
+#include "memoryplan.h"
 #include "nodefactory.h"
+#include "prepareinput.h"
+#include "session.h"
 
 #if __APPLE__
   #include "TargetConditionals.h"
@@ -48,11 +53,18 @@ Graph::Graph() :
   _preparationNode(NULL),
   _layers(NULL),
   _layersLength(0),
+  _fusedLayers(NULL),
   _labelNames(NULL),
-  _labelNamesLength(0) {
+  _labelNamesLength(0),
+  _defaultSession(NULL),
+  _generation(0),
+  _isProfilingEnabled(false) {
 }
 
 Graph::~Graph() {
+  if (_defaultSession != NULL) {
+    delete _defaultSession;
+  }
   if (_fileTag != NULL) {
     deallocate_file_tag(_fileTag, _useMemoryMap);
   }
@@ -62,6 +74,14 @@ Graph::~Graph() {
   if (_preparationNode != NULL) {
     delete _preparationNode;
   }
+  if (_fusedLayers != NULL) {
+    for (int index = 0; index < _layersLength; index += 1) {
+      if (_fusedLayers[index] != NULL) {
+        delete _fusedLayers[index];
+      }
+    }
+    free(_fusedLayers);
+  }
   if (_layers != NULL) {
     for (int index = 0; index < _layersLength; index += 1) {
       delete _layers[index];
@@ -77,15 +97,44 @@ Graph::~Graph() {
 }
 
 Buffer* Graph::run(Buffer* input, int layerOffset) {
+  return run(_defaultSession, input, layerOffset);
+}
+
+Buffer* Graph::run(Session* session, Buffer* input, int layerOffset) {
+  assert(session != NULL);
+
+  // All of the memory the run needs is set up here, and after the first call
+  // with a given input shape this doesn't allocate anything.
+  session->prepareForInput(input->_dims, layerOffset);
+  return runPlan(session, input);
+}
+
+Buffer* Graph::runLayers(Session* session, Buffer* input, int startLayer, int endLayer) {
+  assert(session != NULL);
+  assert((startLayer >= 0) && (startLayer <= endLayer) && (endLayer <= _layersLength));
+
+  const int layerOffset = (endLayer - _layersLength);
+  session->prepareForInput(input->_dims, &layerOffset, 1, startLayer);
+  return runPlan(session, input);
+}
+
+Buffer* Graph::runPlan(Session* session, Buffer* input) {
+  Buffer* planInput = session->_tensors[0];
+  if (input->_data != planInput->_data) {
+    planInput->copyDataFrom(input);
+  }
 
 #ifdef DO_LOG_OPERATIONS
   fprintf(stderr, "Graph::run() input=%s\n", input->debugString());
 #endif // DO_LOG_OPERATIONS
 
-  Buffer* currentInput = input;
-  const int howManyLayers = (_layersLength + layerOffset);
-  for (int index = 0; index < howManyLayers; index += 1) {
-    BaseNode* layer = _layers[index];
+  Buffer* currentInput = planInput;
+  MemoryPlan* plan = session->_plan;
+  const bool doProfile = _isProfilingEnabled;
+  const int howManySteps = plan->_stepsCount;
+  for (int index = 0; index < howManySteps; index += 1) {
+    BaseNode* layer = plan->_steps[index];
+    Buffer* currentOutput = session->_tensors[index + 1];
 #ifdef CHECK_RESULTS
 #ifdef USE_BUNDLE_LOADING
     NSString* expectedInputFilename = [NSString stringWithFormat: @"%03d_input", index];
@@ -117,23 +166,26 @@ Buffer* Graph::run(Buffer* input, int layerOffset) {
     buffer_dump_to_file(currentInput, inputFilename);
 #endif // SAVE_RESULTS
 
-#ifdef DO_LOG_OPERATIONS
     struct timeval start;
-    gettimeofday(&start, NULL);
-#endif // DO_LOG_OPERATIONS
+    if (doProfile) {
+      gettimeofday(&start, NULL);
+    }
 
-    Buffer* currentOutput = layer->run(currentInput);
-    currentOutput->setName(layer->_name);
+    layer->runInto(currentInput, currentOutput, session->_scratchArena);
+
+    float milliseconds = 0.0f;
+    if (doProfile) {
+      struct timeval end;
+      gettimeofday(&end, NULL);
+      const long seconds = (end.tv_sec - start.tv_sec);
+      const long useconds = (end.tv_usec - start.tv_usec);
+      milliseconds = ((seconds * 1000.0f) + (useconds / 1000.0f));
+    }
+    session->_layerStats[index].milliseconds = milliseconds;
 
 #ifdef DO_LOG_OPERATIONS
-    struct timeval end;
-    gettimeofday(&end, NULL);
     fprintf(stderr, "Graph::run() currentOutput=%s\n", currentOutput->debugString());
-
-    long seconds  = end.tv_sec  - start.tv_sec;
-    long useconds = end.tv_usec - start.tv_usec;
-    long duration = ((seconds) * 1000 + useconds/1000.0) + 0.5;
-    fprintf(stderr, "Took %ldms\n", duration);
+    fprintf(stderr, "Took %fms\n", milliseconds);
 #endif // DO_LOG_OPERATIONS
 
 #ifdef CHECK_RESULTS
@@ -173,11 +225,45 @@ Buffer* Graph::run(Buffer* input, int layerOffset) {
   return currentInput;
 }
 
+int Graph::stepsForLayers(int startLayer, int layersCount, const int* tapOffsets, int tapsCount, BaseNode** outSteps, int* outStepEnds) {
+  assert((startLayer >= 0) && (startLayer <= layersCount) && (layersCount <= _layersLength));
+  int stepsCount = 0;
+  int index = startLayer;
+  while (index < layersCount) {
+    FusedNode* fused = NULL;
+    if (_fusedLayers != NULL) {
+      fused = _fusedLayers[index];
+    }
+    // A fused node's intermediate results never reach memory, so it can't be
+    // used if one of the layers it covers, other than the last, is tapped.
+    bool canUseFused = ((fused != NULL) && ((index + fused->_layersCount) <= layersCount));
+    for (int tapIndex = 0; (canUseFused && (tapIndex < tapsCount)); tapIndex += 1) {
+      const int tapLayersCount = (_layersLength + tapOffsets[tapIndex]);
+      if ((tapLayersCount > index) && (tapLayersCount < (index + fused->_layersCount))) {
+        canUseFused = false;
+      }
+    }
+    if (canUseFused) {
+      outSteps[stepsCount] = fused;
+      index += fused->_layersCount;
+    } else {
+      outSteps[stepsCount] = _layers[index];
+      index += 1;
+    }
+    outStepEnds[stepsCount] = index;
+    stepsCount += 1;
+  }
+  return stepsCount;
+}
+
 void Graph::printDebugOutput() {
   fprintf(stderr, "************************\nJPCNN Network with %d layers\n", _layersLength);
   for (int index = 0; index < _layersLength; index += 1) {
     BaseNode* layer = _layers[index];
     fprintf(stderr, "%s\n", layer->debugString());
+    if ((_fusedLayers != NULL) && (_fusedLayers[index] != NULL)) {
+      fprintf(stderr, "  Fused into %s\n", _fusedLayers[index]->_name);
+    }
   }
   fprintf(stderr, "************************\n");
 }
@@ -226,6 +312,34 @@ Graph* new_graph_from_file(const char* filename, int useMemoryMap, int isHomebre
     currentLayerTag = get_next_list_entry(layersTag, currentLayerTag);
   }
 
+  // Look for convolutions and fully-connected layers that can be run in the
+  // same pass as the activations after them. The per-layer checks need every
+  // layer's results, so fusion is left off for those. Setting the
+  // JPCNN_DISABLE_FUSION environment variable also turns it off, which is
+  // useful for comparing against the unfused graph.
+#if !defined(CHECK_RESULTS) && !defined(SAVE_RESULTS)
+  const char* disableFusion = getenv("JPCNN_DISABLE_FUSION");
+  const bool useFusion = ((disableFusion == NULL) || (strcmp(disableFusion, "0") == 0));
+#else // CHECK_RESULTS || SAVE_RESULTS
+  const bool useFusion = false;
+#endif // CHECK_RESULTS || SAVE_RESULTS
+  if (useFusion) {
+    result->_fusedLayers = (FusedNode**)(malloc(sizeof(FusedNode*) * result->_layersLength));
+    index = 0;
+    while (index < result->_layersLength) {
+      FusedNode* fused = new_fusednode_from_layers(result->_layers, result->_layersLength, index);
+      result->_fusedLayers[index] = fused;
+      if (fused == NULL) {
+        index += 1;
+        continue;
+      }
+      for (int skipped = 1; skipped < fused->_layersCount; skipped += 1) {
+        result->_fusedLayers[index + skipped] = NULL;
+      }
+      index += fused->_layersCount;
+    }
+  }
+
   SBinaryTag* labelNamesTag = get_tag_from_dict(graphDict, "label_names");
 
   result->_labelNamesLength = count_list_entries(labelNamesTag);
@@ -243,13 +357,34 @@ Graph* new_graph_from_file(const char* filename, int useMemoryMap, int isHomebre
     currentLabelNameTag = get_next_list_entry(labelNamesTag, currentLabelNameTag);
   }
 
+  bool doFlip;
+  int imageSize;
+  bool isMeanChanneled;
+  if (isHomebrewed) {
+    imageSize = 224;
+    doFlip = false;
+    isMeanChanneled = true;
+  } else {
+    imageSize = 227;
+    doFlip = true;
+    isMeanChanneled = false;
+  }
+  result->_preparationNode = new PrepareInput(result->_dataMean, doFlip, imageSize, result->_inputSize, isMeanChanneled);
+
+  result->_defaultSession = new Session(result);
+
   return result;
 }
 
-void save_graph_to_file(Graph* graph, const char* filename) {
+bool save_graph_to_file(Graph* graph, const char* filename) {
 
   SBinaryTag* graphDict = create_dict_tag();
 
+  // These change how input images are prepared, so they need to survive a
+  // network being loaded and saved again, for example after calibration.
+  graphDict = add_string_to_dict(graphDict, "source", graph->_source);
+  graphDict = add_uint_to_dict(graphDict, "input_size", graph->_inputSize);
+
   SBinaryTag* dataMeanTag = buffer_to_tag_dict(graph->_dataMean);
   graphDict = add_tag_to_dict(graphDict, "data_mean", dataMeanTag);
   free(dataMeanTag);
@@ -276,8 +411,13 @@ void save_graph_to_file(Graph* graph, const char* filename) {
   free(copyrightTag);
 
   FILE* outputFile = fopen(filename, "wb");
-  assert(outputFile != NULL);
+  if (outputFile == NULL) {
+    fprintf(stderr, "save_graph_to_file(): Couldn't open '%s' for writing\n", filename);
+    free(graphDict);
+    return false;
+  }
   fwrite(graphDict, (graphDict->length + 8), 1, outputFile);
   fclose(outputFile);
   free(graphDict);
+  return true;
 }
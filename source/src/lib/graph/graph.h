@@ -14,6 +14,9 @@
 
 class BaseNode;
 class Buffer;
+class FusedNode;
+class PrepareInput;
+class Session;
 
 class Graph {
 public:
@@ -22,8 +25,23 @@ public:
   virtual ~Graph();
 
   Buffer* run(Buffer* input, int layerOffset = 0);
+  Buffer* run(Session* session, Buffer* input, int layerOffset = 0);
+  // Runs the layers in [startLayer, endLayer), where input holds the output of
+  // the layer before startLayer, for example from an earlier run that stopped
+  // there.
+  Buffer* runLayers(Session* session, Buffer* input, int startLayer, int endLayer);
+  // Runs the steps of the session's current plan, which has to have been set
+  // up for this input with Session::prepareForInput().
+  Buffer* runPlan(Session* session, Buffer* input);
   void printDebugOutput();
 
+  // Fills outSteps with the nodes that run the layers from startLayer up to
+  // layersCount, using fused nodes wherever a whole group falls inside the
+  // range and none of its inner layers are tapped. outStepEnds gets how many
+  // layers are done after each step. Returns how many steps there are, which
+  // is never more than the number of layers.
+  int stepsForLayers(int startLayer, int layersCount, const int* tapOffsets, int tapsCount, BaseNode** outSteps, int* outStepEnds);
+
   bool _useMemoryMap;
   bool _isHomebrewed;
   bool _isLibCCV;
@@ -32,14 +50,22 @@ public:
   int _inputSize;
 
   Buffer* _dataMean;
-  BaseNode* _preparationNode;
+  PrepareInput* _preparationNode;
   BaseNode** _layers;
   int _layersLength;
+  // Indexed by the first layer each one replaces, and NULL everywhere else.
+  FusedNode** _fusedLayers;
   char** _labelNames;
   int _labelNamesLength;
+  Session* _defaultSession;
+  // Goes up whenever a layer changes the memory it needs after loading, for
+  // example by switching algorithms, so every session knows to plan again.
+  int _generation;
+  // Whether runs record how long each step takes in their session's stats.
+  bool _isProfilingEnabled;
 };
 
 Graph* new_graph_from_file(const char* filename, int useMemoryMap, int isHomebrewed);
-void save_graph_to_file(Graph* graph, const char* filename);
+bool save_graph_to_file(Graph* graph, const char* filename);
 
 #endif // INCLUDE_GRAPH_H
\ No newline at end of file
@@ -23,12 +23,21 @@ MaxNode::~MaxNode() {
   // Do nothing
 }
 
-Buffer* MaxNode::run(Buffer* input) {
-  if (_output != NULL) {
-    delete _output;
-  }
-  _output = matrix_softmax(input);
-  return _output;
+Dimensions MaxNode::outputDimensions(const Dimensions& inputDims) {
+  return inputDims;
+}
+
+double MaxNode::flopCount(const Dimensions& inputDims) {
+  // Finding the largest value, subtracting it, the exp(), summing and scaling.
+  return (5.0 * inputDims.elementCount());
+}
+
+bool MaxNode::canRunInPlace() {
+  return true;
+}
+
+void MaxNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  matrix_softmax_into(input, output);
 }
 
 SBinaryTag* MaxNode::toTag() {
@@ -0,0 +1,248 @@
+//
+//  memoryplan.cpp
+//  jpcnn
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "memoryplan.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "basenode.h"
+#include "graph.h"
+#include "prepareinput.h"
+
+// Keeps every tensor on a cache line boundary.
+static const int kElementAlignment = 16;
+
+static int align_element_count(int count) {
+  return (((count + (kElementAlignment - 1)) / kElementAlignment) * kElementAlignment);
+}
+
+MemoryPlan::MemoryPlan(Graph* graph, const Dimensions& inputDims, int layerOffset) :
+  _graph(graph),
+  _graphGeneration(graph->_generation),
+  _inputDims(inputDims),
+  _tapOffsets(NULL),
+  _tapsCount(0),
+  _tapTensors(NULL),
+  _startLayer(0),
+  _layersCount(0),
+  _steps(NULL),
+  _stepsCount(0),
+  _tensorsCount(0),
+  _tensorDims(NULL),
+  _tensorOffsets(NULL),
+  _activationBytes(0),
+  _scratchBytes(0),
+  _stepTrafficBytes(NULL) {
+  planTensors(graph, &layerOffset, 1, 0);
+}
+
+MemoryPlan::MemoryPlan(Graph* graph, const Dimensions& inputDims, const int* tapOffsets, int tapsCount, int startLayer) :
+  _graph(graph),
+  _graphGeneration(graph->_generation),
+  _inputDims(inputDims),
+  _tapOffsets(NULL),
+  _tapsCount(0),
+  _tapTensors(NULL),
+  _startLayer(0),
+  _layersCount(0),
+  _steps(NULL),
+  _stepsCount(0),
+  _tensorsCount(0),
+  _tensorDims(NULL),
+  _tensorOffsets(NULL),
+  _activationBytes(0),
+  _scratchBytes(0),
+  _stepTrafficBytes(NULL) {
+  planTensors(graph, tapOffsets, tapsCount, startLayer);
+}
+
+void MemoryPlan::planTensors(Graph* graph, const int* tapOffsets, int tapsCount, int startLayer) {
+  assert(tapsCount > 0);
+  assert((startLayer >= 0) && (startLayer <= graph->_layersLength));
+  _startLayer = startLayer;
+  _tapsCount = tapsCount;
+  _tapOffsets = (int*)(malloc(sizeof(int) * tapsCount));
+  _tapTensors = (int*)(malloc(sizeof(int) * tapsCount));
+  _layersCount = startLayer;
+  for (int index = 0; index < tapsCount; index += 1) {
+    const int tapLayersCount = (graph->_layersLength + tapOffsets[index]);
+    assert((tapLayersCount >= startLayer) && (tapLayersCount <= graph->_layersLength));
+    _tapOffsets[index] = tapOffsets[index];
+    _layersCount = MAX(_layersCount, tapLayersCount);
+  }
+
+  _steps = (BaseNode**)(malloc(sizeof(BaseNode*) * MAX(1, _layersCount)));
+  int* stepEnds = (int*)(malloc(sizeof(int) * MAX(1, _layersCount)));
+  _stepsCount = graph->stepsForLayers(_startLayer, _layersCount, tapOffsets, tapsCount, _steps, stepEnds);
+  _tensorsCount = (_stepsCount + 1);
+  _stepTrafficBytes = (size_t*)(malloc(sizeof(size_t) * MAX(1, _stepsCount)));
+
+  _tensorDims = (Dimensions*)(malloc(sizeof(Dimensions) * _tensorsCount));
+  _tensorOffsets = (int*)(malloc(sizeof(int) * _tensorsCount));
+
+  // Steps never straddle a tap, so every tapped result is the output of one
+  // of them, or the input itself.
+  bool* isTapped = (bool*)(malloc(sizeof(bool) * _tensorsCount));
+  for (int index = 0; index < _tensorsCount; index += 1) {
+    isTapped[index] = false;
+  }
+  for (int tapIndex = 0; tapIndex < tapsCount; tapIndex += 1) {
+    const int tapLayersCount = (graph->_layersLength + tapOffsets[tapIndex]);
+    int tensor = 0;
+    while ((tensor < _stepsCount) && (stepEnds[tensor] <= tapLayersCount)) {
+      tensor += 1;
+    }
+    assert((tensor == 0) ? (tapLayersCount == _startLayer) : (stepEnds[tensor - 1] == tapLayersCount));
+    _tapTensors[tapIndex] = tensor;
+    isTapped[tensor] = true;
+  }
+  free(stepEnds);
+
+  if (graph->_preparationNode != NULL) {
+    _scratchBytes = graph->_preparationNode->scratchBytes(_inputDims);
+  }
+
+  // Work out the shape of every tensor, and which ones can share storage
+  // because a layer overwrites its input in place.
+  int* roots = (int*)(malloc(sizeof(int) * _tensorsCount));
+  _tensorDims[0] = _inputDims;
+  roots[0] = 0;
+  for (int index = 0; index < _stepsCount; index += 1) {
+    BaseNode* layer = _steps[index];
+    const Dimensions& layerInputDims = _tensorDims[index];
+    _tensorDims[index + 1] = layer->outputDimensions(layerInputDims);
+    _scratchBytes = MAX(_scratchBytes, layer->scratchBytes(layerInputDims));
+    _stepTrafficBytes[index] = layer->memoryTrafficBytes(layerInputDims);
+    if (layer->canRunInPlace() && !isTapped[index]) {
+      assert(_tensorDims[index + 1].elementCount() == layerInputDims.elementCount());
+      roots[index + 1] = roots[index];
+    } else {
+      roots[index + 1] = (index + 1);
+    }
+  }
+
+  // Tensor N is written by layer N-1 and read by layer N, so it's live for
+  // steps N and N+1. Tapped results, including the final one, have to
+  // outlast the run.
+  int* firstSteps = (int*)(malloc(sizeof(int) * _tensorsCount));
+  int* lastSteps = (int*)(malloc(sizeof(int) * _tensorsCount));
+  int* sizes = (int*)(malloc(sizeof(int) * _tensorsCount));
+  for (int index = 0; index < _tensorsCount; index += 1) {
+    firstSteps[index] = INT_MAX;
+    lastSteps[index] = -1;
+    sizes[index] = 0;
+  }
+  for (int index = 0; index < _tensorsCount; index += 1) {
+    const int root = roots[index];
+    const bool isKept = (isTapped[index] || (index == (_tensorsCount - 1)));
+    const int lastStep = isKept ? INT_MAX : (index + 1);
+    firstSteps[root] = MIN(firstSteps[root], index);
+    lastSteps[root] = MAX(lastSteps[root], lastStep);
+    sizes[root] = MAX(sizes[root], align_element_count(_tensorDims[index].elementCount()));
+  }
+
+  // Greedily place the largest tensors first, each at the lowest offset that
+  // doesn't collide with anything already placed that's alive at the same
+  // time.
+  int* order = (int*)(malloc(sizeof(int) * _tensorsCount));
+  int orderLength = 0;
+  for (int index = 0; index < _tensorsCount; index += 1) {
+    if (roots[index] != index) {
+      continue;
+    }
+    int insertAt = orderLength;
+    while ((insertAt > 0) && (sizes[order[insertAt - 1]] < sizes[index])) {
+      order[insertAt] = order[insertAt - 1];
+      insertAt -= 1;
+    }
+    order[insertAt] = index;
+    orderLength += 1;
+  }
+
+  int activationElements = 0;
+  for (int orderIndex = 0; orderIndex < orderLength; orderIndex += 1) {
+    const int current = order[orderIndex];
+    int offset = 0;
+    bool didMove = true;
+    while (didMove) {
+      didMove = false;
+      for (int placedIndex = 0; placedIndex < orderIndex; placedIndex += 1) {
+        const int placed = order[placedIndex];
+        const bool overlapsInTime = ((firstSteps[current] <= lastSteps[placed]) &&
+          (firstSteps[placed] <= lastSteps[current]));
+        if (!overlapsInTime) {
+          continue;
+        }
+        const int placedStart = _tensorOffsets[placed];
+        const int placedEnd = (placedStart + sizes[placed]);
+        const bool overlapsInSpace = ((offset < placedEnd) && (placedStart < (offset + sizes[current])));
+        if (overlapsInSpace) {
+          offset = placedEnd;
+          didMove = true;
+        }
+      }
+    }
+    _tensorOffsets[current] = offset;
+    activationElements = MAX(activationElements, (offset + sizes[current]));
+  }
+
+  for (int index = 0; index < _tensorsCount; index += 1) {
+    _tensorOffsets[index] = _tensorOffsets[roots[index]];
+  }
+  _activationBytes = (activationElements * sizeof(jpfloat_t));
+
+  free(order);
+  free(sizes);
+  free(lastSteps);
+  free(firstSteps);
+  free(roots);
+  free(isTapped);
+}
+
+MemoryPlan::~MemoryPlan() {
+  free(_tapOffsets);
+  free(_tapTensors);
+  free(_steps);
+  free(_stepTrafficBytes);
+  free(_tensorDims);
+  free(_tensorOffsets);
+}
+
+bool MemoryPlan::matches(const Dimensions& inputDims, int layerOffset) {
+  return matches(inputDims, &layerOffset, 1);
+}
+
+bool MemoryPlan::matches(const Dimensions& inputDims, const int* tapOffsets, int tapsCount, int startLayer) {
+  if (_graphGeneration != _graph->_generation) {
+    return false;
+  }
+  if (!(_inputDims == inputDims) || (_tapsCount != tapsCount) || (_startLayer != startLayer)) {
+    return false;
+  }
+  for (int index = 0; index < tapsCount; index += 1) {
+    if (_tapOffsets[index] != tapOffsets[index]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MemoryPlan::printDebugOutput() {
+  fprintf(stderr, "MemoryPlan for %d layers in %d steps, activations=%ld bytes, scratch=%ld bytes\n",
+    (_layersCount - _startLayer), _stepsCount, (long)(_activationBytes), (long)(_scratchBytes));
+  fprintf(stderr, "  tensor 0 - input - %s at element offset %d\n",
+    _tensorDims[0].debugString(), _tensorOffsets[0]);
+  for (int index = 0; index < _stepsCount; index += 1) {
+    fprintf(stderr, "  tensor %d - %s - %s at element offset %d, traffic=%ld bytes\n",
+      (index + 1), _steps[index]->_name, _tensorDims[index + 1].debugString(),
+      _tensorOffsets[index + 1], (long)(_stepTrafficBytes[index]));
+  }
+}
@@ -0,0 +1,68 @@
+//
+//  memoryplan.h
+//  jpcnn
+//
+//  Works out where every intermediate result of a graph run will live ahead
+//  of time, so that running the graph doesn't need any heap allocations.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#ifndef INCLUDE_MEMORYPLAN_H
+#define INCLUDE_MEMORYPLAN_H
+
+#include <stddef.h>
+
+#include "jpcnn.h"
+#include "dimensions.h"
+
+class BaseNode;
+class Graph;
+
+class MemoryPlan {
+public:
+
+  MemoryPlan(Graph* graph, const Dimensions& inputDims, int layerOffset);
+  // Keeps the results of several layers, each given as an offset from the end
+  // of the graph in the same way as layerOffset, and stops after the deepest.
+  // If startLayer isn't zero, the input is the output of the layer before it,
+  // and the layers up to that point are skipped.
+  MemoryPlan(Graph* graph, const Dimensions& inputDims, const int* tapOffsets, int tapsCount, int startLayer = 0);
+  virtual ~MemoryPlan();
+
+  void planTensors(Graph* graph, const int* tapOffsets, int tapsCount, int startLayer);
+  bool matches(const Dimensions& inputDims, int layerOffset);
+  bool matches(const Dimensions& inputDims, const int* tapOffsets, int tapsCount, int startLayer = 0);
+  void printDebugOutput();
+
+  Graph* _graph;
+  // The graph's _generation when the plan was made. Plans from before a
+  // layer changed don't match any more.
+  int _graphGeneration;
+  Dimensions _inputDims;
+  // The offsets the plan was made for, and which tensor holds each result.
+  // Those tensors are never reused while the run is going.
+  int* _tapOffsets;
+  int _tapsCount;
+  int* _tapTensors;
+  // The graph's layers from _startLayer up to _layersCount are covered, and
+  // _steps holds the nodes that run them. Fused nodes can stand in for
+  // several layers, so there may be fewer steps.
+  int _startLayer;
+  int _layersCount;
+  BaseNode** _steps;
+  int _stepsCount;
+  // Tensor zero is the input, and tensor N+1 is the output of step N.
+  int _tensorsCount;
+  Dimensions* _tensorDims;
+  int* _tensorOffsets;
+  // Every tensor lives in one activation arena, and all layers share a single
+  // scratch arena, since only one of them is running at a time.
+  size_t _activationBytes;
+  size_t _scratchBytes;
+  // The estimated activation traffic of each step, see memoryTrafficBytes().
+  size_t* _stepTrafficBytes;
+};
+
+#endif // INCLUDE_MEMORYPLAN_H
@@ -9,13 +9,41 @@
 #include "neuronnode.h"
 
 #include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "buffer.h"
 #include "binary_format.h"
 #include "matrix_ops.h"
 
-NeuronNode::NeuronNode() : BaseNode(), _weights(NULL), _bias(NULL), _dropout(0.0f), _areWeightsTransposed(false) {
+// Sparse layers with more than this fraction of their weights left run
+// faster as the dense float weights they'd be expanded into, since every
+// value they use costs an indirect load of the input.
+static const jpfloat_t kMaxSparseDensity = 0.3f;
+
+static bool can_use_int8(NeuronNode* node);
+static SBinaryTag* sparse_weights_to_tag_dict(const SSparseMatrix* sparseWeights, int floatBits, int elementFormat);
+static size_t sparse_weights_saved_bytes(const SSparseMatrix* sparseWeights, int floatBits);
+static SSparseMatrix* sparse_weights_from_tag_dict(SBinaryTag* mainDict, int* outElementFormat);
+
+NeuronNode::NeuronNode() :
+  BaseNode(),
+  _weights(NULL),
+  _bias(NULL),
+  _dropout(0.0f),
+  _areWeightsTransposed(false),
+  _hasInputRange(false),
+  _inputMin(0.0f),
+  _inputMax(0.0f),
+  _useInt8(false),
+  _weightsRowSums(NULL),
+  _savedWeightsFormat(JPElementFormatLinear),
+  _isPruned(false),
+  _sparseWeights(NULL),
+  _lowRankWeights(NULL) {
   setClassName("NeuronNode");
 }
 
@@ -26,22 +54,69 @@ NeuronNode::~NeuronNode() {
   if (_bias != NULL) {
     delete _bias;
   }
+  if (_weightsRowSums != NULL) {
+    free(_weightsRowSums);
+  }
+  if (_sparseWeights != NULL) {
+    matrix_sparse_destroy(_sparseWeights);
+  }
+  if (_lowRankWeights != NULL) {
+    delete _lowRankWeights;
+  }
 }
 
-Buffer* NeuronNode::run(Buffer* input) {
-  if (_output != NULL) {
-    delete _output;
+Dimensions NeuronNode::outputDimensions(const Dimensions& inputDims) {
+  const int numberOfImages = inputDims[0];
+  const Dimensions outputDims(numberOfImages, _outputsCount);
+  return outputDims;
+}
+
+void NeuronNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  runFusedInto(input, output, scratch, false, NULL);
+}
+
+bool NeuronNode::canFuse(PoolNode* pool) {
+  return (pool == NULL);
+}
+
+size_t NeuronNode::scratchBytes(const Dimensions& inputDims) {
+  return fusedScratchBytes(inputDims, NULL);
+}
+
+size_t NeuronNode::fusedScratchBytes(const Dimensions& inputDims, PoolNode* pool) {
+  if (_sparseWeights != NULL) {
+    return matrix_dot_sparse_scratch_bytes(inputDims);
+  } else if (_lowRankWeights != NULL) {
+    // Holds the results of the first factor.
+    const int numberOfImages = inputDims[0];
+    const int rank = _lowRankWeights->_dims[0];
+    return (sizeof(jpfloat_t) * numberOfImages * rank);
+  } else if (_useInt8) {
+    return matrix_dot_int8_scratch_bytes(inputDims);
+  } else {
+    return 0;
   }
+}
 
+void NeuronNode::runFusedInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRelu, PoolNode* pool) {
+  assert(pool == NULL);
   const Dimensions inputDims = input->_dims;
   const int numberOfImages = inputDims[0];
   const Dimensions inputImageDims = inputDims.removeDimensions(1);
   const int elementCount = inputImageDims.elementCount();
   Dimensions flattenedDimensions(numberOfImages, elementCount);
-  Buffer* flattenedInput = input->view();
-  flattenedInput->reshape(flattenedDimensions);
+  Buffer flattenedInput(flattenedDimensions, input, 0);
 
-  if (_areWeightsTransposed) {
+  if (_sparseWeights != NULL) {
+    assert(_sparseWeights->rows == _outputsCount);
+    assert(_sparseWeights->columns == elementCount);
+  } else if (_lowRankWeights != NULL) {
+    const int rank = _lowRankWeights->_dims[0];
+    Dimensions expectedLowRankDimensions(rank, elementCount);
+    assert(expectedLowRankDimensions == _lowRankWeights->_dims);
+    Dimensions expectedWeightsDimensions(_outputsCount, rank);
+    assert(expectedWeightsDimensions == _weights->_dims);
+  } else if (_areWeightsTransposed) {
     Dimensions expectedWeightsDimensions(_outputsCount, elementCount);
     assert(expectedWeightsDimensions == _weights->_dims);
   } else {
@@ -49,28 +124,204 @@ Buffer* NeuronNode::run(Buffer* input) {
     assert(expectedWeightsDimensions == _weights->_dims);
   }
 
-//_weights->quantize(8);
+  SGemmEpilogue epilogue;
+  epilogue.bias = ((_bias != NULL) ? _bias->_data : NULL);
+  if (_dropout > 0.0f) {
+    epilogue.scale = (1.0f - _dropout);
+  } else {
+    epilogue.scale = 1.0f;
+  }
+  epilogue.doRelu = doRelu;
 
-  _output = matrix_dot(flattenedInput, _weights, _areWeightsTransposed);
-  _output->setName(_name);
+  if (_sparseWeights != NULL) {
+    matrix_dot_sparse_into(&flattenedInput, _sparseWeights, output, scratch, &epilogue);
+  } else if (_lowRankWeights != NULL) {
+    const int rank = _lowRankWeights->_dims[0];
+    Buffer intermediate(Dimensions(numberOfImages, rank), scratch, 0);
+    matrix_dot_into(&flattenedInput, _lowRankWeights, true, &intermediate);
+    matrix_dot_into(&intermediate, _weights, true, output, &epilogue);
+  } else if (_useInt8) {
+    matrix_dot_int8_into(&flattenedInput, _inputMin, _inputMax, _weights, _weightsRowSums, output, scratch, &epilogue);
+  } else {
+    matrix_dot_into(&flattenedInput, _weights, _areWeightsTransposed, output, &epilogue);
+  }
+}
 
-  matrix_add_inplace(_output, _bias, 1.0);
+void NeuronNode::calibrateInputRange(Buffer* input) {
+  jpfloat_t min = FLT_MAX;
+  jpfloat_t max = -FLT_MAX;
+  const int elementCount = input->_dims.elementCount();
+  for (int index = 0; index < elementCount; index += 1) {
+    const jpfloat_t value = input->_data[index];
+    min = fminf(min, value);
+    max = fmaxf(max, value);
+  }
+  if (_hasInputRange) {
+    _inputMin = fminf(_inputMin, min);
+    _inputMax = fmaxf(_inputMax, max);
+  } else {
+    _inputMin = min;
+    _inputMax = max;
+    _hasInputRange = true;
+  }
+}
 
-  if (_dropout > 0.0f) {
-    const float scale = (1.0f - _dropout);
-    matrix_scale_inplace(_output, scale);
+bool NeuronNode::prune(jpfloat_t sparsity) {
+  if (_lowRankWeights != NULL) {
+    fprintf(stderr, "NeuronNode::prune() - layer '%s' has been factorized, and can't be pruned as well\n", _name);
+    return false;
+  }
+  SSparseMatrix* sparseWeights;
+  if (_sparseWeights != NULL) {
+    Buffer* denseWeights = matrix_sparse_to_dense(_sparseWeights);
+    sparseWeights = matrix_sparse_prune(denseWeights, true, sparsity);
+    delete denseWeights;
+  } else {
+    sparseWeights = matrix_sparse_prune(_weights, _areWeightsTransposed, sparsity);
+  }
+  if (sparseWeights == NULL) {
+    return false;
+  }
+  setSparseWeights(sparseWeights);
+  return true;
+}
+
+void NeuronNode::setSparseWeights(SSparseMatrix* sparseWeights) {
+  if (_weights != NULL) {
+    delete _weights;
+    _weights = NULL;
+  }
+  if (_sparseWeights != NULL) {
+    matrix_sparse_destroy(_sparseWeights);
+    _sparseWeights = NULL;
+  }
+  if (_weightsRowSums != NULL) {
+    free(_weightsRowSums);
+    _weightsRowSums = NULL;
+  }
+  _useInt8 = false;
+  _isPruned = true;
+
+  // Setting the JPCNN_DISABLE_SPARSE environment variable runs pruned layers
+  // as dense ones, for comparing the two.
+  const char* disableSparse = getenv("JPCNN_DISABLE_SPARSE");
+  const bool allowSparse = ((disableSparse == NULL) || (strcmp(disableSparse, "0") == 0));
+  const double density = ((double)(sparseWeights->nonZeroCount) / ((double)(sparseWeights->rows) * sparseWeights->columns));
+  if (allowSparse && (density <= kMaxSparseDensity)) {
+    _sparseWeights = sparseWeights;
+  } else {
+    _weights = matrix_sparse_to_dense(sparseWeights);
+    _areWeightsTransposed = true;
+    matrix_sparse_destroy(sparseWeights);
+  }
+}
+
+int NeuronNode::factorize(int rank, jpfloat_t energy) {
+  Buffer* denseWeights;
+  bool areDenseWeightsTransposed;
+  if (_sparseWeights != NULL) {
+    denseWeights = matrix_sparse_to_dense(_sparseWeights);
+    areDenseWeightsTransposed = true;
+  } else if (_lowRankWeights != NULL) {
+    // Multiplying the factors back together gives transposed weights, with
+    // the first factor treated as untransposed ones.
+    Buffer* floatU = dequantize_buffer(_weights);
+    Buffer* floatV = dequantize_buffer(_lowRankWeights);
+    denseWeights = matrix_dot(floatU, floatV, false);
+    areDenseWeightsTransposed = true;
+    delete floatU;
+    delete floatV;
+  } else {
+    denseWeights = _weights;
+    areDenseWeightsTransposed = _areWeightsTransposed;
+  }
+
+  Buffer* u;
+  Buffer* v;
+  const int usedRank = matrix_low_rank_factorize(denseWeights, areDenseWeightsTransposed, rank, energy, &u, &v);
+  if (denseWeights != _weights) {
+    delete denseWeights;
+  }
+  if (usedRank == 0) {
+    return 0;
+  }
+
+  // The factors are floats, so the format the weights were loaded in is
+  // remembered for saving them.
+  if ((_savedWeightsFormat == JPElementFormatLinear) && (_weights != NULL)) {
+    _savedWeightsFormat = _weights->_elementFormat;
+  }
+  if (_weights != NULL) {
+    delete _weights;
+  }
+  if (_sparseWeights != NULL) {
+    matrix_sparse_destroy(_sparseWeights);
+    _sparseWeights = NULL;
+  }
+  if (_lowRankWeights != NULL) {
+    delete _lowRankWeights;
+  }
+  if (_weightsRowSums != NULL) {
+    free(_weightsRowSums);
+    _weightsRowSums = NULL;
   }
+  _useInt8 = false;
+  _isPruned = false;
+  _weights = u;
+  _lowRankWeights = v;
+  _areWeightsTransposed = true;
+  return usedRank;
+}
 
-  delete flattenedInput;
+size_t NeuronNode::fusedMemoryTrafficBytes(const Dimensions& inputDims, PoolNode* pool) {
+  return memoryTrafficBytes(inputDims);
+}
 
-  return _output;
+double NeuronNode::flopCount(const Dimensions& inputDims) {
+  const double numberOfImages = inputDims[0];
+  const double elementCount = inputDims.removeDimensions(1).elementCount();
+  if (_sparseWeights != NULL) {
+    return (numberOfImages * ((2.0 * _sparseWeights->nonZeroCount) + _outputsCount));
+  } else if (_lowRankWeights != NULL) {
+    const double rank = _lowRankWeights->_dims[0];
+    return (numberOfImages * ((2.0 * rank * elementCount) + (_outputsCount * ((2.0 * rank) + 1.0))));
+  }
+  return (numberOfImages * _outputsCount * ((2.0 * elementCount) + 1.0));
+}
+
+size_t NeuronNode::weightBytes() {
+  size_t result;
+  if (_sparseWeights != NULL) {
+    result = matrix_sparse_storage_bytes(_sparseWeights);
+  } else {
+    result = _weights->storageBytes();
+  }
+  if (_lowRankWeights != NULL) {
+    result += _lowRankWeights->storageBytes();
+  }
+  if (_bias != NULL) {
+    result += _bias->storageBytes();
+  }
+  return result;
 }
 
 char* NeuronNode::debugString() {
   char additionalInfo[MAX_DEBUG_STRING_LEN];
+  if (_sparseWeights != NULL) {
+    snprintf(additionalInfo, sizeof(additionalInfo),
+      "_outputsCount=%d, _useBias=%d, _sparseWeights=(%d, %d), nonZeroCount=%d",
+      _outputsCount, _useBias, _sparseWeights->rows, _sparseWeights->columns, _sparseWeights->nonZeroCount);
+    return this->debugStringWithMessage(additionalInfo);
+  }
+  if (_lowRankWeights != NULL) {
+    snprintf(additionalInfo, sizeof(additionalInfo),
+      "_outputsCount=%d, _useBias=%d, _lowRankWeights->_dims=%s, _weights->_dims=%s",
+      _outputsCount, _useBias, _lowRankWeights->_dims.debugString(), _weights->_dims.debugString());
+    return this->debugStringWithMessage(additionalInfo);
+  }
   snprintf(additionalInfo, sizeof(additionalInfo),
-    "_outputsCount=%d, _useBias=%d, _weights->_dims=%s",
-    _outputsCount, _useBias, _weights->_dims.debugString());
+    "_outputsCount=%d, _useBias=%d, _useInt8=%d, _isPruned=%d, _weights->_dims=%s",
+    _outputsCount, _useBias, _useInt8, _isPruned, _weights->_dims.debugString());
   return this->debugStringWithMessage(additionalInfo);
 }
 
@@ -85,16 +336,69 @@ SBinaryTag* NeuronNode::toTag() {
   free(specDict);
 
   const bool wantTransposedOutput = true;
-  const int outputBitDepth = 8;
+  int outputFormat = _savedWeightsFormat;
+  if ((outputFormat == JPElementFormatLinear) && (_weights != NULL)) {
+    outputFormat = _weights->_elementFormat;
+  }
+  const int outputBitDepth = ((outputFormat == JPElementFormatLinear) ? 8 : 16);
+
+  // Pruned layers that are running dense still have exact zeros in their
+  // float weights, so those are left out again. The values that are left
+  // are kept as 16-bit floats, since they're expanded into floats when
+  // they're loaded, and re-quantizing them as fixed point each time the
+  // network was saved would lose a little more accuracy every time. Each one
+  // also needs its column index though, so layers with too many weights left
+  // are smaller written out densely, and load as ordinary layers.
+  SSparseMatrix* sparseWeights = NULL;
+  bool isSavedSparse = false;
+  if (_isPruned) {
+    sparseWeights = _sparseWeights;
+    if (sparseWeights == NULL) {
+      sparseWeights = matrix_sparse_prune(_weights, _areWeightsTransposed, 0.0f);
+    }
+    size_t denseBytes = ((size_t)(sparseWeights->rows) * sparseWeights->columns * (outputBitDepth / 8));
+    if (outputFormat == JPElementFormatLinear) {
+      denseBytes += (2 * sparseWeights->rows * sizeof(jpfloat_t));
+    }
+    isSavedSparse = (sparse_weights_saved_bytes(sparseWeights, 16) < denseBytes);
+  }
 
-  if (wantTransposedOutput != _areWeightsTransposed) {
-    _weights->transpose(); // First transpose so they match
+  if (isSavedSparse) {
+    const int valuesFormat = ((outputFormat == JPElementFormatLinear) ? JPElementFormatHalf : outputFormat);
+    SBinaryTag* sparseWeightsTag = sparse_weights_to_tag_dict(sparseWeights, 16, valuesFormat);
+    resultDict = add_tag_to_dict(resultDict, "sparse_weight", sparseWeightsTag);
+    free(sparseWeightsTag);
+  } else {
+    Buffer* weights = _weights;
+    bool areWeightsTransposed = _areWeightsTransposed;
+    if (weights == NULL) {
+      weights = matrix_sparse_to_dense(sparseWeights);
+      areWeightsTransposed = true;
+    }
+    if (wantTransposedOutput != areWeightsTransposed) {
+      weights->transpose(); // First transpose so they match
+    }
+    SBinaryTag* weightsTag = buffer_to_tag_dict(weights, outputBitDepth, outputFormat, true);
+    resultDict = add_tag_to_dict(resultDict, "weight", weightsTag);
+    free(weightsTag);
+    if (wantTransposedOutput != areWeightsTransposed) {
+      weights->transpose(); // Undo the original transpose by applying another
+    }
+    if (weights != _weights) {
+      delete weights;
+    }
   }
-  SBinaryTag* weightsTag = buffer_to_tag_dict(_weights, outputBitDepth);
-  resultDict = add_tag_to_dict(resultDict, "weight", weightsTag);
-  free(weightsTag);
-  if (wantTransposedOutput != _areWeightsTransposed) {
-    _weights->transpose(); // Undo the original transpose by applying another
+  if ((sparseWeights != NULL) && (sparseWeights != _sparseWeights)) {
+    matrix_sparse_destroy(sparseWeights);
+  }
+
+  // The factor that produces the outputs is saved as the usual weights, so
+  // versions of the library that don't know about the other one fail their
+  // dimension checks rather than quietly running with the wrong values.
+  if (_lowRankWeights != NULL) {
+    SBinaryTag* lowRankWeightsTag = buffer_to_tag_dict(_lowRankWeights, outputBitDepth, outputFormat, true);
+    resultDict = add_tag_to_dict(resultDict, "low_rank_weight", lowRankWeightsTag);
+    free(lowRankWeightsTag);
   }
 
   if (wantTransposedOutput) {
@@ -112,6 +416,11 @@ SBinaryTag* NeuronNode::toTag() {
 
   resultDict = add_float_to_dict(resultDict, "dropout", _dropout);
 
+  if (_hasInputRange) {
+    resultDict = add_float_to_dict(resultDict, "input_min", _inputMin);
+    resultDict = add_float_to_dict(resultDict, "input_max", _inputMax);
+  }
+
   return resultDict;
 }
 
@@ -123,8 +432,23 @@ BaseNode* new_neuronnode_from_tag(SBinaryTag* tag, bool skipCopy) {
   SBinaryTag* specDict = get_tag_from_dict(tag, "spec");
   result->_outputsCount = get_uint_from_dict(specDict, "num_output");
 
-  SBinaryTag* weightsTag = get_tag_from_dict(tag, "weight");
-  result->_weights = buffer_from_tag_dict(weightsTag, skipCopy);
+  SBinaryTag* sparseWeightsTag = get_tag_from_dict(tag, "sparse_weight");
+  if (sparseWeightsTag != NULL) {
+    int valuesFormat;
+    SSparseMatrix* sparseWeights = sparse_weights_from_tag_dict(sparseWeightsTag, &valuesFormat);
+    result->_savedWeightsFormat = valuesFormat;
+    result->setSparseWeights(sparseWeights);
+  } else {
+    SBinaryTag* weightsTag = get_tag_from_dict(tag, "weight");
+    result->_weights = buffer_from_tag_dict(weightsTag, skipCopy);
+  }
+
+  SBinaryTag* lowRankWeightsTag = get_tag_from_dict(tag, "low_rank_weight");
+  if (lowRankWeightsTag != NULL) {
+    result->_lowRankWeights = buffer_from_tag_dict(lowRankWeightsTag, skipCopy);
+    assert(result->_lowRankWeights->_dims._length == 2);
+    assert(result->_weights->_dims[1] == result->_lowRankWeights->_dims[0]);
+  }
 
   result->_useBias = (get_uint_from_dict(tag, "has_bias") != 0);
   if (result->_useBias) {
@@ -136,9 +460,98 @@ BaseNode* new_neuronnode_from_tag(SBinaryTag* tag, bool skipCopy) {
     result->_dropout = get_float_from_dict(tag, "dropout");
   }
 
-  if (get_tag_from_dict(tag, "are_weights_transposed")) {
+  if ((sparseWeightsTag == NULL) && get_tag_from_dict(tag, "are_weights_transposed")) {
     result->_areWeightsTransposed = get_uint_from_dict(tag, "are_weights_transposed");
   }
 
+  if (get_tag_from_dict(tag, "input_min") && get_tag_from_dict(tag, "input_max")) {
+    result->_hasInputRange = true;
+    result->_inputMin = get_float_from_dict(tag, "input_min");
+    result->_inputMax = get_float_from_dict(tag, "input_max");
+  }
+
+  // Setting the JPCNN_DISABLE_INT8 environment variable keeps calibrated
+  // layers running in floats, for comparing the two.
+  const char* disableInt8 = getenv("JPCNN_DISABLE_INT8");
+  const bool allowInt8 = ((disableInt8 == NULL) || (strcmp(disableInt8, "0") == 0));
+  if (allowInt8 && can_use_int8(result)) {
+    const Dimensions weightsDims = result->_weights->_dims;
+    result->_weightsRowSums = (int32_t*)(malloc(sizeof(int32_t) * weightsDims[0]));
+    matrix_int8_row_sums((const uint8_t*)(result->_weights->_quantizedData), weightsDims[0], weightsDims[1], weightsDims[1], result->_weightsRowSums);
+    result->_useInt8 = true;
+  }
+
+  return result;
+}
+
+bool can_use_int8(NeuronNode* node) {
+  Buffer* weights = node->_weights;
+  return (node->_hasInputRange &&
+    (weights != NULL) &&
+    (node->_lowRankWeights == NULL) &&
+    node->_areWeightsTransposed &&
+    (weights->_bitsPerElement == 8) &&
+    (weights->_quantizedData != NULL) &&
+    (weights->_dims._length == 2));
+}
+
+// The row starts and column indices are written as they are, and the values
+// are stored like any other weights. Blobs are padded out to whole 32-bit
+// words, so the values are padded with zeros to match.
+SBinaryTag* sparse_weights_to_tag_dict(const SSparseMatrix* sparseWeights, int floatBits, int elementFormat) {
+  SBinaryTag* mainDict = create_dict_tag();
+  mainDict = add_uint_to_dict(mainDict, "rows", sparseWeights->rows);
+  mainDict = add_uint_to_dict(mainDict, "columns", sparseWeights->columns);
+  mainDict = add_blob_to_dict(mainDict, "row_starts", sparseWeights->rowStarts,
+    (int)(sizeof(int32_t) * (sparseWeights->rows + 1)));
+  mainDict = add_blob_to_dict(mainDict, "column_indices", sparseWeights->columnIndices,
+    (int)(sizeof(uint16_t) * sparseWeights->nonZeroCount));
+
+  const int paddedCount = MAX(4, (((sparseWeights->nonZeroCount + 3) / 4) * 4));
+  Buffer values((Dimensions(paddedCount)));
+  memset(values._data, 0, values._dims.byteCount());
+  memcpy(values._data, sparseWeights->values, (sizeof(jpfloat_t) * sparseWeights->nonZeroCount));
+  SBinaryTag* valuesTag = buffer_to_tag_dict(&values, floatBits, elementFormat);
+  mainDict = add_tag_to_dict(mainDict, "values", valuesTag);
+  free(valuesTag);
+
+  return mainDict;
+}
+
+// Matches the blob sizes written by sparse_weights_to_tag_dict().
+size_t sparse_weights_saved_bytes(const SSparseMatrix* sparseWeights, int floatBits) {
+  const size_t rowStartsBytes = (sizeof(int32_t) * (sparseWeights->rows + 1));
+  const size_t columnIndicesBytes = (((sizeof(uint16_t) * sparseWeights->nonZeroCount) + 3) & ~3);
+  const int paddedCount = MAX(4, (((sparseWeights->nonZeroCount + 3) / 4) * 4));
+  const size_t valuesBytes = (paddedCount * (floatBits / 8));
+  return (rowStartsBytes + columnIndicesBytes + valuesBytes);
+}
+
+SSparseMatrix* sparse_weights_from_tag_dict(SBinaryTag* mainDict, int* outElementFormat) {
+  const int rows = get_uint_from_dict(mainDict, "rows");
+  const int columns = get_uint_from_dict(mainDict, "columns");
+  SBinaryTag* rowStartsTag = get_tag_from_dict(mainDict, "row_starts");
+  SBinaryTag* columnIndicesTag = get_tag_from_dict(mainDict, "column_indices");
+  SBinaryTag* valuesTag = get_tag_from_dict(mainDict, "values");
+  assert((rowStartsTag != NULL) && (rowStartsTag->type == JP_BLOB));
+  assert(rowStartsTag->length == (sizeof(int32_t) * (rows + 1)));
+  const int32_t* rowStarts = (const int32_t*)(rowStartsTag->payload.jpchar);
+  const int nonZeroCount = rowStarts[rows];
+  assert((columnIndicesTag != NULL) && (columnIndicesTag->type == JP_BLOB));
+  assert(columnIndicesTag->length == (((sizeof(uint16_t) * nonZeroCount) + 3) & ~3));
+
+  assert(valuesTag != NULL);
+  Buffer* values = buffer_from_tag_dict(valuesTag, true);
+  assert(values != NULL);
+  assert(values->_dims.elementCount() >= nonZeroCount);
+  *outElementFormat = ((values->_bitsPerElement == 32) ? JPElementFormatLinear : values->_elementFormat);
+  Buffer* floatValues = dequantize_buffer(values);
+  delete values;
+
+  SSparseMatrix* result = matrix_sparse_create(rows, columns, nonZeroCount);
+  memcpy(result->rowStarts, rowStarts, rowStartsTag->length);
+  memcpy(result->columnIndices, columnIndicesTag->payload.jpchar, (sizeof(uint16_t) * nonZeroCount));
+  memcpy(result->values, floatValues->_data, (sizeof(jpfloat_t) * nonZeroCount));
+  delete floatValues;
   return result;
 }
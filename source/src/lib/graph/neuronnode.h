@@ -9,8 +9,11 @@
 #ifndef INCLUDE_NEURONNODE_H
 #define INCLUDE_NEURONNODE_H
 
+#include <stdint.h>
+
 #include "basenode.h"
 #include "binary_format.h"
+#include "matrix_ops.h"
 
 class Buffer;
 
@@ -20,16 +23,66 @@ public:
   NeuronNode();
   ~NeuronNode();
 
-  virtual Buffer* run(Buffer* input);
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+  virtual bool canFuse(PoolNode* pool);
+  virtual size_t fusedScratchBytes(const Dimensions& inputDims, PoolNode* pool);
+  virtual void runFusedInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRelu, PoolNode* pool);
+  virtual size_t fusedMemoryTrafficBytes(const Dimensions& inputDims, PoolNode* pool);
+  virtual double flopCount(const Dimensions& inputDims);
+  virtual size_t weightBytes();
   virtual SBinaryTag* toTag();
+  virtual size_t scratchBytes(const Dimensions& inputDims);
   virtual char* debugString();
 
+  // Widens the recorded input range to cover these values. The node should
+  // be running in floats while it's being calibrated.
+  void calibrateInputRange(Buffer* input);
+  // Zeroes the given fraction of the weights, starting with the smallest, and
+  // keeps the rest in sparse form. Returns false if the layer has too many
+  // inputs to be stored that way.
+  bool prune(jpfloat_t sparsity);
+  // Takes ownership of the matrix, and either runs from it directly or, if
+  // too many of its values are non-zero for that to be faster, expands it
+  // back into dense weights.
+  void setSparseWeights(SSparseMatrix* sparseWeights);
+  // Replaces the weights with the two factors of their truncated singular
+  // value decomposition, either at the given rank, or if that's zero at the
+  // smallest one that keeps the given fraction of their energy. Returns the
+  // rank used, or zero if the factors wouldn't be any smaller.
+  int factorize(int rank, jpfloat_t energy);
+
   int _outputsCount;
   Buffer* _weights;
   bool _useBias;
   Buffer* _bias;
   jpfloat_t _dropout;
   bool _areWeightsTransposed;
+  // The range of values calibration saw coming into this layer. When it's
+  // known and the weights are stored transposed as 8 bits, the layer runs
+  // with integer arithmetic unless JPCNN_DISABLE_INT8 is set.
+  bool _hasInputRange;
+  jpfloat_t _inputMin;
+  jpfloat_t _inputMax;
+  bool _useInt8;
+  int32_t* _weightsRowSums;
+  // How toTag() stores the weights. Linear means they're written as 8-bit
+  // fixed point with a range for each output, unless they were loaded as
+  // 16-bit floats, in which case they stay that way. Pruned layers always
+  // store their values as 16-bit floats, half-precision unless bfloat16 is
+  // chosen, and record the format they were loaded in here, since they're
+  // expanded into floats.
+  int _savedWeightsFormat;
+  // Set for layers that have been pruned, which are saved in sparse form.
+  // While they're running sparse their weights are in _sparseWeights, and
+  // _weights is NULL.
+  bool _isPruned;
+  SSparseMatrix* _sparseWeights;
+  // Set for layers that have been factorized, which run as two smaller
+  // layers without a bias or relu between them. The input goes through these
+  // transposed (rank, inputs) weights first, and then _weights holds the
+  // transposed (outputs, rank) ones.
+  Buffer* _lowRankWeights;
 };
 
 BaseNode* new_neuronnode_from_tag(SBinaryTag* tag, bool skipCopy);
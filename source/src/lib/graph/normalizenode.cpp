@@ -23,12 +23,22 @@ NormalizeNode::~NormalizeNode() {
   // Do nothing
 }
 
-Buffer* NormalizeNode::run(Buffer* input) {
-  if (_output != NULL) {
-    delete _output;
-  }
-  _output = matrix_local_response(input, _windowSize, _k, _alpha, _beta);
-  return _output;
+Dimensions NormalizeNode::outputDimensions(const Dimensions& inputDims) {
+  return inputDims;
+}
+
+double NormalizeNode::flopCount(const Dimensions& inputDims) {
+  // Squaring, adding to and dropping from the running window sum, scaling,
+  // the pow() and the final multiply for each value.
+  return (6.0 * inputDims.elementCount());
+}
+
+size_t NormalizeNode::scratchBytes(const Dimensions& inputDims) {
+  return matrix_local_response_scratch_bytes(inputDims);
+}
+
+void NormalizeNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  matrix_local_response_into(input, _windowSize, _k, _alpha, _beta, output, scratch);
 }
 
 char* NormalizeNode::debugString() {
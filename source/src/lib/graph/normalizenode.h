@@ -20,7 +20,10 @@ public:
   NormalizeNode();
   ~NormalizeNode();
 
-  virtual Buffer* run(Buffer* input);
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual size_t scratchBytes(const Dimensions& inputDims);
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+  virtual double flopCount(const Dimensions& inputDims);
   virtual SBinaryTag* toTag();
   virtual char* debugString();
 
@@ -23,12 +23,21 @@ PoolNode::~PoolNode() {
   // Do nothing
 }
 
-Buffer* PoolNode::run(Buffer* input) {
-  if (_output != NULL) {
-    delete _output;
+Dimensions PoolNode::outputDimensions(const Dimensions& inputDims) {
+  return matrix_max_patch_output_dims(inputDims, _patchWidth, _stride);
+}
+
+void PoolNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  if (_mode == PoolNode::EModeAverage) {
+    matrix_average_patch_into(input, _patchWidth, _stride, output);
+  } else {
+    matrix_max_patch_into(input, _patchWidth, _stride, output);
   }
-  _output = matrix_max_patch(input, _patchWidth, _stride);
-  return _output;
+}
+
+double PoolNode::flopCount(const Dimensions& inputDims) {
+  const double outputCount = outputDimensions(inputDims).elementCount();
+  return (outputCount * _patchWidth * _patchWidth);
 }
 
 char* PoolNode::debugString() {
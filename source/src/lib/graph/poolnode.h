@@ -20,7 +20,9 @@ public:
   PoolNode();
   ~PoolNode();
 
-  virtual Buffer* run(Buffer* input);
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+  virtual double flopCount(const Dimensions& inputDims);
   virtual SBinaryTag* toTag();
   virtual char* debugString();
 
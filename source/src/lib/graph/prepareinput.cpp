@@ -14,21 +14,31 @@
 
 #include "buffer.h"
 #include "matrix_ops.h"
+#include "thread_pool.h"
 
 const int kOutputChannels = 3;
 
-static void rescale_image_to_fit(Buffer* input, Buffer* output, bool doFlip);
+static const int kRowsPerRescaleTask = 8;
+
+typedef struct SRescaleTaskStruct {
+  Buffer* input;
+  Buffer* output;
+  bool doFlip;
+} SRescaleTask;
+
+static void rescale_rows(void* cookie, int startRow, int endRow);
 static void crop_and_flip_image(Buffer* destBuffer, Buffer* sourceBuffer, int offsetX, int offsetY, bool doFlipHorizontal);
 
-PrepareInput::PrepareInput(Buffer* dataMean, bool useCenterOnly, bool needsFlip, bool doRandomSample, int imageSize, int rescaledSize, bool isMeanChanneled) :
-  _useCenterOnly(useCenterOnly),
+PrepareInput::PrepareInput(Buffer* dataMean, bool needsFlip, int imageSize, int rescaledSize, bool isMeanChanneled) :
   _needsFlip(needsFlip),
-  _doRandomSample(doRandomSample),
   _imageSize(imageSize),
   _rescaledSize(rescaledSize) {
   assert(dataMean != NULL);
+  // The original mean is written back out if the graph is saved, so reshape a
+  // view rather than touching it.
+  Buffer* dataMeanView = dataMean->view();
   Dimensions expectedDims(_rescaledSize, _rescaledSize, kOutputChannels);
-  dataMean->reshape(expectedDims);
+  dataMeanView->reshape(expectedDims);
   Dimensions outputDims(_imageSize, _imageSize, kOutputChannels);
   _dataMean = new Buffer(outputDims);
   const int deltaX = (_rescaledSize - _imageSize);
@@ -36,12 +46,13 @@ PrepareInput::PrepareInput(Buffer* dataMean, bool useCenterOnly, bool needsFlip,
   const int marginX = (deltaX / 2);
   const int marginY = (deltaY / 2);
   if (isMeanChanneled) {
-    Buffer* fromChanneled = convert_from_channeled_rgb_image(dataMean);
+    Buffer* fromChanneled = convert_from_channeled_rgb_image(dataMeanView);
     crop_and_flip_image(_dataMean, fromChanneled, marginX, marginY, false);
     delete fromChanneled;
   } else {
-    crop_and_flip_image(_dataMean, dataMean, marginX, marginY, false);
+    crop_and_flip_image(_dataMean, dataMeanView, marginX, marginY, false);
   }
+  delete dataMeanView;
   _dataMean->setName("_dataMean");
   setClassName("PrepareInput");
 }
@@ -50,71 +61,76 @@ PrepareInput::~PrepareInput() {
   delete _dataMean;
 }
 
-Buffer* PrepareInput::run(Buffer* input) {
-  if (_output != NULL) {
-    delete _output;
-  }
+Dimensions PrepareInput::outputDimensions(const Dimensions& inputDims) {
+  const Dimensions outputDims(1, _imageSize, _imageSize, kOutputChannels);
+  return outputDims;
+}
+
+size_t PrepareInput::scratchBytes(const Dimensions& inputDims) {
+  const Dimensions rescaledDims(_rescaledSize, _rescaledSize, kOutputChannels);
+  return rescaledDims.byteCount();
+}
+
+void PrepareInput::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  prepareInto(input, output, scratch, false, NULL);
+}
 
+void PrepareInput::prepareInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRandomSample, unsigned int* randomSeed) {
   Dimensions rescaledDims(_rescaledSize, _rescaledSize, kOutputChannels);
 
-  Buffer* rescaled = new Buffer(rescaledDims);
-  rescaled->setName("rescaled");
-  input->setName("input");
-  rescale_image_to_fit(input, rescaled, _needsFlip);
+  Buffer rescaled(rescaledDims, scratch, 0);
+  rescale_image_to_fit(input, &rescaled, _needsFlip);
 
   const int deltaX = (_rescaledSize - _imageSize);
   const int deltaY = (_rescaledSize - _imageSize);
   const int marginX = (deltaX / 2);
   const int marginY = (deltaY / 2);
 
-  if (_useCenterOnly) {
+  const Dimensions outputDims = output->_dims;
+  const Dimensions imageDims(_imageSize, _imageSize, kOutputChannels);
+  assert(outputDims.removeDimensions(1) == imageDims);
+  const int valuesPerImage = imageDims.elementCount();
+  const int imageCount = outputDims[0];
 
-    Dimensions outputDims(1, _imageSize, _imageSize, kOutputChannels);
-    _output = new Buffer(outputDims);
-    _output->setName("prepareInput_output");
+  if (imageCount == 1) {
 
     int sourceX;
     int sourceY;
-    if (_doRandomSample) {
-      sourceX = (int)(rand() * (deltaX / (float)(RAND_MAX)));
-      sourceY = (int)(rand() * (deltaY / (float)(RAND_MAX)));
+    if (doRandomSample) {
+      assert(randomSeed != NULL);
+      sourceX = (int)(rand_r(randomSeed) * (deltaX / (float)(RAND_MAX)));
+      sourceY = (int)(rand_r(randomSeed) * (deltaY / (float)(RAND_MAX)));
     } else {
       sourceX = marginX;
       sourceY = marginY;
     }
 
-    Buffer* blitDestination = buffer_view_at_top_index(_output, 0);
-    crop_and_flip_image(blitDestination, rescaled, sourceX, sourceY, false);
+    Buffer blitDestination(imageDims, output, 0);
+    crop_and_flip_image(&blitDestination, &rescaled, sourceX, sourceY, false);
 
-    matrix_add_inplace(blitDestination, _dataMean, -1.0f);
+    matrix_add_inplace(&blitDestination, _dataMean, -1.0f);
 
   } else {
 
-    Dimensions outputDims(10, _imageSize, _imageSize, kOutputChannels);
-    _output = new Buffer(outputDims);
-    _output->setName("prepareInput_output");
+    assert(imageCount == 10);
 
     for (int flipPass = 0; flipPass < 2; flipPass += 1) {
       const bool doFlip = (flipPass == 1);
-      Buffer* blitDestination = buffer_view_at_top_index(_output, (flipPass * 5));
-      crop_and_flip_image(blitDestination, rescaled, marginX, marginY, doFlip);
+      Buffer blitDestination(imageDims, output, ((flipPass * 5) * valuesPerImage));
+      crop_and_flip_image(&blitDestination, &rescaled, marginX, marginY, doFlip);
       for (int yIndex = 0; yIndex < 2; yIndex += 1) {
         for (int xIndex = 0; xIndex < 2; xIndex += 1) {
           const int viewIndex = ((flipPass * 5) + (yIndex * 2) + xIndex + 1);
-          Buffer* blitDestination = buffer_view_at_top_index(_output, viewIndex);
+          Buffer blitDestination(imageDims, output, (viewIndex * valuesPerImage));
 
           const int sourceX = (xIndex * deltaX);
           const int sourceY = (yIndex * deltaY);
 
-          crop_and_flip_image(blitDestination, rescaled, sourceX, sourceY, doFlip);
+          crop_and_flip_image(&blitDestination, &rescaled, sourceX, sourceY, doFlip);
         }
       }
     }
   }
-
-  delete rescaled;
-
-  return _output;
 }
 
 SBinaryTag* PrepareInput::toTag() {
@@ -126,14 +142,8 @@ SBinaryTag* PrepareInput::toTag() {
 void rescale_image_to_fit(Buffer* input, Buffer* output, bool doFlip) {
 
   const Dimensions inputDims = input->_dims;
-  const int inputWidth = inputDims[1];
-  const int inputHeight = inputDims[0];
-  const int inputChannels = inputDims[2];
-
   const Dimensions outputDims = output->_dims;
-  const int outputWidth = outputDims[1];
   const int outputHeight = outputDims[0];
-  const int outputChannels = outputDims[2];
 
   if ((inputDims == outputDims) && !doFlip) {
     const int elementCount = inputDims.elementCount();
@@ -142,6 +152,93 @@ void rescale_image_to_fit(Buffer* input, Buffer* output, bool doFlip) {
     return;
   }
 
+  // Output rows don't depend on each other, so they're shared out across
+  // the thread pool.
+  SRescaleTask task;
+  task.input = input;
+  task.output = output;
+  task.doFlip = doFlip;
+  thread_pool_parallel_for(outputHeight, kRowsPerRescaleTask, rescale_rows, &task);
+}
+
+void crop_and_flip_image(Buffer* destBuffer, Buffer* sourceBuffer, int offsetX, int offsetY, bool doFlipHorizontal) {
+
+  const Dimensions destDims = destBuffer->_dims;
+  const Dimensions sourceDims = sourceBuffer->_dims;
+  assert((destDims._length == 3) && (sourceDims._length == 3));
+
+  const int destWidth = destDims[1];
+  const int destHeight = destDims[0];
+  const int destChannels = destDims[2];
+
+  const int sourceWidth = sourceDims[1];
+  const int sourceHeight = sourceDims[0];
+  const int sourceChannels = sourceDims[2];
+  assert(destChannels == sourceChannels);
+
+  const int sourceEndX = (offsetX + destWidth);
+  assert(sourceEndX <= sourceWidth);
+  const int sourceEndY = (offsetY + destHeight);
+  assert(sourceEndY <= sourceHeight);
+
+  const Dimensions destRowDims = destDims.removeDimensions(1);
+  const int destRowElementCount = destRowDims.elementCount();
+  const size_t destRowByteCount = (destRowElementCount * sizeof(jpfloat_t));
+
+  jpfloat_t* const destDataStart = destBuffer->_data;
+  jpfloat_t* const sourceDataStart = sourceBuffer->_data;
+
+  if (!doFlipHorizontal) {
+    for (int destY = 0; destY < destHeight; destY += 1) {
+      const int sourceX = offsetX;
+      const int sourceY = (destY + offsetY);
+      const int sourceOffset = sourceDims.offset(sourceY, sourceX, 0);
+      jpfloat_t* const sourceData = (sourceDataStart + sourceOffset);
+      const int destOffset = destDims.offset(destY, 0, 0);
+      jpfloat_t* const destData = (destDataStart + destOffset);
+      memcpy(destData, sourceData, destRowByteCount);
+    }
+  } else {
+    for (int destY = 0; destY < destHeight; destY += 1) {
+      const int sourceX = offsetX;
+      const int sourceY = (destY + offsetY);
+      const int sourceOffset = sourceDims.offset(sourceY, sourceX, 0);
+      jpfloat_t* const sourceLeft = (sourceDataStart + sourceOffset);
+      const int destOffset = destDims.offset(destY, 0, 0);
+      jpfloat_t* const destLeft = (destDataStart + destOffset);
+      jpfloat_t* const destRight = (destLeft + destRowElementCount);
+      jpfloat_t* destCurrent = (destRight - destChannels);
+      jpfloat_t* sourceCurrent = sourceLeft;
+      while (destCurrent >= destLeft) {
+        jpfloat_t* destChannelEnd = (destCurrent + destChannels);
+        while (destCurrent < destChannelEnd) {
+          *destCurrent = *sourceCurrent;
+          destCurrent += 1;
+          sourceCurrent += 1;
+        }
+        destCurrent -= (destChannels * 2);
+      }
+    }
+  }
+
+}
+
+void rescale_rows(void* cookie, int startRow, int endRow) {
+  const SRescaleTask* task = (const SRescaleTask*)(cookie);
+  Buffer* input = task->input;
+  Buffer* output = task->output;
+  const bool doFlip = task->doFlip;
+
+  const Dimensions inputDims = input->_dims;
+  const int inputWidth = inputDims[1];
+  const int inputHeight = inputDims[0];
+  const int inputChannels = inputDims[2];
+
+  const Dimensions outputDims = output->_dims;
+  const int outputWidth = outputDims[1];
+  const int outputHeight = outputDims[0];
+  const int outputChannels = outputDims[2];
+
   const float flipBias = (doFlip) ? inputHeight : 0.0f;
   const float flipScale = (doFlip) ? -1.0f : 1.0f;
 
@@ -155,7 +252,7 @@ void rescale_image_to_fit(Buffer* input, Buffer* output, bool doFlip) {
   const jpfloat_t* inputDataStart = input->_data;
   jpfloat_t* const outputDataStart = output->_data;
 
-  for (int outputY = 0; outputY < outputHeight; outputY += 1) {
+  for (int outputY = startRow; outputY < endRow; outputY += 1) {
     const jpfloat_t inputY = (flipBias + (outputY * scaleY));
     const int indexY0 = fmaxf(0.0f, fminf((inputHeight - 1.0f), floorf(inputY)));
     const int indexY1 = fmaxf(0.0f, fminf((inputHeight - 1.0f), ceilf(inputY)));
@@ -212,66 +309,3 @@ void rescale_image_to_fit(Buffer* input, Buffer* output, bool doFlip) {
     }
   }
 }
-
-void crop_and_flip_image(Buffer* destBuffer, Buffer* sourceBuffer, int offsetX, int offsetY, bool doFlipHorizontal) {
-
-  const Dimensions destDims = destBuffer->_dims;
-  const Dimensions sourceDims = sourceBuffer->_dims;
-  assert((destDims._length == 3) && (sourceDims._length == 3));
-
-  const int destWidth = destDims[1];
-  const int destHeight = destDims[0];
-  const int destChannels = destDims[2];
-
-  const int sourceWidth = sourceDims[1];
-  const int sourceHeight = sourceDims[0];
-  const int sourceChannels = sourceDims[2];
-  assert(destChannels == sourceChannels);
-
-  const int sourceEndX = (offsetX + destWidth);
-  assert(sourceEndX <= sourceWidth);
-  const int sourceEndY = (offsetY + destHeight);
-  assert(sourceEndY <= sourceHeight);
-
-  const Dimensions destRowDims = destDims.removeDimensions(1);
-  const int destRowElementCount = destRowDims.elementCount();
-  const size_t destRowByteCount = (destRowElementCount * sizeof(jpfloat_t));
-
-  jpfloat_t* const destDataStart = destBuffer->_data;
-  jpfloat_t* const sourceDataStart = sourceBuffer->_data;
-
-  if (!doFlipHorizontal) {
-    for (int destY = 0; destY < destHeight; destY += 1) {
-      const int sourceX = offsetX;
-      const int sourceY = (destY + offsetY);
-      const int sourceOffset = sourceDims.offset(sourceY, sourceX, 0);
-      jpfloat_t* const sourceData = (sourceDataStart + sourceOffset);
-      const int destOffset = destDims.offset(destY, 0, 0);
-      jpfloat_t* const destData = (destDataStart + destOffset);
-      memcpy(destData, sourceData, destRowByteCount);
-    }
-  } else {
-    for (int destY = 0; destY < destHeight; destY += 1) {
-      const int sourceX = offsetX;
-      const int sourceY = (destY + offsetY);
-      const int sourceOffset = sourceDims.offset(sourceY, sourceX, 0);
-      jpfloat_t* const sourceLeft = (sourceDataStart + sourceOffset);
-      const int destOffset = destDims.offset(destY, 0, 0);
-      jpfloat_t* const destLeft = (destDataStart + destOffset);
-      jpfloat_t* const destRight = (destLeft + destRowElementCount);
-      jpfloat_t* destCurrent = destRight;
-      jpfloat_t* sourceCurrent = sourceLeft;
-      while (destCurrent != destLeft) {
-        jpfloat_t* destChannelEnd = (destCurrent + destChannels);
-        while (destCurrent < destChannelEnd) {
-          *destCurrent = *sourceCurrent;
-          destCurrent += 1;
-          sourceCurrent += 1;
-        }
-        destCurrent -= (destChannels * 2);
-      }
-    }
-  }
-
-}
-
@@ -16,19 +16,28 @@
 class PrepareInput : BaseNode {
 public:
 
-  PrepareInput(Buffer* dataMean, bool useCenterOnly, bool needsFlip, bool doRandomSample, int imageSize, int rescaledSize, bool isMeanChanneled);
+  PrepareInput(Buffer* dataMean, bool needsFlip, int imageSize, int rescaledSize, bool isMeanChanneled);
   ~PrepareInput();
 
-  virtual Buffer* run(Buffer* input);
   virtual SBinaryTag* toTag();
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual size_t scratchBytes(const Dimensions& inputDims);
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+
+  // Fills output with one sample per image for a batch size of one, or ten
+  // for a multisample batch. The random seed is only used if doRandomSample
+  // is set, and only for single samples.
+  void prepareInto(Buffer* input, Buffer* output, Buffer* scratch, bool doRandomSample, unsigned int* randomSeed);
 
   Buffer* _dataMean;
-  bool _useCenterOnly;
   bool _needsFlip;
-  bool _doRandomSample;
   const int _imageSize;
   const int _rescaledSize;
 };
 
+// Resamples an image of (height, width, channels) to the output's size,
+// optionally mirroring it left to right.
+void rescale_image_to_fit(Buffer* input, Buffer* output, bool doFlip);
+
 #endif // INCLUDE_PREPAREINPUT_H
 
@@ -23,14 +23,20 @@ ReluNode::~ReluNode() {
   // Do nothing
 }
 
-Buffer* ReluNode::run(Buffer* input) {
-  if (_output != NULL) {
-    delete _output;
-  }
+Dimensions ReluNode::outputDimensions(const Dimensions& inputDims) {
+  return inputDims;
+}
+
+double ReluNode::flopCount(const Dimensions& inputDims) {
+  return inputDims.elementCount();
+}
 
-  _output = matrix_max(input, 0.0f);
+bool ReluNode::canRunInPlace() {
+  return true;
+}
 
-  return _output;
+void ReluNode::runInto(Buffer* input, Buffer* output, Buffer* scratch) {
+  matrix_max_into(input, 0.0f, output);
 }
 
 SBinaryTag* ReluNode::toTag() {
@@ -20,7 +20,10 @@ public:
   ReluNode();
   ~ReluNode();
 
-  virtual Buffer* run(Buffer* input);
+  virtual Dimensions outputDimensions(const Dimensions& inputDims);
+  virtual bool canRunInPlace();
+  virtual void runInto(Buffer* input, Buffer* output, Buffer* scratch);
+  virtual double flopCount(const Dimensions& inputDims);
   virtual SBinaryTag* toTag();
 };
 
@@ -0,0 +1,112 @@
+//
+//  session.cpp
+//  jpcnn
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "session.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "basenode.h"
+#include "buffer.h"
+#include "graph.h"
+#include "memoryplan.h"
+
+Session::Session(Graph* graph) :
+  _graph(graph),
+  _plan(NULL),
+  _activationArena(NULL),
+  _scratchArena(NULL),
+  _tensors(NULL),
+  _layerStats(NULL),
+  _randomSeed(1) {
+  assert(graph != NULL);
+}
+
+Session::~Session() {
+  releaseMemory();
+}
+
+void Session::prepareForInput(const Dimensions& inputDims, int layerOffset) {
+  prepareForInput(inputDims, &layerOffset, 1);
+}
+
+void Session::prepareForInput(const Dimensions& inputDims, const int* tapOffsets, int tapsCount, int startLayer) {
+  if ((_plan != NULL) && _plan->matches(inputDims, tapOffsets, tapsCount, startLayer)) {
+    return;
+  }
+  releaseMemory();
+
+  _plan = new MemoryPlan(_graph, inputDims, tapOffsets, tapsCount, startLayer);
+  const int activationCount = (int)(_plan->_activationBytes / sizeof(jpfloat_t));
+  _activationArena = new Buffer(Dimensions(activationCount));
+  _activationArena->setName("_activationArena");
+  const int scratchCount = (int)(_plan->_scratchBytes / sizeof(jpfloat_t));
+  _scratchArena = new Buffer(Dimensions(scratchCount));
+  _scratchArena->setName("_scratchArena");
+
+  const int tensorsCount = _plan->_tensorsCount;
+  _tensors = (Buffer**)(malloc(sizeof(Buffer*) * tensorsCount));
+  for (int index = 0; index < tensorsCount; index += 1) {
+    Buffer* tensor = new Buffer(_plan->_tensorDims[index], _activationArena, _plan->_tensorOffsets[index]);
+    if (index == 0) {
+      tensor->setName("input");
+    } else {
+      tensor->setName(_plan->_steps[index - 1]->_name);
+    }
+    _tensors[index] = tensor;
+  }
+
+  const int stepsCount = _plan->_stepsCount;
+  _layerStats = (JPCNNLayerStats*)(malloc(sizeof(JPCNNLayerStats) * MAX(1, stepsCount)));
+  for (int index = 0; index < stepsCount; index += 1) {
+    BaseNode* step = _plan->_steps[index];
+    const Dimensions& stepInputDims = _plan->_tensorDims[index];
+    const Dimensions& stepOutputDims = _plan->_tensorDims[index + 1];
+    JPCNNLayerStats* stats = &_layerStats[index];
+    stats->name = step->_name;
+    stats->milliseconds = 0.0f;
+    stats->flops = step->flopCount(stepInputDims);
+    // The traffic estimates lump reads and writes together, so treat the
+    // output as the part that's written, unless the step doesn't touch
+    // memory at all, like the reshapes.
+    const size_t trafficBytes = _plan->_stepTrafficBytes[index];
+    const size_t writtenBytes = MIN(trafficBytes, (size_t)(stepOutputDims.byteCount()));
+    stats->bytesRead = ((trafficBytes - writtenBytes) + step->weightBytes());
+    stats->bytesWritten = writtenBytes;
+    stats->outputDimsLength = MIN(stepOutputDims._length, JPCNN_MAX_DIMENSIONS);
+    for (int dimIndex = 0; dimIndex < stats->outputDimsLength; dimIndex += 1) {
+      stats->outputDims[dimIndex] = stepOutputDims[dimIndex];
+    }
+  }
+}
+
+void Session::releaseMemory() {
+  if (_layerStats != NULL) {
+    free(_layerStats);
+    _layerStats = NULL;
+  }
+  if (_tensors != NULL) {
+    for (int index = 0; index < _plan->_tensorsCount; index += 1) {
+      delete _tensors[index];
+    }
+    free(_tensors);
+    _tensors = NULL;
+  }
+  if (_activationArena != NULL) {
+    delete _activationArena;
+    _activationArena = NULL;
+  }
+  if (_scratchArena != NULL) {
+    delete _scratchArena;
+    _scratchArena = NULL;
+  }
+  if (_plan != NULL) {
+    delete _plan;
+    _plan = NULL;
+  }
+}
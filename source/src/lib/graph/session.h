@@ -0,0 +1,53 @@
+//
+//  session.h
+//  jpcnn
+//
+//  Holds all of the mutable state needed to run a graph, so that several
+//  threads can share one set of loaded weights as long as each one has its
+//  own session.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#ifndef INCLUDE_SESSION_H
+#define INCLUDE_SESSION_H
+
+#include "jpcnn.h"
+#include "dimensions.h"
+#include "libjpcnn.h"
+
+class Buffer;
+class Graph;
+class MemoryPlan;
+
+class Session {
+public:
+
+  Session(Graph* graph);
+  virtual ~Session();
+
+  // Makes sure the arenas are laid out for this input shape, and for a run
+  // that stops at layerOffset or keeps the results of every tapped layer,
+  // optionally starting partway through the graph at startLayer.
+  // This only allocates memory when the arguments change from the last call.
+  void prepareForInput(const Dimensions& inputDims, int layerOffset);
+  void prepareForInput(const Dimensions& inputDims, const int* tapOffsets, int tapsCount, int startLayer = 0);
+  void releaseMemory();
+
+  Graph* _graph;
+  MemoryPlan* _plan;
+  Buffer* _activationArena;
+  Buffer* _scratchArena;
+  // Views into the activation arena for each tensor in the plan.
+  Buffer** _tensors;
+  // One entry for each step of the plan, describing the last run. The counts
+  // are worked out when the plan is made, and the timings are only filled in
+  // while the graph has profiling enabled.
+  JPCNNLayerStats* _layerStats;
+  // Used with rand_r() for JPCNN_RANDOM_SAMPLE, so that sessions on different
+  // threads don't share the global rand() state.
+  unsigned int _randomSeed;
+};
+
+#endif // INCLUDE_SESSION_H
@@ -21,6 +21,16 @@
 
 typedef float jpfloat_t;
 
+// How the values of a buffer with fewer than 32 bits per element are stored.
+// Linear ones are fixed-point, and stand for (min + (value * range)). The
+// others are 16-bit floats, either IEEE half-precision or bfloat16, which is
+// the top half of an IEEE single-precision float.
+enum JPELEMENT_FORMAT {
+  JPElementFormatLinear = 0,
+  JPElementFormatHalf = 1,
+  JPElementFormatBFloat16 = 2
+};
+
 // Define this if you want details of the operations being
 // being performed printed to stderr
 //#define DO_LOG_OPERATIONS
@@ -11,13 +11,25 @@
 #include "libjpcnn.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
 #include <sys/time.h>
 
 #include "buffer.h"
 #include "prepareinput.h"
 #include "graph.h"
+#include "session.h"
+#include "memoryplan.h"
 #include "svmutils.h"
 #include "glgemm.h"
+#include "thread_pool.h"
+#include "cpu_features.h"
+#include "matrix_ops.h"
+#include "convnode.h"
+#include "gconvnode.h"
+#include "neuronnode.h"
 
 typedef struct SPredictorInfoStruct {
   struct svm_model* model;
@@ -26,11 +38,57 @@ typedef struct SPredictorInfoStruct {
 
 extern void test_qpu_gemm();
 
+static void prepare_images_in_session(Session* session, Buffer** inputs, int inputsCount, unsigned int flags, const int* tapOffsets, int tapsCount);
+static void classify_images_in_session(Session* session, Buffer** inputs, int inputsCount, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+static int classify_image_topk_in_session(Session* session, Buffer* input, unsigned int flags, int layerOffset, int k, JPCNNPrediction* outPredictions);
+static void classify_image_with_taps_in_session(Session* session, Buffer* input, unsigned int flags, const int* layerOffsets, int tapsCount, float** outTapsValues, int* outTapsLengths);
+static void calibrate_image_in_session(Session* session, Buffer* input, unsigned int flags) {
+
+  // Each fully-connected layer's input is the output of the layer before it,
+  // so those are tapped. A network that starts with one has nothing to tap,
+  // and that layer is left in floats.
+  Graph* graph = session->_graph;
+  int* tapOffsets = (int*)(malloc(sizeof(int) * graph->_layersLength));
+  NeuronNode** calibratedNodes = (NeuronNode**)(malloc(sizeof(NeuronNode*) * graph->_layersLength));
+  int tapsCount = 0;
+  for (int index = 1; index < graph->_layersLength; index += 1) {
+    BaseNode* layer = graph->_layers[index];
+    if ((layer->_className == NULL) || (strcmp(layer->_className, "NeuronNode") != 0)) {
+      continue;
+    }
+    NeuronNode* neuronNode = (NeuronNode*)(layer);
+    // The layers before have to run in floats, so the ranges match what a
+    // float network sees. The network stays that way until it's saved and
+    // loaded again.
+    neuronNode->_useInt8 = false;
+    calibratedNodes[tapsCount] = neuronNode;
+    tapOffsets[tapsCount] = (index - graph->_layersLength);
+    tapsCount += 1;
+  }
+
+  if (tapsCount > 0) {
+    prepare_images_in_session(session, &input, 1, flags, tapOffsets, tapsCount);
+    graph->runPlan(session, session->_tensors[0]);
+    MemoryPlan* plan = session->_plan;
+    for (int index = 0; index < tapsCount; index += 1) {
+      Buffer* tap = session->_tensors[plan->_tapTensors[index]];
+      calibratedNodes[index]->calibrateInputRange(tap);
+    }
+  }
+
+  free(calibratedNodes);
+  free(tapOffsets);
+}
+
+static void classify_activations_in_session(Session* session, Buffer* activations, int startLayerOffset, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+static void set_prediction_outputs(Graph* graph, Buffer* predictions, int inputsCount, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength);
+
 extern "C" {
 
 void* jpcnn_create_network(const char* filename) {
 //test_qpu_gemm();
 //exit(1);
+  cpu_features_initialize();
   Graph* graph = new_graph_from_file(filename, false, true);
   return (void*)(graph);
 }
@@ -97,11 +155,7 @@ void* jpcnn_create_image_buffer_from_uint8_data(unsigned char* pixelData, int wi
           dest += channels;
         }
       } else {
-        while (source < sourceEnd) {
-          *dest = (jpfloat_t)(*source);
-          dest += 1;
-          source += 1;
-        }
+        matrix_dequantize_uint8(source, valuesPerRow, 0.0f, 1.0f, dest);
       }
     }
   }
@@ -110,40 +164,202 @@ void* jpcnn_create_image_buffer_from_uint8_data(unsigned char* pixelData, int wi
 }
 
 void jpcnn_classify_image(void* networkHandle, void* inputHandle, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+  Graph* graph = (Graph*)(networkHandle);
+  Buffer* input = (Buffer*)(inputHandle);
+  classify_images_in_session(graph->_defaultSession, &input, 1, flags, layerOffset, outPredictionsValues, outPredictionsLength, outPredictionsNames, outPredictionsNamesLength);
+}
 
-  const bool doMultiSample = (flags & JPCNN_MULTISAMPLE);
-  const bool doRandomSample = (flags & JPCNN_RANDOM_SAMPLE);
+void jpcnn_classify_images(void* networkHandle, void** inputHandles, int inputsCount, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+  Graph* graph = (Graph*)(networkHandle);
+  Buffer** inputs = (Buffer**)(inputHandles);
+  classify_images_in_session(graph->_defaultSession, inputs, inputsCount, flags, layerOffset, outPredictionsValues, outPredictionsLength, outPredictionsNames, outPredictionsNamesLength);
+}
 
+int jpcnn_classify_image_topk(void* networkHandle, void* inputHandle, unsigned int flags, int layerOffset, int k, JPCNNPrediction* outPredictions) {
   Graph* graph = (Graph*)(networkHandle);
   Buffer* input = (Buffer*)(inputHandle);
+  return classify_image_topk_in_session(graph->_defaultSession, input, flags, layerOffset, k, outPredictions);
+}
 
-  bool doFlip;
-  int imageSize;
-  bool isMeanChanneled;
-  if (graph->_isHomebrewed) {
-    imageSize = 224;
-    doFlip = false;
-    isMeanChanneled = true;
-  } else {
-    imageSize = 227;
-    doFlip = true;
-    isMeanChanneled = false;
+void* jpcnn_create_session(void* networkHandle) {
+  Graph* graph = (Graph*)(networkHandle);
+  if (graph == NULL) {
+    fprintf(stderr, "jpcnn_create_session() - networkHandle is NULL\n");
+    return NULL;
   }
-  const int rescaledSize = graph->_inputSize;
+  Session* session = new Session(graph);
+  return (void*)(session);
+}
 
-  PrepareInput prepareInput(graph->_dataMean, !doMultiSample, doFlip, doRandomSample, imageSize, rescaledSize, isMeanChanneled);
-  Buffer* rescaledInput = prepareInput.run(input);
-  Buffer* predictions = graph->run(rescaledInput, layerOffset);
+void jpcnn_destroy_session(void* sessionHandle) {
+  Session* session = (Session*)(sessionHandle);
+  delete session;
+}
 
-  *outPredictionsValues = predictions->_data;
-  *outPredictionsLength = predictions->_dims.elementCount();
-  if (layerOffset == 0) {
-    *outPredictionsNames = graph->_labelNames;
-    *outPredictionsNamesLength = graph->_labelNamesLength;
-  } else {
-    *outPredictionsNames = NULL;
-    *outPredictionsNamesLength = predictions->_dims.removeDimensions(1).elementCount();
+void jpcnn_classify_image_in_session(void* sessionHandle, void* inputHandle, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+  Session* session = (Session*)(sessionHandle);
+  Buffer* input = (Buffer*)(inputHandle);
+  classify_images_in_session(session, &input, 1, flags, layerOffset, outPredictionsValues, outPredictionsLength, outPredictionsNames, outPredictionsNamesLength);
+}
+
+void jpcnn_classify_images_in_session(void* sessionHandle, void** inputHandles, int inputsCount, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+  Session* session = (Session*)(sessionHandle);
+  Buffer** inputs = (Buffer**)(inputHandles);
+  classify_images_in_session(session, inputs, inputsCount, flags, layerOffset, outPredictionsValues, outPredictionsLength, outPredictionsNames, outPredictionsNamesLength);
+}
+
+int jpcnn_classify_image_topk_in_session(void* sessionHandle, void* inputHandle, unsigned int flags, int layerOffset, int k, JPCNNPrediction* outPredictions) {
+  Session* session = (Session*)(sessionHandle);
+  Buffer* input = (Buffer*)(inputHandle);
+  return classify_image_topk_in_session(session, input, flags, layerOffset, k, outPredictions);
+}
+
+int jpcnn_get_layer_offset(void* networkHandle, const char* layerName, int* outLayerOffset) {
+  Graph* graph = (Graph*)(networkHandle);
+  for (int index = 0; index < graph->_layersLength; index += 1) {
+    const char* currentName = graph->_layers[index]->_name;
+    if ((currentName != NULL) && (strcmp(currentName, layerName) == 0)) {
+      *outLayerOffset = ((index + 1) - graph->_layersLength);
+      return 1;
+    }
   }
+  return 0;
+}
+
+void jpcnn_classify_image_with_taps(void* networkHandle, void* inputHandle, unsigned int flags, const int* layerOffsets, int tapsCount, float** outTapsValues, int* outTapsLengths) {
+  Graph* graph = (Graph*)(networkHandle);
+  Buffer* input = (Buffer*)(inputHandle);
+  classify_image_with_taps_in_session(graph->_defaultSession, input, flags, layerOffsets, tapsCount, outTapsValues, outTapsLengths);
+}
+
+void jpcnn_classify_image_with_taps_in_session(void* sessionHandle, void* inputHandle, unsigned int flags, const int* layerOffsets, int tapsCount, float** outTapsValues, int* outTapsLengths) {
+  Session* session = (Session*)(sessionHandle);
+  Buffer* input = (Buffer*)(inputHandle);
+  classify_image_with_taps_in_session(session, input, flags, layerOffsets, tapsCount, outTapsValues, outTapsLengths);
+}
+
+void* jpcnn_create_activations_from_image(void* networkHandle, void* inputHandle, unsigned int flags, int layerOffset) {
+  Graph* graph = (Graph*)(networkHandle);
+  Buffer* input = (Buffer*)(inputHandle);
+  Session* session = graph->_defaultSession;
+  prepare_images_in_session(session, &input, 1, flags, &layerOffset, 1);
+  Buffer* output = graph->runPlan(session, session->_tensors[0]);
+  Buffer* result = new Buffer(output->_dims);
+  result->copyDataFrom(output);
+  return result;
+}
+
+void jpcnn_destroy_activations(void* activationsHandle) {
+  Buffer* activations = (Buffer*)(activationsHandle);
+  delete activations;
+}
+
+int jpcnn_save_activations(const char* filename, void* activationsHandle, int bitsPerFloat) {
+  Buffer* activations = (Buffer*)(activationsHandle);
+  if ((bitsPerFloat != 32) && (bitsPerFloat != 16) && (bitsPerFloat != 8)) {
+    fprintf(stderr, "jpcnn can only save 32, 16 or 8 bit activations, asked for %d\n", bitsPerFloat);
+    return 0;
+  }
+  FILE* outputFile = fopen(filename, "wb");
+  if (outputFile == NULL) {
+    fprintf(stderr, "Couldn't open activations file '%s' for writing\n", filename);
+    return 0;
+  }
+  SBinaryTag* mainDict = buffer_to_tag_dict(activations, bitsPerFloat);
+  const size_t bytesWritten = fwrite(mainDict, get_total_sizeof_tag(mainDict), 1, outputFile);
+  fclose(outputFile);
+  free(mainDict);
+  if (bytesWritten != 1) {
+    fprintf(stderr, "Couldn't write activations to '%s'\n", filename);
+    return 0;
+  }
+  return 1;
+}
+
+void* jpcnn_load_activations(const char* filename) {
+  SBinaryTag* mainDict = read_tag_from_file(filename, false);
+  if (mainDict == NULL) {
+    return NULL;
+  }
+  Buffer* loaded = buffer_from_tag_dict(mainDict, false);
+  deallocate_file_tag(mainDict, false);
+  if (loaded == NULL) {
+    return NULL;
+  }
+  // The layers only work on float values, so compact files are expanded back
+  // out once here rather than on every run.
+  Buffer* result = loaded;
+  if (loaded->_bitsPerElement != 32) {
+    result = dequantize_buffer(loaded);
+    delete loaded;
+  }
+  result->setName(filename);
+  return result;
+}
+
+void jpcnn_classify_activations(void* networkHandle, void* activationsHandle, int startLayerOffset, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+  Graph* graph = (Graph*)(networkHandle);
+  Buffer* activations = (Buffer*)(activationsHandle);
+  classify_activations_in_session(graph->_defaultSession, activations, startLayerOffset, layerOffset, outPredictionsValues, outPredictionsLength, outPredictionsNames, outPredictionsNamesLength);
+}
+
+void jpcnn_classify_activations_in_session(void* sessionHandle, void* activationsHandle, int startLayerOffset, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+  Session* session = (Session*)(sessionHandle);
+  Buffer* activations = (Buffer*)(activationsHandle);
+  classify_activations_in_session(session, activations, startLayerOffset, layerOffset, outPredictionsValues, outPredictionsLength, outPredictionsNames, outPredictionsNamesLength);
+}
+
+size_t jpcnn_get_planned_memory_size(void* networkHandle, int inputsCount, unsigned int flags, int layerOffset) {
+  Graph* graph = (Graph*)(networkHandle);
+  if (graph == NULL) {
+    fprintf(stderr, "jpcnn_get_planned_memory_size() - networkHandle is NULL\n");
+    return 0;
+  }
+  if (inputsCount < 1) {
+    fprintf(stderr, "jpcnn_get_planned_memory_size() - inputsCount must be at least one, got %d\n", inputsCount);
+    return 0;
+  }
+  // Every image is rescaled to the network's own input size before it runs,
+  // so the batch size is the only part of the input that changes the plan.
+  const bool doMultiSample = (flags & JPCNN_MULTISAMPLE);
+  const int imageSize = graph->_preparationNode->_imageSize;
+  const int samplesPerImage = (doMultiSample ? 10 : 1);
+  const Dimensions preparedDims((inputsCount * samplesPerImage), imageSize, imageSize, 3);
+  MemoryPlan plan(graph, preparedDims, layerOffset);
+  return (plan._activationBytes + plan._scratchBytes);
+}
+
+void jpcnn_set_thread_count(int threadCount) {
+  thread_pool_set_thread_count(threadCount);
+}
+
+int jpcnn_get_thread_count() {
+  return thread_pool_get_thread_count();
+}
+
+const char* jpcnn_get_instruction_set() {
+  return cpu_features_get_level_name(cpu_features_get_level());
+}
+
+void jpcnn_enable_profiling(void* networkHandle, int enabled) {
+  Graph* graph = (Graph*)(networkHandle);
+  graph->_isProfilingEnabled = enabled;
+}
+
+void jpcnn_get_layer_stats(void* networkHandle, JPCNNLayerStats** outStats, int* outStatsLength) {
+  Graph* graph = (Graph*)(networkHandle);
+  jpcnn_get_layer_stats_in_session(graph->_defaultSession, outStats, outStatsLength);
+}
+
+void jpcnn_get_layer_stats_in_session(void* sessionHandle, JPCNNLayerStats** outStats, int* outStatsLength) {
+  Session* session = (Session*)(sessionHandle);
+  if (session->_plan == NULL) {
+    *outStats = NULL;
+    *outStatsLength = 0;
+    return;
+  }
+  *outStats = session->_layerStats;
+  *outStatsLength = session->_plan->_stepsCount;
 }
 
 void jpcnn_print_network(void* networkHandle) {
@@ -195,6 +411,168 @@ void jpcnn_destroy_predictor(void* predictorHandle) {
   free(predictorInfo);
 }
 
+void jpcnn_calibrate_image(void* networkHandle, void* inputHandle, unsigned int flags) {
+  Graph* graph = (Graph*)(networkHandle);
+  Buffer* input = (Buffer*)(inputHandle);
+  calibrate_image_in_session(graph->_defaultSession, input, flags);
+}
+
+int jpcnn_save_network(const char* filename, void* networkHandle) {
+  Graph* graph = (Graph*)(networkHandle);
+  const bool saveResult = save_graph_to_file(graph, filename);
+  if (!saveResult) {
+    return 0;
+  }
+  return 1;
+}
+
+int jpcnn_set_winograd_tolerance(void* networkHandle, const char* layerName, float tolerance) {
+  Graph* graph = (Graph*)(networkHandle);
+  int layerOffset;
+  if (!jpcnn_get_layer_offset(networkHandle, layerName, &layerOffset)) {
+    fprintf(stderr, "Couldn't find layer '%s'\n", layerName);
+    return 0;
+  }
+  BaseNode* layer = graph->_layers[(graph->_layersLength - 1) + layerOffset];
+
+  // Grouped convolutions pass the setting on to each of their groups.
+  BaseNode** convNodes;
+  int convNodesCount;
+  if ((layer->_className != NULL) && (strcmp(layer->_className, "ConvNode") == 0)) {
+    convNodes = &layer;
+    convNodesCount = 1;
+  } else if ((layer->_className != NULL) && (strcmp(layer->_className, "GConvNode") == 0)) {
+    GConvNode* gconvNode = (GConvNode*)(layer);
+    convNodes = gconvNode->_subnodes;
+    convNodesCount = gconvNode->_subnodesCount;
+  } else {
+    fprintf(stderr, "Layer '%s' isn't a convolution\n", layerName);
+    return 0;
+  }
+
+  bool isUsingWinograd = true;
+  for (int index = 0; index < convNodesCount; index += 1) {
+    ConvNode* convNode = (ConvNode*)(convNodes[index]);
+    if (!convNode->setWinogradTolerance(tolerance)) {
+      isUsingWinograd = false;
+    }
+  }
+  // Groups that failed the check would otherwise be left on a different
+  // algorithm from the ones that passed.
+  if (!isUsingWinograd) {
+    for (int index = 0; index < convNodesCount; index += 1) {
+      ConvNode* convNode = (ConvNode*)(convNodes[index]);
+      convNode->setWinogradTolerance(0.0f);
+    }
+  }
+
+  // The layer's scratch space has changed, so every session needs to lay out
+  // its memory again.
+  graph->_generation += 1;
+
+  if (!isUsingWinograd) {
+    return 0;
+  }
+  return 1;
+}
+
+int jpcnn_set_layer_weights_format(void* networkHandle, const char* layerName, int format) {
+  Graph* graph = (Graph*)(networkHandle);
+  int elementFormat;
+  if (format == JPCNN_WEIGHTS_DEFAULT) {
+    elementFormat = JPElementFormatLinear;
+  } else if (format == JPCNN_WEIGHTS_FLOAT16) {
+    elementFormat = JPElementFormatHalf;
+  } else if (format == JPCNN_WEIGHTS_BFLOAT16) {
+    elementFormat = JPElementFormatBFloat16;
+  } else {
+    fprintf(stderr, "Unknown weights format %d\n", format);
+    return 0;
+  }
+  int layerOffset;
+  if (!jpcnn_get_layer_offset(networkHandle, layerName, &layerOffset)) {
+    fprintf(stderr, "Couldn't find layer '%s'\n", layerName);
+    return 0;
+  }
+  BaseNode* layer = graph->_layers[(graph->_layersLength - 1) + layerOffset];
+
+  // The format only changes how the weights are saved, so the layer keeps
+  // running as it is until the network's written out and loaded again.
+  const char* className = layer->_className;
+  if ((className != NULL) && (strcmp(className, "ConvNode") == 0)) {
+    ConvNode* convNode = (ConvNode*)(layer);
+    convNode->_savedKernelsFormat = elementFormat;
+  } else if ((className != NULL) && (strcmp(className, "GConvNode") == 0)) {
+    GConvNode* gconvNode = (GConvNode*)(layer);
+    for (int index = 0; index < gconvNode->_subnodesCount; index += 1) {
+      ConvNode* convNode = (ConvNode*)(gconvNode->_subnodes[index]);
+      convNode->_savedKernelsFormat = elementFormat;
+    }
+  } else if ((className != NULL) && (strcmp(className, "NeuronNode") == 0)) {
+    NeuronNode* neuronNode = (NeuronNode*)(layer);
+    neuronNode->_savedWeightsFormat = elementFormat;
+  } else {
+    fprintf(stderr, "Layer '%s' doesn't have any weights\n", layerName);
+    return 0;
+  }
+  return 1;
+}
+
+int jpcnn_prune_layer(void* networkHandle, const char* layerName, float sparsity) {
+  Graph* graph = (Graph*)(networkHandle);
+  if ((sparsity <= 0.0f) || (sparsity >= 1.0f)) {
+    fprintf(stderr, "The sparsity for layer '%s' should be between zero and one, but was %f\n", layerName, sparsity);
+    return 0;
+  }
+  int layerOffset;
+  if (!jpcnn_get_layer_offset(networkHandle, layerName, &layerOffset)) {
+    fprintf(stderr, "Couldn't find layer '%s'\n", layerName);
+    return 0;
+  }
+  BaseNode* layer = graph->_layers[(graph->_layersLength - 1) + layerOffset];
+  if ((layer->_className == NULL) || (strcmp(layer->_className, "NeuronNode") != 0)) {
+    fprintf(stderr, "Layer '%s' isn't fully connected\n", layerName);
+    return 0;
+  }
+  NeuronNode* neuronNode = (NeuronNode*)(layer);
+  const bool didPrune = neuronNode->prune(sparsity);
+
+  // Pruned layers don't use the 8-bit path's scratch space, so every session
+  // needs to lay out its memory again.
+  graph->_generation += 1;
+
+  if (!didPrune) {
+    return 0;
+  }
+  return 1;
+}
+
+int jpcnn_factorize_layer(void* networkHandle, const char* layerName, int rank, float energy) {
+  Graph* graph = (Graph*)(networkHandle);
+  if ((rank <= 0) && ((energy <= 0.0f) || (energy > 1.0f))) {
+    fprintf(stderr, "Layer '%s' needs either a rank, or an energy between zero and one, but the energy was %f\n", layerName, energy);
+    return 0;
+  }
+  int layerOffset;
+  if (!jpcnn_get_layer_offset(networkHandle, layerName, &layerOffset)) {
+    fprintf(stderr, "Couldn't find layer '%s'\n", layerName);
+    return 0;
+  }
+  BaseNode* layer = graph->_layers[(graph->_layersLength - 1) + layerOffset];
+  if ((layer->_className == NULL) || (strcmp(layer->_className, "NeuronNode") != 0)) {
+    fprintf(stderr, "Layer '%s' isn't fully connected\n", layerName);
+    return 0;
+  }
+  NeuronNode* neuronNode = (NeuronNode*)(layer);
+  const int usedRank = neuronNode->factorize(rank, energy);
+
+  // Factorized layers need scratch space for the first factor's results, so
+  // every session needs to lay out its memory again.
+  graph->_generation += 1;
+
+  return usedRank;
+}
+
 int jpcnn_save_predictor(const char* filename, void* predictorHandle) {
   SPredictorInfo* predictorInfo = (SPredictorInfo*)(predictorHandle);
   struct svm_model* model = predictorInfo->model;
@@ -235,4 +613,165 @@ float jpcnn_predict(void* predictorHandle, float* predictions, int predictionsLe
 }
 
 
-}
\ No newline at end of file
+}
+
+void prepare_images_in_session(Session* session, Buffer** inputs, int inputsCount, unsigned int flags, const int* tapOffsets, int tapsCount) {
+
+  assert(inputsCount > 0);
+  const bool doMultiSample = (flags & JPCNN_MULTISAMPLE);
+  const bool doRandomSample = (flags & JPCNN_RANDOM_SAMPLE);
+
+  PrepareInput* prepareInput = session->_graph->_preparationNode;
+
+  // All of the images are stacked into a single batch, so every layer's
+  // weights are only pulled through the cache once for the whole set. The
+  // prepared input and every layer's output live in the session's arenas, so
+  // the outputs stay valid until the next classification in the same session.
+  const int imageSize = prepareInput->_imageSize;
+  const int samplesPerImage = (doMultiSample ? 10 : 1);
+  const Dimensions preparedDims((inputsCount * samplesPerImage), imageSize, imageSize, 3);
+  session->prepareForInput(preparedDims, tapOffsets, tapsCount);
+  Buffer* preparedInput = session->_tensors[0];
+  const Dimensions samplesDims(samplesPerImage, imageSize, imageSize, 3);
+  const int valuesPerImage = samplesDims.elementCount();
+  for (int index = 0; index < inputsCount; index += 1) {
+    Buffer imageSamples(samplesDims, preparedInput, (index * valuesPerImage));
+    prepareInput->prepareInto(inputs[index], &imageSamples, session->_scratchArena, doRandomSample, &session->_randomSeed);
+  }
+}
+
+void classify_images_in_session(Session* session, Buffer** inputs, int inputsCount, unsigned int flags, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+
+  Graph* graph = session->_graph;
+  prepare_images_in_session(session, inputs, inputsCount, flags, &layerOffset, 1);
+  Buffer* preparedInput = session->_tensors[0];
+
+  Buffer* predictions = graph->run(session, preparedInput, layerOffset);
+  set_prediction_outputs(graph, predictions, inputsCount, layerOffset, outPredictionsValues, outPredictionsLength, outPredictionsNames, outPredictionsNamesLength);
+}
+
+void set_prediction_outputs(Graph* graph, Buffer* predictions, int inputsCount, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+  *outPredictionsValues = predictions->_data;
+  *outPredictionsLength = (predictions->_dims.elementCount() / inputsCount);
+  if (layerOffset == 0) {
+    *outPredictionsNames = graph->_labelNames;
+    *outPredictionsNamesLength = graph->_labelNamesLength;
+  } else {
+    *outPredictionsNames = NULL;
+    *outPredictionsNamesLength = predictions->_dims.removeDimensions(1).elementCount();
+  }
+}
+
+int classify_image_topk_in_session(Session* session, Buffer* input, unsigned int flags, int layerOffset, int k, JPCNNPrediction* outPredictions) {
+
+  Graph* graph = session->_graph;
+
+  // Softmax doesn't change the order of the values, so if only the ranking is
+  // wanted the run can stop at the layer before it. That's not true of the
+  // largest value across several samples though, since each sample's scores
+  // are scaled differently, so multisampled runs always include the softmax.
+  int runLayerOffset = layerOffset;
+  const int lastLayer = ((graph->_layersLength + layerOffset) - 1);
+  const bool canSkipSoftmax = ((flags & JPCNN_SKIP_SOFTMAX) && !(flags & JPCNN_MULTISAMPLE));
+  if (canSkipSoftmax && (lastLayer >= 0) && (lastLayer < graph->_layersLength)) {
+    const char* className = graph->_layers[lastLayer]->_className;
+    if ((className != NULL) && (strcmp(className, "MaxNode") == 0)) {
+      runLayerOffset -= 1;
+    }
+  }
+
+  prepare_images_in_session(session, &input, 1, flags, &runLayerOffset, 1);
+  Buffer* predictions = graph->run(session, session->_tensors[0], runLayerOffset);
+
+  // With multisampling there's a row of results for every sample, and each
+  // value is the largest one any sample gave it.
+  const int samplesCount = predictions->_dims[0];
+  const int valuesCount = predictions->_dims.removeDimensions(1).elementCount();
+  const jpfloat_t* const predictionsData = predictions->_data;
+
+  // The best values found so far are kept in order, and each new one is only
+  // compared against the smallest of them unless it beats it, so this is
+  // close to a single pass over the values when k is small.
+  int foundCount = 0;
+  const int wantedCount = MAX(0, MIN(k, valuesCount));
+  for (int index = 0; index < valuesCount; index += 1) {
+    jpfloat_t value = predictionsData[index];
+    for (int sample = 1; sample < samplesCount; sample += 1) {
+      value = fmaxf(value, predictionsData[(sample * valuesCount) + index]);
+    }
+    if ((foundCount == wantedCount) && ((wantedCount == 0) || (value <= outPredictions[foundCount - 1].value))) {
+      continue;
+    }
+    int insertIndex = MIN(foundCount, (wantedCount - 1));
+    while ((insertIndex > 0) && (outPredictions[insertIndex - 1].value < value)) {
+      outPredictions[insertIndex] = outPredictions[insertIndex - 1];
+      insertIndex -= 1;
+    }
+    outPredictions[insertIndex].index = index;
+    outPredictions[insertIndex].value = value;
+    foundCount = MIN((foundCount + 1), wantedCount);
+  }
+
+  const bool hasLabels = ((layerOffset == 0) && (graph->_labelNames != NULL));
+  for (int index = 0; index < foundCount; index += 1) {
+    const int labelIndex = outPredictions[index].index;
+    if (hasLabels && (labelIndex < graph->_labelNamesLength)) {
+      outPredictions[index].name = graph->_labelNames[labelIndex];
+    } else {
+      outPredictions[index].name = NULL;
+    }
+  }
+
+  return foundCount;
+}
+
+void classify_image_with_taps_in_session(Session* session, Buffer* input, unsigned int flags, const int* layerOffsets, int tapsCount, float** outTapsValues, int* outTapsLengths) {
+
+  // The tapped results are kept out of the way of later layers, and the run
+  // stops as soon as the deepest one is done.
+  prepare_images_in_session(session, &input, 1, flags, layerOffsets, tapsCount);
+  session->_graph->runPlan(session, session->_tensors[0]);
+
+  MemoryPlan* plan = session->_plan;
+  for (int index = 0; index < tapsCount; index += 1) {
+    Buffer* tap = session->_tensors[plan->_tapTensors[index]];
+    outTapsValues[index] = tap->_data;
+    outTapsLengths[index] = tap->_dims.elementCount();
+  }
+}
+
+void classify_activations_in_session(Session* session, Buffer* activations, int startLayerOffset, int layerOffset, float** outPredictionsValues, int* outPredictionsLength, char*** outPredictionsNames, int* outPredictionsNamesLength) {
+
+  Graph* graph = session->_graph;
+  const int startLayer = (graph->_layersLength + startLayerOffset);
+  const int endLayer = (graph->_layersLength + layerOffset);
+  if ((startLayer < 0) || (startLayer > endLayer) || (endLayer > graph->_layersLength)) {
+    fprintf(stderr, "jpcnn can't run from layer offset %d to %d\n", startLayerOffset, layerOffset);
+    *outPredictionsValues = NULL;
+    *outPredictionsLength = 0;
+    *outPredictionsNames = NULL;
+    *outPredictionsNamesLength = 0;
+    return;
+  }
+
+  // Work out what shape the skipped layers would have produced, so that
+  // activations saved from a different offset or network are caught here
+  // rather than part way through the run.
+  const int imageSize = graph->_preparationNode->_imageSize;
+  Dimensions expectedDims(activations->_dims[0], imageSize, imageSize, 3);
+  for (int index = 0; index < startLayer; index += 1) {
+    expectedDims = graph->_layers[index]->outputDimensions(expectedDims);
+  }
+  if (!(expectedDims == activations->_dims)) {
+    fprintf(stderr, "jpcnn expected activations of shape %s at layer offset %d, but found %s\n",
+      expectedDims.debugString(), startLayerOffset, activations->_dims.debugString());
+    *outPredictionsValues = NULL;
+    *outPredictionsLength = 0;
+    *outPredictionsNames = NULL;
+    *outPredictionsNamesLength = 0;
+    return;
+  }
+
+  Buffer* predictions = graph->runLayers(session, activations, startLayer, endLayer);
+  set_prediction_outputs(graph, predictions, 1, layerOffset, outPredictionsValues, outPredictionsLength, outPredictionsNames, outPredictionsNamesLength);
+}
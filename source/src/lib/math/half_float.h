@@ -0,0 +1,117 @@
+//
+//  half_float.h
+//  jpcnn
+//
+//  Conversions between single-precision floats and the two 16-bit float
+//  formats weights can be stored in, IEEE half-precision and bfloat16. These
+//  are the plain versions for odd values and places where speed doesn't
+//  matter, and matrix_dequantize_half() is the one to use for long runs.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#ifndef INCLUDE_HALF_FLOAT_H
+#define INCLUDE_HALF_FLOAT_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "jpcnn.h"
+
+// Wrappers around the raw bits, so that templated loops can tell the float
+// formats apart from 16-bit fixed-point values.
+typedef struct SHalfStruct {
+  uint16_t bits;
+} SHalf;
+
+typedef struct SBFloat16Struct {
+  uint16_t bits;
+} SBFloat16;
+
+static inline uint32_t half_float_bits(jpfloat_t value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+static inline jpfloat_t half_float_from_bits(uint32_t bits) {
+  jpfloat_t value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Moves the exponent and mantissa into place, and then fixes up the cases the
+// shift gets wrong. Infinities and NaNs need the largest exponent, and
+// denormals are renormalized by letting the floating-point unit subtract the
+// implicit leading one back out.
+static inline jpfloat_t half_to_float(uint16_t half) {
+  const uint32_t shiftedExponent = (0x7c00 << 13);
+  uint32_t bits = ((half & 0x7fff) << 13);
+  const uint32_t exponent = (shiftedExponent & bits);
+  bits += ((127 - 15) << 23);
+  if (exponent == shiftedExponent) {
+    bits += ((128 - 16) << 23);
+  } else if (exponent == 0) {
+    bits += (1 << 23);
+    bits = half_float_bits(half_float_from_bits(bits) - half_float_from_bits(113 << 23));
+  }
+  bits |= ((half & 0x8000) << 16);
+  return half_float_from_bits(bits);
+}
+
+// Rounds to the nearest half, with ties going to the even one. Values too big
+// to represent become infinities, and NaNs stay NaNs.
+static inline uint16_t float_to_half(jpfloat_t value) {
+  const uint32_t infinityBits = (255 << 23);
+  const uint32_t overflowBits = ((127 + 16) << 23);
+  const uint32_t denormalMagicBits = (((127 - 15) + (23 - 10) + 1) << 23);
+  uint32_t bits = half_float_bits(value);
+  const uint32_t sign = (bits & 0x80000000);
+  bits ^= sign;
+  uint32_t result;
+  if (bits >= overflowBits) {
+    result = ((bits > infinityBits) ? 0x7e00 : 0x7c00);
+  } else if (bits < (113 << 23)) {
+    // Adding the magic number shifts the mantissa down into the denormal
+    // position, with the hardware doing the rounding.
+    const jpfloat_t shifted = (half_float_from_bits(bits) + half_float_from_bits(denormalMagicBits));
+    result = (half_float_bits(shifted) - denormalMagicBits);
+  } else {
+    const uint32_t isMantissaOdd = ((bits >> 13) & 1);
+    bits += ((uint32_t)(15 - 127) << 23) + 0xfff;
+    bits += isMantissaOdd;
+    result = (bits >> 13);
+  }
+  return (uint16_t)(result | (sign >> 16));
+}
+
+static inline jpfloat_t bfloat16_to_float(uint16_t value) {
+  return half_float_from_bits((uint32_t)(value) << 16);
+}
+
+// Also rounds to nearest even, but leaves NaNs alone so that rounding can't
+// turn them into infinities.
+static inline uint16_t float_to_bfloat16(jpfloat_t value) {
+  const uint32_t bits = half_float_bits(value);
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    return (uint16_t)((bits >> 16) | 0x0040);
+  }
+  return (uint16_t)((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+static inline jpfloat_t half_format_to_float(uint16_t value, int elementFormat) {
+  if (elementFormat == JPElementFormatBFloat16) {
+    return bfloat16_to_float(value);
+  }
+  return half_to_float(value);
+}
+
+static inline uint16_t float_to_half_format(jpfloat_t value, int elementFormat) {
+  if (elementFormat == JPElementFormatBFloat16) {
+    return float_to_bfloat16(value);
+  }
+  return float_to_half(value);
+}
+
+#endif // INCLUDE_HALF_FLOAT_H
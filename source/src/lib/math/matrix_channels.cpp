@@ -14,6 +14,15 @@
 #include "buffer.h"
 
 Buffer* matrix_extract_channels(Buffer* input, int startChannel, int endChannel) {
+  const Dimensions inputDims = input->_dims;
+  Dimensions outputDims(inputDims);
+  outputDims._dims[outputDims._length - 1] = (endChannel - startChannel);
+  Buffer* output = new Buffer(outputDims);
+  matrix_extract_channels_into(input, startChannel, endChannel, output);
+  return output;
+}
+
+void matrix_extract_channels_into(Buffer* input, int startChannel, int endChannel, Buffer* output) {
 #ifdef DO_LOG_OPERATIONS
   fprintf(stderr, "matrix_extract_channels(input=[%s], startChannel=%d, endChannel=%d)\n",
     input->debugString(),
@@ -29,7 +38,7 @@ Buffer* matrix_extract_channels(Buffer* input, int startChannel, int endChannel)
 
   Dimensions outputDims(inputDims);
   outputDims._dims[outputDims._length - 1] = outputChannels;
-  Buffer* output = new Buffer(outputDims);
+  assert(output->_dims == outputDims);
 
   const jpfloat_t* const inputDataStart = input->_data;
   const jpfloat_t* const inputDataEnd = (inputDataStart + inputDims.elementCount());
@@ -49,8 +58,34 @@ Buffer* matrix_extract_channels(Buffer* input, int startChannel, int endChannel)
   fprintf(stderr, "matrix_extract_channels() result=[%s]\n",
     output->debugString());
 #endif // DO_LOG_OPERATIONS
+}
 
-  return output;
+void matrix_insert_channels(Buffer* input, Buffer* output, int startChannel) {
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_insert_channels(input=[%s], output=[%s], startChannel=%d)\n",
+    input->debugString(),
+    output->debugString(),
+    startChannel);
+#endif // DO_LOG_OPERATIONS
+
+  const Dimensions inputDims = input->_dims;
+  const Dimensions outputDims = output->_dims;
+  const int inputChannels = inputDims._dims[inputDims._length - 1];
+  const int outputChannels = outputDims._dims[outputDims._length - 1];
+  assert((startChannel + inputChannels) <= outputChannels);
+  assert((inputDims.elementCount() / inputChannels) == (outputDims.elementCount() / outputChannels));
+
+  const jpfloat_t* const inputDataStart = input->_data;
+  const jpfloat_t* const inputDataEnd = (inputDataStart + inputDims.elementCount());
+  const size_t bytesInInputRow = (inputChannels * sizeof(jpfloat_t));
+
+  const jpfloat_t* inputData = inputDataStart;
+  jpfloat_t* outputData = (output->_data + startChannel);
+  while (inputData < inputDataEnd) {
+    memcpy(outputData, inputData, bytesInInputRow);
+    inputData += inputChannels;
+    outputData += outputChannels;
+  }
 }
 
 Buffer* matrix_join_channels(Buffer** inputs, int inputsCount) {
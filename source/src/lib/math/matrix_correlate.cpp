@@ -14,118 +14,258 @@
 
 #include "buffer.h"
 #include "dimensions.h"
+#include "thread_pool.h"
 
 #if defined(USE_QPU_GEMM)
 #include "qpu_gemm.h"
 #endif // USE_QPU_GEMM
 
+Dimensions matrix_correlate_output_dims(const Dimensions& inputDims, int kernelWidth, int kernelCount, int stride) {
+  // We're expecting (# of images, height, width, # of channels)
+  assert(inputDims._length == 4);
+
+  const int imageCount = inputDims[0];
+  const int inputWidth = inputDims[2];
+  const int inputHeight = inputDims[1];
+
+  const int outputWidth = (int)(ceilf((inputWidth - kernelWidth) / (jpfloat_t)stride) + 1);
+  const int outputHeight = (int)(ceilf((inputHeight - kernelWidth) / (jpfloat_t)stride) + 1);
+  const int outputChannels = kernelCount;
+  const Dimensions outputDims(imageCount, outputHeight, outputWidth, outputChannels);
+  return outputDims;
+}
+
+Buffer* matrix_correlate(Buffer* input, int margin, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed) {
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(input->_dims, margin, margin);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride);
+  Buffer* output = new Buffer(outputDims);
+  const size_t scratchByteCount = matrix_correlate_scratch_bytes(input->_dims, margin, kernelWidth, stride);
+  Buffer* scratch = new Buffer(Dimensions((int)(scratchByteCount / sizeof(jpfloat_t))));
+  matrix_correlate_into(input, margin, kernels, kernelWidth, kernelCount, stride, areKernelsTransposed, output, scratch);
+  delete scratch;
+  return output;
+}
+
 #ifdef USE_GEMM
 
-static Buffer* patches_into_rows(Buffer* input, int kernelWidth, int stride);
+static Dimensions patches_into_rows_output_dims(const Dimensions& inputDims, int margin, int kernelWidth, int stride);
+static void patches_into_rows(Buffer* input, int margin, int kernelWidth, int stride, Buffer* output);
+static void patch_rows_into(Buffer* input, int margin, int kernelWidth, int stride, int imageIndex, int startPatchY, int patchRowsCount, jpfloat_t* outputData);
+static void patch_rows_threaded(Buffer* input, int margin, int kernelWidth, int stride, int imageIndex, int startPatchY, int patchRowsCount, jpfloat_t* outputData);
+static void gemm_patches(Buffer* kernels, int kernelCount, bool areKernelsTransposed, Buffer* patches, int patchesCount, int valuesPerKernel, Buffer* output, const SGemmEpilogue* epilogue);
+#if defined(USE_NATIVE_GEMM)
+static void gemm_implicit_patches(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, jpfloat_t* outputData, const SGemmEpilogue* epilogue);
+#endif // USE_NATIVE_GEMM
+
+Dimensions patches_into_rows_output_dims(const Dimensions& inputDims, int margin, int kernelWidth, int stride) {
+  const int imageCount = inputDims[0];
+  const int inputWidth = (inputDims[2] + (margin * 2));
+  const int inputHeight = (inputDims[1] + (margin * 2));
+  const int inputChannels = inputDims[3];
+
+  const int pixelsPerKernel = (kernelWidth * kernelWidth);
+  const int valuesPerKernel = (pixelsPerKernel * inputChannels);
 
-Buffer* patches_into_rows(Buffer* input, int kernelWidth, int stride) {
+  const int patchesAcross = (int)(ceilf((inputWidth - kernelWidth) / (jpfloat_t)stride) + 1);
+  const int patchesDown = (int)(ceilf((inputHeight - kernelWidth) / (jpfloat_t)stride) + 1);
+  const Dimensions outputDims(imageCount, (patchesDown * patchesAcross), valuesPerKernel);
+  return outputDims;
+}
+
+size_t matrix_correlate_scratch_bytes(const Dimensions& inputDims, int margin, int kernelWidth, int stride) {
+  const Dimensions patchesDims = patches_into_rows_output_dims(inputDims, margin, kernelWidth, stride);
+  return (patchesDims.elementCount() * sizeof(jpfloat_t));
+}
+
+size_t matrix_correlate_rows_scratch_bytes(const Dimensions& inputDims, int margin, int kernelWidth, int stride, int rowCount) {
+  const Dimensions imageDims(1, inputDims[1], inputDims[2], inputDims[3]);
+  const Dimensions patchesDims = patches_into_rows_output_dims(imageDims, margin, kernelWidth, stride);
+  const Dimensions imageWithMarginDims = matrix_insert_margin_output_dims(imageDims, margin, margin);
+  const int patchesDown = matrix_correlate_output_dims(imageWithMarginDims, kernelWidth, 1, stride)[1];
+  const int patchRowsCount = MIN(rowCount, patchesDown);
+  return (((patchesDims.elementCount() / patchesDown) * patchRowsCount) * sizeof(jpfloat_t));
+}
+
+void patches_into_rows(Buffer* input, int margin, int kernelWidth, int stride, Buffer* output) {
 #ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "patches_into_rows(input=[%s], kernelWidth=%d, stride=%d)\n",
-    input->debugString(), kernelWidth, stride);
+  fprintf(stderr, "patches_into_rows(input=[%s], margin=%d, kernelWidth=%d, stride=%d)\n",
+    input->debugString(), margin, kernelWidth, stride);
 #endif // DO_LOG_OPERATIONS
 
   const Dimensions inputDims = input->_dims;
   // We're expecting (# of images, height, width, # of channels)
   assert(inputDims._length == 4);
+  assert(output->_dims == patches_into_rows_output_dims(inputDims, margin, kernelWidth, stride));
 
   const int imageCount = inputDims[0];
+  const int inputHeight = (inputDims[1] + (margin * 2));
+  const int patchesDown = (int)(ceilf((inputHeight - kernelWidth) / (jpfloat_t)stride) + 1);
+
+  const int valuesPerImage = output->_dims.removeDimensions(1).elementCount();
+  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
+    jpfloat_t* outputData = (output->_data + (imageIndex * valuesPerImage));
+    patch_rows_threaded(input, margin, kernelWidth, stride, imageIndex, 0, patchesDown, outputData);
+  }
+
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "patches_into_rows() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+// Writes out the patches for a range of rows in one image. Patch positions are
+// in the coordinates of the image with its margin, so the ones that overlap
+// the margin or hang off the far edges get zeros for the parts outside the
+// input, while the ones wholly inside are copied a kernel row at a time.
+void patch_rows_into(Buffer* input, int margin, int kernelWidth, int stride, int imageIndex, int startPatchY, int patchRowsCount, jpfloat_t* outputData) {
+  const Dimensions inputDims = input->_dims;
+
   const int inputWidth = inputDims[2];
   const int inputHeight = inputDims[1];
   const int inputChannels = inputDims[3];
 
-  const int pixelsPerKernel = (kernelWidth * kernelWidth);
-  const int valuesPerKernel = (pixelsPerKernel * inputChannels);
+  const int patchesAcross = (int)(ceilf(((inputWidth + (margin * 2)) - kernelWidth) / (jpfloat_t)stride) + 1);
+  const int endPatchY = (startPatchY + patchRowsCount);
 
-  const int patchesAcross = (int)(ceilf((inputWidth - kernelWidth) / (jpfloat_t)stride) + 1);
-  const int patchesDown = (int)(ceilf((inputHeight - kernelWidth) / (jpfloat_t)stride) + 1);
-  const Dimensions outputDims(imageCount, (patchesDown * patchesAcross), valuesPerKernel);
-  Buffer* output = new Buffer(outputDims);
-
-  const jpfloat_t* const inputStart = input->_data;
-  jpfloat_t* outputData = output->_data;
+  const jpfloat_t* const imageStart = (input->_data + inputDims.offset(imageIndex, 0, 0, 0));
 
   const int valuesPerInputRow = inputDims.removeDimensions(2).elementCount();
   const int valuesPerKernelRow = (kernelWidth * inputChannels);
   const size_t bytesPerKernelRow = (valuesPerKernelRow * sizeof(jpfloat_t));
 
-  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
-    for (int patchY = 0; patchY < patchesDown; patchY += 1) {
-      const int inputOriginY = (patchY * stride);
-      const int inputEndY = (inputOriginY + kernelWidth);
-      for (int patchX = 0; patchX < patchesAcross; patchX += 1) {
-        const int inputOriginX = (patchX * stride);
-        const int inputEndX = (inputOriginX + kernelWidth);
-        const int inputPatchOffset = inputDims.offset(imageIndex, inputOriginY, inputOriginX, 0);
-        const jpfloat_t* const inputPatchStart = (inputStart + inputPatchOffset);
-        const jpfloat_t* inputData = inputPatchStart;
-        if ((inputEndY <= inputHeight) && (inputEndX <= inputWidth)) {
-          for (int row = 0; row < kernelWidth; row += 1) {
-            memcpy(outputData, inputData, bytesPerKernelRow);
-            outputData += valuesPerKernelRow;
-            inputData += valuesPerInputRow;
-          }
-        } else {
-          size_t bytesToCopy;
-          if (inputEndX > inputWidth) {
-            bytesToCopy = ((kernelWidth - (inputEndX - inputWidth)) * inputChannels * sizeof(jpfloat_t));
-          } else {
-            bytesToCopy = bytesPerKernelRow;
-          }
-          const size_t bytesToZero = (bytesPerKernelRow - bytesToCopy);
-          int rowsToCopy;
-          if (inputEndY > inputHeight) {
-            rowsToCopy = (kernelWidth - (inputEndY - inputHeight));
+  for (int patchY = startPatchY; patchY < endPatchY; patchY += 1) {
+    const int inputOriginY = ((patchY * stride) - margin);
+    const int inputEndY = (inputOriginY + kernelWidth);
+    const bool isRowInside = ((inputOriginY >= 0) && (inputEndY <= inputHeight));
+    for (int patchX = 0; patchX < patchesAcross; patchX += 1) {
+      const int inputOriginX = ((patchX * stride) - margin);
+      const int inputEndX = (inputOriginX + kernelWidth);
+      if (isRowInside && (inputOriginX >= 0) && (inputEndX <= inputWidth)) {
+        const jpfloat_t* inputData = (imageStart + (inputOriginY * valuesPerInputRow) + (inputOriginX * inputChannels));
+        for (int row = 0; row < kernelWidth; row += 1) {
+          memcpy(outputData, inputData, bytesPerKernelRow);
+          outputData += valuesPerKernelRow;
+          inputData += valuesPerInputRow;
+        }
+      } else {
+        const int copyStartX = MAX(inputOriginX, 0);
+        const int copyEndX = MIN(inputEndX, inputWidth);
+        const int zerosBefore = ((copyStartX - inputOriginX) * inputChannels);
+        const int valuesToCopy = (MAX((copyEndX - copyStartX), 0) * inputChannels);
+        const int zerosAfter = (valuesPerKernelRow - (zerosBefore + valuesToCopy));
+        for (int row = 0; row < kernelWidth; row += 1) {
+          const int inputY = (inputOriginY + row);
+          if ((inputY < 0) || (inputY >= inputHeight) || (valuesToCopy == 0)) {
+            memset(outputData, 0, bytesPerKernelRow);
           } else {
-            rowsToCopy = kernelWidth;
-          }
-          for (int row = 0; row < kernelWidth; row += 1) {
-            if (row < rowsToCopy) {
-              memcpy(outputData, inputData, bytesToCopy);
-              if (bytesToZero > 0) {
-                memset(outputData + bytesToCopy, 0, bytesToZero);
-              }
-              outputData += valuesPerKernelRow;
-              inputData += valuesPerInputRow;
-            } else {
-              memset(outputData, 0, bytesPerKernelRow);
-              outputData += valuesPerKernelRow;
+            const jpfloat_t* inputData = (imageStart + (inputY * valuesPerInputRow) + (copyStartX * inputChannels));
+            if (zerosBefore > 0) {
+              memset(outputData, 0, (zerosBefore * sizeof(jpfloat_t)));
+            }
+            memcpy((outputData + zerosBefore), inputData, (valuesToCopy * sizeof(jpfloat_t)));
+            if (zerosAfter > 0) {
+              memset((outputData + zerosBefore + valuesToCopy), 0, (zerosAfter * sizeof(jpfloat_t)));
             }
           }
+          outputData += valuesPerKernelRow;
         }
       }
     }
   }
 
-#ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "patches_into_rows() result=[%s]\n",
-    output->debugString());
-#endif // DO_LOG_OPERATIONS
+}
 
-  return output;
+typedef struct SPatchRowsTaskStruct {
+  Buffer* input;
+  int margin;
+  int kernelWidth;
+  int stride;
+  int imageIndex;
+  int startPatchY;
+  jpfloat_t* outputData;
+  int valuesPerPatchRow;
+} SPatchRowsTask;
+
+static void patch_rows_task(void* cookie, int startIndex, int endIndex) {
+  const SPatchRowsTask* task = (const SPatchRowsTask*)(cookie);
+  jpfloat_t* outputData = (task->outputData + (startIndex * task->valuesPerPatchRow));
+  patch_rows_into(task->input, task->margin, task->kernelWidth, task->stride, task->imageIndex, (task->startPatchY + startIndex), (endIndex - startIndex), outputData);
+}
+
+// Each row of patches is copied out independently, so they're shared out
+// across the thread pool a row at a time.
+void patch_rows_threaded(Buffer* input, int margin, int kernelWidth, int stride, int imageIndex, int startPatchY, int patchRowsCount, jpfloat_t* outputData) {
+  const Dimensions inputDims = input->_dims;
+  const int inputWidth = (inputDims[2] + (margin * 2));
+  const int inputChannels = inputDims[3];
+  const int patchesAcross = (int)(ceilf((inputWidth - kernelWidth) / (jpfloat_t)stride) + 1);
+
+  SPatchRowsTask task;
+  task.input = input;
+  task.margin = margin;
+  task.kernelWidth = kernelWidth;
+  task.stride = stride;
+  task.imageIndex = imageIndex;
+  task.startPatchY = startPatchY;
+  task.outputData = outputData;
+  task.valuesPerPatchRow = (patchesAcross * kernelWidth * kernelWidth * inputChannels);
+  thread_pool_parallel_for(patchRowsCount, 1, patch_rows_task, &task);
 }
 
-Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed) {
+void matrix_correlate_into(Buffer* input, int margin, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
 #ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "matrix_correlate[GEMM](input=[%s], kernels=[%s], kernelWidth=%d, kernelCount=%d, stride=%d)\n",
-    input->debugString(), kernels->debugString(), kernelWidth, kernelCount, stride);
+  fprintf(stderr, "matrix_correlate[GEMM](input=[%s], margin=%d, kernels=[%s], kernelWidth=%d, kernelCount=%d, stride=%d)\n",
+    input->debugString(), margin, kernels->debugString(), kernelWidth, kernelCount, stride);
 #endif // DO_LOG_OPERATIONS
 
   const Dimensions inputDims = input->_dims;
   // We're expecting (# of images, height, width, # of channels)
   assert(inputDims._length == 4);
 
-  const int imageCount = inputDims[0];
-  const int inputWidth = inputDims[2];
-  const int inputHeight = inputDims[1];
   const int inputChannels = inputDims[3];
 
   const int pixelsPerKernel = (kernelWidth * kernelWidth);
   const int valuesPerKernel = (pixelsPerKernel * inputChannels);
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  assert(output->_dims == matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride));
+
+  const Dimensions patchesDims = patches_into_rows_output_dims(inputDims, margin, kernelWidth, stride);
+  Buffer patchesView(patchesDims, scratch, 0);
+  Buffer* patches = &patchesView;
+  patches_into_rows(input, margin, kernelWidth, stride, patches);
+
+  const int patchesCount = (patchesDims[0] * patchesDims[1]);
+  gemm_patches(kernels, kernelCount, areKernelsTransposed, patches, patchesCount, valuesPerKernel, output, epilogue);
+
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_correlate[GEMM]() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+void matrix_correlate_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
+  const Dimensions inputDims = input->_dims;
+  // We're expecting (# of images, height, width, # of channels)
+  assert(inputDims._length == 4);
+
+  const int inputChannels = inputDims[3];
+  const int valuesPerKernel = (kernelWidth * kernelWidth * inputChannels);
+
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions fullOutputDims = matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride);
+  const int outputWidth = fullOutputDims[2];
+  assert((startRow >= 0) && ((startRow + rowCount) <= fullOutputDims[1]));
+  assert(output->_dims == Dimensions(1, rowCount, outputWidth, kernelCount));
+
+  const int patchesCount = (rowCount * outputWidth);
+  Buffer patchesView(Dimensions(patchesCount, valuesPerKernel), scratch, 0);
+  Buffer* patches = &patchesView;
+  patch_rows_threaded(input, margin, kernelWidth, stride, imageIndex, startRow, rowCount, patches->_data);
+
+  gemm_patches(kernels, kernelCount, areKernelsTransposed, patches, patchesCount, valuesPerKernel, output, epilogue);
+}
+
+void gemm_patches(Buffer* kernels, int kernelCount, bool areKernelsTransposed, Buffer* patches, int patchesCount, int valuesPerKernel, Buffer* output, const SGemmEpilogue* epilogue) {
   if (areKernelsTransposed) {
     Dimensions expectedKernelsDims(kernelCount, valuesPerKernel);
     assert(expectedKernelsDims == kernels->_dims);
@@ -134,14 +274,6 @@ Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int ke
     assert(expectedKernelsDims == kernels->_dims);
   }
 
-  const int outputWidth = (int)(ceilf((inputWidth - kernelWidth) / (jpfloat_t)stride) + 1);
-  const int outputHeight = (int)(ceilf((inputHeight - kernelWidth) / (jpfloat_t)stride) + 1);
-  const int outputChannels = kernelCount;
-  const Dimensions outputDims(imageCount, outputHeight, outputWidth, outputChannels);
-  Buffer* output = new Buffer(outputDims);
-
-  Buffer* patches = patches_into_rows(input, kernelWidth, stride);
-
   const int order = JPCblasColMajor;
   int transposeA;
   if (areKernelsTransposed) {
@@ -152,8 +284,8 @@ Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int ke
   const int transposeB = JPCblasNoTrans;
 
   const int m = kernelCount;
-  const int n = (patches->_dims[1] * patches->_dims[0]);
-  const int k = patches->_dims[2];
+  const int n = patchesCount;
+  const int k = valuesPerKernel;
   const float alpha = 1.0f;
   int lda;
   if (areKernelsTransposed) {
@@ -181,7 +313,8 @@ Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int ke
       ldb,
       beta,
       output->_data,
-      ldc
+      ldc,
+      epilogue
     );
 #else // USE_QPU_GEMM
     qpu_cblas_sgemm(
@@ -200,6 +333,9 @@ Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int ke
       output->_gpuMemoryBase,
       ldc
     );
+    if (epilogue != NULL) {
+      matrix_gemm_epilogue(m, n, output->_data, ldc, epilogue);
+    }
 #endif // USE_QPU_GEMM
   } else {
 #if !defined(USE_QPU_GEMM)
@@ -214,13 +350,17 @@ Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int ke
       kernels->_quantizedData,
       kernels->_min,
       kernels->_max,
+      kernels->_rowMins,
+      kernels->_rowScales,
       kernels->_bitsPerElement,
+      kernels->_elementFormat,
       lda,
       patches->_data,
       ldb,
       beta,
       output->_data,
-      ldc
+      ldc,
+      epilogue
     );
 #else
     qpu_cblas_sgemm_fixed(
@@ -242,25 +382,107 @@ Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int ke
       output->_gpuMemoryBase,
       ldc
     );
+    if (epilogue != NULL) {
+      matrix_gemm_epilogue(m, n, output->_data, ldc, epilogue);
+    }
 #endif
   }
+}
 
-  delete patches;
+#if defined(USE_NATIVE_GEMM)
 
+void matrix_correlate_implicit_into(Buffer* input, int margin, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, const SGemmEpilogue* epilogue) {
 #ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "matrix_correlate[GEMM]() result=[%s]\n",
+  fprintf(stderr, "matrix_correlate[implicit GEMM](input=[%s], margin=%d, kernels=[%s], kernelWidth=%d, kernelCount=%d, stride=%d)\n",
+    input->debugString(), margin, kernels->debugString(), kernelWidth, kernelCount, stride);
+#endif // DO_LOG_OPERATIONS
+
+  const Dimensions inputDims = input->_dims;
+  // We're expecting (# of images, height, width, # of channels)
+  assert(inputDims._length == 4);
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = output->_dims;
+  assert(outputDims == matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride));
+
+  const int imageCount = inputDims[0];
+  const int outputHeight = outputDims[1];
+  const int valuesPerOutputImage = outputDims.removeDimensions(1).elementCount();
+  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
+    jpfloat_t* outputData = (output->_data + (imageIndex * valuesPerOutputImage));
+    gemm_implicit_patches(input, margin, imageIndex, 0, outputHeight, kernels, kernelWidth, kernelCount, stride, areKernelsTransposed, outputData, epilogue);
+  }
+
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_correlate[implicit GEMM]() result=[%s]\n",
     output->debugString());
 #endif // DO_LOG_OPERATIONS
+}
 
-  return output;
+void matrix_correlate_implicit_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, const SGemmEpilogue* epilogue) {
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(input->_dims, margin, margin);
+  const Dimensions fullOutputDims = matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride);
+  assert((startRow >= 0) && ((startRow + rowCount) <= fullOutputDims[1]));
+  assert(output->_dims == Dimensions(1, rowCount, fullOutputDims[2], kernelCount));
+  gemm_implicit_patches(input, margin, imageIndex, startRow, rowCount, kernels, kernelWidth, kernelCount, stride, areKernelsTransposed, output->_data, epilogue);
 }
 
+void gemm_implicit_patches(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, jpfloat_t* outputData, const SGemmEpilogue* epilogue) {
+  const Dimensions inputDims = input->_dims;
+  const int inputHeight = inputDims[1];
+  const int inputWidth = inputDims[2];
+  const int inputChannels = inputDims[3];
+  const int valuesPerKernel = (kernelWidth * kernelWidth * inputChannels);
+  if (areKernelsTransposed) {
+    Dimensions expectedKernelsDims(kernelCount, valuesPerKernel);
+    assert(expectedKernelsDims == kernels->_dims);
+  } else {
+    Dimensions expectedKernelsDims(valuesPerKernel, kernelCount);
+    assert(expectedKernelsDims == kernels->_dims);
+  }
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const int outputWidth = matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride)[2];
+
+  SGemmPatches patches;
+  patches.image = (input->_data + (imageIndex * inputHeight * inputWidth * inputChannels));
+  patches.inputHeight = inputHeight;
+  patches.inputWidth = inputWidth;
+  patches.inputChannels = inputChannels;
+  patches.margin = margin;
+  patches.kernelWidth = kernelWidth;
+  patches.stride = stride;
+  patches.outputWidth = outputWidth;
+  patches.startRow = startRow;
+
+  const int transposeA = (areKernelsTransposed ? JPCblasTrans : JPCblasNoTrans);
+  const int m = kernelCount;
+  const int n = (rowCount * outputWidth);
+  const int k = valuesPerKernel;
+  const int lda = (areKernelsTransposed ? k : m);
+  if (kernels->_bitsPerElement == 32) {
+    matrix_gemm_patches(transposeA, m, n, k, 1.0f, kernels->_data, 0.0f, 0.0f, NULL, NULL, 32, JPElementFormatLinear, lda, &patches, 0.0f, outputData, m, epilogue);
+  } else {
+    matrix_gemm_patches(transposeA, m, n, k, 1.0f, kernels->_quantizedData, kernels->_min, kernels->_max, kernels->_rowMins, kernels->_rowScales, kernels->_bitsPerElement, kernels->_elementFormat, lda, &patches, 0.0f, outputData, m, epilogue);
+  }
+}
+
+#endif // USE_NATIVE_GEMM
+
 #else // Use the naive algorithm
 
-Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int kernelCount, int stride) {
+static void correlate_rows(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, jpfloat_t* outputData, const SGemmEpilogue* epilogue);
+
+size_t matrix_correlate_scratch_bytes(const Dimensions& inputDims, int margin, int kernelWidth, int stride) {
+  return 0;
+}
+
+size_t matrix_correlate_rows_scratch_bytes(const Dimensions& inputDims, int margin, int kernelWidth, int stride, int rowCount) {
+  return 0;
+}
+
+void matrix_correlate_into(Buffer* input, int margin, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
 #ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "matrix_correlate(input=[%s], kernels=[%s], kernelWidth=%d, kernelCount=%d, stride=%d)\n",
-    input->debugString(), kernels->debugString(), kernelWidth, kernelCount, stride);
+  fprintf(stderr, "matrix_correlate(input=[%s], margin=%d, kernels=[%s], kernelWidth=%d, kernelCount=%d, stride=%d)\n",
+    input->debugString(), margin, kernels->debugString(), kernelWidth, kernelCount, stride);
 #endif // DO_LOG_OPERATIONS
 
   const Dimensions inputDims = input->_dims;
@@ -268,8 +490,6 @@ Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int ke
   assert(inputDims._length == 4);
 
   const int imageCount = inputDims[0];
-  const int inputWidth = inputDims[2];
-  const int inputHeight = inputDims[1];
   const int inputChannels = inputDims[3];
 
   const int pixelsPerKernel = (kernelWidth * kernelWidth);
@@ -277,58 +497,90 @@ Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int ke
   Dimensions expectedKernelsDims(valuesPerKernel, kernelCount);
   assert(expectedKernelsDims == kernels->_dims);
 
-  const int outputWidth = (int)(ceilf((inputWidth - kernelWidth) / (jpfloat_t)stride) + 1);
-  const int outputHeight = (int)(ceilf((inputHeight - kernelWidth) / (jpfloat_t)stride) + 1);
-  const int outputChannels = kernelCount;
-  const Dimensions outputDims(imageCount, outputHeight, outputWidth, outputChannels);
-  Buffer* output = new Buffer(outputDims);
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = output->_dims;
+  assert(outputDims == matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride));
+  const int outputHeight = outputDims[1];
+  const int valuesPerOutputImage = outputDims.removeDimensions(1).elementCount();
 
   for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
-    for (int outputY = 0; outputY < outputHeight; outputY += 1) {
-      const int inputOriginY = (outputY * stride);
-      for (int outputX = 0; outputX < outputWidth; outputX += 1) {
-        const int inputOriginX = (outputX * stride);
-        for (int outputChannel = 0; outputChannel < outputChannels; outputChannel += 1) {
-          jpfloat_t accumulated = 0.0f;
-          for (int kernelY = 0; kernelY < kernelWidth; kernelY += 1) {
-            const int inputY = (inputOriginY + kernelY);
-            if (inputY >= inputHeight) {
+    jpfloat_t* outputData = (output->_data + (imageIndex * valuesPerOutputImage));
+    correlate_rows(input, margin, imageIndex, 0, outputHeight, kernels, kernelWidth, kernelCount, stride, outputData, epilogue);
+  }
+
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_correlate() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+void matrix_correlate_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(input->_dims, margin, margin);
+  const Dimensions fullOutputDims = matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride);
+  assert((startRow >= 0) && ((startRow + rowCount) <= fullOutputDims[1]));
+  assert(output->_dims == Dimensions(1, rowCount, fullOutputDims[2], kernelCount));
+  correlate_rows(input, margin, imageIndex, startRow, rowCount, kernels, kernelWidth, kernelCount, stride, output->_data, epilogue);
+}
+
+// Positions are in the coordinates of the image with its margin, and any
+// kernel values that fall outside the input itself are skipped.
+void correlate_rows(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, jpfloat_t* outputData, const SGemmEpilogue* epilogue) {
+  const Dimensions inputDims = input->_dims;
+  const int inputWidth = inputDims[2];
+  const int inputHeight = inputDims[1];
+  const int inputChannels = inputDims[3];
+
+  const int pixelsPerKernel = (kernelWidth * kernelWidth);
+  const int valuesPerKernel = (pixelsPerKernel * inputChannels);
+  Dimensions expectedKernelsDims(valuesPerKernel, kernelCount);
+  assert(expectedKernelsDims == kernels->_dims);
+
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride);
+  const int outputWidth = outputDims[2];
+  const int outputChannels = outputDims[3];
+  const int endRow = (startRow + rowCount);
+
+  for (int outputY = startRow; outputY < endRow; outputY += 1) {
+    const int inputOriginY = ((outputY * stride) - margin);
+    for (int outputX = 0; outputX < outputWidth; outputX += 1) {
+      const int inputOriginX = ((outputX * stride) - margin);
+      for (int outputChannel = 0; outputChannel < outputChannels; outputChannel += 1) {
+        jpfloat_t accumulated = 0.0f;
+        for (int kernelY = 0; kernelY < kernelWidth; kernelY += 1) {
+          const int inputY = (inputOriginY + kernelY);
+          if ((inputY < 0) || (inputY >= inputHeight)) {
+            continue;
+          }
+          for (int kernelX = 0; kernelX < kernelWidth; kernelX += 1) {
+            const int inputX = (inputOriginX + kernelX);
+            if ((inputX < 0) || (inputX >= inputWidth)) {
               continue;
             }
-            for (int kernelX = 0; kernelX < kernelWidth; kernelX += 1) {
-              const int inputX = (inputOriginX + kernelX);
-              if (inputX >= inputWidth) {
-                continue;
-              }
-              for (int kernelChannel = 0; kernelChannel < inputChannels; kernelChannel += 1) {
-                const int kernelsOffset = (
-                  (kernelY * kernelWidth * inputChannels * kernelCount) +
-                  (kernelX * inputChannels * kernelCount) +
-                  (kernelChannel * kernelCount) +
-                  outputChannel);
-                const jpfloat_t kernelValue = *(kernels->_data + kernelsOffset);
-                assert(!isnan(kernelValue));
-                const int inputOffset = inputDims.offset(imageIndex, inputY, inputX, kernelChannel);
-                const jpfloat_t inputValue = *(input->_data + inputOffset);
-                assert(!isnan(inputValue));
-                accumulated += (kernelValue * inputValue);
-              }
+            for (int kernelChannel = 0; kernelChannel < inputChannels; kernelChannel += 1) {
+              const int kernelsOffset = (
+                (kernelY * kernelWidth * inputChannels * kernelCount) +
+                (kernelX * inputChannels * kernelCount) +
+                (kernelChannel * kernelCount) +
+                outputChannel);
+              const jpfloat_t kernelValue = *(kernels->_data + kernelsOffset);
+              assert(!isnan(kernelValue));
+              const int inputOffset = inputDims.offset(imageIndex, inputY, inputX, kernelChannel);
+              const jpfloat_t inputValue = *(input->_data + inputOffset);
+              assert(!isnan(inputValue));
+              accumulated += (kernelValue * inputValue);
             }
           }
-          const int outputOffset = outputDims.offset(imageIndex, outputY, outputX, outputChannel);
-          assert(!isnan(accumulated));
-          *(output->_data + outputOffset) = accumulated;
         }
+        assert(!isnan(accumulated));
+        *outputData = accumulated;
+        outputData += 1;
+      }
+      if (epilogue != NULL) {
+        matrix_gemm_epilogue(outputChannels, 1, (outputData - outputChannels), outputChannels, epilogue);
       }
     }
   }
-
-#ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "matrix_correlate() result=[%s]\n",
-    output->debugString());
-#endif // DO_LOG_OPERATIONS
-
-  return output;
 }
 
 #endif // USE_GEMM
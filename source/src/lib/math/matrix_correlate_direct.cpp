@@ -0,0 +1,472 @@
+//
+//  matrix_correlate_direct.cpp
+//  jpcnn
+//
+//  Runs convolutions straight from the NHWC input, instead of copying every
+//  patch out into a row and calling GEMM. For small filters that copy is
+//  several times the size of the input, so skipping it keeps the working set
+//  of the mid-network layers down to the input, the weights and the output.
+//  The kernels are rearranged ahead of time into blocks of output channels,
+//  and each call to a micro-kernel accumulates one block of channels for a
+//  run of output pixels in registers. Pixels that fall in the margin or off
+//  the edge of the input read from a row of zeros, so no padded copy of the
+//  input is needed either.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "matrix_ops.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "cpu_features.h"
+#include "thread_pool.h"
+
+#if defined(USE_CPU_DISPATCH)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH
+
+// How many output channels each micro-kernel call works on. The packed
+// kernels are padded with zeros up to a whole number of blocks.
+static const int kDirectChannelBlock = 16;
+// The widest run of output pixels any of the micro-kernels handles, and the
+// largest filter the tap table has room for.
+static const int kDirectMaxTilePixels = 12;
+static const int kDirectMaxKernelWidth = 11;
+static const int kDirectMaxTaps = (kDirectMaxKernelWidth * kDirectMaxKernelWidth);
+
+// taps holds a pointer to the first input channel for every tap of every
+// pixel in the tile, tap by tap, and outTile gets kDirectChannelBlock results
+// for each pixel.
+typedef void (*DirectKernelFunction)(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile);
+
+typedef struct SDirectKernelStruct {
+  int tilePixels;
+  DirectKernelFunction function;
+} SDirectKernel;
+
+typedef struct SDirectTaskStruct {
+  const jpfloat_t* input;
+  int inputHeight;
+  int inputWidth;
+  int inputChannels;
+  int imageIndex;
+  int margin;
+  int stride;
+  int kernelWidth;
+  int kernelCount;
+  const jpfloat_t* packedKernels;
+  const jpfloat_t* zeros;
+  int startRow;
+  int rowCount;
+  int outputWidth;
+  int tilesCount;
+  jpfloat_t* outputRows;
+  const SGemmEpilogue* epilogue;
+  const SDirectKernel* kernel;
+} SDirectTask;
+
+static const SDirectKernel* direct_kernel_for_current_cpu();
+static void correlate_direct_rows(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* packedKernels, int kernelWidth, int kernelCount, int stride, jpfloat_t* outputRows, Buffer* scratch, const SGemmEpilogue* epilogue);
+static void correlate_direct_task(void* cookie, int startIndex, int endIndex);
+static void direct_kernel_generic(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile);
+#if defined(USE_CPU_DISPATCH)
+static void direct_kernel_sse41(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile);
+static void direct_kernel_avx2(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile);
+static void direct_kernel_avx512(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile);
+#endif // USE_CPU_DISPATCH
+
+static const int kDirectGenericTilePixels = 4;
+static const SDirectKernel g_directGenericKernel = {kDirectGenericTilePixels, direct_kernel_generic};
+#if defined(USE_CPU_DISPATCH)
+static const int kDirectSSE41TilePixels = 3;
+static const int kDirectAVX2TilePixels = 6;
+static const int kDirectAVX512TilePixels = 12;
+static const SDirectKernel g_directSSE41Kernel = {kDirectSSE41TilePixels, direct_kernel_sse41};
+static const SDirectKernel g_directAVX2Kernel = {kDirectAVX2TilePixels, direct_kernel_avx2};
+static const SDirectKernel g_directAVX512Kernel = {kDirectAVX512TilePixels, direct_kernel_avx512};
+#endif // USE_CPU_DISPATCH
+
+Dimensions matrix_correlate_direct_packed_kernels_dims(int kernelWidth, int inputChannels, int kernelCount) {
+  const int blocksCount = ((kernelCount + kDirectChannelBlock - 1) / kDirectChannelBlock);
+  const int valuesPerKernel = (kernelWidth * kernelWidth * inputChannels);
+  const Dimensions result(blocksCount, valuesPerKernel, kDirectChannelBlock);
+  return result;
+}
+
+void matrix_correlate_direct_pack_kernels(Buffer* kernels, int kernelWidth, int kernelCount, bool areKernelsTransposed, Buffer* output) {
+  const int valuesPerKernel = (areKernelsTransposed ? kernels->_dims[1] : kernels->_dims[0]);
+  assert((valuesPerKernel % (kernelWidth * kernelWidth)) == 0);
+  const int inputChannels = (valuesPerKernel / (kernelWidth * kernelWidth));
+  assert(output->_dims == matrix_correlate_direct_packed_kernels_dims(kernelWidth, inputChannels, kernelCount));
+
+  Buffer* floatKernels;
+  if (kernels->_bitsPerElement == 32) {
+    floatKernels = kernels;
+  } else {
+    floatKernels = dequantize_buffer(kernels);
+  }
+
+  jpfloat_t* outputData = output->_data;
+  const int blocksCount = output->_dims[0];
+  for (int block = 0; block < blocksCount; block += 1) {
+    for (int valueIndex = 0; valueIndex < valuesPerKernel; valueIndex += 1) {
+      for (int channelOffset = 0; channelOffset < kDirectChannelBlock; channelOffset += 1) {
+        const int kernelIndex = ((block * kDirectChannelBlock) + channelOffset);
+        jpfloat_t value;
+        if (kernelIndex >= kernelCount) {
+          value = 0.0f;
+        } else if (areKernelsTransposed) {
+          value = floatKernels->_data[(kernelIndex * valuesPerKernel) + valueIndex];
+        } else {
+          value = floatKernels->_data[(valueIndex * kernelCount) + kernelIndex];
+        }
+        *outputData = value;
+        outputData += 1;
+      }
+    }
+  }
+
+  if (floatKernels != kernels) {
+    delete floatKernels;
+  }
+}
+
+size_t matrix_correlate_direct_scratch_bytes(const Dimensions& inputDims) {
+  // Room for the row of zeros that out-of-range taps read.
+  return (inputDims[3] * sizeof(jpfloat_t));
+}
+
+void matrix_correlate_direct_into(Buffer* input, int margin, Buffer* packedKernels, int kernelWidth, int kernelCount, int stride, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_correlate_direct(input=[%s], margin=%d, kernelWidth=%d, kernelCount=%d, stride=%d)\n",
+    input->debugString(), margin, kernelWidth, kernelCount, stride);
+#endif // DO_LOG_OPERATIONS
+
+  const Dimensions inputDims = input->_dims;
+  // We're expecting (# of images, height, width, # of channels)
+  assert(inputDims._length == 4);
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = output->_dims;
+  assert(outputDims == matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride));
+
+  const int imageCount = inputDims[0];
+  const int outputHeight = outputDims[1];
+  const int valuesPerOutputImage = outputDims.removeDimensions(1).elementCount();
+  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
+    jpfloat_t* outputRows = (output->_data + (imageIndex * valuesPerOutputImage));
+    correlate_direct_rows(input, margin, imageIndex, 0, outputHeight, packedKernels, kernelWidth, kernelCount, stride, outputRows, scratch, epilogue);
+  }
+
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_correlate_direct() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+void matrix_correlate_direct_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* packedKernels, int kernelWidth, int kernelCount, int stride, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(input->_dims, margin, margin);
+  const Dimensions fullOutputDims = matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride);
+  assert((startRow >= 0) && ((startRow + rowCount) <= fullOutputDims[1]));
+  assert(output->_dims == Dimensions(1, rowCount, fullOutputDims[2], kernelCount));
+  correlate_direct_rows(input, margin, imageIndex, startRow, rowCount, packedKernels, kernelWidth, kernelCount, stride, output->_data, scratch, epilogue);
+}
+
+const SDirectKernel* direct_kernel_for_current_cpu() {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    return &g_directAVX512Kernel;
+  } else if (level >= JPCPULevelAVX2) {
+    return &g_directAVX2Kernel;
+  } else if (level >= JPCPULevelSSE41) {
+    return &g_directSSE41Kernel;
+  }
+#endif // USE_CPU_DISPATCH
+  return &g_directGenericKernel;
+}
+
+// The output pixels of all the rows are numbered in order and split into
+// tiles, so that a tile can carry on from the end of one row to the start of
+// the next, and narrow layers don't waste most of their last tile on every
+// row. The work is shared out as (block of channels, tile) pairs, with all
+// the tiles for one block next to each other so that a thread working through
+// a run of them keeps reusing the same weights.
+void correlate_direct_rows(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* packedKernels, int kernelWidth, int kernelCount, int stride, jpfloat_t* outputRows, Buffer* scratch, const SGemmEpilogue* epilogue) {
+  const Dimensions inputDims = input->_dims;
+  const int inputChannels = inputDims[3];
+  assert(kernelWidth <= kDirectMaxKernelWidth);
+  assert(packedKernels->_dims == matrix_correlate_direct_packed_kernels_dims(kernelWidth, inputChannels, kernelCount));
+  assert((scratch->_dims.elementCount() * sizeof(jpfloat_t)) >= matrix_correlate_direct_scratch_bytes(inputDims));
+
+  jpfloat_t* zeros = scratch->_data;
+  memset(zeros, 0, (inputChannels * sizeof(jpfloat_t)));
+
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputWithMarginDims, kernelWidth, kernelCount, stride);
+
+  SDirectTask task;
+  task.input = input->_data;
+  task.inputHeight = inputDims[1];
+  task.inputWidth = inputDims[2];
+  task.inputChannels = inputChannels;
+  task.imageIndex = imageIndex;
+  task.margin = margin;
+  task.stride = stride;
+  task.kernelWidth = kernelWidth;
+  task.kernelCount = kernelCount;
+  task.packedKernels = packedKernels->_data;
+  task.zeros = zeros;
+  task.startRow = startRow;
+  task.rowCount = rowCount;
+  task.outputWidth = outputDims[2];
+  task.outputRows = outputRows;
+  task.epilogue = epilogue;
+  task.kernel = direct_kernel_for_current_cpu();
+
+  const int blocksCount = packedKernels->_dims[0];
+  const int tilePixels = task.kernel->tilePixels;
+  task.tilesCount = ((((rowCount * task.outputWidth) + tilePixels) - 1) / tilePixels);
+  thread_pool_parallel_for((blocksCount * task.tilesCount), 1, correlate_direct_task, &task);
+}
+
+void correlate_direct_task(void* cookie, int startIndex, int endIndex) {
+  const SDirectTask* task = (const SDirectTask*)(cookie);
+  const int inputHeight = task->inputHeight;
+  const int inputWidth = task->inputWidth;
+  const int inputChannels = task->inputChannels;
+  const int margin = task->margin;
+  const int stride = task->stride;
+  const int kernelWidth = task->kernelWidth;
+  const int kernelCount = task->kernelCount;
+  const int outputWidth = task->outputWidth;
+  const int tilePixels = task->kernel->tilePixels;
+  const DirectKernelFunction kernelFunction = task->kernel->function;
+  const int tapsCount = (kernelWidth * kernelWidth);
+  const int valuesPerKernel = (tapsCount * inputChannels);
+  const jpfloat_t* imageData = (task->input + (task->imageIndex * inputHeight * inputWidth * inputChannels));
+
+  const jpfloat_t* taps[kDirectMaxTaps * kDirectMaxTilePixels];
+  jpfloat_t tile[kDirectMaxTilePixels * kDirectChannelBlock] __attribute__((aligned(64)));
+
+  const int pixelsCount = (task->rowCount * outputWidth);
+  for (int index = startIndex; index < endIndex; index += 1) {
+    const int block = (index / task->tilesCount);
+    const int startPixel = ((index % task->tilesCount) * tilePixels);
+    // A short final tile repeats its last pixel, and ignores those results.
+    const int tilePixelsCount = MIN(tilePixels, (pixelsCount - startPixel));
+    const int startChannel = (block * kDirectChannelBlock);
+    const int channelsCount = MIN(kDirectChannelBlock, (kernelCount - startChannel));
+    const jpfloat_t* weights = (task->packedKernels + (block * valuesPerKernel * kDirectChannelBlock));
+
+    for (int pixel = 0; pixel < tilePixels; pixel += 1) {
+      const int pixelIndex = (startPixel + MIN(pixel, (tilePixelsCount - 1)));
+      const int outputY = (task->startRow + (pixelIndex / outputWidth));
+      const int outputX = (pixelIndex % outputWidth);
+      for (int kernelY = 0; kernelY < kernelWidth; kernelY += 1) {
+        const int inputY = ((outputY * stride) + kernelY - margin);
+        const bool isRowInside = ((inputY >= 0) && (inputY < inputHeight));
+        for (int kernelX = 0; kernelX < kernelWidth; kernelX += 1) {
+          const int inputX = ((outputX * stride) + kernelX - margin);
+          const int tap = ((kernelY * kernelWidth) + kernelX);
+          if (isRowInside && (inputX >= 0) && (inputX < inputWidth)) {
+            taps[(tap * tilePixels) + pixel] = (imageData + (((inputY * inputWidth) + inputX) * inputChannels));
+          } else {
+            taps[(tap * tilePixels) + pixel] = task->zeros;
+          }
+        }
+      }
+    }
+
+    kernelFunction(taps, tapsCount, inputChannels, weights, tile);
+
+    // The pixels are numbered in the same order as they're stored, so the
+    // tile's results are evenly spaced in the output.
+    jpfloat_t* output = (task->outputRows + (startPixel * kernelCount) + startChannel);
+    for (int pixel = 0; pixel < tilePixelsCount; pixel += 1) {
+      memcpy((output + (pixel * kernelCount)), (tile + (pixel * kDirectChannelBlock)), (channelsCount * sizeof(jpfloat_t)));
+    }
+    if (task->epilogue != NULL) {
+      SGemmEpilogue blockEpilogue = *task->epilogue;
+      if (blockEpilogue.bias != NULL) {
+        blockEpilogue.bias += startChannel;
+      }
+      matrix_gemm_epilogue(channelsCount, tilePixelsCount, output, kernelCount, &blockEpilogue);
+    }
+  }
+}
+
+void direct_kernel_generic(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile) {
+  jpfloat_t totals[kDirectGenericTilePixels][kDirectChannelBlock];
+  for (int pixel = 0; pixel < kDirectGenericTilePixels; pixel += 1) {
+    for (int channel = 0; channel < kDirectChannelBlock; channel += 1) {
+      totals[pixel][channel] = 0.0f;
+    }
+  }
+  for (int tap = 0; tap < tapsCount; tap += 1) {
+    const jpfloat_t* const* tapPixels = (taps + (tap * kDirectGenericTilePixels));
+    for (int inputChannel = 0; inputChannel < inputChannels; inputChannel += 1) {
+      for (int pixel = 0; pixel < kDirectGenericTilePixels; pixel += 1) {
+        const jpfloat_t inputValue = tapPixels[pixel][inputChannel];
+        for (int channel = 0; channel < kDirectChannelBlock; channel += 1) {
+          totals[pixel][channel] += (weights[channel] * inputValue);
+        }
+      }
+      weights += kDirectChannelBlock;
+    }
+  }
+  for (int pixel = 0; pixel < kDirectGenericTilePixels; pixel += 1) {
+    for (int channel = 0; channel < kDirectChannelBlock; channel += 1) {
+      outTile[(pixel * kDirectChannelBlock) + channel] = totals[pixel][channel];
+    }
+  }
+}
+
+#if defined(USE_CPU_DISPATCH)
+
+// Each micro-kernel keeps twelve vectors of totals in registers, and for
+// every input channel of every tap loads one block of weights and broadcasts
+// one input value per pixel.
+
+JP_TARGET_SSE41 void direct_kernel_sse41(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile) {
+  __m128 c00 = _mm_setzero_ps();
+  __m128 c01 = _mm_setzero_ps();
+  __m128 c02 = _mm_setzero_ps();
+  __m128 c03 = _mm_setzero_ps();
+  __m128 c10 = _mm_setzero_ps();
+  __m128 c11 = _mm_setzero_ps();
+  __m128 c12 = _mm_setzero_ps();
+  __m128 c13 = _mm_setzero_ps();
+  __m128 c20 = _mm_setzero_ps();
+  __m128 c21 = _mm_setzero_ps();
+  __m128 c22 = _mm_setzero_ps();
+  __m128 c23 = _mm_setzero_ps();
+  for (int tap = 0; tap < tapsCount; tap += 1) {
+    const jpfloat_t* const* tapPixels = (taps + (tap * kDirectSSE41TilePixels));
+    const jpfloat_t* input0 = tapPixels[0];
+    const jpfloat_t* input1 = tapPixels[1];
+    const jpfloat_t* input2 = tapPixels[2];
+    for (int inputChannel = 0; inputChannel < inputChannels; inputChannel += 1) {
+      const __m128 w0 = _mm_load_ps(weights);
+      const __m128 w1 = _mm_load_ps(weights + 4);
+      const __m128 w2 = _mm_load_ps(weights + 8);
+      const __m128 w3 = _mm_load_ps(weights + 12);
+      __m128 inputValue = _mm_set1_ps(input0[inputChannel]);
+      c00 = _mm_add_ps(c00, _mm_mul_ps(w0, inputValue));
+      c01 = _mm_add_ps(c01, _mm_mul_ps(w1, inputValue));
+      c02 = _mm_add_ps(c02, _mm_mul_ps(w2, inputValue));
+      c03 = _mm_add_ps(c03, _mm_mul_ps(w3, inputValue));
+      inputValue = _mm_set1_ps(input1[inputChannel]);
+      c10 = _mm_add_ps(c10, _mm_mul_ps(w0, inputValue));
+      c11 = _mm_add_ps(c11, _mm_mul_ps(w1, inputValue));
+      c12 = _mm_add_ps(c12, _mm_mul_ps(w2, inputValue));
+      c13 = _mm_add_ps(c13, _mm_mul_ps(w3, inputValue));
+      inputValue = _mm_set1_ps(input2[inputChannel]);
+      c20 = _mm_add_ps(c20, _mm_mul_ps(w0, inputValue));
+      c21 = _mm_add_ps(c21, _mm_mul_ps(w1, inputValue));
+      c22 = _mm_add_ps(c22, _mm_mul_ps(w2, inputValue));
+      c23 = _mm_add_ps(c23, _mm_mul_ps(w3, inputValue));
+      weights += kDirectChannelBlock;
+    }
+  }
+  const __m128 totals[kDirectSSE41TilePixels * 4] = {c00, c01, c02, c03, c10, c11, c12, c13, c20, c21, c22, c23};
+  for (int index = 0; index < (kDirectSSE41TilePixels * 4); index += 1) {
+    _mm_store_ps((outTile + (index * 4)), totals[index]);
+  }
+}
+
+JP_TARGET_AVX2 void direct_kernel_avx2(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile) {
+  __m256 c00 = _mm256_setzero_ps();
+  __m256 c01 = _mm256_setzero_ps();
+  __m256 c10 = _mm256_setzero_ps();
+  __m256 c11 = _mm256_setzero_ps();
+  __m256 c20 = _mm256_setzero_ps();
+  __m256 c21 = _mm256_setzero_ps();
+  __m256 c30 = _mm256_setzero_ps();
+  __m256 c31 = _mm256_setzero_ps();
+  __m256 c40 = _mm256_setzero_ps();
+  __m256 c41 = _mm256_setzero_ps();
+  __m256 c50 = _mm256_setzero_ps();
+  __m256 c51 = _mm256_setzero_ps();
+  for (int tap = 0; tap < tapsCount; tap += 1) {
+    const jpfloat_t* const* tapPixels = (taps + (tap * kDirectAVX2TilePixels));
+    const jpfloat_t* input0 = tapPixels[0];
+    const jpfloat_t* input1 = tapPixels[1];
+    const jpfloat_t* input2 = tapPixels[2];
+    const jpfloat_t* input3 = tapPixels[3];
+    const jpfloat_t* input4 = tapPixels[4];
+    const jpfloat_t* input5 = tapPixels[5];
+    for (int inputChannel = 0; inputChannel < inputChannels; inputChannel += 1) {
+      const __m256 w0 = _mm256_loadu_ps(weights);
+      const __m256 w1 = _mm256_loadu_ps(weights + 8);
+      __m256 inputValue = _mm256_broadcast_ss(input0 + inputChannel);
+      c00 = _mm256_fmadd_ps(w0, inputValue, c00);
+      c01 = _mm256_fmadd_ps(w1, inputValue, c01);
+      inputValue = _mm256_broadcast_ss(input1 + inputChannel);
+      c10 = _mm256_fmadd_ps(w0, inputValue, c10);
+      c11 = _mm256_fmadd_ps(w1, inputValue, c11);
+      inputValue = _mm256_broadcast_ss(input2 + inputChannel);
+      c20 = _mm256_fmadd_ps(w0, inputValue, c20);
+      c21 = _mm256_fmadd_ps(w1, inputValue, c21);
+      inputValue = _mm256_broadcast_ss(input3 + inputChannel);
+      c30 = _mm256_fmadd_ps(w0, inputValue, c30);
+      c31 = _mm256_fmadd_ps(w1, inputValue, c31);
+      inputValue = _mm256_broadcast_ss(input4 + inputChannel);
+      c40 = _mm256_fmadd_ps(w0, inputValue, c40);
+      c41 = _mm256_fmadd_ps(w1, inputValue, c41);
+      inputValue = _mm256_broadcast_ss(input5 + inputChannel);
+      c50 = _mm256_fmadd_ps(w0, inputValue, c50);
+      c51 = _mm256_fmadd_ps(w1, inputValue, c51);
+      weights += kDirectChannelBlock;
+    }
+  }
+  const __m256 totals[kDirectAVX2TilePixels * 2] = {c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51};
+  for (int index = 0; index < (kDirectAVX2TilePixels * 2); index += 1) {
+    _mm256_store_ps((outTile + (index * 8)), totals[index]);
+  }
+}
+
+// A block of channels fits in one AVX-512 register, so this covers twice as
+// many pixels with the same number of totals.
+JP_TARGET_AVX512 void direct_kernel_avx512(const jpfloat_t* const* taps, int tapsCount, int inputChannels, const jpfloat_t* weights, jpfloat_t* outTile) {
+  __m512 c0 = _mm512_setzero_ps();
+  __m512 c1 = _mm512_setzero_ps();
+  __m512 c2 = _mm512_setzero_ps();
+  __m512 c3 = _mm512_setzero_ps();
+  __m512 c4 = _mm512_setzero_ps();
+  __m512 c5 = _mm512_setzero_ps();
+  __m512 c6 = _mm512_setzero_ps();
+  __m512 c7 = _mm512_setzero_ps();
+  __m512 c8 = _mm512_setzero_ps();
+  __m512 c9 = _mm512_setzero_ps();
+  __m512 c10 = _mm512_setzero_ps();
+  __m512 c11 = _mm512_setzero_ps();
+  for (int tap = 0; tap < tapsCount; tap += 1) {
+    const jpfloat_t* const* tapPixels = (taps + (tap * kDirectAVX512TilePixels));
+    for (int inputChannel = 0; inputChannel < inputChannels; inputChannel += 1) {
+      const __m512 w = _mm512_loadu_ps(weights);
+      c0 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[0][inputChannel]), c0);
+      c1 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[1][inputChannel]), c1);
+      c2 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[2][inputChannel]), c2);
+      c3 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[3][inputChannel]), c3);
+      c4 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[4][inputChannel]), c4);
+      c5 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[5][inputChannel]), c5);
+      c6 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[6][inputChannel]), c6);
+      c7 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[7][inputChannel]), c7);
+      c8 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[8][inputChannel]), c8);
+      c9 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[9][inputChannel]), c9);
+      c10 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[10][inputChannel]), c10);
+      c11 = _mm512_fmadd_ps(w, _mm512_set1_ps(tapPixels[11][inputChannel]), c11);
+      weights += kDirectChannelBlock;
+    }
+  }
+  const __m512 totals[kDirectAVX512TilePixels] = {c0, c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11};
+  for (int pixel = 0; pixel < kDirectAVX512TilePixels; pixel += 1) {
+    _mm512_store_ps((outTile + (pixel * kDirectChannelBlock)), totals[pixel]);
+  }
+}
+
+#endif // USE_CPU_DISPATCH
@@ -0,0 +1,364 @@
+//
+//  matrix_correlate_winograd.cpp
+//  jpcnn
+//
+//  Runs 3x3, stride 1 convolutions with Winograd's F(2x2, 3x3) algorithm.
+//  Each 4x4 tile of the input is transformed so that the 2x2 block of output
+//  pixels it covers can be found with 16 multiplies per channel pair instead
+//  of 36. The multiplies for all the tiles become 16 independent GEMMs, one
+//  for each position in the transformed tile, and an inverse transform then
+//  turns their results into output pixels. The kernels are transformed once
+//  when the network is loaded. The transforms add and subtract values, so
+//  the results differ slightly from the direct calculation, and callers are
+//  expected to check a layer is accurate enough before relying on this.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "matrix_ops.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "thread_pool.h"
+
+// F(2x2, 3x3) produces a 2x2 block of outputs from each 4x4 input tile.
+static const int kWinogradOutputTile = 2;
+static const int kWinogradInputTile = 4;
+static const int kWinogradPositions = (kWinogradInputTile * kWinogradInputTile);
+static const int kWinogradKernelWidth = 3;
+// How many tiles each task transforms.
+static const int kWinogradTilesPerTask = 4;
+
+typedef struct SWinogradTaskStruct {
+  const jpfloat_t* input;
+  int inputHeight;
+  int inputWidth;
+  int inputChannels;
+  int imageIndex;
+  int margin;
+  int kernelCount;
+  int startRow;
+  int rowCount;
+  int outputWidth;
+  int tilesAcross;
+  int tilesCount;
+  const jpfloat_t* zeros;
+  jpfloat_t* transformedInput;
+  jpfloat_t* transformedOutput;
+  jpfloat_t* outputRows;
+  const SGemmEpilogue* epilogue;
+} SWinogradTask;
+
+static void correlate_winograd_rows(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* transformedKernels, int kernelCount, jpfloat_t* outputRows, Buffer* scratch, const SGemmEpilogue* epilogue);
+static void winograd_input_task(void* cookie, int startIndex, int endIndex);
+static void winograd_output_task(void* cookie, int startIndex, int endIndex);
+static int winograd_tiles_count(int rowCount, int outputWidth);
+
+Dimensions matrix_correlate_winograd_kernels_dims(int inputChannels, int kernelCount) {
+  const Dimensions result(kWinogradPositions, kernelCount, inputChannels);
+  return result;
+}
+
+// Each kernel becomes G * g * transpose(G), where
+//     | 1    0    0   |
+// G = | 1/2  1/2  1/2 |
+//     | 1/2 -1/2  1/2 |
+//     | 0    0    1   |
+// and the 16 values are stored in a separate matrix for each position, with
+// each kernel's values for all the input channels next to each other, the
+// same way as transposed kernels are given to the GEMM by matrix_correlate().
+void matrix_correlate_winograd_transform_kernels(Buffer* kernels, int kernelCount, bool areKernelsTransposed, Buffer* output) {
+  const int valuesPerKernel = (areKernelsTransposed ? kernels->_dims[1] : kernels->_dims[0]);
+  const int tapsCount = (kWinogradKernelWidth * kWinogradKernelWidth);
+  assert((valuesPerKernel % tapsCount) == 0);
+  const int inputChannels = (valuesPerKernel / tapsCount);
+  assert(output->_dims == matrix_correlate_winograd_kernels_dims(inputChannels, kernelCount));
+
+  Buffer* floatKernels;
+  if (kernels->_bitsPerElement == 32) {
+    floatKernels = kernels;
+  } else {
+    floatKernels = dequantize_buffer(kernels);
+  }
+
+  for (int kernelIndex = 0; kernelIndex < kernelCount; kernelIndex += 1) {
+    for (int inputChannel = 0; inputChannel < inputChannels; inputChannel += 1) {
+      jpfloat_t g[3][3];
+      for (int tap = 0; tap < tapsCount; tap += 1) {
+        const int valueIndex = ((tap * inputChannels) + inputChannel);
+        jpfloat_t value;
+        if (areKernelsTransposed) {
+          value = floatKernels->_data[(kernelIndex * valuesPerKernel) + valueIndex];
+        } else {
+          value = floatKernels->_data[(valueIndex * kernelCount) + kernelIndex];
+        }
+        g[tap / 3][tap % 3] = value;
+      }
+
+      jpfloat_t gg[4][3];
+      for (int column = 0; column < 3; column += 1) {
+        gg[0][column] = g[0][column];
+        gg[1][column] = (0.5f * ((g[0][column] + g[1][column]) + g[2][column]));
+        gg[2][column] = (0.5f * ((g[0][column] - g[1][column]) + g[2][column]));
+        gg[3][column] = g[2][column];
+      }
+      jpfloat_t u[4][4];
+      for (int row = 0; row < 4; row += 1) {
+        u[row][0] = gg[row][0];
+        u[row][1] = (0.5f * ((gg[row][0] + gg[row][1]) + gg[row][2]));
+        u[row][2] = (0.5f * ((gg[row][0] - gg[row][1]) + gg[row][2]));
+        u[row][3] = gg[row][2];
+      }
+
+      for (int position = 0; position < kWinogradPositions; position += 1) {
+        const int outputIndex = ((((position * kernelCount) + kernelIndex) * inputChannels) + inputChannel);
+        output->_data[outputIndex] = u[position / 4][position % 4];
+      }
+    }
+  }
+
+  if (floatKernels != kernels) {
+    delete floatKernels;
+  }
+}
+
+size_t matrix_correlate_winograd_scratch_bytes(const Dimensions& inputDims, int margin, int kernelCount) {
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputWithMarginDims, kWinogradKernelWidth, kernelCount, 1);
+  return matrix_correlate_winograd_rows_scratch_bytes(inputDims, margin, kernelCount, outputDims[1]);
+}
+
+// Room for the transformed input and the GEMM results for every tile, and a
+// row of zeros for the parts of tiles outside the image.
+size_t matrix_correlate_winograd_rows_scratch_bytes(const Dimensions& inputDims, int margin, int kernelCount, int rowCount) {
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputWithMarginDims, kWinogradKernelWidth, kernelCount, 1);
+  const int inputChannels = inputDims[3];
+  const size_t tilesCount = winograd_tiles_count(rowCount, outputDims[2]);
+  const size_t floatsCount = ((kWinogradPositions * tilesCount * (inputChannels + kernelCount)) + inputChannels);
+  return (floatsCount * sizeof(jpfloat_t));
+}
+
+void matrix_correlate_winograd_into(Buffer* input, int margin, Buffer* transformedKernels, int kernelCount, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_correlate_winograd(input=[%s], margin=%d, kernelCount=%d)\n",
+    input->debugString(), margin, kernelCount);
+#endif // DO_LOG_OPERATIONS
+
+  const Dimensions inputDims = input->_dims;
+  // We're expecting (# of images, height, width, # of channels)
+  assert(inputDims._length == 4);
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = output->_dims;
+  assert(outputDims == matrix_correlate_output_dims(inputWithMarginDims, kWinogradKernelWidth, kernelCount, 1));
+
+  const int imageCount = inputDims[0];
+  const int outputHeight = outputDims[1];
+  const int valuesPerOutputImage = outputDims.removeDimensions(1).elementCount();
+  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
+    jpfloat_t* outputRows = (output->_data + (imageIndex * valuesPerOutputImage));
+    correlate_winograd_rows(input, margin, imageIndex, 0, outputHeight, transformedKernels, kernelCount, outputRows, scratch, epilogue);
+  }
+
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_correlate_winograd() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+void matrix_correlate_winograd_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* transformedKernels, int kernelCount, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(input->_dims, margin, margin);
+  const Dimensions fullOutputDims = matrix_correlate_output_dims(inputWithMarginDims, kWinogradKernelWidth, kernelCount, 1);
+  assert((startRow >= 0) && ((startRow + rowCount) <= fullOutputDims[1]));
+  assert(output->_dims == Dimensions(1, rowCount, fullOutputDims[2], kernelCount));
+  correlate_winograd_rows(input, margin, imageIndex, startRow, rowCount, transformedKernels, kernelCount, output->_data, scratch, epilogue);
+}
+
+int winograd_tiles_count(int rowCount, int outputWidth) {
+  const int tilesDown = (((rowCount + kWinogradOutputTile) - 1) / kWinogradOutputTile);
+  const int tilesAcross = (((outputWidth + kWinogradOutputTile) - 1) / kWinogradOutputTile);
+  return (tilesDown * tilesAcross);
+}
+
+// The tiles start at startRow, so a band can begin on any row. Tiles that
+// hang off the bottom or right of the output calculate a few values that are
+// never written.
+void correlate_winograd_rows(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* transformedKernels, int kernelCount, jpfloat_t* outputRows, Buffer* scratch, const SGemmEpilogue* epilogue) {
+  const Dimensions inputDims = input->_dims;
+  const int inputChannels = inputDims[3];
+  assert(transformedKernels->_dims == matrix_correlate_winograd_kernels_dims(inputChannels, kernelCount));
+  assert((scratch->_dims.elementCount() * sizeof(jpfloat_t)) >= matrix_correlate_winograd_rows_scratch_bytes(inputDims, margin, kernelCount, rowCount));
+
+  const Dimensions inputWithMarginDims = matrix_insert_margin_output_dims(inputDims, margin, margin);
+  const Dimensions outputDims = matrix_correlate_output_dims(inputWithMarginDims, kWinogradKernelWidth, kernelCount, 1);
+  const int outputWidth = outputDims[2];
+  const int tilesCount = winograd_tiles_count(rowCount, outputWidth);
+
+  jpfloat_t* transformedInput = scratch->_data;
+  jpfloat_t* transformedOutput = (transformedInput + (kWinogradPositions * tilesCount * inputChannels));
+  jpfloat_t* zeros = (transformedOutput + (kWinogradPositions * tilesCount * kernelCount));
+  memset(zeros, 0, (inputChannels * sizeof(jpfloat_t)));
+
+  SWinogradTask task;
+  task.input = input->_data;
+  task.inputHeight = inputDims[1];
+  task.inputWidth = inputDims[2];
+  task.inputChannels = inputChannels;
+  task.imageIndex = imageIndex;
+  task.margin = margin;
+  task.kernelCount = kernelCount;
+  task.startRow = startRow;
+  task.rowCount = rowCount;
+  task.outputWidth = outputWidth;
+  task.tilesAcross = (((outputWidth + kWinogradOutputTile) - 1) / kWinogradOutputTile);
+  task.tilesCount = tilesCount;
+  task.zeros = zeros;
+  task.transformedInput = transformedInput;
+  task.transformedOutput = transformedOutput;
+  task.outputRows = outputRows;
+  task.epilogue = epilogue;
+
+  thread_pool_parallel_for(tilesCount, kWinogradTilesPerTask, winograd_input_task, &task);
+
+  for (int position = 0; position < kWinogradPositions; position += 1) {
+    matrix_gemm(
+      JPCblasColMajor,
+      JPCblasTrans,
+      JPCblasNoTrans,
+      kernelCount,
+      tilesCount,
+      inputChannels,
+      1.0f,
+      (transformedKernels->_data + (position * kernelCount * inputChannels)),
+      inputChannels,
+      (transformedInput + (position * tilesCount * inputChannels)),
+      inputChannels,
+      0.0f,
+      (transformedOutput + (position * tilesCount * kernelCount)),
+      kernelCount
+    );
+  }
+
+  thread_pool_parallel_for(tilesCount, kWinogradTilesPerTask, winograd_output_task, &task);
+}
+
+// Calculates transpose(B) * d * B for every channel of the tile d, where
+//                | 1  0 -1  0 |
+// transpose(B) = | 0  1  1  0 |
+//                | 0 -1  1  0 |
+//                | 0  1  0 -1 |
+// and writes each of the 16 results into the B argument of its GEMM, as a
+// column of inputChannels values.
+void winograd_input_task(void* cookie, int startIndex, int endIndex) {
+  const SWinogradTask* task = (const SWinogradTask*)(cookie);
+  const int inputHeight = task->inputHeight;
+  const int inputWidth = task->inputWidth;
+  const int inputChannels = task->inputChannels;
+  const int margin = task->margin;
+  const int tilesCount = task->tilesCount;
+  const jpfloat_t* imageData = (task->input + (task->imageIndex * inputHeight * inputWidth * inputChannels));
+
+  for (int tile = startIndex; tile < endIndex; tile += 1) {
+    const int tileY = ((tile / task->tilesAcross) * kWinogradOutputTile);
+    const int tileX = ((tile % task->tilesAcross) * kWinogradOutputTile);
+
+    const jpfloat_t* d[4][4];
+    for (int row = 0; row < 4; row += 1) {
+      const int inputY = ((task->startRow + tileY + row) - margin);
+      const bool isRowInside = ((inputY >= 0) && (inputY < inputHeight));
+      for (int column = 0; column < 4; column += 1) {
+        const int inputX = ((tileX + column) - margin);
+        if (isRowInside && (inputX >= 0) && (inputX < inputWidth)) {
+          d[row][column] = (imageData + (((inputY * inputWidth) + inputX) * inputChannels));
+        } else {
+          d[row][column] = task->zeros;
+        }
+      }
+    }
+
+    jpfloat_t* v[16];
+    for (int position = 0; position < kWinogradPositions; position += 1) {
+      v[position] = (task->transformedInput + (((position * tilesCount) + tile) * inputChannels));
+    }
+
+    for (int channel = 0; channel < inputChannels; channel += 1) {
+      jpfloat_t t[4][4];
+      for (int column = 0; column < 4; column += 1) {
+        const jpfloat_t d0 = d[0][column][channel];
+        const jpfloat_t d1 = d[1][column][channel];
+        const jpfloat_t d2 = d[2][column][channel];
+        const jpfloat_t d3 = d[3][column][channel];
+        t[0][column] = (d0 - d2);
+        t[1][column] = (d1 + d2);
+        t[2][column] = (d2 - d1);
+        t[3][column] = (d1 - d3);
+      }
+      for (int row = 0; row < 4; row += 1) {
+        v[(row * 4) + 0][channel] = (t[row][0] - t[row][2]);
+        v[(row * 4) + 1][channel] = (t[row][1] + t[row][2]);
+        v[(row * 4) + 2][channel] = (t[row][2] - t[row][1]);
+        v[(row * 4) + 3][channel] = (t[row][1] - t[row][3]);
+      }
+    }
+  }
+}
+
+// Calculates transpose(A) * m * A for the GEMM results m of every kernel, where
+// transpose(A) = | 1  1  1  0 |
+//                | 0  1 -1 -1 |
+// and writes the 2x2 block of output pixels it gives.
+void winograd_output_task(void* cookie, int startIndex, int endIndex) {
+  const SWinogradTask* task = (const SWinogradTask*)(cookie);
+  const int kernelCount = task->kernelCount;
+  const int outputWidth = task->outputWidth;
+  const int tilesCount = task->tilesCount;
+
+  for (int tile = startIndex; tile < endIndex; tile += 1) {
+    const int tileY = ((tile / task->tilesAcross) * kWinogradOutputTile);
+    const int tileX = ((tile % task->tilesAcross) * kWinogradOutputTile);
+    const int rowsCount = MIN(kWinogradOutputTile, (task->rowCount - tileY));
+    const int columnsCount = MIN(kWinogradOutputTile, (outputWidth - tileX));
+
+    const jpfloat_t* m[16];
+    for (int position = 0; position < kWinogradPositions; position += 1) {
+      m[position] = (task->transformedOutput + (((position * tilesCount) + tile) * kernelCount));
+    }
+
+    jpfloat_t* y[2][2];
+    for (int row = 0; row < kWinogradOutputTile; row += 1) {
+      for (int column = 0; column < kWinogradOutputTile; column += 1) {
+        // Values that fall outside the output go to the first pixel, and
+        // are overwritten by its real value straight afterwards.
+        const int outputRow = ((row < rowsCount) ? (tileY + row) : tileY);
+        const int outputColumn = ((column < columnsCount) ? (tileX + column) : tileX);
+        y[row][column] = (task->outputRows + (((outputRow * outputWidth) + outputColumn) * kernelCount));
+      }
+    }
+
+    for (int kernelIndex = 0; kernelIndex < kernelCount; kernelIndex += 1) {
+      jpfloat_t r[2][4];
+      for (int column = 0; column < 4; column += 1) {
+        const jpfloat_t m0 = m[0 + column][kernelIndex];
+        const jpfloat_t m1 = m[4 + column][kernelIndex];
+        const jpfloat_t m2 = m[8 + column][kernelIndex];
+        const jpfloat_t m3 = m[12 + column][kernelIndex];
+        r[0][column] = ((m0 + m1) + m2);
+        r[1][column] = ((m1 - m2) - m3);
+      }
+      // Written in reverse, so the first pixel's real value lands last.
+      y[1][1][kernelIndex] = ((r[1][1] - r[1][2]) - r[1][3]);
+      y[1][0][kernelIndex] = ((r[1][0] + r[1][1]) + r[1][2]);
+      y[0][1][kernelIndex] = ((r[0][1] - r[0][2]) - r[0][3]);
+      y[0][0][kernelIndex] = ((r[0][0] + r[0][1]) + r[0][2]);
+    }
+
+    if (task->epilogue != NULL) {
+      for (int row = 0; row < rowsCount; row += 1) {
+        matrix_gemm_epilogue(kernelCount, columnsCount, y[row][0], kernelCount, task->epilogue);
+      }
+    }
+  }
+}
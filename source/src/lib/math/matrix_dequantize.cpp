@@ -0,0 +1,226 @@
+//
+//  matrix_dequantize.cpp
+//  jpcnn
+//
+//  Turns runs of 8 or 16-bit fixed-point values into floats, for loading
+//  quantized weights and converting image pixels, along with half-precision
+//  and bfloat16 weights. There's a version for each instruction set in
+//  cpu_features.h, and the widest one the processor supports is picked on
+//  every call.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "matrix_ops.h"
+
+#include <assert.h>
+
+#include "cpu_features.h"
+#include "half_float.h"
+
+#if defined(USE_CPU_DISPATCH)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH
+
+template <class T> static void dequantize_generic(const T* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+#if defined(USE_CPU_DISPATCH)
+static void dequantize_uint8_sse41(const uint8_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+static void dequantize_uint16_sse41(const uint16_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+static void dequantize_uint8_avx2(const uint8_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+static void dequantize_uint16_avx2(const uint16_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+static void dequantize_uint8_avx512(const uint8_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+static void dequantize_uint16_avx512(const uint16_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+#endif // USE_CPU_DISPATCH
+static void dequantize_half_generic(const uint16_t* input, int count, int elementFormat, jpfloat_t* output);
+#if defined(USE_CPU_DISPATCH)
+static void dequantize_half_avx2(const uint16_t* input, int count, int elementFormat, jpfloat_t* output);
+static void dequantize_half_avx512(const uint16_t* input, int count, int elementFormat, jpfloat_t* output);
+#endif // USE_CPU_DISPATCH
+
+void matrix_dequantize_uint8(const uint8_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    dequantize_uint8_avx512(input, count, min, range, output);
+    return;
+  } else if (level >= JPCPULevelAVX2) {
+    dequantize_uint8_avx2(input, count, min, range, output);
+    return;
+  } else if (level >= JPCPULevelSSE41) {
+    dequantize_uint8_sse41(input, count, min, range, output);
+    return;
+  }
+#endif // USE_CPU_DISPATCH
+  dequantize_generic(input, count, min, range, output);
+}
+
+void matrix_dequantize_uint16(const uint16_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    dequantize_uint16_avx512(input, count, min, range, output);
+    return;
+  } else if (level >= JPCPULevelAVX2) {
+    dequantize_uint16_avx2(input, count, min, range, output);
+    return;
+  } else if (level >= JPCPULevelSSE41) {
+    dequantize_uint16_sse41(input, count, min, range, output);
+    return;
+  }
+#endif // USE_CPU_DISPATCH
+  dequantize_generic(input, count, min, range, output);
+}
+
+void matrix_dequantize_half(const uint16_t* input, int count, int elementFormat, jpfloat_t* output) {
+  assert((elementFormat == JPElementFormatHalf) || (elementFormat == JPElementFormatBFloat16));
+#if defined(USE_CPU_DISPATCH)
+  // The hardware conversions for half-precision arrived with AVX2, so there's
+  // no SSE4.1 version.
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    dequantize_half_avx512(input, count, elementFormat, output);
+    return;
+  } else if (level >= JPCPULevelAVX2) {
+    dequantize_half_avx2(input, count, elementFormat, output);
+    return;
+  }
+#endif // USE_CPU_DISPATCH
+  dequantize_half_generic(input, count, elementFormat, output);
+}
+
+template <class T> void dequantize_generic(const T* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+  for (int index = 0; index < count; index += 1) {
+    output[index] = (min + (input[index] * range));
+  }
+}
+
+void dequantize_half_generic(const uint16_t* input, int count, int elementFormat, jpfloat_t* output) {
+  if (elementFormat == JPElementFormatBFloat16) {
+    for (int index = 0; index < count; index += 1) {
+      output[index] = bfloat16_to_float(input[index]);
+    }
+  } else {
+    for (int index = 0; index < count; index += 1) {
+      output[index] = half_to_float(input[index]);
+    }
+  }
+}
+
+#if defined(USE_CPU_DISPATCH)
+
+// The vector loops handle as many whole vectors as they can, and leave any
+// values left over at the end to the plain version.
+
+JP_TARGET_SSE41 void dequantize_uint8_sse41(const uint8_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+  const __m128 minVector = _mm_set1_ps(min);
+  const __m128 rangeVector = _mm_set1_ps(range);
+  int index = 0;
+  for (; index <= (count - 16); index += 16) {
+    __m128i values = _mm_loadu_si128((const __m128i*)(input + index));
+    for (int part = 0; part < 4; part += 1) {
+      const __m128 floats = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(values));
+      _mm_storeu_ps((output + index + (part * 4)), _mm_add_ps(minVector, _mm_mul_ps(floats, rangeVector)));
+      values = _mm_srli_si128(values, 4);
+    }
+  }
+  dequantize_generic((input + index), (count - index), min, range, (output + index));
+}
+
+JP_TARGET_SSE41 void dequantize_uint16_sse41(const uint16_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+  const __m128 minVector = _mm_set1_ps(min);
+  const __m128 rangeVector = _mm_set1_ps(range);
+  int index = 0;
+  for (; index <= (count - 8); index += 8) {
+    const __m128i values = _mm_loadu_si128((const __m128i*)(input + index));
+    const __m128 low = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(values));
+    const __m128 high = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(values, 8)));
+    _mm_storeu_ps((output + index), _mm_add_ps(minVector, _mm_mul_ps(low, rangeVector)));
+    _mm_storeu_ps((output + index + 4), _mm_add_ps(minVector, _mm_mul_ps(high, rangeVector)));
+  }
+  dequantize_generic((input + index), (count - index), min, range, (output + index));
+}
+
+JP_TARGET_AVX2 void dequantize_uint8_avx2(const uint8_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+  const __m256 minVector = _mm256_set1_ps(min);
+  const __m256 rangeVector = _mm256_set1_ps(range);
+  int index = 0;
+  for (; index <= (count - 8); index += 8) {
+    const __m256i values = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(input + index)));
+    const __m256 result = _mm256_add_ps(minVector, _mm256_mul_ps(_mm256_cvtepi32_ps(values), rangeVector));
+    _mm256_storeu_ps((output + index), result);
+  }
+  dequantize_generic((input + index), (count - index), min, range, (output + index));
+}
+
+JP_TARGET_AVX2 void dequantize_uint16_avx2(const uint16_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+  const __m256 minVector = _mm256_set1_ps(min);
+  const __m256 rangeVector = _mm256_set1_ps(range);
+  int index = 0;
+  for (; index <= (count - 8); index += 8) {
+    const __m256i values = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(input + index)));
+    const __m256 result = _mm256_add_ps(minVector, _mm256_mul_ps(_mm256_cvtepi32_ps(values), rangeVector));
+    _mm256_storeu_ps((output + index), result);
+  }
+  dequantize_generic((input + index), (count - index), min, range, (output + index));
+}
+
+JP_TARGET_AVX512 void dequantize_uint8_avx512(const uint8_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+  const __m512 minVector = _mm512_set1_ps(min);
+  const __m512 rangeVector = _mm512_set1_ps(range);
+  int index = 0;
+  for (; index <= (count - 16); index += 16) {
+    const __m512i values = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(input + index)));
+    const __m512 result = _mm512_add_ps(minVector, _mm512_mul_ps(_mm512_cvtepi32_ps(values), rangeVector));
+    _mm512_storeu_ps((output + index), result);
+  }
+  dequantize_generic((input + index), (count - index), min, range, (output + index));
+}
+
+JP_TARGET_AVX512 void dequantize_uint16_avx512(const uint16_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output) {
+  const __m512 minVector = _mm512_set1_ps(min);
+  const __m512 rangeVector = _mm512_set1_ps(range);
+  int index = 0;
+  for (; index <= (count - 16); index += 16) {
+    const __m512i values = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(input + index)));
+    const __m512 result = _mm512_add_ps(minVector, _mm512_mul_ps(_mm512_cvtepi32_ps(values), rangeVector));
+    _mm512_storeu_ps((output + index), result);
+  }
+  dequantize_generic((input + index), (count - index), min, range, (output + index));
+}
+
+// A bfloat16 only needs moving into the top half of a float, and F16C
+// converts half-precision values eight at a time.
+JP_TARGET_AVX2 void dequantize_half_avx2(const uint16_t* input, int count, int elementFormat, jpfloat_t* output) {
+  int index = 0;
+  if (elementFormat == JPElementFormatBFloat16) {
+    for (; index <= (count - 8); index += 8) {
+      const __m256i values = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(input + index)));
+      _mm256_storeu_ps((output + index), _mm256_castsi256_ps(_mm256_slli_epi32(values, 16)));
+    }
+  } else {
+    for (; index <= (count - 8); index += 8) {
+      const __m256 result = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(input + index)));
+      _mm256_storeu_ps((output + index), result);
+    }
+  }
+  dequantize_half_generic((input + index), (count - index), elementFormat, (output + index));
+}
+
+JP_TARGET_AVX512 void dequantize_half_avx512(const uint16_t* input, int count, int elementFormat, jpfloat_t* output) {
+  int index = 0;
+  if (elementFormat == JPElementFormatBFloat16) {
+    for (; index <= (count - 16); index += 16) {
+      const __m512i values = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(input + index)));
+      _mm512_storeu_ps((output + index), _mm512_castsi512_ps(_mm512_slli_epi32(values, 16)));
+    }
+  } else {
+    for (; index <= (count - 16); index += 16) {
+      const __m512 result = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(input + index)));
+      _mm512_storeu_ps((output + index), result);
+    }
+  }
+  dequantize_half_generic((input + index), (count - index), elementFormat, (output + index));
+}
+
+#endif // USE_CPU_DISPATCH
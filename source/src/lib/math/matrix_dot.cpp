@@ -17,6 +17,14 @@
 #endif // USE_QPU_GEMM
 
 Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
+  const int outputChannels = weights->_dims[areWeightsTransposed ? 0 : 1];
+  const Dimensions outputDims(input->_dims[0], outputChannels);
+  Buffer* output = new Buffer(outputDims);
+  matrix_dot_into(input, weights, areWeightsTransposed, output);
+  return output;
+}
+
+void matrix_dot_into(Buffer* input, Buffer* weights, bool areWeightsTransposed, Buffer* output, const SGemmEpilogue* epilogue) {
 
 #ifdef DO_LOG_OPERATIONS
   fprintf(stderr, "matrix_dot(input=[%s], weights=[%s])\n",
@@ -46,7 +54,7 @@ Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
   const int outputChannels = weightsDims[outputChannelsIndex];
 
   const Dimensions outputDims(imageCount, outputChannels);
-  Buffer* output = new Buffer(outputDims);
+  assert(output->_dims == outputDims);
 
 #ifdef USE_GEMM
 
@@ -73,7 +81,37 @@ Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
   const int ldc = m;
   const jpfloat_t beta = 0.0f;
 
-  if (weights->_bitsPerElement == 32) {
+#if !defined(USE_QPU_GEMM)
+  // A single image only needs a matrix-vector product, which streams the
+  // weights once instead of packing them into panels for a GEMM.
+  const bool useGemv = ((n == 1) && areWeightsTransposed);
+#else // USE_QPU_GEMM
+  const bool useGemv = false;
+#endif // USE_QPU_GEMM
+
+  if (useGemv) {
+    void* weightsData;
+    if (weights->_bitsPerElement == 32) {
+      weightsData = weights->_data;
+    } else {
+      weightsData = weights->_quantizedData;
+    }
+    matrix_gemv(
+      m,
+      k,
+      weightsData,
+      weights->_min,
+      weights->_max,
+      weights->_rowMins,
+      weights->_rowScales,
+      weights->_bitsPerElement,
+      weights->_elementFormat,
+      lda,
+      input->_data,
+      output->_data,
+      epilogue
+    );
+  } else if (weights->_bitsPerElement == 32) {
 #if !defined(USE_QPU_GEMM)
     matrix_gemm(
       order,
@@ -89,7 +127,8 @@ Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
       ldb,
       beta,
       output->_data,
-      ldc
+      ldc,
+      epilogue
     );
 #else // USE_QPU_GEMM
     qpu_cblas_sgemm(
@@ -108,6 +147,9 @@ Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
       output->_gpuMemoryBase,
       ldc
     );
+    if (epilogue != NULL) {
+      matrix_gemm_epilogue(m, n, output->_data, ldc, epilogue);
+    }
 #endif // USE_QPU_GEMM
   } else {
 #if !defined(USE_QPU_GEMM)
@@ -122,13 +164,17 @@ Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
       weights->_quantizedData,
       weights->_min,
       weights->_max,
+      weights->_rowMins,
+      weights->_rowScales,
       weights->_bitsPerElement,
+      weights->_elementFormat,
       lda,
       input->_data,
       ldb,
       beta,
       output->_data,
-      ldc
+      ldc,
+      epilogue
     );
 #else // USE_QPU_GEMM
     qpu_cblas_sgemm_fixed(
@@ -150,6 +196,9 @@ Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
       output->_gpuMemoryBase,
       ldc
     );
+    if (epilogue != NULL) {
+      matrix_gemm_epilogue(m, n, output->_data, ldc, epilogue);
+    }
 #endif // USE_QPU_GEMM
   }
 
@@ -178,6 +227,9 @@ Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
       *outputData = accumulated;
       outputData += 1;
     }
+    if (epilogue != NULL) {
+      matrix_gemm_epilogue(outputChannels, 1, (outputData - outputChannels), outputChannels, epilogue);
+    }
   }
 #endif // USE_GEMM
 
@@ -185,6 +237,4 @@ Buffer* matrix_dot(Buffer* input, Buffer* weights, bool areWeightsTransposed) {
   fprintf(stderr, "matrix_dot() result=[%s]\n",
     output->debugString());
 #endif // DO_LOG_OPERATIONS
-
-  return output;
 }
@@ -0,0 +1,362 @@
+//
+//  matrix_dot_int8.cpp
+//  jpcnn
+//
+//  Runs fully-connected layers directly on their 8-bit weights, rather than
+//  turning them back into floats first. The input is quantized to signed
+//  8-bit values using a range recorded during calibration, the products are
+//  accumulated as exact 32-bit integers, and the results are converted back
+//  to floats in the same pass that applies the bias, scale and ReLU.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "matrix_ops.h"
+
+#include <assert.h>
+#include <math.h>
+
+#include "buffer.h"
+#include "cpu_features.h"
+#include "thread_pool.h"
+
+#if defined(USE_CPU_DISPATCH)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH
+
+// Each call to a kernel works out the dot products of this many rows of
+// weights with one column of inputs, so every input value that's loaded is
+// used several times.
+static const int kInt8KernelRows = 4;
+// Fully-connected layers only have a handful of columns, so the work is split
+// across threads by rows. Every result is calculated the same way whichever
+// task it falls in, so they don't depend on the number of threads.
+static const int kInt8RowsPerTask = 64;
+
+typedef void (*Int8DotKernelFunction)(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals);
+
+typedef struct SInt8GemmTaskStruct {
+  int m;
+  int n;
+  int k;
+  const uint8_t* a;
+  int lda;
+  jpfloat_t aMin;
+  jpfloat_t aRange;
+  const jpfloat_t* aRowMins;
+  const jpfloat_t* aRowScales;
+  const int32_t* aRowSums;
+  const int8_t* b;
+  int ldb;
+  jpfloat_t bZero;
+  jpfloat_t bRange;
+  const int32_t* bColumnSums;
+  jpfloat_t* c;
+  int ldc;
+  const SGemmEpilogue* epilogue;
+  Int8DotKernelFunction kernel;
+} SInt8GemmTask;
+
+static Int8DotKernelFunction int8_kernel_for_current_cpu();
+static void int8_gemm_task(void* cookie, int startIndex, int endIndex);
+static void int8_dot_generic(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals);
+#if defined(USE_CPU_DISPATCH)
+static void int8_dot_sse41(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals);
+static void int8_dot_avx2(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals);
+static void int8_dot_avx512vnni(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals);
+#endif // USE_CPU_DISPATCH
+
+size_t matrix_dot_int8_scratch_bytes(const Dimensions& inputDims) {
+  const int imageCount = inputDims[0];
+  const int inputValuesCount = inputDims.removeDimensions(1).elementCount();
+  const size_t result = ((imageCount * sizeof(int32_t)) + (imageCount * inputValuesCount * sizeof(int8_t)));
+  // Rounded up to whole floats, since that's how scratch buffers are sized.
+  return (((result + sizeof(jpfloat_t) - 1) / sizeof(jpfloat_t)) * sizeof(jpfloat_t));
+}
+
+void matrix_dot_int8_into(Buffer* input, jpfloat_t inputMin, jpfloat_t inputMax, Buffer* weights, const int32_t* weightsRowSums, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
+
+  const Dimensions inputDims = input->_dims;
+  assert(inputDims._length == 2);
+  const int imageCount = inputDims[0];
+  const int inputValuesCount = inputDims[1];
+
+  // The weights have to be transposed, so that each output channel's values
+  // are next to each other in memory.
+  assert(weights->_bitsPerElement == 8);
+  assert(weights->_dims[1] == inputValuesCount);
+  const int outputChannels = weights->_dims[0];
+  assert(output->_dims == Dimensions(imageCount, outputChannels));
+  assert((scratch->_dims.elementCount() * sizeof(jpfloat_t)) >= matrix_dot_int8_scratch_bytes(inputDims));
+
+  // The quantized weights are wMin + (q * wRange) for q in [0, 255], and the
+  // inputs are stored as signed values around the middle of their range, so
+  // that they're iZero + (s * iRange) for s in [-128, 127].
+  const jpfloat_t weightsRange = ((weights->_max - weights->_min) / (1 << 8));
+  const jpfloat_t inputRange = ((inputMax - inputMin) / (1 << 8));
+  const jpfloat_t inputZero = (inputMin + (128 * inputRange));
+
+  int32_t* inputSums = (int32_t*)(scratch->_data);
+  int8_t* quantizedInput = (int8_t*)(inputSums + imageCount);
+  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
+    const int offset = (imageIndex * inputValuesCount);
+    inputSums[imageIndex] = matrix_quantize_int8((input->_data + offset), inputValuesCount, inputMin, inputRange, (quantizedInput + offset));
+  }
+
+  matrix_gemm_int8(
+    outputChannels,
+    imageCount,
+    inputValuesCount,
+    (const uint8_t*)(weights->_quantizedData),
+    inputValuesCount,
+    weights->_min,
+    weightsRange,
+    weights->_rowMins,
+    weights->_rowScales,
+    weightsRowSums,
+    quantizedInput,
+    inputValuesCount,
+    inputZero,
+    inputRange,
+    inputSums,
+    output->_data,
+    outputChannels,
+    epilogue);
+}
+
+int32_t matrix_quantize_int8(const jpfloat_t* input, int count, jpfloat_t min, jpfloat_t range, int8_t* output) {
+  const jpfloat_t recipRange = (1.0f / fmaxf(0.00000001f, range));
+  int32_t total = 0;
+  for (int index = 0; index < count; index += 1) {
+    int quantized = (int)(lrintf((input[index] - min) * recipRange));
+    if (quantized < 0) {
+      quantized = 0;
+    } else if (quantized > 255) {
+      quantized = 255;
+    }
+    const int8_t value = (int8_t)(quantized - 128);
+    output[index] = value;
+    total += value;
+  }
+  return total;
+}
+
+void matrix_gemm_int8(
+  int m,
+  int n,
+  int k,
+  const uint8_t* a,
+  int lda,
+  jpfloat_t aMin,
+  jpfloat_t aRange,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
+  const int32_t* aRowSums,
+  const int8_t* b,
+  int ldb,
+  jpfloat_t bZero,
+  jpfloat_t bRange,
+  const int32_t* bColumnSums,
+  jpfloat_t* c,
+  int ldc,
+  const SGemmEpilogue* epilogue) {
+
+  SInt8GemmTask task;
+  task.m = m;
+  task.n = n;
+  task.k = k;
+  task.a = a;
+  task.lda = lda;
+  task.aMin = aMin;
+  task.aRange = aRange;
+  task.aRowMins = aRowMins;
+  task.aRowScales = aRowScales;
+  task.aRowSums = aRowSums;
+  task.b = b;
+  task.ldb = ldb;
+  task.bZero = bZero;
+  task.bRange = bRange;
+  task.bColumnSums = bColumnSums;
+  task.c = c;
+  task.ldc = ldc;
+  task.epilogue = epilogue;
+  task.kernel = int8_kernel_for_current_cpu();
+  thread_pool_parallel_for(m, kInt8RowsPerTask, int8_gemm_task, &task);
+}
+
+void matrix_int8_row_sums(const uint8_t* a, int m, int k, int lda, int32_t* outSums) {
+  for (int row = 0; row < m; row += 1) {
+    const uint8_t* rowValues = (a + (row * lda));
+    int32_t total = 0;
+    for (int index = 0; index < k; index += 1) {
+      total += rowValues[index];
+    }
+    outSums[row] = total;
+  }
+}
+
+Int8DotKernelFunction int8_kernel_for_current_cpu() {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512VNNI) {
+    return int8_dot_avx512vnni;
+  } else if (level >= JPCPULevelAVX2) {
+    return int8_dot_avx2;
+  } else if (level >= JPCPULevelSSE41) {
+    return int8_dot_sse41;
+  }
+#endif // USE_CPU_DISPATCH
+  return int8_dot_generic;
+}
+
+void int8_gemm_task(void* cookie, int startIndex, int endIndex) {
+  const SInt8GemmTask* task = (const SInt8GemmTask*)(cookie);
+  const int k = task->k;
+  const SGemmEpilogue* epilogue = task->epilogue;
+
+  // Expanding the product of the two affine mappings gives
+  // sum((aMin + (qa * aRange)) * (bZero + (sb * bRange))) =
+  //   (k * aMin * bZero) + (aMin * bRange * sum(sb)) +
+  //   (aRange * bZero * sum(qa)) + (aRange * bRange * sum(qa * sb))
+  // where only the last sum needs the whole dot product. The terms can be
+  // large and nearly cancel, so they're combined in double precision. When
+  // the weights have a range for each row, aMin and aRange are that row's.
+  const double bZero = task->bZero;
+  const double bRange = task->bRange;
+
+  for (int startRow = startIndex; startRow < endIndex; startRow += kInt8KernelRows) {
+    // A short final group repeats its last row, and ignores those results.
+    const uint8_t* rows[kInt8KernelRows];
+    for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+      const int row = MIN((startRow + rowOffset), (endIndex - 1));
+      rows[rowOffset] = (task->a + (row * task->lda));
+    }
+    const int rowsCount = MIN(kInt8KernelRows, (endIndex - startRow));
+    for (int column = 0; column < task->n; column += 1) {
+      int32_t totals[kInt8KernelRows];
+      task->kernel(rows, (task->b + (column * task->ldb)), k, totals);
+      jpfloat_t* cColumn = (task->c + (column * task->ldc));
+      for (int rowOffset = 0; rowOffset < rowsCount; rowOffset += 1) {
+        const int row = (startRow + rowOffset);
+        const double aMin = ((task->aRowMins != NULL) ? task->aRowMins[row] : task->aMin);
+        const double aRange = ((task->aRowScales != NULL) ? task->aRowScales[row] : task->aRange);
+        const double columnTerm = ((k * aMin * bZero) + (aMin * bRange * task->bColumnSums[column]));
+        const double rowTerm = (aRange * bZero * task->aRowSums[row]);
+        jpfloat_t value = (jpfloat_t)(columnTerm + rowTerm + (aRange * bRange * totals[rowOffset]));
+        if (epilogue != NULL) {
+          if (epilogue->bias != NULL) {
+            value += epilogue->bias[row];
+          }
+          value *= epilogue->scale;
+          if (epilogue->doRelu && (value < 0.0f)) {
+            value = 0.0f;
+          }
+        }
+        cColumn[row] = value;
+      }
+    }
+  }
+}
+
+void int8_dot_generic(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals) {
+  for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+    const uint8_t* row = rows[rowOffset];
+    int32_t total = 0;
+    for (int index = 0; index < k; index += 1) {
+      total += (row[index] * column[index]);
+    }
+    outTotals[rowOffset] = total;
+  }
+}
+
+#if defined(USE_CPU_DISPATCH)
+
+// pmaddubsw would multiply and add pairs of unsigned and signed bytes in one
+// instruction, but it saturates at 16 bits, and (255 * -128) * 2 doesn't fit.
+// Widening both sides to 16 bits first and using pmaddwd keeps every total
+// exact. The VNNI instruction accumulates straight into 32 bits, so it can
+// take the bytes as they are.
+
+JP_TARGET_SSE41 void int8_dot_sse41(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals) {
+  __m128i totals[kInt8KernelRows];
+  for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+    totals[rowOffset] = _mm_setzero_si128();
+  }
+  int index = 0;
+  for (; index <= (k - 16); index += 16) {
+    const __m128i columnValues = _mm_loadu_si128((const __m128i*)(column + index));
+    const __m128i columnLow = _mm_cvtepi8_epi16(columnValues);
+    const __m128i columnHigh = _mm_cvtepi8_epi16(_mm_srli_si128(columnValues, 8));
+    for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+      const __m128i rowValues = _mm_loadu_si128((const __m128i*)(rows[rowOffset] + index));
+      const __m128i rowLow = _mm_cvtepu8_epi16(rowValues);
+      const __m128i rowHigh = _mm_cvtepu8_epi16(_mm_srli_si128(rowValues, 8));
+      totals[rowOffset] = _mm_add_epi32(totals[rowOffset], _mm_madd_epi16(rowLow, columnLow));
+      totals[rowOffset] = _mm_add_epi32(totals[rowOffset], _mm_madd_epi16(rowHigh, columnHigh));
+    }
+  }
+  for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+    __m128i total = totals[rowOffset];
+    total = _mm_add_epi32(total, _mm_srli_si128(total, 8));
+    total = _mm_add_epi32(total, _mm_srli_si128(total, 4));
+    int32_t result = _mm_cvtsi128_si32(total);
+    for (int tail = index; tail < k; tail += 1) {
+      result += (rows[rowOffset][tail] * column[tail]);
+    }
+    outTotals[rowOffset] = result;
+  }
+}
+
+JP_TARGET_AVX2 void int8_dot_avx2(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals) {
+  __m256i totals[kInt8KernelRows];
+  for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+    totals[rowOffset] = _mm256_setzero_si256();
+  }
+  int index = 0;
+  for (; index <= (k - 32); index += 32) {
+    const __m256i columnLow = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(column + index)));
+    const __m256i columnHigh = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(column + index + 16)));
+    for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+      const uint8_t* row = (rows[rowOffset] + index);
+      const __m256i rowLow = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row)));
+      const __m256i rowHigh = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(row + 16)));
+      totals[rowOffset] = _mm256_add_epi32(totals[rowOffset], _mm256_madd_epi16(rowLow, columnLow));
+      totals[rowOffset] = _mm256_add_epi32(totals[rowOffset], _mm256_madd_epi16(rowHigh, columnHigh));
+    }
+  }
+  for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+    __m128i total = _mm_add_epi32(_mm256_castsi256_si128(totals[rowOffset]), _mm256_extracti128_si256(totals[rowOffset], 1));
+    total = _mm_add_epi32(total, _mm_srli_si128(total, 8));
+    total = _mm_add_epi32(total, _mm_srli_si128(total, 4));
+    int32_t result = _mm_cvtsi128_si32(total);
+    for (int tail = index; tail < k; tail += 1) {
+      result += (rows[rowOffset][tail] * column[tail]);
+    }
+    outTotals[rowOffset] = result;
+  }
+}
+
+JP_TARGET_AVX512VNNI void int8_dot_avx512vnni(const uint8_t** rows, const int8_t* column, int k, int32_t* outTotals) {
+  __m512i totals[kInt8KernelRows];
+  for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+    totals[rowOffset] = _mm512_setzero_si512();
+  }
+  int index = 0;
+  for (; index <= (k - 64); index += 64) {
+    const __m512i columnValues = _mm512_loadu_si512((const void*)(column + index));
+    for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+      const __m512i rowValues = _mm512_loadu_si512((const void*)(rows[rowOffset] + index));
+      totals[rowOffset] = _mm512_dpbusd_epi32(totals[rowOffset], rowValues, columnValues);
+    }
+  }
+  for (int rowOffset = 0; rowOffset < kInt8KernelRows; rowOffset += 1) {
+    int32_t result = _mm512_reduce_add_epi32(totals[rowOffset]);
+    for (int tail = index; tail < k; tail += 1) {
+      result += (rows[rowOffset][tail] * column[tail]);
+    }
+    outTotals[rowOffset] = result;
+  }
+}
+
+#endif // USE_CPU_DISPATCH
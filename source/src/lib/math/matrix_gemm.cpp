@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -33,16 +34,148 @@
 #include "glgemm.h"
 #endif // USE_OPENGL
 
+#include "thread_pool.h"
+
 #ifdef USE_NEON
 #include <arm_neon.h>
 #include <omp.h>
 #endif // USE_NEON
 
-#if !defined(USE_ACCELERATE_GEMM) && !defined(USE_MKL_GEMM) && !defined(USE_OPENGL) && !defined(USE_ATLAS_GEMM) && !defined(USE_EIGEN_GEMM) && !defined(USE_QPU_GEMM)
+#include <pthread.h>
+
+#ifdef USE_NATIVE_GEMM
+#include "cpu_features.h"
+#if defined(USE_CPU_DISPATCH)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH
+#endif // USE_NATIVE_GEMM
+
+#if !defined(USE_ACCELERATE_GEMM) && !defined(USE_MKL_GEMM) && !defined(USE_OPENGL) && !defined(USE_ATLAS_GEMM) && !defined(USE_EIGEN_GEMM) && !defined(USE_QPU_GEMM) && !defined(USE_NATIVE_GEMM)
 #define USE_NAIVE_GEMM
 #endif
 
-#define DO_LOG_OPERATIONS
+// Results are worked on in blocks of columns that fit comfortably in the L2
+// cache, so that the epilogue doesn't need another trip out to main memory.
+static const int kEpilogueBlockElements = (64 * 1024);
+// The naive loops accumulate this many columns of C at once, so each weight
+// value that's loaded is reused across a whole block of pixels or images.
+static const int kNaiveColumnsPerBlock = 4;
+// The naive GEMM is spread across threads in runs of columns when there are
+// enough of them, so each thread works on its own pixels. Fully-connected
+// layers usually only have a column or two, so those are split by rows of
+// weights instead. Runs of columns are a multiple of the block size, so the
+// results are the same however many threads there are.
+static const int kNaiveColumnsPerTask = (kNaiveColumnsPerBlock * 16);
+static const int kNaiveRowsPerTask = 32;
+// Half-precision weights are converted this many rows at a time into a float
+// panel, rather than a value at a time in the inner loops.
+static const int kNaiveHalfRowsPerPanel = 64;
+
+typedef struct SNaiveGemmTaskStruct {
+  int transposeA;
+  int m;
+  int n;
+  int k;
+  jpfloat_t alpha;
+  void* a;
+  jpfloat_t aMin;
+  jpfloat_t aMax;
+  const jpfloat_t* aRowMins;
+  const jpfloat_t* aRowScales;
+  int aBitsPerElement;
+  int aElementFormat;
+  int lda;
+  jpfloat_t* b;
+  int ldb;
+  jpfloat_t beta;
+  jpfloat_t* c;
+  int ldc;
+  const SGemmEpilogue* epilogue;
+  bool splitColumns;
+} SNaiveGemmTask;
+
+static void naive_gemm_threaded(int order, int transposeA, int transposeB, int m, int n, int k, jpfloat_t alpha, void* a, jpfloat_t aMin, jpfloat_t aMax, const jpfloat_t* aRowMins, const jpfloat_t* aRowScales, int aBitsPerElement, int aElementFormat, int lda, jpfloat_t* b, int ldb, jpfloat_t beta, jpfloat_t* c, int ldc, const SGemmEpilogue* epilogue);
+static void naive_gemm_task(void* cookie, int startIndex, int endIndex);
+static void naive_gemm_half(const SNaiveGemmTask* task, int startRow, int rowsCount, const jpfloat_t* b, int columnsCount, jpfloat_t* c);
+
+#if defined(USE_NATIVE_GEMM)
+// The native GEMM copies blocks of A and B into contiguous panels laid out in
+// the order the micro-kernel reads them, and then works through the results
+// a register-sized tile at a time. A panel block of kNativeRowsPerBlock rows
+// by kNativeDepthPerBlock values is sized to stay in the L2 cache, and each
+// strip of B is reused across all of it. The tile height depends on which
+// instruction set's micro-kernel is picked at run time, from eight rows up to
+// 32, and the row counts below are multiples of all of them.
+static const int kNativeTileColumns = 6;
+static const int kNativeMaxTileRows = 32;
+static const int kNativeDepthPerBlock = 256;
+static const int kNativeRowsPerBlock = 128;
+static const int kNativeColumnsPerBlock = 384;
+// Quantized weights are either converted to floats as they're packed, or
+// left quantized in the panels and converted in registers by the
+// micro-kernels. The second saves the bandwidth of writing and reading a
+// float panel, but repeats the conversion for every tile of columns, so it
+// only pays off when there's a single tile, as there is for fully-connected
+// layers run on one image at a time.
+static const int kNativeMaxColumnsForRegisterConversion = kNativeTileColumns;
+// As with the naive version, the work is split into runs of columns when
+// there are enough of them, and runs of rows otherwise. Both are multiples of
+// the tile size, so every result is calculated the same way whatever the
+// thread count.
+static const int kNativeColumnsPerTask = (kNativeTileColumns * 16);
+static const int kNativeRowsPerTask = kNativeRowsPerBlock;
+
+// What to do with each tile of results once it's been accumulated. Results
+// from the first block of depth are combined with C using beta, and later
+// blocks are added to them. The epilogue is applied after the last block.
+typedef struct SNativeTileUpdateStruct {
+  jpfloat_t alpha;
+  jpfloat_t beta;
+  const SGemmEpilogue* epilogue;
+} SNativeTileUpdate;
+
+typedef struct SNativeGemmBuffersStruct {
+  jpfloat_t* packedA;
+  jpfloat_t* packedB;
+} SNativeGemmBuffers;
+
+// The strips of A are float, uint16_t or uint8_t values, matching the type
+// of the weights. Fixed-point ones in row i of the strip stand for
+// (aMins[i] + (value * aRanges[i])), and both arrays are tileRows long.
+typedef void (*NativeMicroKernelFunction)(int depthCount, const void* a, const jpfloat_t* aMins, const jpfloat_t* aRanges, const jpfloat_t* b, jpfloat_t* c, int ldc, int rowsCount, int columnsCount, const jpfloat_t* bias, const SNativeTileUpdate* update);
+
+// The micro-kernels for one instruction set, and the height of the strips of
+// A they expect to find in the panels.
+typedef struct SNativeKernelStruct {
+  int tileRows;
+  NativeMicroKernelFunction floatKernel;
+  NativeMicroKernelFunction fixed16Kernel;
+  NativeMicroKernelFunction fixed8Kernel;
+} SNativeKernel;
+
+static void native_gemm_threaded(int order, int transposeA, int transposeB, int m, int n, int k, jpfloat_t alpha, void* a, jpfloat_t aMin, jpfloat_t aMax, const jpfloat_t* aRowMins, const jpfloat_t* aRowScales, int aBitsPerElement, int aElementFormat, int lda, jpfloat_t* b, int ldb, const SGemmPatches* patches, jpfloat_t beta, jpfloat_t* c, int ldc, const SGemmEpilogue* epilogue);
+static void native_gemm_task(void* cookie, int startIndex, int endIndex);
+#endif // USE_NATIVE_GEMM
+
+static int epilogue_columns_per_block(int m) {
+  return MAX(16, (kEpilogueBlockElements / MAX(1, m)));
+}
+
+static void gemm_block(
+  int order,
+  int transposeA,
+  int transposeB,
+  int m,
+  int n,
+  int k,
+  jpfloat_t alpha,
+  jpfloat_t *a,
+  int lda,
+  jpfloat_t *b,
+  int ldb,
+  jpfloat_t beta,
+  jpfloat_t* c,
+  int ldc);
 
 void matrix_gemm(
   int order,
@@ -58,7 +191,8 @@ void matrix_gemm(
   int ldb,
   jpfloat_t beta,
   jpfloat_t* c,
-  int ldc) {
+  int ldc,
+  const SGemmEpilogue* epilogue) {
 
 #ifdef DO_LOG_OPERATIONS
   fprintf(stderr, "matrix_gemm(\n  m=%d,\n  n=%d,\n  k=%d,\n  alpha=%f,\n  a=%p,\n  lda=%d,\n  b=%p,\n  ldb=%d,\n  beta=%f,\n  c=%p,\n  ldc=%d)\n",
@@ -75,6 +209,44 @@ void matrix_gemm(
     ldc);
 #endif // DO_LOG_OPERATIONS
 
+#if defined(USE_NAIVE_GEMM)
+  naive_gemm_threaded(order, transposeA, transposeB, m, n, k, alpha, a, 0.0f, 0.0f, NULL, NULL, 32, JPElementFormatLinear, lda, b, ldb, beta, c, ldc, epilogue);
+  return;
+#elif defined(USE_NATIVE_GEMM)
+  native_gemm_threaded(order, transposeA, transposeB, m, n, k, alpha, a, 0.0f, 0.0f, NULL, NULL, 32, JPElementFormatLinear, lda, b, ldb, NULL, beta, c, ldc, epilogue);
+  return;
+#endif // USE_NAIVE_GEMM
+
+  if (epilogue == NULL) {
+    gemm_block(order, transposeA, transposeB, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);
+    return;
+  }
+
+  const int columnsPerBlock = epilogue_columns_per_block(m);
+  for (int jBase = 0; jBase < n; jBase += columnsPerBlock) {
+    const int columnsThisTime = MIN(columnsPerBlock, (n - jBase));
+    jpfloat_t* cBlock = (c + (ldc * jBase));
+    gemm_block(order, transposeA, transposeB, m, columnsThisTime, k, alpha, a, lda, (b + (ldb * jBase)), ldb, beta, cBlock, ldc);
+    matrix_gemm_epilogue(m, columnsThisTime, cBlock, ldc, epilogue);
+  }
+}
+
+static void gemm_block(
+  int order,
+  int transposeA,
+  int transposeB,
+  int m,
+  int n,
+  int k,
+  jpfloat_t alpha,
+  jpfloat_t *a,
+  int lda,
+  jpfloat_t *b,
+  int ldb,
+  jpfloat_t beta,
+  jpfloat_t* c,
+  int ldc) {
+
 #if defined(USE_NAIVE_GEMM)
   naive_cblas_sgemm(
     order,
@@ -143,6 +315,8 @@ void matrix_gemm(
     c,
     ldc
   );
+#elif defined(USE_NATIVE_GEMM)
+  native_gemm_threaded(order, transposeA, transposeB, m, n, k, alpha, a, 0.0f, 0.0f, NULL, NULL, 32, JPElementFormatLinear, lda, b, ldb, NULL, beta, c, ldc, NULL);
 #elif defined(USE_QPU_GEMM)
   assert(false); // You need to call the GEMM function directly so it has access to the GPU memory
 #else
@@ -162,15 +336,24 @@ void matrix_gemm_fixed(
   void *a,
   jpfloat_t aMin,
   jpfloat_t aMax,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
   int aBitsPerElement,
+  int aElementFormat,
   int lda,
   jpfloat_t *b,
   int ldb,
   jpfloat_t beta,
   jpfloat_t* c,
-  int ldc) {
+  int ldc,
+  const SGemmEpilogue* epilogue) {
 
 #if defined(USE_OPENGL)
+  // Half-precision weights and ones with a range for each row are expanded to
+  // floats as they're loaded for the GPU builds, so only fixed-point ones with
+  // a single range should reach here.
+  assert(aElementFormat == JPElementFormatLinear);
+  assert(aRowMins == NULL);
   gl_gemm_fixed(
     order,
     transposeA,
@@ -190,6 +373,9 @@ void matrix_gemm_fixed(
     c,
     ldc
   );
+  if (epilogue != NULL) {
+    matrix_gemm_epilogue(m, n, c, ldc, epilogue);
+  }
 #elif defined(USE_ACCELERATE_GEMM) || defined(USE_MKL_GEMM) || defined(USE_ATLAS_GEMM) || defined(USE_EIGEN_GEMM)
   cblas_sgemm_fixed(
     order,
@@ -202,82 +388,1235 @@ void matrix_gemm_fixed(
     a,
     aMin,
     aMax,
+    aRowMins,
+    aRowScales,
     aBitsPerElement,
+    aElementFormat,
     lda,
     b,
     ldb,
     beta,
     c,
-    ldc
+    ldc,
+    epilogue
   );
 #elif defined(USE_QPU_GEMM)
   assert(false); // You need to call the GEMM function directly so it has access to the GPU memory
+#elif defined(USE_NATIVE_GEMM)
+  // The weights are converted to float either as they're packed into panels,
+  // or in registers by the micro-kernels, so there's no separate pass over
+  // them.
+  native_gemm_threaded(order, transposeA, transposeB, m, n, k, alpha, a, aMin, aMax, aRowMins, aRowScales, aBitsPerElement, aElementFormat, lda, b, ldb, NULL, beta, c, ldc, epilogue);
 #else
-  naive_cblas_sgemm_fixed(
-    order,
-    transposeA,
-    transposeB,
-    m,
-    n,
-    k,
-    alpha,
-    a,
-    aMin,
-    aMax,
-    aBitsPerElement,
-    lda,
-    b,
-    ldb,
-    beta,
-    c,
-    ldc
-  );
+  naive_gemm_threaded(order, transposeA, transposeB, m, n, k, alpha, a, aMin, aMax, aRowMins, aRowScales, aBitsPerElement, aElementFormat, lda, b, ldb, beta, c, ldc, epilogue);
 #endif
 }
 
-void naive_cblas_sgemm(
-  int order,
+#if defined(USE_NATIVE_GEMM)
+void matrix_gemm_patches(
   int transposeA,
-  int transposeB,
   int m,
   int n,
   int k,
   jpfloat_t alpha,
-  jpfloat_t *a,
+  void *a,
+  jpfloat_t aMin,
+  jpfloat_t aMax,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
+  int aBitsPerElement,
+  int aElementFormat,
   int lda,
-  jpfloat_t *b,
+  const SGemmPatches* b,
+  jpfloat_t beta,
+  jpfloat_t* c,
+  int ldc,
+  const SGemmEpilogue* epilogue) {
+  assert(k == (b->kernelWidth * b->kernelWidth * b->inputChannels));
+  native_gemm_threaded(JPCblasColMajor, transposeA, JPCblasNoTrans, m, n, k, alpha, a, aMin, aMax, aRowMins, aRowScales, aBitsPerElement, aElementFormat, lda, NULL, 0, b, beta, c, ldc, epilogue);
+}
+#endif // USE_NATIVE_GEMM
+
+void matrix_gemm_epilogue(int m, int n, jpfloat_t* c, int ldc, const SGemmEpilogue* epilogue) {
+  const jpfloat_t* const bias = epilogue->bias;
+  const jpfloat_t scale = epilogue->scale;
+  const bool doRelu = epilogue->doRelu;
+  for (int j = 0; j < n; j += 1) {
+    jpfloat_t* column = (c + (ldc * j));
+    for (int i = 0; i < m; i += 1) {
+      jpfloat_t value = column[i];
+      if (bias != NULL) {
+        value += bias[i];
+      }
+      value *= scale;
+      if (doRelu) {
+        value = fmaxf(value, 0.0f);
+      }
+      column[i] = value;
+    }
+  }
+}
+
+typedef struct SFixedPanelStruct {
+  jpfloat_t* data;
+  size_t bytes;
+} SFixedPanel;
+
+static pthread_once_t g_fixedPanelOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_fixedPanelKey;
+
+static void free_fixed_panel(void* cookie) {
+  SFixedPanel* panel = (SFixedPanel*)(cookie);
+  free(panel->data);
+  free(panel);
+}
+
+static void create_fixed_panel_key() {
+  pthread_key_create(&g_fixedPanelKey, free_fixed_panel);
+}
+
+// The float copy of each group of weight rows goes into a panel that belongs
+// to the calling thread, and is only reallocated when a layer needs a bigger
+// one than it's seen before. It's used for fixed-point weights with the BLAS
+// libraries, and for half-precision ones with the naive GEMM.
+static jpfloat_t* fixed_panel_for_current_thread(size_t bytes) {
+  pthread_once(&g_fixedPanelOnce, create_fixed_panel_key);
+  SFixedPanel* panel = (SFixedPanel*)(pthread_getspecific(g_fixedPanelKey));
+  if (panel == NULL) {
+    panel = (SFixedPanel*)(malloc(sizeof(SFixedPanel)));
+    panel->data = NULL;
+    panel->bytes = 0;
+    pthread_setspecific(g_fixedPanelKey, panel);
+  }
+  if (panel->bytes < bytes) {
+    free(panel->data);
+    posix_memalign((void**)(&panel->data), 64, bytes);
+    panel->bytes = bytes;
+  }
+  return panel->data;
+}
+
+static inline jpfloat_t naive_value(jpfloat_t value, jpfloat_t aMin, jpfloat_t aRange) {
+  return value;
+}
+
+static inline jpfloat_t naive_value(uint16_t value, jpfloat_t aMin, jpfloat_t aRange) {
+  return (aMin + (value * aRange));
+}
+
+static inline jpfloat_t naive_value(uint8_t value, jpfloat_t aMin, jpfloat_t aRange) {
+  return (aMin + (value * aRange));
+}
+
+// Picks out the min and range for one row of fixed-point values, which are
+// the same for every row unless there are separate ones in aRowMins and
+// aRowScales.
+static inline void fixed_row_range(jpfloat_t aMin, jpfloat_t aRange, const jpfloat_t* aRowMins, const jpfloat_t* aRowScales, int row, jpfloat_t* outMin, jpfloat_t* outRange) {
+  if (aRowMins != NULL) {
+    *outMin = aRowMins[row];
+    *outRange = aRowScales[row];
+  } else {
+    *outMin = aMin;
+    *outRange = aRange;
+  }
+}
+
+// The row ranges are optional, so moving them along to a later row has to
+// allow for them being NULL.
+static inline const jpfloat_t* offset_row_ranges(const jpfloat_t* rowRanges, int startRow) {
+  return ((rowRanges != NULL) ? (rowRanges + startRow) : NULL);
+}
+
+// Works through C a block of columns at a time, keeping one running total per
+// column so every value of A that's loaded and converted is used several times.
+template <class T> static void naive_gemm_blocked(
+  int m,
+  int n,
+  int k,
+  jpfloat_t alpha,
+  const T* a,
+  int aRowStride,
+  int aDepthStride,
+  jpfloat_t aMin,
+  jpfloat_t aRange,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
+  const jpfloat_t* b,
   int ldb,
   jpfloat_t beta,
   jpfloat_t* c,
   int ldc) {
 
+  for (int j = 0; j < n; j += kNaiveColumnsPerBlock) {
+    const int columnsThisTime = MIN(kNaiveColumnsPerBlock, (n - j));
+    const jpfloat_t* b0 = (b + (ldb * j));
+    for (int i = 0; i < m; i++) {
+      const T* aRow = (a + (aRowStride * i));
+      jpfloat_t rowMin;
+      jpfloat_t rowRange;
+      fixed_row_range(aMin, aRange, aRowMins, aRowScales, i, &rowMin, &rowRange);
+      jpfloat_t totals[kNaiveColumnsPerBlock];
+      if (columnsThisTime == 4) {
+        const jpfloat_t* b1 = (b0 + ldb);
+        const jpfloat_t* b2 = (b1 + ldb);
+        const jpfloat_t* b3 = (b2 + ldb);
+        jpfloat_t total0 = 0.0f;
+        jpfloat_t total1 = 0.0f;
+        jpfloat_t total2 = 0.0f;
+        jpfloat_t total3 = 0.0f;
+        for (int l = 0; l < k; l++) {
+          const jpfloat_t aValue = naive_value(aRow[aDepthStride * l], rowMin, rowRange);
+          total0 += (aValue * b0[l]);
+          total1 += (aValue * b1[l]);
+          total2 += (aValue * b2[l]);
+          total3 += (aValue * b3[l]);
+        }
+        totals[0] = total0;
+        totals[1] = total1;
+        totals[2] = total2;
+        totals[3] = total3;
+      } else {
+        for (int column = 0; column < columnsThisTime; column++) {
+          const jpfloat_t* bColumn = (b0 + (ldb * column));
+          jpfloat_t total = 0.0f;
+          for (int l = 0; l < k; l++) {
+            const jpfloat_t aValue = naive_value(aRow[aDepthStride * l], rowMin, rowRange);
+            total += (aValue * bColumn[l]);
+          }
+          totals[column] = total;
+        }
+      }
+      for (int column = 0; column < columnsThisTime; column++) {
+        const int cIndex = ((ldc * (j + column)) + i);
+        const jpfloat_t total = totals[column];
+        // As with BLAS, C isn't read when beta is zero, so it's fine to pass in
+        // uninitialized memory.
+        if (beta == 0.0f) {
+          c[cIndex] = (alpha * total);
+        } else {
+          const jpfloat_t oldCValue = c[cIndex];
+          c[cIndex] = ((alpha * total) + (beta * oldCValue));
+        }
+      }
+    }
+  }
+}
+
+void naive_gemm_threaded(int order, int transposeA, int transposeB, int m, int n, int k, jpfloat_t alpha, void* a, jpfloat_t aMin, jpfloat_t aMax, const jpfloat_t* aRowMins, const jpfloat_t* aRowScales, int aBitsPerElement, int aElementFormat, int lda, jpfloat_t* b, int ldb, jpfloat_t beta, jpfloat_t* c, int ldc, const SGemmEpilogue* epilogue) {
   assert((transposeA == JPCblasNoTrans) || (transposeA == JPCblasTrans));
   assert(transposeB == JPCblasNoTrans);
   assert(order == JPCblasColMajor);
 
-  int i, j, l;
-  for (j = 0; j < n; j++) {
-    for (i = 0; i < m; i++) {
-      jpfloat_t total = 0.0f;
-      for (l = 0; l < k; l++) {
-        int aIndex;
-        if (transposeA == JPCblasNoTrans) {
-          aIndex = ((lda * l) + i);
+  SNaiveGemmTask task;
+  task.transposeA = transposeA;
+  task.m = m;
+  task.n = n;
+  task.k = k;
+  task.alpha = alpha;
+  task.a = a;
+  task.aMin = aMin;
+  task.aMax = aMax;
+  task.aRowMins = aRowMins;
+  task.aRowScales = aRowScales;
+  task.aBitsPerElement = aBitsPerElement;
+  task.aElementFormat = aElementFormat;
+  task.lda = lda;
+  task.b = b;
+  task.ldb = ldb;
+  task.beta = beta;
+  task.c = c;
+  task.ldc = ldc;
+  task.epilogue = epilogue;
+  task.splitColumns = (n >= kNaiveColumnsPerTask);
+  if (task.splitColumns) {
+    thread_pool_parallel_for(n, kNaiveColumnsPerTask, naive_gemm_task, &task);
+  } else {
+    thread_pool_parallel_for(m, kNaiveRowsPerTask, naive_gemm_task, &task);
+  }
+}
+
+void naive_gemm_task(void* cookie, int startIndex, int endIndex) {
+  const SNaiveGemmTask* task = (const SNaiveGemmTask*)(cookie);
+  const int startRow = (task->splitColumns ? 0 : startIndex);
+  const int rowsCount = (task->splitColumns ? task->m : (endIndex - startIndex));
+  const int startColumn = (task->splitColumns ? startIndex : 0);
+  const int columnsCount = (task->splitColumns ? (endIndex - startIndex) : task->n);
+
+  const int aRowStride = ((task->transposeA == JPCblasNoTrans) ? 1 : task->lda);
+  const int aDepthStride = ((task->transposeA == JPCblasNoTrans) ? task->lda : 1);
+  const int aOffset = (aRowStride * startRow);
+  const jpfloat_t* b = (task->b + (task->ldb * startColumn));
+  jpfloat_t* c = (task->c + (task->ldc * startColumn) + startRow);
+
+  if (task->aBitsPerElement == 32) {
+    const jpfloat_t* a = ((jpfloat_t*)(task->a) + aOffset);
+    naive_gemm_blocked(rowsCount, columnsCount, task->k, task->alpha, a, aRowStride, aDepthStride, 0.0f, 1.0f, NULL, NULL, b, task->ldb, task->beta, c, task->ldc);
+  } else if (task->aElementFormat != JPElementFormatLinear) {
+    naive_gemm_half(task, startRow, rowsCount, b, columnsCount, c);
+  } else {
+    const jpfloat_t aRange = ((task->aMax - task->aMin) / (1 << task->aBitsPerElement));
+    const jpfloat_t* aRowMins = offset_row_ranges(task->aRowMins, startRow);
+    const jpfloat_t* aRowScales = offset_row_ranges(task->aRowScales, startRow);
+    if (task->aBitsPerElement == 16) {
+      const uint16_t* a = ((uint16_t*)(task->a) + aOffset);
+      naive_gemm_blocked(rowsCount, columnsCount, task->k, task->alpha, a, aRowStride, aDepthStride, task->aMin, aRange, aRowMins, aRowScales, b, task->ldb, task->beta, c, task->ldc);
+    } else if (task->aBitsPerElement == 8) {
+      const uint8_t* a = ((uint8_t*)(task->a) + aOffset);
+      naive_gemm_blocked(rowsCount, columnsCount, task->k, task->alpha, a, aRowStride, aDepthStride, task->aMin, aRange, aRowMins, aRowScales, b, task->ldb, task->beta, c, task->ldc);
+    } else {
+      assert(false); // Should never get here, only 8 or 16 bit supported
+    }
+  }
+
+  if (task->epilogue != NULL) {
+    SGemmEpilogue rowsEpilogue = *task->epilogue;
+    if (rowsEpilogue.bias != NULL) {
+      rowsEpilogue.bias += startRow;
+    }
+    matrix_gemm_epilogue(rowsCount, columnsCount, c, task->ldc, &rowsEpilogue);
+  }
+}
+
+void naive_gemm_half(const SNaiveGemmTask* task, int startRow, int rowsCount, const jpfloat_t* b, int columnsCount, jpfloat_t* c) {
+  const int k = task->k;
+  const int lda = task->lda;
+  const int elementFormat = task->aElementFormat;
+  const uint16_t* a = (const uint16_t*)(task->a);
+  jpfloat_t* panel = fixed_panel_for_current_thread(sizeof(jpfloat_t) * kNaiveHalfRowsPerPanel * k);
+  for (int panelRow = 0; panelRow < rowsCount; panelRow += kNaiveHalfRowsPerPanel) {
+    const int rowsThisTime = MIN(kNaiveHalfRowsPerPanel, (rowsCount - panelRow));
+    const int row = (startRow + panelRow);
+    // The panel keeps the layout of the weights, so each conversion works on
+    // a contiguous run of them.
+    int panelRowStride;
+    int panelDepthStride;
+    if (task->transposeA == JPCblasNoTrans) {
+      for (int l = 0; l < k; l += 1) {
+        matrix_dequantize_half((a + (lda * l) + row), rowsThisTime, elementFormat, (panel + (rowsThisTime * l)));
+      }
+      panelRowStride = 1;
+      panelDepthStride = rowsThisTime;
+    } else {
+      for (int i = 0; i < rowsThisTime; i += 1) {
+        matrix_dequantize_half((a + (lda * (row + i))), k, elementFormat, (panel + (k * i)));
+      }
+      panelRowStride = k;
+      panelDepthStride = 1;
+    }
+    naive_gemm_blocked(rowsThisTime, columnsCount, k, task->alpha, panel, panelRowStride, panelDepthStride, 0.0f, 1.0f, NULL, NULL, b, task->ldb, task->beta, (c + panelRow), task->ldc);
+  }
+}
+
+#if defined(USE_NATIVE_GEMM)
+
+static pthread_once_t g_nativeBuffersOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_nativeBuffersKey;
+
+static void free_native_buffers(void* cookie) {
+  SNativeGemmBuffers* buffers = (SNativeGemmBuffers*)(cookie);
+  free(buffers->packedA);
+  free(buffers->packedB);
+  free(buffers);
+}
+
+static void create_native_buffers_key() {
+  pthread_key_create(&g_nativeBuffersKey, free_native_buffers);
+}
+
+// Each thread packs into its own panels, which are allocated the first time
+// it runs a GEMM and kept until it exits, so steady-state runs don't touch
+// the heap.
+static SNativeGemmBuffers* native_buffers_for_current_thread() {
+  pthread_once(&g_nativeBuffersOnce, create_native_buffers_key);
+  SNativeGemmBuffers* buffers = (SNativeGemmBuffers*)(pthread_getspecific(g_nativeBuffersKey));
+  if (buffers == NULL) {
+    buffers = (SNativeGemmBuffers*)(malloc(sizeof(SNativeGemmBuffers)));
+    const size_t packedABytes = (sizeof(jpfloat_t) * kNativeRowsPerBlock * kNativeDepthPerBlock);
+    const size_t packedBBytes = (sizeof(jpfloat_t) * kNativeColumnsPerBlock * kNativeDepthPerBlock);
+    posix_memalign((void**)(&buffers->packedA), 64, packedABytes);
+    posix_memalign((void**)(&buffers->packedB), 64, packedBBytes);
+    pthread_setspecific(g_nativeBuffersKey, buffers);
+  }
+  return buffers;
+}
+
+// Copies rowsCount rows and depthCount values of A into strips of tileRows
+// rows, with the rows of each depth step next to each other. The values keep
+// their original type, and the last strip is padded with zeros, which only
+// ever end up in results that are thrown away.
+template <class T> static void native_pack_a(
+  const T* a,
+  int aRowStride,
+  int aDepthStride,
+  int rowsCount,
+  int depthCount,
+  int tileRows,
+  T* packed) {
+
+  for (int stripRow = 0; stripRow < rowsCount; stripRow += tileRows) {
+    const int rowsThisTime = MIN(tileRows, (rowsCount - stripRow));
+    T* strip = (packed + (stripRow * depthCount));
+    if (aDepthStride == 1) {
+      for (int row = 0; row < rowsThisTime; row += 1) {
+        const T* aRow = (a + (aRowStride * (stripRow + row)));
+        T* output = (strip + row);
+        for (int l = 0; l < depthCount; l += 1) {
+          *output = aRow[l];
+          output += tileRows;
+        }
+      }
+    } else {
+      for (int l = 0; l < depthCount; l += 1) {
+        const T* aColumn = (a + (aDepthStride * l) + (aRowStride * stripRow));
+        T* output = (strip + (l * tileRows));
+        for (int row = 0; row < rowsThisTime; row += 1) {
+          output[row] = aColumn[aRowStride * row];
+        }
+      }
+    }
+    if (rowsThisTime < tileRows) {
+      for (int l = 0; l < depthCount; l += 1) {
+        T* output = (strip + (l * tileRows));
+        for (int row = rowsThisTime; row < tileRows; row += 1) {
+          output[row] = 0;
+        }
+      }
+    }
+  }
+}
+
+// The same layout as native_pack_a, with quantized values converted to floats
+// on the way.
+template <class T> static void native_pack_a_as_float(
+  const T* a,
+  int aRowStride,
+  int aDepthStride,
+  jpfloat_t aMin,
+  jpfloat_t aRange,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
+  int rowsCount,
+  int depthCount,
+  int tileRows,
+  jpfloat_t* packed) {
+
+  for (int stripRow = 0; stripRow < rowsCount; stripRow += tileRows) {
+    const int rowsThisTime = MIN(tileRows, (rowsCount - stripRow));
+    jpfloat_t* strip = (packed + (stripRow * depthCount));
+    if (aDepthStride == 1) {
+      for (int row = 0; row < rowsThisTime; row += 1) {
+        const T* aRow = (a + (aRowStride * (stripRow + row)));
+        jpfloat_t rowMin;
+        jpfloat_t rowRange;
+        fixed_row_range(aMin, aRange, aRowMins, aRowScales, (stripRow + row), &rowMin, &rowRange);
+        jpfloat_t* output = (strip + row);
+        for (int l = 0; l < depthCount; l += 1) {
+          *output = naive_value(aRow[l], rowMin, rowRange);
+          output += tileRows;
+        }
+      }
+    } else {
+      jpfloat_t rowMins[kNativeMaxTileRows];
+      jpfloat_t rowRanges[kNativeMaxTileRows];
+      for (int row = 0; row < rowsThisTime; row += 1) {
+        fixed_row_range(aMin, aRange, aRowMins, aRowScales, (stripRow + row), &rowMins[row], &rowRanges[row]);
+      }
+      for (int l = 0; l < depthCount; l += 1) {
+        const T* aColumn = (a + (aDepthStride * l) + (aRowStride * stripRow));
+        jpfloat_t* output = (strip + (l * tileRows));
+        for (int row = 0; row < rowsThisTime; row += 1) {
+          output[row] = naive_value(aColumn[aRowStride * row], rowMins[row], rowRanges[row]);
+        }
+      }
+    }
+    if (rowsThisTime < tileRows) {
+      for (int l = 0; l < depthCount; l += 1) {
+        jpfloat_t* output = (strip + (l * tileRows));
+        for (int row = rowsThisTime; row < tileRows; row += 1) {
+          output[row] = 0.0f;
+        }
+      }
+    }
+  }
+}
+
+// The same layout once more for half-precision or bfloat16 values, converted
+// with matrix_dequantize_half(). When the rows run along the depth, each one
+// is converted into a scratch row first and then spread across the strip.
+static void native_pack_a_half(
+  const uint16_t* a,
+  int aRowStride,
+  int aDepthStride,
+  int elementFormat,
+  int rowsCount,
+  int depthCount,
+  int tileRows,
+  jpfloat_t* packed) {
+
+  assert(depthCount <= kNativeDepthPerBlock);
+  for (int stripRow = 0; stripRow < rowsCount; stripRow += tileRows) {
+    const int rowsThisTime = MIN(tileRows, (rowsCount - stripRow));
+    jpfloat_t* strip = (packed + (stripRow * depthCount));
+    if (aDepthStride == 1) {
+      jpfloat_t converted[kNativeDepthPerBlock];
+      for (int row = 0; row < rowsThisTime; row += 1) {
+        matrix_dequantize_half((a + (aRowStride * (stripRow + row))), depthCount, elementFormat, converted);
+        jpfloat_t* output = (strip + row);
+        for (int l = 0; l < depthCount; l += 1) {
+          *output = converted[l];
+          output += tileRows;
+        }
+      }
+    } else {
+      assert(aRowStride == 1);
+      for (int l = 0; l < depthCount; l += 1) {
+        matrix_dequantize_half((a + (aDepthStride * l) + stripRow), rowsThisTime, elementFormat, (strip + (l * tileRows)));
+      }
+    }
+    if (rowsThisTime < tileRows) {
+      for (int l = 0; l < depthCount; l += 1) {
+        jpfloat_t* output = (strip + (l * tileRows));
+        for (int row = rowsThisTime; row < tileRows; row += 1) {
+          output[row] = 0.0f;
+        }
+      }
+    }
+  }
+}
+
+// Copies columnsCount columns and depthCount values of B into strips of
+// kNativeTileColumns columns, padding the last one with zeros.
+static void native_pack_b(const jpfloat_t* b, int ldb, int columnsCount, int depthCount, jpfloat_t* packed) {
+  for (int stripColumn = 0; stripColumn < columnsCount; stripColumn += kNativeTileColumns) {
+    const int columnsThisTime = MIN(kNativeTileColumns, (columnsCount - stripColumn));
+    jpfloat_t* strip = (packed + (stripColumn * depthCount));
+    for (int column = 0; column < kNativeTileColumns; column += 1) {
+      jpfloat_t* output = (strip + column);
+      if (column < columnsThisTime) {
+        const jpfloat_t* bColumn = (b + (ldb * (stripColumn + column)));
+        for (int l = 0; l < depthCount; l += 1) {
+          *output = bColumn[l];
+          output += kNativeTileColumns;
+        }
+      } else {
+        for (int l = 0; l < depthCount; l += 1) {
+          *output = 0.0f;
+          output += kNativeTileColumns;
+        }
+      }
+    }
+  }
+}
+
+// Packs the same strips as native_pack_b, reading each column's values from
+// the image under its patch instead of from a matrix. A column's values are
+// the rows of its patch one after another, and each row of the patch is a
+// run of kernelWidth pixels that sit next to each other in the image, so
+// they're copied a row at a time, with zeros for anything outside the image.
+static void native_pack_b_patches(const SGemmPatches* patches, int startColumn, int columnsCount, int startDepth, int depthCount, jpfloat_t* packed) {
+  const int inputHeight = patches->inputHeight;
+  const int inputWidth = patches->inputWidth;
+  const int inputChannels = patches->inputChannels;
+  const int kernelWidth = patches->kernelWidth;
+  const int stride = patches->stride;
+  const int outputWidth = patches->outputWidth;
+  const int valuesPerKernelRow = (kernelWidth * inputChannels);
+
+  for (int stripColumn = 0; stripColumn < columnsCount; stripColumn += kNativeTileColumns) {
+    const int columnsThisTime = MIN(kNativeTileColumns, (columnsCount - stripColumn));
+    jpfloat_t* strip = (packed + (stripColumn * depthCount));
+    for (int column = 0; column < kNativeTileColumns; column += 1) {
+      jpfloat_t* output = (strip + column);
+      if (column >= columnsThisTime) {
+        for (int l = 0; l < depthCount; l += 1) {
+          *output = 0.0f;
+          output += kNativeTileColumns;
+        }
+        continue;
+      }
+
+      const int pixel = (startColumn + stripColumn + column);
+      const int originY = (((patches->startRow + (pixel / outputWidth)) * stride) - patches->margin);
+      const int originX = (((pixel % outputWidth) * stride) - patches->margin);
+      const bool isRowInside = ((originX >= 0) && ((originX + kernelWidth) <= inputWidth));
+      int kernelY = (startDepth / valuesPerKernelRow);
+      int rowOffset = (startDepth % valuesPerKernelRow);
+      int valuesLeft = depthCount;
+      while (valuesLeft > 0) {
+        const int valuesThisRow = MIN((valuesPerKernelRow - rowOffset), valuesLeft);
+        const int inputY = (originY + kernelY);
+        if ((inputY < 0) || (inputY >= inputHeight)) {
+          for (int index = 0; index < valuesThisRow; index += 1) {
+            *output = 0.0f;
+            output += kNativeTileColumns;
+          }
         } else {
-          aIndex = ((lda * i) + l);
+          const jpfloat_t* inputRow = (patches->image + (inputY * inputWidth * inputChannels));
+          if (isRowInside) {
+            const jpfloat_t* input = (inputRow + (originX * inputChannels) + rowOffset);
+            for (int index = 0; index < valuesThisRow; index += 1) {
+              *output = input[index];
+              output += kNativeTileColumns;
+            }
+          } else {
+            for (int index = rowOffset; index < (rowOffset + valuesThisRow); index += 1) {
+              const int inputX = (originX + (index / inputChannels));
+              if ((inputX < 0) || (inputX >= inputWidth)) {
+                *output = 0.0f;
+              } else {
+                *output = inputRow[(originX * inputChannels) + index];
+              }
+              output += kNativeTileColumns;
+            }
+          }
         }
-        const jpfloat_t aValue = a[aIndex];
-        const int bIndex = ((ldb * j) + l);
-        const jpfloat_t bValue = b[bIndex];
-        total += (aValue * bValue);
+        valuesLeft -= valuesThisRow;
+        kernelY += 1;
+        rowOffset = 0;
       }
-      const int cIndex = ((ldc * j) + i);
-      const jpfloat_t oldCValue = c[cIndex];
-      c[cIndex] = ((alpha * total) + (beta * oldCValue));
     }
   }
 }
 
+static inline jpfloat_t native_update_value(jpfloat_t total, jpfloat_t oldValue, jpfloat_t bias, const SNativeTileUpdate* update) {
+  jpfloat_t value = (update->alpha * total);
+  if (update->beta != 0.0f) {
+    value += (update->beta * oldValue);
+  }
+  const SGemmEpilogue* epilogue = update->epilogue;
+  if (epilogue != NULL) {
+    value = ((value + bias) * epilogue->scale);
+    if (epilogue->doRelu) {
+      value = fmaxf(value, 0.0f);
+    }
+  }
+  return value;
+}
+
+// Used for tiles that hang off the edge of C, with totals holding the
+// accumulated values a column of tileRows at a time.
+static void native_update_partial_tile(const jpfloat_t* totals, int tileRows, jpfloat_t* c, int ldc, int rowsCount, int columnsCount, const jpfloat_t* bias, const SNativeTileUpdate* update) {
+  for (int column = 0; column < columnsCount; column += 1) {
+    jpfloat_t* cColumn = (c + (ldc * column));
+    const jpfloat_t* totalsColumn = (totals + (tileRows * column));
+    for (int row = 0; row < rowsCount; row += 1) {
+      const jpfloat_t biasValue = ((bias != NULL) ? bias[row] : 0.0f);
+      const jpfloat_t oldValue = ((update->beta != 0.0f) ? cColumn[row] : 0.0f);
+      cColumn[row] = native_update_value(totalsColumn[row], oldValue, biasValue, update);
+    }
+  }
+}
+
+// A plain C version of the tile loop for processors without any of the
+// instruction sets below, written so that the compiler can keep the totals
+// in whatever vector registers the build targets. Copying each step of A
+// into a local array first lets it see that the totals can't be overwritten
+// through the input pointers.
+static const int kNativeGenericTileRows = 8;
+
+template <class T> static void native_micro_kernel_generic(int depthCount, const void* aData, const jpfloat_t* aMins, const jpfloat_t* aRanges, const jpfloat_t* b, jpfloat_t* c, int ldc, int rowsCount, int columnsCount, const jpfloat_t* bias, const SNativeTileUpdate* update) {
+  const T* a = (const T*)(aData);
+  jpfloat_t totals[kNativeTileColumns][kNativeGenericTileRows];
+  for (int column = 0; column < kNativeTileColumns; column += 1) {
+    for (int row = 0; row < kNativeGenericTileRows; row += 1) {
+      totals[column][row] = 0.0f;
+    }
+  }
+  for (int l = 0; l < depthCount; l += 1) {
+    jpfloat_t aValues[kNativeGenericTileRows];
+    for (int row = 0; row < kNativeGenericTileRows; row += 1) {
+      aValues[row] = naive_value(a[row], aMins[row], aRanges[row]);
+    }
+    for (int column = 0; column < kNativeTileColumns; column += 1) {
+      const jpfloat_t bValue = b[column];
+      for (int row = 0; row < kNativeGenericTileRows; row += 1) {
+        totals[column][row] += (aValues[row] * bValue);
+      }
+    }
+    a += kNativeGenericTileRows;
+    b += kNativeTileColumns;
+  }
+  native_update_partial_tile(&totals[0][0], kNativeGenericTileRows, c, ldc, rowsCount, columnsCount, bias, update);
+}
+
+static const SNativeKernel g_nativeGenericKernel = {
+  kNativeGenericTileRows,
+  native_micro_kernel_generic<jpfloat_t>,
+  native_micro_kernel_generic<uint16_t>,
+  native_micro_kernel_generic<uint8_t>,
+};
+
+#if defined(USE_CPU_DISPATCH)
+
+static const int kNativeSSE41TileRows = 8;
+
+JP_TARGET_SSE41 static inline __m128 native_update_vector_sse41(__m128 total, const jpfloat_t* c, const jpfloat_t* bias, const SNativeTileUpdate* update) {
+  __m128 value = _mm_mul_ps(_mm_set1_ps(update->alpha), total);
+  if (update->beta != 0.0f) {
+    value = _mm_add_ps(value, _mm_mul_ps(_mm_set1_ps(update->beta), _mm_loadu_ps(c)));
+  }
+  const SGemmEpilogue* epilogue = update->epilogue;
+  if (epilogue != NULL) {
+    if (bias != NULL) {
+      value = _mm_add_ps(value, _mm_loadu_ps(bias));
+    }
+    value = _mm_mul_ps(value, _mm_set1_ps(epilogue->scale));
+    if (epilogue->doRelu) {
+      value = _mm_max_ps(value, _mm_setzero_ps());
+    }
+  }
+  return value;
+}
+
+// Loads one step of a strip of A as two vectors of floats.
+JP_TARGET_SSE41 static inline void native_load_a_sse41(const jpfloat_t* a, __m128 aMin0, __m128 aMin1, __m128 aRange0, __m128 aRange1, __m128* outA0, __m128* outA1) {
+  *outA0 = _mm_load_ps(a);
+  *outA1 = _mm_load_ps(a + 4);
+}
+
+JP_TARGET_SSE41 static inline void native_load_a_sse41(const uint16_t* a, __m128 aMin0, __m128 aMin1, __m128 aRange0, __m128 aRange1, __m128* outA0, __m128* outA1) {
+  const __m128i values = _mm_loadu_si128((const __m128i*)(a));
+  const __m128 low = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(values));
+  const __m128 high = _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(values, 8)));
+  *outA0 = _mm_add_ps(aMin0, _mm_mul_ps(low, aRange0));
+  *outA1 = _mm_add_ps(aMin1, _mm_mul_ps(high, aRange1));
+}
+
+JP_TARGET_SSE41 static inline void native_load_a_sse41(const uint8_t* a, __m128 aMin0, __m128 aMin1, __m128 aRange0, __m128 aRange1, __m128* outA0, __m128* outA1) {
+  const __m128i values = _mm_loadl_epi64((const __m128i*)(a));
+  const __m128 low = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(values));
+  const __m128 high = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(values, 4)));
+  *outA0 = _mm_add_ps(aMin0, _mm_mul_ps(low, aRange0));
+  *outA1 = _mm_add_ps(aMin1, _mm_mul_ps(high, aRange1));
+}
+
+// Accumulates an 8x6 tile of C in twelve registers, using two vectors of A and
+// six broadcast values of B for each step along the depth.
+template <class T> JP_TARGET_SSE41 static void native_micro_kernel_sse41(int depthCount, const void* aData, const jpfloat_t* aMins, const jpfloat_t* aRanges, const jpfloat_t* b, jpfloat_t* c, int ldc, int rowsCount, int columnsCount, const jpfloat_t* bias, const SNativeTileUpdate* update) {
+  const T* a = (const T*)(aData);
+  const __m128 aMin0 = _mm_loadu_ps(aMins);
+  const __m128 aMin1 = _mm_loadu_ps(aMins + 4);
+  const __m128 aRange0 = _mm_loadu_ps(aRanges);
+  const __m128 aRange1 = _mm_loadu_ps(aRanges + 4);
+  __m128 c00 = _mm_setzero_ps();
+  __m128 c01 = _mm_setzero_ps();
+  __m128 c02 = _mm_setzero_ps();
+  __m128 c03 = _mm_setzero_ps();
+  __m128 c04 = _mm_setzero_ps();
+  __m128 c05 = _mm_setzero_ps();
+  __m128 c10 = _mm_setzero_ps();
+  __m128 c11 = _mm_setzero_ps();
+  __m128 c12 = _mm_setzero_ps();
+  __m128 c13 = _mm_setzero_ps();
+  __m128 c14 = _mm_setzero_ps();
+  __m128 c15 = _mm_setzero_ps();
+  for (int l = 0; l < depthCount; l += 1) {
+    __m128 a0;
+    __m128 a1;
+    native_load_a_sse41(a, aMin0, aMin1, aRange0, aRange1, &a0, &a1);
+    __m128 bValue = _mm_set1_ps(b[0]);
+    c00 = _mm_add_ps(c00, _mm_mul_ps(a0, bValue));
+    c10 = _mm_add_ps(c10, _mm_mul_ps(a1, bValue));
+    bValue = _mm_set1_ps(b[1]);
+    c01 = _mm_add_ps(c01, _mm_mul_ps(a0, bValue));
+    c11 = _mm_add_ps(c11, _mm_mul_ps(a1, bValue));
+    bValue = _mm_set1_ps(b[2]);
+    c02 = _mm_add_ps(c02, _mm_mul_ps(a0, bValue));
+    c12 = _mm_add_ps(c12, _mm_mul_ps(a1, bValue));
+    bValue = _mm_set1_ps(b[3]);
+    c03 = _mm_add_ps(c03, _mm_mul_ps(a0, bValue));
+    c13 = _mm_add_ps(c13, _mm_mul_ps(a1, bValue));
+    bValue = _mm_set1_ps(b[4]);
+    c04 = _mm_add_ps(c04, _mm_mul_ps(a0, bValue));
+    c14 = _mm_add_ps(c14, _mm_mul_ps(a1, bValue));
+    bValue = _mm_set1_ps(b[5]);
+    c05 = _mm_add_ps(c05, _mm_mul_ps(a0, bValue));
+    c15 = _mm_add_ps(c15, _mm_mul_ps(a1, bValue));
+    a += kNativeSSE41TileRows;
+    b += kNativeTileColumns;
+  }
+
+  __m128 totals[kNativeTileColumns * 2] = {c00, c10, c01, c11, c02, c12, c03, c13, c04, c14, c05, c15};
+  if ((rowsCount == kNativeSSE41TileRows) && (columnsCount == kNativeTileColumns)) {
+    const jpfloat_t* bias1 = ((bias != NULL) ? (bias + 4) : NULL);
+    for (int column = 0; column < kNativeTileColumns; column += 1) {
+      jpfloat_t* cColumn = (c + (ldc * column));
+      _mm_storeu_ps(cColumn, native_update_vector_sse41(totals[(column * 2) + 0], cColumn, bias, update));
+      _mm_storeu_ps((cColumn + 4), native_update_vector_sse41(totals[(column * 2) + 1], (cColumn + 4), bias1, update));
+    }
+  } else {
+    jpfloat_t partialTotals[kNativeSSE41TileRows * kNativeTileColumns];
+    for (int index = 0; index < (kNativeTileColumns * 2); index += 1) {
+      _mm_storeu_ps((partialTotals + (index * 4)), totals[index]);
+    }
+    native_update_partial_tile(partialTotals, kNativeSSE41TileRows, c, ldc, rowsCount, columnsCount, bias, update);
+  }
+}
+
+static const SNativeKernel g_nativeSSE41Kernel = {
+  kNativeSSE41TileRows,
+  native_micro_kernel_sse41<jpfloat_t>,
+  native_micro_kernel_sse41<uint16_t>,
+  native_micro_kernel_sse41<uint8_t>,
+};
+
+static const int kNativeAVX2TileRows = 16;
+
+JP_TARGET_AVX2 static inline __m256 native_update_vector_avx2(__m256 total, const jpfloat_t* c, const jpfloat_t* bias, const SNativeTileUpdate* update) {
+  __m256 value = _mm256_mul_ps(_mm256_set1_ps(update->alpha), total);
+  if (update->beta != 0.0f) {
+    value = _mm256_fmadd_ps(_mm256_set1_ps(update->beta), _mm256_loadu_ps(c), value);
+  }
+  const SGemmEpilogue* epilogue = update->epilogue;
+  if (epilogue != NULL) {
+    if (bias != NULL) {
+      value = _mm256_add_ps(value, _mm256_loadu_ps(bias));
+    }
+    value = _mm256_mul_ps(value, _mm256_set1_ps(epilogue->scale));
+    if (epilogue->doRelu) {
+      value = _mm256_max_ps(value, _mm256_setzero_ps());
+    }
+  }
+  return value;
+}
+
+JP_TARGET_AVX2 static inline void native_load_a_avx2(const jpfloat_t* a, __m256 aMin0, __m256 aMin1, __m256 aRange0, __m256 aRange1, __m256* outA0, __m256* outA1) {
+  *outA0 = _mm256_load_ps(a);
+  *outA1 = _mm256_load_ps(a + 8);
+}
+
+JP_TARGET_AVX2 static inline void native_load_a_avx2(const uint16_t* a, __m256 aMin0, __m256 aMin1, __m256 aRange0, __m256 aRange1, __m256* outA0, __m256* outA1) {
+  const __m256 low = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(a))));
+  const __m256 high = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(a + 8))));
+  *outA0 = _mm256_fmadd_ps(low, aRange0, aMin0);
+  *outA1 = _mm256_fmadd_ps(high, aRange1, aMin1);
+}
+
+JP_TARGET_AVX2 static inline void native_load_a_avx2(const uint8_t* a, __m256 aMin0, __m256 aMin1, __m256 aRange0, __m256 aRange1, __m256* outA0, __m256* outA1) {
+  const __m256 low = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(a))));
+  const __m256 high = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(a + 8))));
+  *outA0 = _mm256_fmadd_ps(low, aRange0, aMin0);
+  *outA1 = _mm256_fmadd_ps(high, aRange1, aMin1);
+}
+
+// Accumulates a 16x6 tile of C in twelve registers, using two vectors of A and
+// six broadcast values of B for each step along the depth.
+template <class T> JP_TARGET_AVX2 static void native_micro_kernel_avx2(int depthCount, const void* aData, const jpfloat_t* aMins, const jpfloat_t* aRanges, const jpfloat_t* b, jpfloat_t* c, int ldc, int rowsCount, int columnsCount, const jpfloat_t* bias, const SNativeTileUpdate* update) {
+  const T* a = (const T*)(aData);
+  const __m256 aMin0 = _mm256_loadu_ps(aMins);
+  const __m256 aMin1 = _mm256_loadu_ps(aMins + 8);
+  const __m256 aRange0 = _mm256_loadu_ps(aRanges);
+  const __m256 aRange1 = _mm256_loadu_ps(aRanges + 8);
+  __m256 c00 = _mm256_setzero_ps();
+  __m256 c01 = _mm256_setzero_ps();
+  __m256 c02 = _mm256_setzero_ps();
+  __m256 c03 = _mm256_setzero_ps();
+  __m256 c04 = _mm256_setzero_ps();
+  __m256 c05 = _mm256_setzero_ps();
+  __m256 c10 = _mm256_setzero_ps();
+  __m256 c11 = _mm256_setzero_ps();
+  __m256 c12 = _mm256_setzero_ps();
+  __m256 c13 = _mm256_setzero_ps();
+  __m256 c14 = _mm256_setzero_ps();
+  __m256 c15 = _mm256_setzero_ps();
+  for (int l = 0; l < depthCount; l += 1) {
+    __m256 a0;
+    __m256 a1;
+    native_load_a_avx2(a, aMin0, aMin1, aRange0, aRange1, &a0, &a1);
+    __m256 bValue = _mm256_broadcast_ss(b);
+    c00 = _mm256_fmadd_ps(a0, bValue, c00);
+    c10 = _mm256_fmadd_ps(a1, bValue, c10);
+    bValue = _mm256_broadcast_ss(b + 1);
+    c01 = _mm256_fmadd_ps(a0, bValue, c01);
+    c11 = _mm256_fmadd_ps(a1, bValue, c11);
+    bValue = _mm256_broadcast_ss(b + 2);
+    c02 = _mm256_fmadd_ps(a0, bValue, c02);
+    c12 = _mm256_fmadd_ps(a1, bValue, c12);
+    bValue = _mm256_broadcast_ss(b + 3);
+    c03 = _mm256_fmadd_ps(a0, bValue, c03);
+    c13 = _mm256_fmadd_ps(a1, bValue, c13);
+    bValue = _mm256_broadcast_ss(b + 4);
+    c04 = _mm256_fmadd_ps(a0, bValue, c04);
+    c14 = _mm256_fmadd_ps(a1, bValue, c14);
+    bValue = _mm256_broadcast_ss(b + 5);
+    c05 = _mm256_fmadd_ps(a0, bValue, c05);
+    c15 = _mm256_fmadd_ps(a1, bValue, c15);
+    a += kNativeAVX2TileRows;
+    b += kNativeTileColumns;
+  }
+
+  __m256 totals[kNativeTileColumns * 2] = {c00, c10, c01, c11, c02, c12, c03, c13, c04, c14, c05, c15};
+  if ((rowsCount == kNativeAVX2TileRows) && (columnsCount == kNativeTileColumns)) {
+    const jpfloat_t* bias1 = ((bias != NULL) ? (bias + 8) : NULL);
+    for (int column = 0; column < kNativeTileColumns; column += 1) {
+      jpfloat_t* cColumn = (c + (ldc * column));
+      _mm256_storeu_ps(cColumn, native_update_vector_avx2(totals[(column * 2) + 0], cColumn, bias, update));
+      _mm256_storeu_ps((cColumn + 8), native_update_vector_avx2(totals[(column * 2) + 1], (cColumn + 8), bias1, update));
+    }
+  } else {
+    jpfloat_t partialTotals[kNativeAVX2TileRows * kNativeTileColumns];
+    for (int index = 0; index < (kNativeTileColumns * 2); index += 1) {
+      _mm256_storeu_ps((partialTotals + (index * 8)), totals[index]);
+    }
+    native_update_partial_tile(partialTotals, kNativeAVX2TileRows, c, ldc, rowsCount, columnsCount, bias, update);
+  }
+}
+
+static const SNativeKernel g_nativeAVX2Kernel = {
+  kNativeAVX2TileRows,
+  native_micro_kernel_avx2<jpfloat_t>,
+  native_micro_kernel_avx2<uint16_t>,
+  native_micro_kernel_avx2<uint8_t>,
+};
+
+static const int kNativeAVX512TileRows = 32;
+
+JP_TARGET_AVX512 static inline __m512 native_update_vector_avx512(__m512 total, const jpfloat_t* c, const jpfloat_t* bias, const SNativeTileUpdate* update) {
+  __m512 value = _mm512_mul_ps(_mm512_set1_ps(update->alpha), total);
+  if (update->beta != 0.0f) {
+    value = _mm512_fmadd_ps(_mm512_set1_ps(update->beta), _mm512_loadu_ps(c), value);
+  }
+  const SGemmEpilogue* epilogue = update->epilogue;
+  if (epilogue != NULL) {
+    if (bias != NULL) {
+      value = _mm512_add_ps(value, _mm512_loadu_ps(bias));
+    }
+    value = _mm512_mul_ps(value, _mm512_set1_ps(epilogue->scale));
+    if (epilogue->doRelu) {
+      value = _mm512_max_ps(value, _mm512_setzero_ps());
+    }
+  }
+  return value;
+}
+
+JP_TARGET_AVX512 static inline void native_load_a_avx512(const jpfloat_t* a, __m512 aMin0, __m512 aMin1, __m512 aRange0, __m512 aRange1, __m512* outA0, __m512* outA1) {
+  *outA0 = _mm512_load_ps(a);
+  *outA1 = _mm512_load_ps(a + 16);
+}
+
+JP_TARGET_AVX512 static inline void native_load_a_avx512(const uint16_t* a, __m512 aMin0, __m512 aMin1, __m512 aRange0, __m512 aRange1, __m512* outA0, __m512* outA1) {
+  const __m512 low = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(a))));
+  const __m512 high = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(a + 16))));
+  *outA0 = _mm512_fmadd_ps(low, aRange0, aMin0);
+  *outA1 = _mm512_fmadd_ps(high, aRange1, aMin1);
+}
+
+JP_TARGET_AVX512 static inline void native_load_a_avx512(const uint8_t* a, __m512 aMin0, __m512 aMin1, __m512 aRange0, __m512 aRange1, __m512* outA0, __m512* outA1) {
+  const __m512 low = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(a))));
+  const __m512 high = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(a + 16))));
+  *outA0 = _mm512_fmadd_ps(low, aRange0, aMin0);
+  *outA1 = _mm512_fmadd_ps(high, aRange1, aMin1);
+}
+
+// The same register layout as the AVX2 version, with vectors twice as wide,
+// so each tile is 32x6.
+template <class T> JP_TARGET_AVX512 static void native_micro_kernel_avx512(int depthCount, const void* aData, const jpfloat_t* aMins, const jpfloat_t* aRanges, const jpfloat_t* b, jpfloat_t* c, int ldc, int rowsCount, int columnsCount, const jpfloat_t* bias, const SNativeTileUpdate* update) {
+  const T* a = (const T*)(aData);
+  const __m512 aMin0 = _mm512_loadu_ps(aMins);
+  const __m512 aMin1 = _mm512_loadu_ps(aMins + 16);
+  const __m512 aRange0 = _mm512_loadu_ps(aRanges);
+  const __m512 aRange1 = _mm512_loadu_ps(aRanges + 16);
+  __m512 c00 = _mm512_setzero_ps();
+  __m512 c01 = _mm512_setzero_ps();
+  __m512 c02 = _mm512_setzero_ps();
+  __m512 c03 = _mm512_setzero_ps();
+  __m512 c04 = _mm512_setzero_ps();
+  __m512 c05 = _mm512_setzero_ps();
+  __m512 c10 = _mm512_setzero_ps();
+  __m512 c11 = _mm512_setzero_ps();
+  __m512 c12 = _mm512_setzero_ps();
+  __m512 c13 = _mm512_setzero_ps();
+  __m512 c14 = _mm512_setzero_ps();
+  __m512 c15 = _mm512_setzero_ps();
+  for (int l = 0; l < depthCount; l += 1) {
+    __m512 a0;
+    __m512 a1;
+    native_load_a_avx512(a, aMin0, aMin1, aRange0, aRange1, &a0, &a1);
+    __m512 bValue = _mm512_set1_ps(b[0]);
+    c00 = _mm512_fmadd_ps(a0, bValue, c00);
+    c10 = _mm512_fmadd_ps(a1, bValue, c10);
+    bValue = _mm512_set1_ps(b[1]);
+    c01 = _mm512_fmadd_ps(a0, bValue, c01);
+    c11 = _mm512_fmadd_ps(a1, bValue, c11);
+    bValue = _mm512_set1_ps(b[2]);
+    c02 = _mm512_fmadd_ps(a0, bValue, c02);
+    c12 = _mm512_fmadd_ps(a1, bValue, c12);
+    bValue = _mm512_set1_ps(b[3]);
+    c03 = _mm512_fmadd_ps(a0, bValue, c03);
+    c13 = _mm512_fmadd_ps(a1, bValue, c13);
+    bValue = _mm512_set1_ps(b[4]);
+    c04 = _mm512_fmadd_ps(a0, bValue, c04);
+    c14 = _mm512_fmadd_ps(a1, bValue, c14);
+    bValue = _mm512_set1_ps(b[5]);
+    c05 = _mm512_fmadd_ps(a0, bValue, c05);
+    c15 = _mm512_fmadd_ps(a1, bValue, c15);
+    a += kNativeAVX512TileRows;
+    b += kNativeTileColumns;
+  }
+
+  __m512 totals[kNativeTileColumns * 2] = {c00, c10, c01, c11, c02, c12, c03, c13, c04, c14, c05, c15};
+  if ((rowsCount == kNativeAVX512TileRows) && (columnsCount == kNativeTileColumns)) {
+    const jpfloat_t* bias1 = ((bias != NULL) ? (bias + 16) : NULL);
+    for (int column = 0; column < kNativeTileColumns; column += 1) {
+      jpfloat_t* cColumn = (c + (ldc * column));
+      _mm512_storeu_ps(cColumn, native_update_vector_avx512(totals[(column * 2) + 0], cColumn, bias, update));
+      _mm512_storeu_ps((cColumn + 16), native_update_vector_avx512(totals[(column * 2) + 1], (cColumn + 16), bias1, update));
+    }
+  } else {
+    jpfloat_t partialTotals[kNativeAVX512TileRows * kNativeTileColumns];
+    for (int index = 0; index < (kNativeTileColumns * 2); index += 1) {
+      _mm512_storeu_ps((partialTotals + (index * 16)), totals[index]);
+    }
+    native_update_partial_tile(partialTotals, kNativeAVX512TileRows, c, ldc, rowsCount, columnsCount, bias, update);
+  }
+}
+
+static const SNativeKernel g_nativeAVX512Kernel = {
+  kNativeAVX512TileRows,
+  native_micro_kernel_avx512<jpfloat_t>,
+  native_micro_kernel_avx512<uint16_t>,
+  native_micro_kernel_avx512<uint8_t>,
+};
+
+#endif // USE_CPU_DISPATCH
+
+static const SNativeKernel* native_kernel_for_current_cpu() {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    return &g_nativeAVX512Kernel;
+  } else if (level >= JPCPULevelAVX2) {
+    return &g_nativeAVX2Kernel;
+  } else if (level >= JPCPULevelSSE41) {
+    return &g_nativeSSE41Kernel;
+  }
+#endif // USE_CPU_DISPATCH
+  return &g_nativeGenericKernel;
+}
+
+typedef struct SNativeGemmTaskStruct {
+  int transposeA;
+  int m;
+  int n;
+  int k;
+  jpfloat_t alpha;
+  void* a;
+  jpfloat_t aMin;
+  jpfloat_t aMax;
+  const jpfloat_t* aRowMins;
+  const jpfloat_t* aRowScales;
+  int aBitsPerElement;
+  int aElementFormat;
+  int lda;
+  jpfloat_t* b;
+  int ldb;
+  // Set instead of b when B is made up of an image's patches.
+  const SGemmPatches* patches;
+  jpfloat_t beta;
+  jpfloat_t* c;
+  int ldc;
+  const SGemmEpilogue* epilogue;
+  bool splitColumns;
+  const SNativeKernel* kernel;
+} SNativeGemmTask;
+
+void native_gemm_threaded(int order, int transposeA, int transposeB, int m, int n, int k, jpfloat_t alpha, void* a, jpfloat_t aMin, jpfloat_t aMax, const jpfloat_t* aRowMins, const jpfloat_t* aRowScales, int aBitsPerElement, int aElementFormat, int lda, jpfloat_t* b, int ldb, const SGemmPatches* patches, jpfloat_t beta, jpfloat_t* c, int ldc, const SGemmEpilogue* epilogue) {
+  assert((transposeA == JPCblasNoTrans) || (transposeA == JPCblasTrans));
+  assert(transposeB == JPCblasNoTrans);
+  assert(order == JPCblasColMajor);
+
+  // Packing only pays for itself when every value of A is used across several
+  // columns. Products with fewer columns than a tile, like fully-connected
+  // layers on a single image, are limited by reading the weights anyway, so
+  // they go through the unpacked loops that only touch A once. Patches have
+  // to be packed, however few there are.
+  if ((n < kNativeTileColumns) && (patches == NULL)) {
+    naive_gemm_threaded(order, transposeA, transposeB, m, n, k, alpha, a, aMin, aMax, aRowMins, aRowScales, aBitsPerElement, aElementFormat, lda, b, ldb, beta, c, ldc, epilogue);
+    return;
+  }
+
+  SNativeGemmTask task;
+  task.transposeA = transposeA;
+  task.m = m;
+  task.n = n;
+  task.k = k;
+  task.alpha = alpha;
+  task.a = a;
+  task.aMin = aMin;
+  task.aMax = aMax;
+  task.aRowMins = aRowMins;
+  task.aRowScales = aRowScales;
+  task.aBitsPerElement = aBitsPerElement;
+  task.aElementFormat = aElementFormat;
+  task.lda = lda;
+  task.b = b;
+  task.ldb = ldb;
+  task.patches = patches;
+  task.beta = beta;
+  task.c = c;
+  task.ldc = ldc;
+  task.epilogue = epilogue;
+  task.splitColumns = (n >= kNativeColumnsPerTask);
+  task.kernel = native_kernel_for_current_cpu();
+  if (task.splitColumns) {
+    thread_pool_parallel_for(n, kNativeColumnsPerTask, native_gemm_task, &task);
+  } else {
+    thread_pool_parallel_for(m, kNativeRowsPerTask, native_gemm_task, &task);
+  }
+}
+
+// The panel buffer is sized for floats, so it has room for narrower values.
+static void native_pack_a_block(const SNativeGemmTask* task, int startRow, int rowsCount, int startDepth, int depthCount, bool convertInRegisters, void* packed) {
+  const int tileRows = task->kernel->tileRows;
+  const int aRowStride = ((task->transposeA == JPCblasNoTrans) ? 1 : task->lda);
+  const int aDepthStride = ((task->transposeA == JPCblasNoTrans) ? task->lda : 1);
+  const int aOffset = ((aRowStride * startRow) + (aDepthStride * startDepth));
+  const jpfloat_t aRange = ((task->aMax - task->aMin) / (1 << task->aBitsPerElement));
+  const jpfloat_t* aRowMins = offset_row_ranges(task->aRowMins, startRow);
+  const jpfloat_t* aRowScales = offset_row_ranges(task->aRowScales, startRow);
+  if (task->aBitsPerElement == 32) {
+    const jpfloat_t* a = ((jpfloat_t*)(task->a) + aOffset);
+    native_pack_a(a, aRowStride, aDepthStride, rowsCount, depthCount, tileRows, (jpfloat_t*)(packed));
+  } else if (task->aElementFormat != JPElementFormatLinear) {
+    const uint16_t* a = ((uint16_t*)(task->a) + aOffset);
+    native_pack_a_half(a, aRowStride, aDepthStride, task->aElementFormat, rowsCount, depthCount, tileRows, (jpfloat_t*)(packed));
+  } else if (task->aBitsPerElement == 16) {
+    const uint16_t* a = ((uint16_t*)(task->a) + aOffset);
+    if (convertInRegisters) {
+      native_pack_a(a, aRowStride, aDepthStride, rowsCount, depthCount, tileRows, (uint16_t*)(packed));
+    } else {
+      native_pack_a_as_float(a, aRowStride, aDepthStride, task->aMin, aRange, aRowMins, aRowScales, rowsCount, depthCount, tileRows, (jpfloat_t*)(packed));
+    }
+  } else if (task->aBitsPerElement == 8) {
+    const uint8_t* a = ((uint8_t*)(task->a) + aOffset);
+    if (convertInRegisters) {
+      native_pack_a(a, aRowStride, aDepthStride, rowsCount, depthCount, tileRows, (uint8_t*)(packed));
+    } else {
+      native_pack_a_as_float(a, aRowStride, aDepthStride, task->aMin, aRange, aRowMins, aRowScales, rowsCount, depthCount, tileRows, (jpfloat_t*)(packed));
+    }
+  } else {
+    assert(false); // Should never get here, only 8 or 16 bit supported
+  }
+}
+
+void native_gemm_task(void* cookie, int startIndex, int endIndex) {
+  const SNativeGemmTask* task = (const SNativeGemmTask*)(cookie);
+  const int startRow = (task->splitColumns ? 0 : startIndex);
+  const int endRow = (task->splitColumns ? task->m : endIndex);
+  const int startColumn = (task->splitColumns ? startIndex : 0);
+  const int endColumn = (task->splitColumns ? endIndex : task->n);
+  const int k = task->k;
+  const int ldc = task->ldc;
+  const int tileRows = task->kernel->tileRows;
+  // This depends only on the shape of the whole GEMM, so every task makes the
+  // same choice and the results don't change with the thread count.
+  // The micro-kernels only know how to convert fixed-point values, so
+  // half-precision ones are always converted as they're packed.
+  const int aBitsPerElement = task->aBitsPerElement;
+  const bool isFixedPoint = ((aBitsPerElement != 32) && (task->aElementFormat == JPElementFormatLinear));
+  const bool convertInRegisters = (isFixedPoint && (task->n <= kNativeMaxColumnsForRegisterConversion));
+  NativeMicroKernelFunction microKernel = task->kernel->floatKernel;
+  int aElementBytes = sizeof(jpfloat_t);
+  jpfloat_t aMin = 0.0f;
+  jpfloat_t aRange = 1.0f;
+  if (convertInRegisters) {
+    microKernel = ((aBitsPerElement == 16) ? task->kernel->fixed16Kernel : task->kernel->fixed8Kernel);
+    aElementBytes = (aBitsPerElement / 8);
+    aMin = task->aMin;
+    aRange = ((task->aMax - task->aMin) / (1 << aBitsPerElement));
+  }
+  // The ranges of the rows in the current tile. They only need refilling for
+  // each tile when A has a range for every row.
+  const bool hasRowRanges = (convertInRegisters && (task->aRowMins != NULL));
+  assert(tileRows <= kNativeMaxTileRows);
+  jpfloat_t tileMins[kNativeMaxTileRows];
+  jpfloat_t tileRanges[kNativeMaxTileRows];
+  for (int row = 0; row < kNativeMaxTileRows; row += 1) {
+    tileMins[row] = aMin;
+    tileRanges[row] = aRange;
+  }
+
+  SNativeGemmBuffers* buffers = native_buffers_for_current_thread();
+  jpfloat_t* packedA = buffers->packedA;
+  jpfloat_t* packedB = buffers->packedB;
+
+  for (int blockColumn = startColumn; blockColumn < endColumn; blockColumn += kNativeColumnsPerBlock) {
+    const int blockColumnsCount = MIN(kNativeColumnsPerBlock, (endColumn - blockColumn));
+    for (int blockDepth = 0; blockDepth < k; blockDepth += kNativeDepthPerBlock) {
+      const int blockDepthCount = MIN(kNativeDepthPerBlock, (k - blockDepth));
+      const bool isFirstDepth = (blockDepth == 0);
+      const bool isLastDepth = ((blockDepth + blockDepthCount) >= k);
+      SNativeTileUpdate update;
+      update.alpha = task->alpha;
+      update.beta = (isFirstDepth ? task->beta : 1.0f);
+      update.epilogue = (isLastDepth ? task->epilogue : NULL);
+
+      if (task->patches != NULL) {
+        native_pack_b_patches(task->patches, blockColumn, blockColumnsCount, blockDepth, blockDepthCount, packedB);
+      } else {
+        const jpfloat_t* b = (task->b + (task->ldb * blockColumn) + blockDepth);
+        native_pack_b(b, task->ldb, blockColumnsCount, blockDepthCount, packedB);
+      }
+
+      for (int blockRow = startRow; blockRow < endRow; blockRow += kNativeRowsPerBlock) {
+        const int blockRowsCount = MIN(kNativeRowsPerBlock, (endRow - blockRow));
+        native_pack_a_block(task, blockRow, blockRowsCount, blockDepth, blockDepthCount, convertInRegisters, packedA);
+
+        for (int tileColumn = 0; tileColumn < blockColumnsCount; tileColumn += kNativeTileColumns) {
+          const int tileColumnsCount = MIN(kNativeTileColumns, (blockColumnsCount - tileColumn));
+          const jpfloat_t* bStrip = (packedB + (tileColumn * blockDepthCount));
+          for (int tileRow = 0; tileRow < blockRowsCount; tileRow += tileRows) {
+            const int tileRowsCount = MIN(tileRows, (blockRowsCount - tileRow));
+            const void* aStrip = ((const char*)(packedA) + (tileRow * blockDepthCount * aElementBytes));
+            const int row = (blockRow + tileRow);
+            const int column = (blockColumn + tileColumn);
+            jpfloat_t* c = (task->c + (ldc * column) + row);
+            const jpfloat_t* bias = NULL;
+            if ((update.epilogue != NULL) && (update.epilogue->bias != NULL)) {
+              bias = (update.epilogue->bias + row);
+            }
+            if (hasRowRanges) {
+              for (int tileRowIndex = 0; tileRowIndex < tileRows; tileRowIndex += 1) {
+                const bool isInside = (tileRowIndex < tileRowsCount);
+                tileMins[tileRowIndex] = (isInside ? task->aRowMins[row + tileRowIndex] : 0.0f);
+                tileRanges[tileRowIndex] = (isInside ? task->aRowScales[row + tileRowIndex] : 0.0f);
+              }
+            }
+            microKernel(blockDepthCount, aStrip, tileMins, tileRanges, bStrip, c, ldc, tileRowsCount, tileColumnsCount, bias, &update);
+          }
+        }
+      }
+    }
+  }
+}
+
+#endif // USE_NATIVE_GEMM
+
+void naive_cblas_sgemm(
+  int order,
+  int transposeA,
+  int transposeB,
+  int m,
+  int n,
+  int k,
+  jpfloat_t alpha,
+  jpfloat_t *a,
+  int lda,
+  jpfloat_t *b,
+  int ldb,
+  jpfloat_t beta,
+  jpfloat_t* c,
+  int ldc) {
+
+  assert((transposeA == JPCblasNoTrans) || (transposeA == JPCblasTrans));
+  assert(transposeB == JPCblasNoTrans);
+  assert(order == JPCblasColMajor);
+
+  const int aRowStride = ((transposeA == JPCblasNoTrans) ? 1 : lda);
+  const int aDepthStride = ((transposeA == JPCblasNoTrans) ? lda : 1);
+  naive_gemm_blocked(m, n, k, alpha, a, aRowStride, aDepthStride, 0.0f, 1.0f, NULL, NULL, b, ldb, beta, c, ldc);
+}
+
 void naive_cblas_sgemm_fixed(
   int order,
   int transposeA,
@@ -302,55 +1641,13 @@ void naive_cblas_sgemm_fixed(
   assert(order == JPCblasColMajor);
 
   const jpfloat_t aRange = ((aMax - aMin) / (1 << aBitsPerElement));
+  const int aRowStride = ((transposeA == JPCblasNoTrans) ? 1 : lda);
+  const int aDepthStride = ((transposeA == JPCblasNoTrans) ? lda : 1);
 
   if (aBitsPerElement == 16) {
-    uint16_t* aData = (uint16_t*)(a);
-    int i, j, l;
-    for (j = 0; j < n; j++) {
-      for (i = 0; i < m; i++) {
-        jpfloat_t total = 0.0f;
-        for (l = 0; l < k; l++) {
-          int aIndex;
-          if (transposeA == JPCblasNoTrans) {
-            aIndex = ((lda * l) + i);
-          } else {
-            aIndex = ((lda * i) + l);
-          }
-          uint16_t aIntValue = aData[aIndex];
-          const jpfloat_t aValue = aMin + (aIntValue * aRange);
-          const int bIndex = ((ldb * j) + l);
-          const jpfloat_t bValue = b[bIndex];
-          total += (aValue * bValue);
-        }
-        const int cIndex = ((ldc * j) + i);
-        const jpfloat_t oldCValue = c[cIndex];
-        c[cIndex] = ((alpha * total) + (beta * oldCValue));
-      }
-    }
+    naive_gemm_blocked(m, n, k, alpha, (uint16_t*)(a), aRowStride, aDepthStride, aMin, aRange, NULL, NULL, b, ldb, beta, c, ldc);
   } else if (aBitsPerElement == 8) {
-    uint8_t* aData = (uint8_t*)(a);
-    int i, j, l;
-    for (j = 0; j < n; j++) {
-      for (i = 0; i < m; i++) {
-        jpfloat_t total = 0.0f;
-        for (l = 0; l < k; l++) {
-          int aIndex;
-          if (transposeA == JPCblasNoTrans) {
-            aIndex = ((lda * l) + i);
-          } else {
-            aIndex = ((lda * i) + l);
-          }
-          uint8_t aIntValue = aData[aIndex];
-          const jpfloat_t aValue = aMin + (aIntValue * aRange);
-          const int bIndex = ((ldb * j) + l);
-          const jpfloat_t bValue = b[bIndex];
-          total += (aValue * bValue);
-        }
-        const int cIndex = ((ldc * j) + i);
-        const jpfloat_t oldCValue = c[cIndex];
-        c[cIndex] = ((alpha * total) + (beta * oldCValue));
-      }
-    }
+    naive_gemm_blocked(m, n, k, alpha, (uint8_t*)(a), aRowStride, aDepthStride, aMin, aRange, NULL, NULL, b, ldb, beta, c, ldc);
   } else {
     assert(false); // Should never get here, only 8 or 16 bit supported
   }
@@ -368,13 +1665,17 @@ void cblas_sgemm_fixed(
   void *a,
   jpfloat_t aMin,
   jpfloat_t aMax,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
   int aBitsPerElement,
+  int aElementFormat,
   int lda,
   jpfloat_t *b,
   int ldb,
   jpfloat_t beta,
   jpfloat_t* c,
-  int ldc) {
+  int ldc,
+  const SGemmEpilogue* epilogue) {
 
   assert(transposeA == JPCblasTrans);
   assert(transposeB == JPCblasNoTrans);
@@ -386,56 +1687,58 @@ void cblas_sgemm_fixed(
 
   const size_t bytesPerRow = (k * sizeof(jpfloat_t));
   const size_t bytesPerSubMatrix = (bytesPerRow * rowsPerOperation);
-#if defined(TARGET_PI)
-  jpfloat_t* aSubMatrix;
-  posix_memalign((void**)(&aSubMatrix), 16, bytesPerSubMatrix);
-  jpfloat_t* cSubMatrix;
-  posix_memalign((void**)(&cSubMatrix), 16, bytesPerSubMatrix);
-#elif defined(USE_EIGEN_GEMM)
-  jpfloat_t* aSubMatrix = (jpfloat_t*)(Eigen::internal::aligned_malloc(bytesPerSubMatrix));
-  jpfloat_t* cSubMatrix = (jpfloat_t*)(Eigen::internal::aligned_malloc(bytesPerSubMatrix));
-#else // TARGET_PI
-  jpfloat_t* aSubMatrix = (jpfloat_t*)(malloc(bytesPerSubMatrix));
-  jpfloat_t* cSubMatrix = (jpfloat_t*)(malloc(bytesPerSubMatrix));
-#endif // TARGET_PI
+  jpfloat_t* aSubMatrix = fixed_panel_for_current_thread(bytesPerSubMatrix);
 
   for (int iBase = 0; iBase < m; iBase += rowsPerOperation) {
     const int rowsThisTime = MIN(rowsPerOperation, (m - iBase));
-    const int elementsPerSubMatrix = (rowsThisTime * k);
-    if (aBitsPerElement == 16) {
+    if (aElementFormat != JPElementFormatLinear) {
+      uint16_t* aData = (uint16_t*)(a);
+      for (int iOffset = 0; iOffset < rowsThisTime; iOffset += 1) {
+        matrix_dequantize_half((aData + (lda * (iBase + iOffset))), k, aElementFormat, (aSubMatrix + (k * iOffset)));
+      }
+    } else if (aBitsPerElement == 16) {
       uint16_t* aData = (uint16_t*)(a);
 #ifdef USE_ACCELERATE_GEMM
-      uint16_t* aSubDataStart = (aData + (lda * iBase));
-      vDSP_vfltu16(
-        aSubDataStart,
-        1,
-        aSubMatrix,
-        1,
-        elementsPerSubMatrix);
-      vDSP_vsmsa(
-        aSubMatrix,
-        1,
-        &aRange,
-        &aMin,
-        aSubMatrix,
-        1,
-        elementsPerSubMatrix
-      );
+      // Rows can be padded out past k, so each one is converted separately.
+      for (int iOffset = 0; iOffset < rowsThisTime; iOffset += 1) {
+        uint16_t* aSubDataStart = (aData + (lda * (iBase + iOffset)));
+        jpfloat_t* currentSubMatrix = (aSubMatrix + (k * iOffset));
+        jpfloat_t rowMin;
+        jpfloat_t rowRange;
+        fixed_row_range(aMin, aRange, aRowMins, aRowScales, (iBase + iOffset), &rowMin, &rowRange);
+        vDSP_vfltu16(
+          aSubDataStart,
+          1,
+          currentSubMatrix,
+          1,
+          k);
+        vDSP_vsmsa(
+          currentSubMatrix,
+          1,
+          &rowRange,
+          &rowMin,
+          currentSubMatrix,
+          1,
+          k
+        );
+      }
 #elif defined(USE_NEON)
 
       // Only works on data that's multiples of 8 in size
       assert((k % 8) == 0);
 
-      const float32x4_t vAMin0 = vdupq_n_f32(aMin);
-      const float32x4_t vAMin1 = vdupq_n_f32(aMin);
-      const float32x4_t vARange0 = vdupq_n_f32(aRange);
-      const float32x4_t vARange1 = vdupq_n_f32(aRange);
-
       for (int iOffset = 0; iOffset < rowsThisTime; iOffset += 1) {
         const int i = (iBase + iOffset);
         uint16_t* currentA = (aData + (lda * i));
         uint16_t* endA = (currentA + k);
-        jpfloat_t* currentSubMatrix = (aSubMatrix + (lda * iOffset));
+        jpfloat_t* currentSubMatrix = (aSubMatrix + (k * iOffset));
+        jpfloat_t rowMin;
+        jpfloat_t rowRange;
+        fixed_row_range(aMin, aRange, aRowMins, aRowScales, i, &rowMin, &rowRange);
+        const float32x4_t vAMin0 = vdupq_n_f32(rowMin);
+        const float32x4_t vAMin1 = vdupq_n_f32(rowMin);
+        const float32x4_t vARange0 = vdupq_n_f32(rowRange);
+        const float32x4_t vARange1 = vdupq_n_f32(rowRange);
         while (currentA < endA) {
           uint16x8_t vAInput16Bit = vld1q_u16(currentA);
           uint16x4_t vAInput16BitHigh = vget_high_u16(vAInput16Bit);
@@ -462,9 +1765,12 @@ void cblas_sgemm_fixed(
         const int i = (iBase + iOffset);
         uint16_t* currentA = (aData + (lda * i));
         uint16_t* endA = (currentA + k);
-        jpfloat_t* currentSubMatrix = (aSubMatrix + (lda * iOffset));
+        jpfloat_t* currentSubMatrix = (aSubMatrix + (k * iOffset));
+        jpfloat_t rowMin;
+        jpfloat_t rowRange;
+        fixed_row_range(aMin, aRange, aRowMins, aRowScales, i, &rowMin, &rowRange);
         while (currentA < endA) {
-          *currentSubMatrix = (aMin + ((*currentA) * aRange));
+          *currentSubMatrix = (rowMin + ((*currentA) * rowRange));
           currentA += 1;
           currentSubMatrix += 1;
         }
@@ -473,37 +1779,46 @@ void cblas_sgemm_fixed(
     } else if (aBitsPerElement == 8) {
       uint8_t* aData = (uint8_t*)(a);
 #ifdef USE_ACCELERATE_GEMM
-      uint8_t* aSubDataStart = (aData + (lda * iBase));
-      vDSP_vfltu8(
-        aSubDataStart,
-        1,
-        aSubMatrix,
-        1,
-        elementsPerSubMatrix);
-      vDSP_vsmsa(
-        aSubMatrix,
-        1,
-        &aRange,
-        &aMin,
-        aSubMatrix,
-        1,
-        elementsPerSubMatrix
-      );
+      // Rows can be padded out past k, so each one is converted separately.
+      for (int iOffset = 0; iOffset < rowsThisTime; iOffset += 1) {
+        uint8_t* aSubDataStart = (aData + (lda * (iBase + iOffset)));
+        jpfloat_t* currentSubMatrix = (aSubMatrix + (k * iOffset));
+        jpfloat_t rowMin;
+        jpfloat_t rowRange;
+        fixed_row_range(aMin, aRange, aRowMins, aRowScales, (iBase + iOffset), &rowMin, &rowRange);
+        vDSP_vfltu8(
+          aSubDataStart,
+          1,
+          currentSubMatrix,
+          1,
+          k);
+        vDSP_vsmsa(
+          currentSubMatrix,
+          1,
+          &rowRange,
+          &rowMin,
+          currentSubMatrix,
+          1,
+          k
+        );
+      }
 #elif defined(USE_NEON)
 
       // Only works on data that's multiples of 8 in size
       assert((k % 8) == 0);
 
-      const float32x4_t vAMin0 = vdupq_n_f32(aMin);
-      const float32x4_t vAMin1 = vdupq_n_f32(aMin);
-      const float32x4_t vARange0 = vdupq_n_f32(aRange);
-      const float32x4_t vARange1 = vdupq_n_f32(aRange);
-
       for (int iOffset = 0; iOffset < rowsThisTime; iOffset += 1) {
         const int i = (iBase + iOffset);
         uint8_t* currentA = (aData + (lda * i));
         uint8_t* endA = (currentA + k);
-        jpfloat_t* currentSubMatrix = (aSubMatrix + (lda * iOffset));
+        jpfloat_t* currentSubMatrix = (aSubMatrix + (k * iOffset));
+        jpfloat_t rowMin;
+        jpfloat_t rowRange;
+        fixed_row_range(aMin, aRange, aRowMins, aRowScales, i, &rowMin, &rowRange);
+        const float32x4_t vAMin0 = vdupq_n_f32(rowMin);
+        const float32x4_t vAMin1 = vdupq_n_f32(rowMin);
+        const float32x4_t vARange0 = vdupq_n_f32(rowRange);
+        const float32x4_t vARange1 = vdupq_n_f32(rowRange);
         while (currentA < endA) {
           uint8x8_t vAInput8Bit = vld1_u8(currentA);
           uint16x8_t vAInput16Bit = vmovl_u8(vAInput8Bit);
@@ -531,9 +1846,12 @@ void cblas_sgemm_fixed(
         const int i = (iBase + iOffset);
         uint8_t* currentA = (aData + (lda * i));
         uint8_t* endA = (currentA + k);
-        jpfloat_t* currentSubMatrix = (aSubMatrix + (lda * iOffset));
+        jpfloat_t* currentSubMatrix = (aSubMatrix + (k * iOffset));
+        jpfloat_t rowMin;
+        jpfloat_t rowRange;
+        fixed_row_range(aMin, aRange, aRowMins, aRowScales, i, &rowMin, &rowRange);
         while (currentA < endA) {
-          *currentSubMatrix = (aMin + ((*currentA) * aRange));
+          *currentSubMatrix = (rowMin + ((*currentA) * rowRange));
           currentA += 1;
           currentSubMatrix += 1;
         }
@@ -552,7 +1870,7 @@ void cblas_sgemm_fixed(
       k,
       alpha,
       aSubMatrix,
-      lda,
+      k,
       b,
       ldb,
       beta,
@@ -569,7 +1887,7 @@ void cblas_sgemm_fixed(
       k,
       alpha,
       aSubMatrix,
-      lda,
+      k,
       b,
       ldb,
       beta,
@@ -577,15 +1895,10 @@ void cblas_sgemm_fixed(
       ldc
     );
 #endif // USE_EIGEN_GEMM
+    if (epilogue != NULL) {
+      matrix_gemm_epilogue(rowsThisTime, n, (c + iBase), ldc, epilogue);
+    }
   }
-
-#if defined(USE_EIGEN_GEMM)
-  Eigen::internal::aligned_free(aSubMatrix);
-  Eigen::internal::aligned_free(cSubMatrix);
-#else // USE_EIGEN_GEMM
-  free(aSubMatrix);
-  free(cSubMatrix);
-#endif // USE_EIGEN_GEMM
 }
 #endif
 
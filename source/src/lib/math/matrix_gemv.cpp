@@ -0,0 +1,361 @@
+//
+//  matrix_gemv.cpp
+//  jpcnn
+//
+//  Multiplies a matrix of transposed weights by a single column of inputs,
+//  which is what a fully-connected layer does for one image. A general GEMM
+//  has nothing to reuse when there's only one column, so the time is all in
+//  streaming the weights through from memory. This reads each row once, with
+//  8 and 16-bit weights converted to floats in registers rather than being
+//  expanded into a buffer first, and shares the rows out across threads.
+//  Half-precision weights use the F16C conversions, so they cost no more to
+//  run than 16-bit fixed-point ones.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "matrix_ops.h"
+
+#include <assert.h>
+
+#include "cpu_features.h"
+#include "half_float.h"
+#include "thread_pool.h"
+
+#if defined(USE_CPU_DISPATCH)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH
+
+// Each call to a kernel works out this many rows' dot products, so every
+// input value that's loaded is used several times.
+static const int kGemvKernelRows = 4;
+// The rows are handed out to threads in groups of this many kernel calls.
+static const int kGemvGroupsPerTask = 16;
+// How far ahead of the values being multiplied each row is prefetched.
+static const int kGemvPrefetchBytes = 512;
+
+// Works out the dot products of kGemvKernelRows rows of weights with the
+// input. Quantized rows give the sums of the raw integer values times the
+// inputs, and the caller turns those into real totals.
+typedef void (*GemvKernelFunction)(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+
+typedef struct SGemvTaskStruct {
+  int m;
+  int k;
+  const uint8_t* a;
+  size_t bytesPerRow;
+  int aBitsPerElement;
+  int aElementFormat;
+  jpfloat_t aMin;
+  jpfloat_t aRange;
+  const jpfloat_t* aRowMins;
+  const jpfloat_t* aRowScales;
+  const jpfloat_t* x;
+  jpfloat_t xTotal;
+  jpfloat_t* y;
+  GemvKernelFunction kernel;
+} SGemvTask;
+
+static GemvKernelFunction gemv_kernel_for_current_cpu(int bitsPerElement, int elementFormat);
+static void gemv_task(void* cookie, int startIndex, int endIndex);
+static inline void gemv_prefetch(const void* address);
+static void gemv_float_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+static void gemv_uint8_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+static void gemv_uint16_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+static void gemv_half_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+static void gemv_bfloat16_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+#if defined(USE_CPU_DISPATCH)
+static void gemv_float_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+static void gemv_uint8_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+static void gemv_uint16_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+static void gemv_half_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+static void gemv_bfloat16_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals);
+#endif // USE_CPU_DISPATCH
+
+void matrix_gemv(
+  int m,
+  int k,
+  const void* a,
+  jpfloat_t aMin,
+  jpfloat_t aMax,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
+  int aBitsPerElement,
+  int aElementFormat,
+  int lda,
+  const jpfloat_t* x,
+  jpfloat_t* y,
+  const SGemmEpilogue* epilogue) {
+  assert((aBitsPerElement == 32) || (aBitsPerElement == 16) || (aBitsPerElement == 8));
+  assert((aElementFormat == JPElementFormatLinear) || (aBitsPerElement == 16));
+  assert(lda >= k);
+
+  SGemvTask task;
+  task.m = m;
+  task.k = k;
+  task.a = (const uint8_t*)(a);
+  task.bytesPerRow = ((lda * (size_t)(aBitsPerElement)) / 8);
+  task.aBitsPerElement = aBitsPerElement;
+  task.aElementFormat = aElementFormat;
+  task.aMin = aMin;
+  task.aRange = 0.0f;
+  task.aRowMins = aRowMins;
+  task.aRowScales = aRowScales;
+  task.x = x;
+  // Quantized values are aMin + (q * aRange), so every row's total includes
+  // aMin times the sum of the inputs. Rows with their own ranges use their
+  // own min and range in the same way.
+  jpfloat_t xTotal = 0.0f;
+  if ((aBitsPerElement != 32) && (aElementFormat == JPElementFormatLinear)) {
+    task.aRange = ((aMax - aMin) / (1 << aBitsPerElement));
+    for (int index = 0; index < k; index += 1) {
+      xTotal += x[index];
+    }
+  }
+  task.xTotal = xTotal;
+  task.y = y;
+  task.kernel = gemv_kernel_for_current_cpu(aBitsPerElement, aElementFormat);
+
+  const int groupsCount = ((m + (kGemvKernelRows - 1)) / kGemvKernelRows);
+  thread_pool_parallel_for(groupsCount, kGemvGroupsPerTask, gemv_task, &task);
+
+  if (epilogue != NULL) {
+    matrix_gemm_epilogue(m, 1, y, m, epilogue);
+  }
+}
+
+GemvKernelFunction gemv_kernel_for_current_cpu(int bitsPerElement, int elementFormat) {
+#if defined(USE_CPU_DISPATCH)
+  if (cpu_features_get_level() >= JPCPULevelAVX2) {
+    if (elementFormat == JPElementFormatHalf) {
+      return gemv_half_avx2;
+    } else if (elementFormat == JPElementFormatBFloat16) {
+      return gemv_bfloat16_avx2;
+    } else if (bitsPerElement == 8) {
+      return gemv_uint8_avx2;
+    } else if (bitsPerElement == 16) {
+      return gemv_uint16_avx2;
+    } else {
+      return gemv_float_avx2;
+    }
+  }
+#endif // USE_CPU_DISPATCH
+  if (elementFormat == JPElementFormatHalf) {
+    return gemv_half_generic;
+  } else if (elementFormat == JPElementFormatBFloat16) {
+    return gemv_bfloat16_generic;
+  } else if (bitsPerElement == 8) {
+    return gemv_uint8_generic;
+  } else if (bitsPerElement == 16) {
+    return gemv_uint16_generic;
+  } else {
+    return gemv_float_generic;
+  }
+}
+
+// Works on a range of groups of rows. When the row count isn't a multiple of
+// the kernel's, the last group repeats its final row and the extra totals are
+// dropped.
+void gemv_task(void* cookie, int startIndex, int endIndex) {
+  const SGemvTask* task = (const SGemvTask*)(cookie);
+  const bool isQuantized = ((task->aBitsPerElement != 32) && (task->aElementFormat == JPElementFormatLinear));
+  for (int groupIndex = startIndex; groupIndex < endIndex; groupIndex += 1) {
+    const int startRow = (groupIndex * kGemvKernelRows);
+    const int rowsCount = MIN(kGemvKernelRows, (task->m - startRow));
+    const void* rows[kGemvKernelRows];
+    for (int row = 0; row < kGemvKernelRows; row += 1) {
+      const int rowIndex = (startRow + MIN(row, (rowsCount - 1)));
+      rows[row] = (task->a + (rowIndex * task->bytesPerRow));
+    }
+    jpfloat_t totals[kGemvKernelRows];
+    task->kernel(rows, task->x, task->k, totals);
+    for (int row = 0; row < rowsCount; row += 1) {
+      if (isQuantized && (task->aRowMins != NULL)) {
+        const int rowIndex = (startRow + row);
+        task->y[rowIndex] = ((task->aRowMins[rowIndex] * task->xTotal) + (task->aRowScales[rowIndex] * totals[row]));
+      } else if (isQuantized) {
+        task->y[startRow + row] = ((task->aMin * task->xTotal) + (task->aRange * totals[row]));
+      } else {
+        task->y[startRow + row] = totals[row];
+      }
+    }
+  }
+}
+
+void gemv_prefetch(const void* address) {
+#if defined(__GNUC__)
+  __builtin_prefetch(address);
+#endif // __GNUC__
+}
+
+// The plain versions are written so that the compiler can vectorize them for
+// whatever baseline the library was built for, apart from the half-precision
+// ones, which convert a value at a time.
+
+static inline jpfloat_t gemv_value(jpfloat_t value) {
+  return value;
+}
+
+static inline jpfloat_t gemv_value(uint8_t value) {
+  return value;
+}
+
+static inline jpfloat_t gemv_value(uint16_t value) {
+  return value;
+}
+
+static inline jpfloat_t gemv_value(SHalf value) {
+  return half_to_float(value.bits);
+}
+
+static inline jpfloat_t gemv_value(SBFloat16 value) {
+  return bfloat16_to_float(value.bits);
+}
+
+template <class T> static void gemv_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  const T* row0 = (const T*)(rows[0]);
+  const T* row1 = (const T*)(rows[1]);
+  const T* row2 = (const T*)(rows[2]);
+  const T* row3 = (const T*)(rows[3]);
+  const int prefetchStep = MAX(1, (int)(64 / sizeof(T)));
+  const int prefetchDistance = (int)(kGemvPrefetchBytes / sizeof(T));
+  jpfloat_t total0 = 0.0f;
+  jpfloat_t total1 = 0.0f;
+  jpfloat_t total2 = 0.0f;
+  jpfloat_t total3 = 0.0f;
+  for (int start = 0; start < k; start += prefetchStep) {
+    gemv_prefetch(row0 + start + prefetchDistance);
+    gemv_prefetch(row1 + start + prefetchDistance);
+    gemv_prefetch(row2 + start + prefetchDistance);
+    gemv_prefetch(row3 + start + prefetchDistance);
+    const int end = MIN((start + prefetchStep), k);
+    for (int index = start; index < end; index += 1) {
+      const jpfloat_t value = x[index];
+      total0 += (gemv_value(row0[index]) * value);
+      total1 += (gemv_value(row1[index]) * value);
+      total2 += (gemv_value(row2[index]) * value);
+      total3 += (gemv_value(row3[index]) * value);
+    }
+  }
+  outTotals[0] = total0;
+  outTotals[1] = total1;
+  outTotals[2] = total2;
+  outTotals[3] = total3;
+}
+
+void gemv_float_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_generic<jpfloat_t>(rows, x, k, outTotals);
+}
+
+void gemv_uint8_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_generic<uint8_t>(rows, x, k, outTotals);
+}
+
+void gemv_uint16_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_generic<uint16_t>(rows, x, k, outTotals);
+}
+
+void gemv_half_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_generic<SHalf>(rows, x, k, outTotals);
+}
+
+void gemv_bfloat16_generic(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_generic<SBFloat16>(rows, x, k, outTotals);
+}
+
+#if defined(USE_CPU_DISPATCH)
+
+// The AVX2 kernels take eight values from each row at a time, converting
+// quantized and half-precision ones to floats as they're loaded, and leave whatever's left over
+// at the end to the plain version. SSE4.1 machines use the plain versions,
+// since with only one column to multiply by they're limited by memory rather
+// than arithmetic.
+
+JP_TARGET_AVX2 static inline jpfloat_t gemv_sum_avx2(__m256 values) {
+  const __m128 pairs = _mm_add_ps(_mm256_castps256_ps128(values), _mm256_extractf128_ps(values, 1));
+  const __m128 quads = _mm_add_ps(pairs, _mm_movehl_ps(pairs, pairs));
+  return _mm_cvtss_f32(_mm_add_ss(quads, _mm_shuffle_ps(quads, quads, 1)));
+}
+
+JP_TARGET_AVX2 static inline __m256 gemv_load_avx2(const jpfloat_t* row) {
+  return _mm256_loadu_ps(row);
+}
+
+JP_TARGET_AVX2 static inline __m256 gemv_load_avx2(const uint8_t* row) {
+  return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(row))));
+}
+
+JP_TARGET_AVX2 static inline __m256 gemv_load_avx2(const uint16_t* row) {
+  return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(row))));
+}
+
+JP_TARGET_AVX2 static inline __m256 gemv_load_avx2(const SHalf* row) {
+  return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(row)));
+}
+
+JP_TARGET_AVX2 static inline __m256 gemv_load_avx2(const SBFloat16* row) {
+  return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(row))), 16));
+}
+
+template <class T> JP_TARGET_AVX2 static void gemv_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  const T* row0 = (const T*)(rows[0]);
+  const T* row1 = (const T*)(rows[1]);
+  const T* row2 = (const T*)(rows[2]);
+  const T* row3 = (const T*)(rows[3]);
+  const int prefetchDistance = (int)(kGemvPrefetchBytes / sizeof(T));
+  // Prefetching once per cache line is enough, which is every eight values
+  // for floats and less often for the narrower types.
+  const int prefetchEvery = MAX(1, (int)(64 / (8 * sizeof(T))));
+  __m256 total0 = _mm256_setzero_ps();
+  __m256 total1 = _mm256_setzero_ps();
+  __m256 total2 = _mm256_setzero_ps();
+  __m256 total3 = _mm256_setzero_ps();
+  int index = 0;
+  int step = 0;
+  for (; index <= (k - 8); index += 8) {
+    if ((step % prefetchEvery) == 0) {
+      _mm_prefetch((const char*)(row0 + index + prefetchDistance), _MM_HINT_T0);
+      _mm_prefetch((const char*)(row1 + index + prefetchDistance), _MM_HINT_T0);
+      _mm_prefetch((const char*)(row2 + index + prefetchDistance), _MM_HINT_T0);
+      _mm_prefetch((const char*)(row3 + index + prefetchDistance), _MM_HINT_T0);
+    }
+    step += 1;
+    const __m256 value = _mm256_loadu_ps(x + index);
+    total0 = _mm256_fmadd_ps(gemv_load_avx2(row0 + index), value, total0);
+    total1 = _mm256_fmadd_ps(gemv_load_avx2(row1 + index), value, total1);
+    total2 = _mm256_fmadd_ps(gemv_load_avx2(row2 + index), value, total2);
+    total3 = _mm256_fmadd_ps(gemv_load_avx2(row3 + index), value, total3);
+  }
+  jpfloat_t leftOvers[kGemvKernelRows] = {0.0f, 0.0f, 0.0f, 0.0f};
+  if (index < k) {
+    const void* leftOverRows[kGemvKernelRows] = {(row0 + index), (row1 + index), (row2 + index), (row3 + index)};
+    gemv_generic<T>(leftOverRows, (x + index), (k - index), leftOvers);
+  }
+  outTotals[0] = (gemv_sum_avx2(total0) + leftOvers[0]);
+  outTotals[1] = (gemv_sum_avx2(total1) + leftOvers[1]);
+  outTotals[2] = (gemv_sum_avx2(total2) + leftOvers[2]);
+  outTotals[3] = (gemv_sum_avx2(total3) + leftOvers[3]);
+}
+
+void gemv_float_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_avx2<jpfloat_t>(rows, x, k, outTotals);
+}
+
+void gemv_uint8_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_avx2<uint8_t>(rows, x, k, outTotals);
+}
+
+void gemv_uint16_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_avx2<uint16_t>(rows, x, k, outTotals);
+}
+
+void gemv_half_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_avx2<SHalf>(rows, x, k, outTotals);
+}
+
+void gemv_bfloat16_avx2(const void** rows, const jpfloat_t* x, int k, jpfloat_t* outTotals) {
+  gemv_avx2<SBFloat16>(rows, x, k, outTotals);
+}
+
+#endif // USE_CPU_DISPATCH
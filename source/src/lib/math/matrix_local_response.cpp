@@ -7,6 +7,13 @@
 //  Calculates a rolling average magnitude across the channels, and then
 //  scales down channels based on their neighbors' strengths.
 //
+//  Unless Accelerate or MKL is available, the scaling doesn't use powf().
+//  The usual beta of 0.75 is done with square roots in vector registers, and
+//  any other beta with a polynomial approximation. Both stay within a relative
+//  error of 1e-6 of the exact result for betas up to one, and the polynomial
+//  drifts up to about 2e-6 for betas of two or more, as the float exponent
+//  loses precision.
+//
 //  Created by Peter Warden on 1/9/14.
 //  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
 //
@@ -27,8 +34,60 @@
 #endif // USE_MKL_GEMM
 
 #include "buffer.h"
+#include "cpu_features.h"
+#include "thread_pool.h"
+
+#if defined(USE_CPU_DISPATCH) && !defined(USE_ACCELERATE_GEMM) && !defined(USE_MKL_GEMM)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH && !USE_ACCELERATE_GEMM && !USE_MKL_GEMM
+
+// Groups of pixels are normalized independently on different threads, so
+// roughly this many values are handed out at a time.
+static const int kValuesPerTask = (16 * 1024);
+
+typedef struct SLocalResponseTaskStruct {
+  const jpfloat_t* inputData;
+  jpfloat_t* outputData;
+  int inputChannels;
+  int windowSize;
+  jpfloat_t k;
+  jpfloat_t alphaOverSize;
+  jpfloat_t beta;
+} SLocalResponseTask;
+
+static void local_response_magnitudes(void* cookie, int startPixel, int endPixel);
+#if !defined(USE_ACCELERATE_GEMM) && !defined(USE_MKL_GEMM)
+static void local_response_pixels(void* cookie, int startPixel, int endPixel);
+static void local_response_scale(const jpfloat_t* input, int count, jpfloat_t beta, jpfloat_t* magnitudes);
+static void scale_three_quarters_generic(const jpfloat_t* input, int count, jpfloat_t* magnitudes);
+static void scale_pow_generic(const jpfloat_t* input, int count, jpfloat_t beta, jpfloat_t* magnitudes);
+static inline jpfloat_t fast_pow(jpfloat_t x, jpfloat_t power);
+#if defined(USE_CPU_DISPATCH)
+static void scale_three_quarters_sse41(const jpfloat_t* input, int count, jpfloat_t* magnitudes);
+static void scale_three_quarters_avx2(const jpfloat_t* input, int count, jpfloat_t* magnitudes);
+static void scale_three_quarters_avx512(const jpfloat_t* input, int count, jpfloat_t* magnitudes);
+#endif // USE_CPU_DISPATCH
+#endif // !USE_ACCELERATE_GEMM && !USE_MKL_GEMM
+
+size_t matrix_local_response_scratch_bytes(const Dimensions& inputDims) {
+  size_t result = 0;
+#if defined(USE_ACCELERATE_GEMM) || defined(USE_MKL_GEMM)
+  result += (inputDims.elementCount() * sizeof(jpfloat_t));
+#endif // USE_ACCELERATE_GEMM || USE_MKL_GEMM
+  return result;
+}
 
 Buffer* matrix_local_response(Buffer* input, int windowSize, jpfloat_t k, jpfloat_t alpha, jpfloat_t beta) {
+  const Dimensions inputDims = input->_dims;
+  Buffer* output = new Buffer(inputDims);
+  const size_t scratchByteCount = matrix_local_response_scratch_bytes(inputDims);
+  Buffer* scratch = new Buffer(Dimensions(scratchByteCount / sizeof(jpfloat_t)));
+  matrix_local_response_into(input, windowSize, k, alpha, beta, output, scratch);
+  delete scratch;
+  return output;
+}
+
+void matrix_local_response_into(Buffer* input, int windowSize, jpfloat_t k, jpfloat_t alpha, jpfloat_t beta, Buffer* output, Buffer* scratch) {
 #ifdef DO_LOG_OPERATIONS
   fprintf(stderr, "matrix_local_response(input=[%s], windowSize=%d, k=%f, alpha=%f, beta=%f)\n",
     input->debugString(), windowSize, k, alpha, beta);
@@ -37,97 +96,236 @@ Buffer* matrix_local_response(Buffer* input, int windowSize, jpfloat_t k, jpfloa
   const Dimensions inputDims = input->_dims;
   // We're expecting (# of images, height, width, # of channels)
   assert(inputDims._length == 4);
+  assert(output->_dims == inputDims);
+  assert(output->_data != input->_data);
 
   const int inputChannels = inputDims[3];
+  const int elementCount = inputDims.elementCount();
+  const int pixelCount = (elementCount / inputChannels);
+  const int pixelsPerTask = MAX(1, (kValuesPerTask / inputChannels));
 
-  Buffer* magnitude = new Buffer(inputDims);
-
-  Buffer* magBuffer = new Buffer(Dimensions(inputChannels));
-  jpfloat_t* magBufferData = magBuffer->_data;
+  SLocalResponseTask task;
+  task.inputData = input->_data;
+  task.outputData = output->_data;
+  task.inputChannels = inputChannels;
+  task.windowSize = windowSize;
+  task.k = k;
+  task.alphaOverSize = (alpha / windowSize);
+  task.beta = beta;
 
+#if defined(USE_ACCELERATE_GEMM)
+  // The summed magnitudes are built up in the output buffer, and then
+  // replaced with the final values in a second pass.
+  thread_pool_parallel_for(pixelCount, pixelsPerTask, local_response_magnitudes, &task);
   const jpfloat_t* inputData = input->_data;
-  const int elementCount = inputDims.elementCount();
-  const jpfloat_t* inputDataEnd = (input->_data + elementCount);
-  jpfloat_t* magnitudeData = magnitude->_data;
+  jpfloat_t* magnitudeData = output->_data;
+  jpfloat_t* outputData = output->_data;
+  jpfloat_t* repeatedBeta = scratch->_data;
+  const float minusBeta = -beta;
+  vDSP_vfill(&minusBeta, repeatedBeta, 1, elementCount);
+  vvpowf(outputData, repeatedBeta, magnitudeData, &elementCount);
+  vDSP_vmul(outputData, 1, inputData, 1, outputData, 1, elementCount);
+#elif defined(USE_MKL_GEMM)
+  thread_pool_parallel_for(pixelCount, pixelsPerTask, local_response_magnitudes, &task);
+  const jpfloat_t* inputData = input->_data;
+  jpfloat_t* magnitudeData = output->_data;
+  jpfloat_t* outputData = output->_data;
+  jpfloat_t* repeatedBeta = scratch->_data;
+  const float minusBeta = -beta;
+  jpfloat_t* betaCurrent = repeatedBeta;
+  const jpfloat_t* const betaEnd = (repeatedBeta + elementCount);
+  while (betaCurrent < betaEnd) {
+    *betaCurrent = minusBeta;
+    betaCurrent += 1;
+  }
+  vsPow(elementCount, magnitudeData, repeatedBeta, outputData);
+  vsMul(elementCount, inputData, outputData, outputData);
+#else // USE_ACCELERATE_GEMM
+  thread_pool_parallel_for(pixelCount, pixelsPerTask, local_response_pixels, &task);
+#endif // USE_ACCELERATE_GEMM
 
-  const jpfloat_t alphaOverSize = (alpha / windowSize);
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_local_response() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+// Writes the summed magnitudes of each channel's neighbors for a range of
+// pixels into the output buffer.
+void local_response_magnitudes(void* cookie, int startPixel, int endPixel) {
+  const SLocalResponseTask* task = (const SLocalResponseTask*)(cookie);
+  const int inputChannels = task->inputChannels;
+  const int windowSize = task->windowSize;
+  const jpfloat_t k = task->k;
+  const jpfloat_t alphaOverSize = task->alphaOverSize;
   const int prereadCount = ((windowSize / 2) - 0);
 
+  const jpfloat_t* inputData = (task->inputData + (startPixel * inputChannels));
+  const jpfloat_t* inputDataEnd = (task->inputData + (endPixel * inputChannels));
+  jpfloat_t* magnitudeData = (task->outputData + (startPixel * inputChannels));
   while (inputData < inputDataEnd) {
-
-    for (int channel = 0; channel < inputChannels; channel += 1) {
-      const jpfloat_t inputValue = inputData[channel];
-      magBufferData[channel] = (inputValue * inputValue * alphaOverSize);
-    }
-
     float averagedScale = 0;
     for (int index = 0; index < prereadCount; index += 1) {
-      averagedScale += magBufferData[index];
+      const jpfloat_t inputValue = inputData[index];
+      averagedScale += (inputValue * inputValue * alphaOverSize);
     }
-
     for (int channel = 0; channel < inputChannels; channel += 1) {
       const int rightIndex = (channel + (windowSize / 2));
       if (rightIndex < inputChannels) {
-        averagedScale += magBufferData[rightIndex];
+        const jpfloat_t rightValue = inputData[rightIndex];
+        averagedScale += (rightValue * rightValue * alphaOverSize);
       }
       magnitudeData[channel] = (averagedScale + k);
       const int leftIndex = (channel - (windowSize / 2));
       if (leftIndex >= 0) {
-        averagedScale -= magBufferData[leftIndex];
+        const jpfloat_t leftValue = inputData[leftIndex];
+        averagedScale -= (leftValue * leftValue * alphaOverSize);
       }
     }
-
     inputData += inputChannels;
     magnitudeData += inputChannels;
   }
+}
 
-  delete magBuffer;
+#if !defined(USE_ACCELERATE_GEMM) && !defined(USE_MKL_GEMM)
+// Both passes are run on one range of pixels before moving on, so the
+// magnitudes are still in the cache when they're replaced by the results.
+void local_response_pixels(void* cookie, int startPixel, int endPixel) {
+  local_response_magnitudes(cookie, startPixel, endPixel);
 
-  Buffer* output = new Buffer(inputDims);
+  const SLocalResponseTask* task = (const SLocalResponseTask*)(cookie);
+  const int inputChannels = task->inputChannels;
+  const jpfloat_t* inputData = (task->inputData + (startPixel * inputChannels));
+  jpfloat_t* outputData = (task->outputData + (startPixel * inputChannels));
+  const int count = ((endPixel - startPixel) * inputChannels);
+  local_response_scale(inputData, count, task->beta, outputData);
+}
 
-  inputData = input->_data;
-  magnitudeData = magnitude->_data;
-  jpfloat_t* outputData = output->_data;
-#if defined(USE_ACCELERATE_GEMM)
-  jpfloat_t* repeatedBeta = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * elementCount));
-  const float minusBeta = -beta;
-  vDSP_vfill(&minusBeta, repeatedBeta, 1, elementCount);
-  vvpowf(outputData, repeatedBeta, magnitudeData, &elementCount);
-  free(repeatedBeta);
-  vDSP_vmul(outputData, 1, inputData, 1, outputData, 1, elementCount);
-#elif defined(USE_MKL_GEMM)
-  jpfloat_t* repeatedBeta = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * elementCount));
-  const float minusBeta = -beta;
-  jpfloat_t* betaCurrent = repeatedBeta;
-  const jpfloat_t* const betaEnd = (repeatedBeta + elementCount);
-  while (betaCurrent < betaEnd) {
-    *betaCurrent = minusBeta;
-    betaCurrent += 1;
+// Replaces each magnitude with the input value times the magnitude to the
+// power of -beta.
+void local_response_scale(const jpfloat_t* input, int count, jpfloat_t beta, jpfloat_t* magnitudes) {
+  if (beta != 0.75f) {
+    scale_pow_generic(input, count, beta, magnitudes);
+    return;
   }
-  vsPow(elementCount, magnitudeData, repeatedBeta, outputData);
-  free(repeatedBeta);
-  vsMul(elementCount, inputData, outputData, outputData);
-#else // USE_ACCELERATE_GEMM
-  while (inputData < inputDataEnd) {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    scale_three_quarters_avx512(input, count, magnitudes);
+    return;
+  } else if (level >= JPCPULevelAVX2) {
+    scale_three_quarters_avx2(input, count, magnitudes);
+    return;
+  } else if (level >= JPCPULevelSSE41) {
+    scale_three_quarters_sse41(input, count, magnitudes);
+    return;
+  }
+#endif // USE_CPU_DISPATCH
+  scale_three_quarters_generic(input, count, magnitudes);
+}
 
-    const jpfloat_t inputValue = *inputData;
-    const jpfloat_t magnitudeValue = *magnitudeData;
+// x^-0.75 is 1 / (sqrt(x) * sqrt(sqrt(x))), which needs no logarithms.
+void scale_three_quarters_generic(const jpfloat_t* input, int count, jpfloat_t* magnitudes) {
+  for (int index = 0; index < count; index += 1) {
+    const jpfloat_t root = sqrtf(magnitudes[index]);
+    magnitudes[index] = (input[index] / (root * sqrtf(root)));
+  }
+}
 
-    jpfloat_t outputValue = (powf(magnitudeValue, -beta) * inputValue);
-    *outputData = outputValue;
+void scale_pow_generic(const jpfloat_t* input, int count, jpfloat_t beta, jpfloat_t* magnitudes) {
+  const jpfloat_t minusBeta = -beta;
+  for (int index = 0; index < count; index += 1) {
+    magnitudes[index] = (input[index] * fast_pow(magnitudes[index], minusBeta));
+  }
+}
 
-    inputData += 1;
-    magnitudeData += 1;
-    outputData += 1;
+// Works out x^power as 2^(power * log2(x)) for positive, normal x. The
+// mantissa's logarithm comes from the atanh series, after it's been moved
+// into [sqrt(0.5), sqrt(2)) so the series converges within five terms, and
+// the fractional part of the exponent is rounded into [-0.5, 0.5] before
+// it's raised with a short Taylor series.
+jpfloat_t fast_pow(jpfloat_t x, jpfloat_t power) {
+  uint32_t xBits;
+  memcpy(&xBits, &x, sizeof(xBits));
+  int exponent = (int)((xBits >> 23) & 0xff) - 127;
+  uint32_t mantissaBits = ((xBits & 0x007fffff) | 0x3f800000);
+  jpfloat_t mantissa;
+  memcpy(&mantissa, &mantissaBits, sizeof(mantissa));
+  if (mantissa > 1.41421356f) {
+    mantissa *= 0.5f;
+    exponent += 1;
   }
-#endif // USE_ACCELERATE_GEMM
+  const jpfloat_t t = ((mantissa - 1.0f) / (mantissa + 1.0f));
+  const jpfloat_t t2 = (t * t);
+  const jpfloat_t series = (t * (2.0f + (t2 * ((2.0f / 3.0f) + (t2 * ((2.0f / 5.0f) + (t2 * ((2.0f / 7.0f) + (t2 * (2.0f / 9.0f))))))))));
+  const jpfloat_t log2X = (exponent + (series * 1.44269504f));
 
-  delete magnitude;
+  const jpfloat_t y = (power * log2X);
+  const jpfloat_t whole = floorf(y + 0.5f);
+  const jpfloat_t f = ((y - whole) * 0.693147181f);
+  const jpfloat_t fraction = (1.0f + (f * (1.0f + (f * ((1.0f / 2.0f) + (f * ((1.0f / 6.0f) + (f * ((1.0f / 24.0f) + (f * ((1.0f / 120.0f) + (f * (1.0f / 720.0f)))))))))))));
+  const uint32_t scaleBits = ((uint32_t)((int)whole + 127) << 23);
+  jpfloat_t scale;
+  memcpy(&scale, &scaleBits, sizeof(scale));
+  return (fraction * scale);
+}
 
-#ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "matrix_local_response() result=[%s]\n",
-    output->debugString());
-#endif // DO_LOG_OPERATIONS
+#if defined(USE_CPU_DISPATCH)
 
-  return output;
-}
\ No newline at end of file
+// The vector loops handle as many whole vectors as they can, and leave any
+// values left over at the end to the plain version. The reciprocal square
+// root estimate is refined with a Newton-Raphson step, which brings it to
+// within a few units in the last place.
+
+JP_TARGET_SSE41 void scale_three_quarters_sse41(const jpfloat_t* input, int count, jpfloat_t* magnitudes) {
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 threeHalves = _mm_set1_ps(1.5f);
+  int index = 0;
+  for (; index <= (count - 4); index += 4) {
+    const __m128 magnitude = _mm_loadu_ps(magnitudes + index);
+    __m128 reciprocalRoot = _mm_rsqrt_ps(magnitude);
+    const __m128 halfMagnitude = _mm_mul_ps(half, magnitude);
+    const __m128 error = _mm_mul_ps(halfMagnitude, _mm_mul_ps(reciprocalRoot, reciprocalRoot));
+    reciprocalRoot = _mm_mul_ps(reciprocalRoot, _mm_sub_ps(threeHalves, error));
+    const __m128 scale = _mm_mul_ps(reciprocalRoot, _mm_sqrt_ps(reciprocalRoot));
+    _mm_storeu_ps((magnitudes + index), _mm_mul_ps(_mm_loadu_ps(input + index), scale));
+  }
+  scale_three_quarters_generic((input + index), (count - index), (magnitudes + index));
+}
+
+JP_TARGET_AVX2 void scale_three_quarters_avx2(const jpfloat_t* input, int count, jpfloat_t* magnitudes) {
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 threeHalves = _mm256_set1_ps(1.5f);
+  int index = 0;
+  for (; index <= (count - 8); index += 8) {
+    const __m256 magnitude = _mm256_loadu_ps(magnitudes + index);
+    __m256 reciprocalRoot = _mm256_rsqrt_ps(magnitude);
+    const __m256 halfMagnitude = _mm256_mul_ps(half, magnitude);
+    const __m256 error = _mm256_mul_ps(halfMagnitude, _mm256_mul_ps(reciprocalRoot, reciprocalRoot));
+    reciprocalRoot = _mm256_mul_ps(reciprocalRoot, _mm256_sub_ps(threeHalves, error));
+    const __m256 scale = _mm256_mul_ps(reciprocalRoot, _mm256_sqrt_ps(reciprocalRoot));
+    _mm256_storeu_ps((magnitudes + index), _mm256_mul_ps(_mm256_loadu_ps(input + index), scale));
+  }
+  scale_three_quarters_generic((input + index), (count - index), (magnitudes + index));
+}
+
+// AVX-512's estimate is already accurate to 14 bits, so it gets the same
+// single refinement step.
+JP_TARGET_AVX512 void scale_three_quarters_avx512(const jpfloat_t* input, int count, jpfloat_t* magnitudes) {
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512 threeHalves = _mm512_set1_ps(1.5f);
+  int index = 0;
+  for (; index <= (count - 16); index += 16) {
+    const __m512 magnitude = _mm512_loadu_ps(magnitudes + index);
+    __m512 reciprocalRoot = _mm512_rsqrt14_ps(magnitude);
+    const __m512 halfMagnitude = _mm512_mul_ps(half, magnitude);
+    const __m512 error = _mm512_mul_ps(halfMagnitude, _mm512_mul_ps(reciprocalRoot, reciprocalRoot));
+    reciprocalRoot = _mm512_mul_ps(reciprocalRoot, _mm512_sub_ps(threeHalves, error));
+    const __m512 scale = _mm512_mul_ps(reciprocalRoot, _mm512_sqrt_ps(reciprocalRoot));
+    _mm512_storeu_ps((magnitudes + index), _mm512_mul_ps(_mm512_loadu_ps(input + index), scale));
+  }
+  scale_three_quarters_generic((input + index), (count - index), (magnitudes + index));
+}
+
+#endif // USE_CPU_DISPATCH
+#endif // !USE_ACCELERATE_GEMM && !USE_MKL_GEMM
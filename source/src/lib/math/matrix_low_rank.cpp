@@ -0,0 +1,498 @@
+//
+//  matrix_low_rank.cpp
+//  jpcnn
+//
+//  Factorizes a fully-connected layer's weights W, with one row per output,
+//  into U times V, where U has only rank columns and V only rank rows. When
+//  the rank is well below the size of W, the two together are much smaller
+//  than it and need far fewer multiplies to run.
+//
+//  The factors come from a truncated singular value decomposition, found with
+//  the randomized method from Halko, Martinsson and Tropp's "Finding
+//  Structure with Randomness". W is multiplied by a few more random vectors
+//  than the rank, which picks out the directions its columns mostly lie in.
+//  Projecting W onto those leaves a small matrix whose decomposition can be
+//  found exactly, with a symmetric eigensolver, and the large products all go
+//  through matrix_gemm().
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "matrix_ops.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+// How many more random vectors than the rank are used, which makes it much
+// more likely that the directions that matter are all caught.
+static const int kLowRankOversampling = 10;
+// Each power iteration multiplies by W and its transpose again, which makes
+// the larger singular values stand out from the rest. That helps a lot with
+// weights whose values fall off slowly.
+static const int kLowRankPowerIterations = 1;
+// When the rank is picked to keep a fraction of the energy, the search starts
+// with this many random vectors and doubles them until there are enough.
+static const int kLowRankFirstSampleCount = 64;
+
+// The orthonormal basis found for a sample of the weights' columns, the
+// weights projected onto it, and the eigen-decomposition of that projection
+// times its transpose, with the largest eigenvalues first.
+typedef struct SLowRankSampleStruct {
+  int count;
+  jpfloat_t* basis;
+  jpfloat_t* projected;
+  double* eigenvalues;
+  double* eigenvectors;
+} SLowRankSample;
+
+static SLowRankSample* low_rank_sample_create(jpfloat_t* weights, jpfloat_t* weightsTransposed, int rows, int columns, int count);
+static void low_rank_sample_destroy(SLowRankSample* sample);
+static int low_rank_rank_for_energy(const SLowRankSample* sample, double wantedEnergy);
+static void multiply_by_transpose(int m, int n, int k, jpfloat_t* a, jpfloat_t* b, jpfloat_t* c);
+static void orthonormalize_rows(jpfloat_t* data, int rows, int columns);
+static void transpose_floats(const jpfloat_t* input, int rows, int columns, jpfloat_t* output);
+static void symmetric_eigen(double* a, int n, double* outValues);
+static void tridiagonalize(double* v, int n, double* d, double* e);
+static void tridiagonal_ql(double* v, int n, double* d, double* e);
+
+int matrix_low_rank_factorize(Buffer* weights, bool areWeightsTransposed, int rank, jpfloat_t energy, Buffer** outU, Buffer** outV) {
+  assert(weights->_dims._length == 2);
+  *outU = NULL;
+  *outV = NULL;
+
+  Buffer* floatWeights = dequantize_buffer(weights);
+  if (!areWeightsTransposed) {
+    Buffer* untransposedWeights = floatWeights;
+    const Dimensions untransposedDims = untransposedWeights->_dims;
+    floatWeights = new Buffer(Dimensions(untransposedDims[1], untransposedDims[0]));
+    transpose_floats(untransposedWeights->_data, untransposedDims[0], untransposedDims[1], floatWeights->_data);
+    delete untransposedWeights;
+  }
+  const int rows = floatWeights->_dims[0];
+  const int columns = floatWeights->_dims[1];
+  jpfloat_t* data = floatWeights->_data;
+  // Every product is worked out as one matrix times the transpose of
+  // another, since that's the fastest layout for matrix_gemm(), so the
+  // weights are needed both ways around.
+  jpfloat_t* dataTransposed = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * rows * columns));
+  transpose_floats(data, rows, columns, dataTransposed);
+
+  // Past this rank the two factors hold more values than the weights do.
+  const int maxRank = (int)(((double)(rows) * columns) / ((double)(rows) + columns));
+  const int smallerSide = MIN(rows, columns);
+  if (rank >= maxRank) {
+    fprintf(stderr, "matrix_low_rank_factorize() - a rank of %d for (%d, %d) weights would be bigger than the original, which needs less than %d\n",
+      rank, rows, columns, maxRank);
+    free(dataTransposed);
+    delete floatWeights;
+    return 0;
+  }
+
+  double totalEnergy = 0.0;
+  const int elementCount = (rows * columns);
+  for (int index = 0; index < elementCount; index += 1) {
+    totalEnergy += ((double)(data[index]) * data[index]);
+  }
+  const double wantedEnergy = (energy * totalEnergy);
+
+  const int maxSampleCount = MIN((maxRank + kLowRankOversampling), smallerSide);
+  int sampleCount;
+  if (rank > 0) {
+    sampleCount = MIN((rank + kLowRankOversampling), smallerSide);
+  } else {
+    sampleCount = MIN(kLowRankFirstSampleCount, maxSampleCount);
+  }
+
+  SLowRankSample* sample;
+  int chosenRank;
+  while (true) {
+    sample = low_rank_sample_create(data, dataTransposed, rows, columns, sampleCount);
+    if (rank > 0) {
+      chosenRank = rank;
+      break;
+    }
+    chosenRank = low_rank_rank_for_energy(sample, wantedEnergy);
+    const bool hasEnoughSamples = ((chosenRank > 0) && ((chosenRank + kLowRankOversampling) <= sampleCount));
+    if (hasEnoughSamples || (sampleCount >= maxSampleCount)) {
+      break;
+    }
+    low_rank_sample_destroy(sample);
+    sampleCount = MIN((sampleCount * 2), maxSampleCount);
+  }
+
+  if ((chosenRank <= 0) || (chosenRank >= maxRank)) {
+    fprintf(stderr, "matrix_low_rank_factorize() - keeping %f of the energy of (%d, %d) weights needs a rank of at least %d\n",
+      energy, rows, columns, maxRank);
+    low_rank_sample_destroy(sample);
+    free(dataTransposed);
+    delete floatWeights;
+    return 0;
+  }
+
+  // The eigenvectors for the largest eigenvalues turn the sample's basis into
+  // the leading singular vectors of the weights.
+  const int count = sample->count;
+  jpfloat_t* leading = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * chosenRank * count));
+  for (int row = 0; row < chosenRank; row += 1) {
+    for (int column = 0; column < count; column += 1) {
+      leading[(row * count) + column] = (jpfloat_t)(sample->eigenvectors[(column * count) + row]);
+    }
+  }
+  jpfloat_t* basisTransposed = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * rows * count));
+  transpose_floats(sample->basis, count, rows, basisTransposed);
+  jpfloat_t* projectedTransposed = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * columns * count));
+  transpose_floats(sample->projected, count, columns, projectedTransposed);
+
+  Buffer* u = new Buffer(Dimensions(rows, chosenRank));
+  multiply_by_transpose(rows, chosenRank, count, basisTransposed, leading, u->_data);
+  Buffer* v = new Buffer(Dimensions(chosenRank, columns));
+  multiply_by_transpose(chosenRank, columns, count, leading, projectedTransposed, v->_data);
+
+  free(basisTransposed);
+  free(projectedTransposed);
+  free(leading);
+  low_rank_sample_destroy(sample);
+  free(dataTransposed);
+  delete floatWeights;
+
+  *outU = u;
+  *outV = v;
+  return chosenRank;
+}
+
+SLowRankSample* low_rank_sample_create(jpfloat_t* weights, jpfloat_t* weightsTransposed, int rows, int columns, int count) {
+  // Random signs work as well as Gaussian values for the test vectors, and
+  // a fixed seed means the same weights always give the same factors.
+  jpfloat_t* random = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * count * columns));
+  uint32_t state = 2463534242u;
+  for (int index = 0; index < (count * columns); index += 1) {
+    state ^= (state << 13);
+    state ^= (state >> 17);
+    state ^= (state << 5);
+    random[index] = ((state & 0x80000000u) ? -1.0f : 1.0f);
+  }
+
+  // The basis is kept as rows, so that orthonormalizing it works through
+  // contiguous memory.
+  jpfloat_t* basis = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * count * rows));
+  jpfloat_t* projected = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * count * columns));
+  multiply_by_transpose(count, rows, columns, random, weights, basis);
+  orthonormalize_rows(basis, count, rows);
+  for (int iteration = 0; iteration < kLowRankPowerIterations; iteration += 1) {
+    multiply_by_transpose(count, columns, rows, basis, weightsTransposed, projected);
+    orthonormalize_rows(projected, count, columns);
+    multiply_by_transpose(count, rows, columns, projected, weights, basis);
+    orthonormalize_rows(basis, count, rows);
+  }
+  multiply_by_transpose(count, columns, rows, basis, weightsTransposed, projected);
+  free(random);
+
+  // The eigenvalues of the projection times its transpose are the squares
+  // of its singular values.
+  jpfloat_t* gram = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * count * count));
+  multiply_by_transpose(count, count, columns, projected, projected, gram);
+  double* eigenvectors = (double*)(malloc(sizeof(double) * count * count));
+  for (int index = 0; index < (count * count); index += 1) {
+    eigenvectors[index] = gram[index];
+  }
+  free(gram);
+  double* eigenvalues = (double*)(malloc(sizeof(double) * count));
+  symmetric_eigen(eigenvectors, count, eigenvalues);
+
+  SLowRankSample* result = (SLowRankSample*)(malloc(sizeof(SLowRankSample)));
+  result->count = count;
+  result->basis = basis;
+  result->projected = projected;
+  result->eigenvalues = eigenvalues;
+  result->eigenvectors = eigenvectors;
+  return result;
+}
+
+void low_rank_sample_destroy(SLowRankSample* sample) {
+  free(sample->basis);
+  free(sample->projected);
+  free(sample->eigenvalues);
+  free(sample->eigenvectors);
+  free(sample);
+}
+
+// Returns the smallest rank that keeps the wanted energy, or 0 if the sample
+// doesn't have enough.
+int low_rank_rank_for_energy(const SLowRankSample* sample, double wantedEnergy) {
+  double energy = 0.0;
+  for (int index = 0; index < sample->count; index += 1) {
+    energy += MAX(0.0, sample->eigenvalues[index]);
+    if (energy >= wantedEnergy) {
+      return (index + 1);
+    }
+  }
+  return 0;
+}
+
+// Works out C = A * transpose(B) for row-major matrices, where A is (m, k),
+// B is (n, k), and C is (m, n). A row-major matrix is the transpose of the
+// column-major one in the same memory, so this is the column-major product
+// of B, transposed, and A.
+void multiply_by_transpose(int m, int n, int k, jpfloat_t* a, jpfloat_t* b, jpfloat_t* c) {
+  matrix_gemm(
+    JPCblasColMajor,
+    JPCblasTrans,
+    JPCblasNoTrans,
+    n,
+    m,
+    k,
+    1.0f,
+    b,
+    k,
+    a,
+    k,
+    0.0f,
+    c,
+    n);
+}
+
+// Modified Gram-Schmidt, applied twice since once loses orthogonality when
+// the rows are close to dependent. Rows that are left with nothing once the
+// earlier ones are taken out are set to zero.
+void orthonormalize_rows(jpfloat_t* data, int rows, int columns) {
+  for (int pass = 0; pass < 2; pass += 1) {
+    for (int row = 0; row < rows; row += 1) {
+      jpfloat_t* current = (data + (row * columns));
+      for (int previousRow = 0; previousRow < row; previousRow += 1) {
+        const jpfloat_t* previous = (data + (previousRow * columns));
+        jpfloat_t dot = 0.0f;
+        for (int column = 0; column < columns; column += 1) {
+          dot += (current[column] * previous[column]);
+        }
+        for (int column = 0; column < columns; column += 1) {
+          current[column] -= (dot * previous[column]);
+        }
+      }
+      double lengthSquared = 0.0;
+      for (int column = 0; column < columns; column += 1) {
+        lengthSquared += ((double)(current[column]) * current[column]);
+      }
+      const jpfloat_t length = (jpfloat_t)(sqrt(lengthSquared));
+      const jpfloat_t scale = ((length > 1e-20f) ? (1.0f / length) : 0.0f);
+      for (int column = 0; column < columns; column += 1) {
+        current[column] *= scale;
+      }
+    }
+  }
+}
+
+void transpose_floats(const jpfloat_t* input, int rows, int columns, jpfloat_t* output) {
+  for (int row = 0; row < rows; row += 1) {
+    for (int column = 0; column < columns; column += 1) {
+      output[(column * rows) + row] = input[(row * columns) + column];
+    }
+  }
+}
+
+// Replaces the symmetric (n, n) matrix with its eigenvectors as columns, and
+// writes the eigenvalues into outValues, largest first. The matrix is reduced
+// to tridiagonal form with Householder reflections and then diagonalized with
+// the implicit QL method, following the EISPACK tred2 and tql2 routines.
+void symmetric_eigen(double* a, int n, double* outValues) {
+  double* e = (double*)(malloc(sizeof(double) * n));
+  tridiagonalize(a, n, outValues, e);
+  tridiagonal_ql(a, n, outValues, e);
+  free(e);
+
+  // Selection sort is plenty for matrices this small, and it keeps each
+  // eigenvector next to its value.
+  for (int i = 0; i < (n - 1); i += 1) {
+    int largest = i;
+    for (int j = (i + 1); j < n; j += 1) {
+      if (outValues[j] > outValues[largest]) {
+        largest = j;
+      }
+    }
+    if (largest != i) {
+      const double value = outValues[i];
+      outValues[i] = outValues[largest];
+      outValues[largest] = value;
+      for (int row = 0; row < n; row += 1) {
+        double* rowData = (a + (row * n));
+        const double swapped = rowData[i];
+        rowData[i] = rowData[largest];
+        rowData[largest] = swapped;
+      }
+    }
+  }
+}
+
+void tridiagonalize(double* v, int n, double* d, double* e) {
+  for (int j = 0; j < n; j += 1) {
+    d[j] = v[((n - 1) * n) + j];
+  }
+
+  for (int i = (n - 1); i > 0; i -= 1) {
+    double scale = 0.0;
+    double h = 0.0;
+    for (int k = 0; k < i; k += 1) {
+      scale += fabs(d[k]);
+    }
+    if (scale == 0.0) {
+      e[i] = d[i - 1];
+      for (int j = 0; j < i; j += 1) {
+        d[j] = v[((i - 1) * n) + j];
+        v[(i * n) + j] = 0.0;
+        v[(j * n) + i] = 0.0;
+      }
+    } else {
+      for (int k = 0; k < i; k += 1) {
+        d[k] /= scale;
+        h += (d[k] * d[k]);
+      }
+      double f = d[i - 1];
+      double g = sqrt(h);
+      if (f > 0.0) {
+        g = -g;
+      }
+      e[i] = (scale * g);
+      h = (h - (f * g));
+      d[i - 1] = (f - g);
+      for (int j = 0; j < i; j += 1) {
+        e[j] = 0.0;
+      }
+      for (int j = 0; j < i; j += 1) {
+        f = d[j];
+        v[(j * n) + i] = f;
+        g = (e[j] + (v[(j * n) + j] * f));
+        for (int k = (j + 1); k <= (i - 1); k += 1) {
+          g += (v[(k * n) + j] * d[k]);
+          e[k] += (v[(k * n) + j] * f);
+        }
+        e[j] = g;
+      }
+      f = 0.0;
+      for (int j = 0; j < i; j += 1) {
+        e[j] /= h;
+        f += (e[j] * d[j]);
+      }
+      const double hh = (f / (h + h));
+      for (int j = 0; j < i; j += 1) {
+        e[j] -= (hh * d[j]);
+      }
+      for (int j = 0; j < i; j += 1) {
+        f = d[j];
+        g = e[j];
+        for (int k = j; k <= (i - 1); k += 1) {
+          v[(k * n) + j] -= ((f * e[k]) + (g * d[k]));
+        }
+        d[j] = v[((i - 1) * n) + j];
+        v[(i * n) + j] = 0.0;
+      }
+    }
+    d[i] = h;
+  }
+
+  // Builds up the product of the reflections.
+  for (int i = 0; i < (n - 1); i += 1) {
+    v[((n - 1) * n) + i] = v[(i * n) + i];
+    v[(i * n) + i] = 1.0;
+    const double h = d[i + 1];
+    if (h != 0.0) {
+      for (int k = 0; k <= i; k += 1) {
+        d[k] = (v[(k * n) + (i + 1)] / h);
+      }
+      for (int j = 0; j <= i; j += 1) {
+        double g = 0.0;
+        for (int k = 0; k <= i; k += 1) {
+          g += (v[(k * n) + (i + 1)] * v[(k * n) + j]);
+        }
+        for (int k = 0; k <= i; k += 1) {
+          v[(k * n) + j] -= (g * d[k]);
+        }
+      }
+    }
+    for (int k = 0; k <= i; k += 1) {
+      v[(k * n) + (i + 1)] = 0.0;
+    }
+  }
+  for (int j = 0; j < n; j += 1) {
+    d[j] = v[((n - 1) * n) + j];
+    v[((n - 1) * n) + j] = 0.0;
+  }
+  v[((n - 1) * n) + (n - 1)] = 1.0;
+  e[0] = 0.0;
+}
+
+void tridiagonal_ql(double* v, int n, double* d, double* e) {
+  for (int i = 1; i < n; i += 1) {
+    e[i - 1] = e[i];
+  }
+  e[n - 1] = 0.0;
+
+  double f = 0.0;
+  double largest = 0.0;
+  const double epsilon = ldexp(1.0, -52);
+  for (int l = 0; l < n; l += 1) {
+    largest = MAX(largest, (fabs(d[l]) + fabs(e[l])));
+    int m = l;
+    while (m < n) {
+      if (fabs(e[m]) <= (epsilon * largest)) {
+        break;
+      }
+      m += 1;
+    }
+
+    if (m > l) {
+      do {
+        double g = d[l];
+        double p = ((d[l + 1] - g) / (2.0 * e[l]));
+        double r = hypot(p, 1.0);
+        if (p < 0.0) {
+          r = -r;
+        }
+        d[l] = (e[l] / (p + r));
+        d[l + 1] = (e[l] * (p + r));
+        const double dl1 = d[l + 1];
+        double h = (g - d[l]);
+        for (int i = (l + 2); i < n; i += 1) {
+          d[i] -= h;
+        }
+        f += h;
+
+        p = d[m];
+        double c = 1.0;
+        double c2 = c;
+        double c3 = c;
+        const double el1 = e[l + 1];
+        double s = 0.0;
+        double s2 = 0.0;
+        for (int i = (m - 1); i >= l; i -= 1) {
+          c3 = c2;
+          c2 = c;
+          s2 = s;
+          g = (c * e[i]);
+          h = (c * p);
+          r = hypot(p, e[i]);
+          e[i + 1] = (s * r);
+          s = (e[i] / r);
+          c = (p / r);
+          p = ((c * d[i]) - (s * g));
+          d[i + 1] = (h + (s * ((c * g) + (s * d[i]))));
+          for (int k = 0; k < n; k += 1) {
+            double* vRow = (v + (k * n));
+            h = vRow[i + 1];
+            vRow[i + 1] = ((s * vRow[i]) + (c * h));
+            vRow[i] = ((c * vRow[i]) - (s * h));
+          }
+        }
+        p = ((-s * s2 * c3 * el1 * e[l]) / dl1);
+        e[l] = (s * p);
+        d[l] = (c * p);
+      } while (fabs(e[l]) > (epsilon * largest));
+    }
+    d[l] = (d[l] + f);
+    e[l] = 0.0;
+  }
+}
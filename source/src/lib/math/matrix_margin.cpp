@@ -15,7 +15,25 @@
 #include "buffer.h"
 #include "dimensions.h"
 
+Dimensions matrix_insert_margin_output_dims(const Dimensions& inputDims, int marginWidth, int marginHeight) {
+  // We're expecting (# of images, height, width, # of channels)
+  assert(inputDims._length == 4);
+  const Dimensions outputDims(
+    inputDims[0],
+    (inputDims[1] + (marginHeight * 2)),
+    (inputDims[2] + (marginWidth * 2)),
+    inputDims[3]);
+  return outputDims;
+}
+
 Buffer* matrix_insert_margin(Buffer* input, int marginWidth, int marginHeight) {
+  const Dimensions outputDims = matrix_insert_margin_output_dims(input->_dims, marginWidth, marginHeight);
+  Buffer* output = new Buffer(outputDims);
+  matrix_insert_margin_into(input, marginWidth, marginHeight, output);
+  return output;
+}
+
+void matrix_insert_margin_into(Buffer* input, int marginWidth, int marginHeight, Buffer* output) {
 
 #ifdef DO_LOG_OPERATIONS
   fprintf(stderr, "matrix_insert_margin(input=[%s], marginWidth=%d, marginHeight=%d)\n",
@@ -33,8 +51,7 @@ Buffer* matrix_insert_margin(Buffer* input, int marginWidth, int marginHeight) {
 
   const int outputWidth = (inputWidth + (marginWidth * 2));
   const int outputHeight = (inputHeight + (marginHeight * 2));
-  const Dimensions outputDims(imageCount, outputHeight, outputWidth, inputChannels);
-  Buffer* output = new Buffer(outputDims);
+  assert(output->_dims == Dimensions(imageCount, outputHeight, outputWidth, inputChannels));
 
   const int valuesPerInputRow = (inputWidth * inputChannels);
   const size_t bytesPerInputRow = (valuesPerInputRow * sizeof(jpfloat_t));
@@ -69,6 +86,4 @@ Buffer* matrix_insert_margin(Buffer* input, int marginWidth, int marginHeight) {
   fprintf(stderr, "matrix_insert_margin() result=[%s]\n",
     output->debugString());
 #endif // DO_LOG_OPERATIONS
-
-  return output;
 }
\ No newline at end of file
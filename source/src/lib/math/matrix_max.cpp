@@ -15,13 +15,19 @@
 #include "buffer.h"
 
 Buffer* matrix_max(Buffer* input, jpfloat_t maxValue) {
+  const Dimensions inputDims = input->_dims;
+  Buffer* output = new Buffer(inputDims);
+  matrix_max_into(input, maxValue, output);
+  return output;
+}
+
+void matrix_max_into(Buffer* input, jpfloat_t maxValue, Buffer* output) {
 #ifdef DO_LOG_OPERATIONS
   fprintf(stderr, "matrix_max(input=[%s], maxValue=%f)\n",
     input->debugString(), maxValue);
 #endif // DO_LOG_OPERATIONS
 
-  const Dimensions inputDims = input->_dims;
-  Buffer* output = new Buffer(inputDims);
+  assert(input->_dims.elementCount() == output->_dims.elementCount());
 
   jpfloat_t* const outputDataStart = output->_data;
   jpfloat_t* const outputDataEnd = (outputDataStart + output->_dims.elementCount());
@@ -39,58 +45,4 @@ Buffer* matrix_max(Buffer* input, jpfloat_t maxValue) {
   fprintf(stderr, "matrix_max() result=[%s]\n",
     output->debugString());
 #endif // DO_LOG_OPERATIONS
-
-  return output;
 }
-
-Buffer* matrix_max_patch(Buffer* input, int patchWidth, int stride) {
-#ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "matrix_max_patch(input=[%s], patchWidth=%d, stride=%d)\n",
-    input->debugString(), patchWidth, stride);
-#endif // DO_LOG_OPERATIONS
-
-  const Dimensions inputDims = input->_dims;
-  // We're expecting (# of images, height, width, # of channels)
-  assert(inputDims._length == 4);
-
-  const int imageCount = inputDims[0];
-  const int inputWidth = inputDims[2];
-  const int inputHeight = inputDims[1];
-  const int inputChannels = inputDims[3];
-
-  const int outputWidth = (int)(floorf((inputWidth - patchWidth) / stride) + 1);
-  const int outputHeight = (int)(floorf((inputHeight - patchWidth) / stride) + 1);
-  const int outputChannels = inputChannels;
-  const Dimensions outputDims(imageCount, outputHeight, outputWidth, outputChannels);
-  Buffer* output = new Buffer(outputDims);
-
-  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
-    for (int outputY = 0; outputY < outputHeight; outputY += 1) {
-      const int inputOriginY = (outputY * stride);
-      for (int outputX = 0; outputX < outputWidth; outputX += 1) {
-        const int inputOriginX = (outputX * stride);
-        for (int outputChannel = 0; outputChannel < outputChannels; outputChannel += 1) {
-          jpfloat_t patchMax = -FLT_MAX;
-          for (int patchY = 0; patchY < patchWidth; patchY += 1) {
-            const int inputY = (int)fmin((inputHeight - 1), (inputOriginY + patchY));
-            for (int patchX = 0; patchX < patchWidth; patchX += 1) {
-              const int inputX = (int)fmin((inputWidth - 1), (inputOriginX + patchX));
-              const int inputOffset = inputDims.offset(imageIndex, inputY, inputX, outputChannel);
-              const jpfloat_t inputValue = *(input->_data + inputOffset);
-              patchMax = fmaxf(patchMax, inputValue);
-            }
-          }
-          const int outputOffset = outputDims.offset(imageIndex, outputY, outputX, outputChannel);
-          *(output->_data + outputOffset) = patchMax;
-        }
-      }
-    }
-  }
-
-#ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "matrix_max_patch() result=[%s]\n",
-    output->debugString());
-#endif // DO_LOG_OPERATIONS
-
-  return output;
-}
\ No newline at end of file
@@ -11,12 +11,27 @@
 #ifndef INCLUDE_MATRIX_OPS_H
 #define INCLUDE_MATRIX_OPS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "jpcnn.h"
+#include "dimensions.h"
 
 class Buffer;
 
+// Work that's done to each block of a GEMM's results while they're still in
+// the cache, rather than in separate passes over the whole output. Every
+// value in row i becomes ((value + bias[i]) * scale), clamped at zero if
+// doRelu is set. The bias may be NULL.
+typedef struct SGemmEpilogueStruct {
+  const jpfloat_t* bias;
+  jpfloat_t scale;
+  bool doRelu;
+} SGemmEpilogue;
+
 void matrix_add_inplace(Buffer* output, Buffer* input, jpfloat_t inputScale);
-Buffer* matrix_correlate(Buffer* input, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed);
+Buffer* matrix_average_patch(Buffer* input, int patchWidth, int stride);
+Buffer* matrix_correlate(Buffer* input, int margin, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed);
 Buffer* matrix_dot(Buffer* a, Buffer* b, bool areWeightsTransposed);
 Buffer* matrix_extract_channels(Buffer* input, int startChannel, int endChannel);
 Buffer* matrix_insert_margin(Buffer* input, int marginWidth, int marginHeight);
@@ -27,6 +42,129 @@ Buffer* matrix_max_patch(Buffer* input, int patchWidth, int stride);
 void matrix_scale_inplace(Buffer* output, jpfloat_t scale);
 Buffer* matrix_softmax(Buffer* input);
 
+// Versions of the operations above that write into buffers the caller has
+// already allocated, so that a planned graph run never touches the heap. The
+// *_output_dims() and *_scratch_bytes() functions say how big those buffers
+// need to be.
+// The correlations treat a margin of zeros around each image as part of the
+// input without it being inserted, so their results are the ones for the
+// input with matrix_insert_margin() applied, and the dimensions given to
+// matrix_correlate_output_dims() should include it.
+Dimensions matrix_correlate_output_dims(const Dimensions& inputDims, int kernelWidth, int kernelCount, int stride);
+size_t matrix_correlate_scratch_bytes(const Dimensions& inputDims, int margin, int kernelWidth, int stride);
+void matrix_correlate_into(Buffer* input, int margin, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue = NULL);
+void matrix_dot_into(Buffer* input, Buffer* weights, bool areWeightsTransposed, Buffer* output, const SGemmEpilogue* epilogue = NULL);
+void matrix_extract_channels_into(Buffer* input, int startChannel, int endChannel, Buffer* output);
+void matrix_insert_channels(Buffer* input, Buffer* output, int startChannel);
+Dimensions matrix_insert_margin_output_dims(const Dimensions& inputDims, int marginWidth, int marginHeight);
+void matrix_insert_margin_into(Buffer* input, int marginWidth, int marginHeight, Buffer* output);
+size_t matrix_local_response_scratch_bytes(const Dimensions& inputDims);
+void matrix_local_response_into(Buffer* input, int windowSize, jpfloat_t k, jpfloat_t alpha, jpfloat_t beta, Buffer* output, Buffer* scratch);
+void matrix_max_into(Buffer* input, jpfloat_t maxValue, Buffer* output);
+Dimensions matrix_max_patch_output_dims(const Dimensions& inputDims, int patchWidth, int stride);
+void matrix_max_patch_into(Buffer* input, int patchWidth, int stride, Buffer* output);
+// Takes the same output dimensions as matrix_max_patch_output_dims().
+void matrix_average_patch_into(Buffer* input, int patchWidth, int stride, Buffer* output);
+void matrix_softmax_into(Buffer* input, Buffer* output);
+
+// Converts count fixed-point values into floats, as (min + (value * range)),
+// using the widest vector instructions the processor supports.
+void matrix_dequantize_uint8(const uint8_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+void matrix_dequantize_uint16(const uint16_t* input, int count, jpfloat_t min, jpfloat_t range, jpfloat_t* output);
+// Converts count half-precision or bfloat16 values into floats, using the
+// F16C instructions where they're available. The elementFormat is one of the
+// JPELEMENT_FORMAT values other than linear.
+void matrix_dequantize_half(const uint16_t* input, int count, int elementFormat, jpfloat_t* output);
+
+// Runs a fully-connected layer on transposed 8-bit weights without turning
+// them into floats, by quantizing the input to signed 8-bit values over the
+// range [inputMin, inputMax] and accumulating exact integer products. The
+// weights' row sums come from matrix_int8_row_sums(), and the scratch buffer
+// needs to be matrix_dot_int8_scratch_bytes() long.
+size_t matrix_dot_int8_scratch_bytes(const Dimensions& inputDims);
+void matrix_dot_int8_into(Buffer* input, jpfloat_t inputMin, jpfloat_t inputMax, Buffer* weights, const int32_t* weightsRowSums, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue = NULL);
+void matrix_int8_row_sums(const uint8_t* a, int m, int k, int lda, int32_t* outSums);
+// Stores round((value - min) / range) - 128 for each value, clamped to
+// [-128, 127], and returns the sum of the stored values.
+int32_t matrix_quantize_int8(const jpfloat_t* input, int count, jpfloat_t min, jpfloat_t range, int8_t* output);
+
+// A matrix in compressed sparse row form, used for pruned fully-connected
+// weights with one row per output. Row i's values are the entries from
+// rowStarts[i] up to rowStarts[i + 1] of values, and columnIndices holds the
+// column each one belongs in. Everything that's not listed is zero. The
+// column indices are 16 bits, so there can't be more than 65536 columns.
+typedef struct SSparseMatrixStruct {
+  int rows;
+  int columns;
+  int nonZeroCount;
+  int32_t* rowStarts;
+  uint16_t* columnIndices;
+  jpfloat_t* values;
+} SSparseMatrix;
+
+// The create function allocates the arrays for the caller to fill in.
+SSparseMatrix* matrix_sparse_create(int rows, int columns, int nonZeroCount);
+void matrix_sparse_destroy(SSparseMatrix* matrix);
+size_t matrix_sparse_storage_bytes(const SSparseMatrix* matrix);
+// Zeroes the smallest-magnitude fraction of the weights given by sparsity,
+// and returns the rest as a sparse matrix. Returns NULL if the weights have
+// too many inputs.
+SSparseMatrix* matrix_sparse_prune(Buffer* weights, bool areWeightsTransposed, jpfloat_t sparsity);
+// Expands the matrix back into transposed float weights.
+Buffer* matrix_sparse_to_dense(const SSparseMatrix* matrix);
+// The sparse version of matrix_dot_into(), for an input of
+// (images, matrix->columns) and an output of (images, matrix->rows). Batches
+// of more than one image need matrix_dot_sparse_scratch_bytes() of scratch.
+size_t matrix_dot_sparse_scratch_bytes(const Dimensions& inputDims);
+void matrix_dot_sparse_into(Buffer* input, const SSparseMatrix* weights, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue = NULL);
+
+// Approximates fully-connected weights as the product of a transposed
+// (outputs, rank) matrix U and a transposed (rank, inputs) one V, from their
+// truncated singular value decomposition. If rank is zero, the smallest one
+// that keeps the given fraction of the weights' energy, the sum of their
+// squares, is chosen. Returns the rank used, or zero if it would need as
+// many values as the weights themselves, with outU and outV set to new float
+// buffers on success.
+int matrix_low_rank_factorize(Buffer* weights, bool areWeightsTransposed, int rank, jpfloat_t energy, Buffer** outU, Buffer** outV);
+
+// Calculates rowCount rows of one image's correlation, starting at startRow,
+// into an output of (1, rowCount, output width, kernelCount). This lets the
+// caller work through a layer in bands that stay in the cache.
+size_t matrix_correlate_rows_scratch_bytes(const Dimensions& inputDims, int margin, int kernelWidth, int stride, int rowCount);
+void matrix_correlate_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue = NULL);
+
+#if defined(USE_NATIVE_GEMM)
+// Implicit-GEMM versions of the correlation, which use matrix_gemm_patches()
+// to read the input's patches where they are instead of copying them out. They
+// need no scratch space.
+void matrix_correlate_implicit_into(Buffer* input, int margin, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, const SGemmEpilogue* epilogue = NULL);
+void matrix_correlate_implicit_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* kernels, int kernelWidth, int kernelCount, int stride, bool areKernelsTransposed, Buffer* output, const SGemmEpilogue* epilogue = NULL);
+#endif // USE_NATIVE_GEMM
+
+// Direct versions of the correlation, which read the input in place rather
+// than copying its patches out for a GEMM. The margin is handled the same way
+// as matrix_correlate_into() handles it. The kernels have to be rearranged
+// with matrix_correlate_direct_pack_kernels() first, into a float buffer of
+// matrix_correlate_direct_packed_kernels_dims().
+Dimensions matrix_correlate_direct_packed_kernels_dims(int kernelWidth, int inputChannels, int kernelCount);
+void matrix_correlate_direct_pack_kernels(Buffer* kernels, int kernelWidth, int kernelCount, bool areKernelsTransposed, Buffer* output);
+size_t matrix_correlate_direct_scratch_bytes(const Dimensions& inputDims);
+void matrix_correlate_direct_into(Buffer* input, int margin, Buffer* packedKernels, int kernelWidth, int kernelCount, int stride, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue = NULL);
+void matrix_correlate_direct_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* packedKernels, int kernelWidth, int kernelCount, int stride, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue = NULL);
+
+// Winograd F(2x2, 3x3) versions of the correlation, for 3x3 kernels with a
+// stride of one. The margin is handled the same way as the direct versions.
+// The kernels have to be transformed first with
+// matrix_correlate_winograd_transform_kernels(), into a float buffer of
+// matrix_correlate_winograd_kernels_dims(). The results aren't exactly the
+// same as matrix_correlate_into()'s, so compare them before relying on this.
+Dimensions matrix_correlate_winograd_kernels_dims(int inputChannels, int kernelCount);
+void matrix_correlate_winograd_transform_kernels(Buffer* kernels, int kernelCount, bool areKernelsTransposed, Buffer* output);
+size_t matrix_correlate_winograd_scratch_bytes(const Dimensions& inputDims, int margin, int kernelCount);
+void matrix_correlate_winograd_into(Buffer* input, int margin, Buffer* transformedKernels, int kernelCount, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue = NULL);
+size_t matrix_correlate_winograd_rows_scratch_bytes(const Dimensions& inputDims, int margin, int kernelCount, int rowCount);
+void matrix_correlate_winograd_rows_into(Buffer* input, int margin, int imageIndex, int startRow, int rowCount, Buffer* transformedKernels, int kernelCount, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue = NULL);
+
 enum JPCBLAS_ORDER {
   JPCblasRowMajor=101,
   JPCblasColMajor=102
@@ -52,8 +190,12 @@ void matrix_gemm(
   int ldb,
   jpfloat_t beta,
   jpfloat_t* c,
-  int ldc);
+  int ldc,
+  const SGemmEpilogue* epilogue = NULL);
 
+// Fixed-point values of A stand for (aMin + (value * aRange)), where aRange
+// is ((aMax - aMin) / (1 << aBitsPerElement)). When aRowMins and aRowScales
+// are set, each row of A uses its own min and range from them instead.
 void matrix_gemm_fixed(
   int order,
   int transposeA,
@@ -65,13 +207,106 @@ void matrix_gemm_fixed(
   void *a,
   jpfloat_t aMin,
   jpfloat_t aMax,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
   int aBitsPerElement,
+  int aElementFormat,
   int lda,
   jpfloat_t *b,
   int ldb,
   jpfloat_t beta,
   jpfloat_t* c,
-  int ldc);
+  int ldc,
+  const SGemmEpilogue* epilogue = NULL);
+
+// C(i, j) = sum(A(i, l) * B(l, j)) for a row-major A of unsigned values that
+// stand for (aMin + (value * aRange)), and a column-major B of signed values
+// that stand for (bZero + (value * bRange)). aRowSums and bColumnSums hold the
+// sums of the raw values in each row of A and each column of B. If aRowMins
+// and aRowScales are set, they replace aMin and aRange for each row.
+void matrix_gemm_int8(
+  int m,
+  int n,
+  int k,
+  const uint8_t* a,
+  int lda,
+  jpfloat_t aMin,
+  jpfloat_t aRange,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
+  const int32_t* aRowSums,
+  const int8_t* b,
+  int ldb,
+  jpfloat_t bZero,
+  jpfloat_t bRange,
+  const int32_t* bColumnSums,
+  jpfloat_t* c,
+  int ldc,
+  const SGemmEpilogue* epilogue = NULL);
+
+// y(i) = sum(A(i, l) * x(l)) for a row-major A, which is how transposed
+// weights are stored, of floats or of 8 or 16-bit values that stand for
+// (aMin + (value * aRange)), or of 16-bit floats when aElementFormat isn't
+// linear. Fixed-point rows can have their own ranges, as with
+// matrix_gemm_fixed(). Rows are split across threads.
+void matrix_gemv(
+  int m,
+  int k,
+  const void* a,
+  jpfloat_t aMin,
+  jpfloat_t aMax,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
+  int aBitsPerElement,
+  int aElementFormat,
+  int lda,
+  const jpfloat_t* x,
+  jpfloat_t* y,
+  const SGemmEpilogue* epilogue = NULL);
+
+void matrix_gemm_epilogue(int m, int n, jpfloat_t* c, int ldc, const SGemmEpilogue* epilogue);
+
+// Describes the B argument of a convolution's GEMM without it being stored
+// anywhere. Column j is the patch of an NHWC image under output pixel j,
+// counting along the output rows from startRow, with its values in the same
+// order as the rows patches_into_rows() writes. Values in the margin or past
+// the edges of the image are zeros.
+typedef struct SGemmPatchesStruct {
+  const jpfloat_t* image;
+  int inputHeight;
+  int inputWidth;
+  int inputChannels;
+  int margin;
+  int kernelWidth;
+  int stride;
+  int outputWidth;
+  int startRow;
+} SGemmPatches;
+
+#if defined(USE_NATIVE_GEMM)
+// A column-major GEMM whose B is read straight from an image's patches as
+// it's packed into panels, so the patches never have to be written out. Only
+// the native GEMM packs B itself, so this isn't available with the others.
+void matrix_gemm_patches(
+  int transposeA,
+  int m,
+  int n,
+  int k,
+  jpfloat_t alpha,
+  void *a,
+  jpfloat_t aMin,
+  jpfloat_t aMax,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
+  int aBitsPerElement,
+  int aElementFormat,
+  int lda,
+  const SGemmPatches* b,
+  jpfloat_t beta,
+  jpfloat_t* c,
+  int ldc,
+  const SGemmEpilogue* epilogue = NULL);
+#endif // USE_NATIVE_GEMM
 
 void naive_cblas_sgemm(
   int order,
@@ -119,13 +354,17 @@ void cblas_sgemm_fixed(
   void *a,
   jpfloat_t aMin,
   jpfloat_t aMax,
+  const jpfloat_t* aRowMins,
+  const jpfloat_t* aRowScales,
   int aBitsPerElement,
+  int aElementFormat,
   int lda,
   jpfloat_t *b,
   int ldb,
   jpfloat_t beta,
   jpfloat_t* c,
-  int ldc);
+  int ldc,
+  const SGemmEpilogue* epilogue = NULL);
 
 void eigen_cblas_sgemm(
   int order,
@@ -0,0 +1,289 @@
+//
+//  matrix_pool.cpp
+//  jpcnn
+//
+//  Max and average pooling over square patches of an image. Images are stored
+//  with their channels innermost, so each pixel of a patch is a contiguous
+//  vector of channels, and the pooling is done a whole pixel's worth of
+//  channels at a time with the widest vector instructions the processor has.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "matrix_ops.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "cpu_features.h"
+#include "thread_pool.h"
+
+#if defined(USE_CPU_DISPATCH)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH
+
+// Combines count values from input into output, one channel at a time.
+typedef void (*PoolChannelsFunction)(const jpfloat_t* input, int count, jpfloat_t* output);
+
+typedef struct SPoolPatchTaskStruct {
+  Buffer* input;
+  Buffer* output;
+  int patchWidth;
+  int stride;
+  bool isAverage;
+  PoolChannelsFunction combineChannels;
+} SPoolPatchTask;
+
+static void pool_patch_into(Buffer* input, int patchWidth, int stride, bool isAverage, Buffer* output);
+static void pool_patch_rows(void* cookie, int startIndex, int endIndex);
+static PoolChannelsFunction get_max_channels_function();
+static PoolChannelsFunction get_add_channels_function();
+static void max_channels_generic(const jpfloat_t* input, int count, jpfloat_t* output);
+static void add_channels_generic(const jpfloat_t* input, int count, jpfloat_t* output);
+#if defined(USE_CPU_DISPATCH)
+static void max_channels_sse41(const jpfloat_t* input, int count, jpfloat_t* output);
+static void add_channels_sse41(const jpfloat_t* input, int count, jpfloat_t* output);
+static void max_channels_avx2(const jpfloat_t* input, int count, jpfloat_t* output);
+static void add_channels_avx2(const jpfloat_t* input, int count, jpfloat_t* output);
+static void max_channels_avx512(const jpfloat_t* input, int count, jpfloat_t* output);
+static void add_channels_avx512(const jpfloat_t* input, int count, jpfloat_t* output);
+#endif // USE_CPU_DISPATCH
+
+Dimensions matrix_max_patch_output_dims(const Dimensions& inputDims, int patchWidth, int stride) {
+  // We're expecting (# of images, height, width, # of channels)
+  assert(inputDims._length == 4);
+
+  const int imageCount = inputDims[0];
+  const int inputWidth = inputDims[2];
+  const int inputHeight = inputDims[1];
+  const int inputChannels = inputDims[3];
+
+  const int outputWidth = (int)(floorf((inputWidth - patchWidth) / stride) + 1);
+  const int outputHeight = (int)(floorf((inputHeight - patchWidth) / stride) + 1);
+  const int outputChannels = inputChannels;
+  const Dimensions outputDims(imageCount, outputHeight, outputWidth, outputChannels);
+  return outputDims;
+}
+
+Buffer* matrix_max_patch(Buffer* input, int patchWidth, int stride) {
+  const Dimensions outputDims = matrix_max_patch_output_dims(input->_dims, patchWidth, stride);
+  Buffer* output = new Buffer(outputDims);
+  matrix_max_patch_into(input, patchWidth, stride, output);
+  return output;
+}
+
+void matrix_max_patch_into(Buffer* input, int patchWidth, int stride, Buffer* output) {
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_max_patch(input=[%s], patchWidth=%d, stride=%d)\n",
+    input->debugString(), patchWidth, stride);
+#endif // DO_LOG_OPERATIONS
+
+  pool_patch_into(input, patchWidth, stride, false, output);
+
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_max_patch() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+Buffer* matrix_average_patch(Buffer* input, int patchWidth, int stride) {
+  const Dimensions outputDims = matrix_max_patch_output_dims(input->_dims, patchWidth, stride);
+  Buffer* output = new Buffer(outputDims);
+  matrix_average_patch_into(input, patchWidth, stride, output);
+  return output;
+}
+
+void matrix_average_patch_into(Buffer* input, int patchWidth, int stride, Buffer* output) {
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_average_patch(input=[%s], patchWidth=%d, stride=%d)\n",
+    input->debugString(), patchWidth, stride);
+#endif // DO_LOG_OPERATIONS
+
+  pool_patch_into(input, patchWidth, stride, true, output);
+
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_average_patch() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+void pool_patch_into(Buffer* input, int patchWidth, int stride, bool isAverage, Buffer* output) {
+  const Dimensions inputDims = input->_dims;
+  // We're expecting (# of images, height, width, # of channels)
+  assert(inputDims._length == 4);
+
+  const Dimensions outputDims = output->_dims;
+  assert(outputDims == matrix_max_patch_output_dims(inputDims, patchWidth, stride));
+
+  // Every output row is independent, so they're shared out across threads.
+  SPoolPatchTask task;
+  task.input = input;
+  task.output = output;
+  task.patchWidth = patchWidth;
+  task.stride = stride;
+  task.isAverage = isAverage;
+  if (isAverage) {
+    task.combineChannels = get_add_channels_function();
+  } else {
+    task.combineChannels = get_max_channels_function();
+  }
+  const int imageCount = outputDims[0];
+  const int outputHeight = outputDims[1];
+  thread_pool_parallel_for((imageCount * outputHeight), 1, pool_patch_rows, &task);
+}
+
+// Works on a range of output rows, counting down through all the images. Each
+// output pixel starts as a copy of the first pixel in its patch, and then the
+// rest of the patch is combined into it. Patches are clipped to the image, so
+// averages are over the pixels that are actually there.
+void pool_patch_rows(void* cookie, int startIndex, int endIndex) {
+  const SPoolPatchTask* task = (const SPoolPatchTask*)(cookie);
+  const int patchWidth = task->patchWidth;
+  const int stride = task->stride;
+  const PoolChannelsFunction combineChannels = task->combineChannels;
+
+  const Dimensions inputDims = task->input->_dims;
+  const int inputWidth = inputDims[2];
+  const int inputHeight = inputDims[1];
+  const int channels = inputDims[3];
+  const int valuesPerInputRow = (inputWidth * channels);
+  const int valuesPerInputImage = (inputHeight * valuesPerInputRow);
+  const size_t bytesPerPixel = (channels * sizeof(jpfloat_t));
+
+  const Dimensions outputDims = task->output->_dims;
+  const int outputWidth = outputDims[2];
+  const int outputHeight = outputDims[1];
+
+  for (int rowIndex = startIndex; rowIndex < endIndex; rowIndex += 1) {
+    const int imageIndex = (rowIndex / outputHeight);
+    const int outputY = (rowIndex % outputHeight);
+    const int inputStartY = (outputY * stride);
+    const int inputEndY = MIN((inputStartY + patchWidth), inputHeight);
+    const jpfloat_t* const inputImage = (task->input->_data + (imageIndex * valuesPerInputImage));
+    jpfloat_t* outputData = (task->output->_data + (rowIndex * outputWidth * channels));
+    for (int outputX = 0; outputX < outputWidth; outputX += 1) {
+      const int inputStartX = (outputX * stride);
+      const int inputEndX = MIN((inputStartX + patchWidth), inputWidth);
+      const int patchPixelsAcross = (inputEndX - inputStartX);
+      const jpfloat_t* inputPatch = (inputImage + (inputStartY * valuesPerInputRow) + (inputStartX * channels));
+      memcpy(outputData, inputPatch, bytesPerPixel);
+      for (int patchY = 0; patchY < (inputEndY - inputStartY); patchY += 1) {
+        const jpfloat_t* inputData = (inputPatch + (patchY * valuesPerInputRow));
+        for (int patchX = ((patchY == 0) ? 1 : 0); patchX < patchPixelsAcross; patchX += 1) {
+          combineChannels((inputData + (patchX * channels)), channels, outputData);
+        }
+      }
+      if (task->isAverage) {
+        const jpfloat_t scale = (1.0f / ((inputEndY - inputStartY) * patchPixelsAcross));
+        for (int channel = 0; channel < channels; channel += 1) {
+          outputData[channel] *= scale;
+        }
+      }
+      outputData += channels;
+    }
+  }
+}
+
+PoolChannelsFunction get_max_channels_function() {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    return max_channels_avx512;
+  } else if (level >= JPCPULevelAVX2) {
+    return max_channels_avx2;
+  } else if (level >= JPCPULevelSSE41) {
+    return max_channels_sse41;
+  }
+#endif // USE_CPU_DISPATCH
+  return max_channels_generic;
+}
+
+PoolChannelsFunction get_add_channels_function() {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    return add_channels_avx512;
+  } else if (level >= JPCPULevelAVX2) {
+    return add_channels_avx2;
+  } else if (level >= JPCPULevelSSE41) {
+    return add_channels_sse41;
+  }
+#endif // USE_CPU_DISPATCH
+  return add_channels_generic;
+}
+
+void max_channels_generic(const jpfloat_t* input, int count, jpfloat_t* output) {
+  for (int index = 0; index < count; index += 1) {
+    output[index] = fmaxf(output[index], input[index]);
+  }
+}
+
+void add_channels_generic(const jpfloat_t* input, int count, jpfloat_t* output) {
+  for (int index = 0; index < count; index += 1) {
+    output[index] += input[index];
+  }
+}
+
+#if defined(USE_CPU_DISPATCH)
+
+// The vector loops handle as many whole vectors as they can, and leave any
+// values left over at the end to the plain version.
+
+JP_TARGET_SSE41 void max_channels_sse41(const jpfloat_t* input, int count, jpfloat_t* output) {
+  int index = 0;
+  for (; index <= (count - 4); index += 4) {
+    const __m128 result = _mm_max_ps(_mm_loadu_ps(output + index), _mm_loadu_ps(input + index));
+    _mm_storeu_ps((output + index), result);
+  }
+  max_channels_generic((input + index), (count - index), (output + index));
+}
+
+JP_TARGET_SSE41 void add_channels_sse41(const jpfloat_t* input, int count, jpfloat_t* output) {
+  int index = 0;
+  for (; index <= (count - 4); index += 4) {
+    const __m128 result = _mm_add_ps(_mm_loadu_ps(output + index), _mm_loadu_ps(input + index));
+    _mm_storeu_ps((output + index), result);
+  }
+  add_channels_generic((input + index), (count - index), (output + index));
+}
+
+JP_TARGET_AVX2 void max_channels_avx2(const jpfloat_t* input, int count, jpfloat_t* output) {
+  int index = 0;
+  for (; index <= (count - 8); index += 8) {
+    const __m256 result = _mm256_max_ps(_mm256_loadu_ps(output + index), _mm256_loadu_ps(input + index));
+    _mm256_storeu_ps((output + index), result);
+  }
+  max_channels_generic((input + index), (count - index), (output + index));
+}
+
+JP_TARGET_AVX2 void add_channels_avx2(const jpfloat_t* input, int count, jpfloat_t* output) {
+  int index = 0;
+  for (; index <= (count - 8); index += 8) {
+    const __m256 result = _mm256_add_ps(_mm256_loadu_ps(output + index), _mm256_loadu_ps(input + index));
+    _mm256_storeu_ps((output + index), result);
+  }
+  add_channels_generic((input + index), (count - index), (output + index));
+}
+
+JP_TARGET_AVX512 void max_channels_avx512(const jpfloat_t* input, int count, jpfloat_t* output) {
+  int index = 0;
+  for (; index <= (count - 16); index += 16) {
+    const __m512 result = _mm512_max_ps(_mm512_loadu_ps(output + index), _mm512_loadu_ps(input + index));
+    _mm512_storeu_ps((output + index), result);
+  }
+  max_channels_generic((input + index), (count - index), (output + index));
+}
+
+JP_TARGET_AVX512 void add_channels_avx512(const jpfloat_t* input, int count, jpfloat_t* output) {
+  int index = 0;
+  for (; index <= (count - 16); index += 16) {
+    const __m512 result = _mm512_add_ps(_mm512_loadu_ps(output + index), _mm512_loadu_ps(input + index));
+    _mm512_storeu_ps((output + index), result);
+  }
+  add_channels_generic((input + index), (count - index), (output + index));
+}
+
+#endif // USE_CPU_DISPATCH
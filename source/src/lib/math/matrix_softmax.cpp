@@ -1,7 +1,13 @@
 //
-//  matrix_add.cpp
+//  matrix_softmax.cpp
 //  jpcnn
 //
+//  The exponentials use a polynomial approximation rather than exp(), worked
+//  out several values at a time in vector registers, and are within a couple
+//  of float rounding steps of the exact results. Anything more than 87 below
+//  the largest value comes out as about 1e-38 instead of something smaller,
+//  which makes no difference once they're normalized.
+//
 //  Created by Peter Warden on 1/9/14.
 //  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
 //
@@ -13,8 +19,54 @@
 #include <math.h>
 
 #include "buffer.h"
+#include "cpu_features.h"
+#include "thread_pool.h"
+
+#if defined(USE_CPU_DISPATCH)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH
+
+// Below this the result of the exponential won't fit in a normal float, so
+// inputs are clamped to it.
+static const jpfloat_t kSoftmaxMinExponent = -87.0f;
+// The coefficients for the range reduction and polynomial, from Cephes' expf.
+static const jpfloat_t kSoftmaxLog2E = 1.44269504088896341f;
+static const jpfloat_t kSoftmaxLn2High = 0.693359375f;
+static const jpfloat_t kSoftmaxLn2Low = -2.12194440e-4f;
+static const jpfloat_t kSoftmaxP0 = 1.9875691500e-4f;
+static const jpfloat_t kSoftmaxP1 = 1.3981999507e-3f;
+static const jpfloat_t kSoftmaxP2 = 8.3334519073e-3f;
+static const jpfloat_t kSoftmaxP3 = 4.1665795894e-2f;
+static const jpfloat_t kSoftmaxP4 = 1.6666665459e-1f;
+static const jpfloat_t kSoftmaxP5 = 5.0000001201e-1f;
+
+// Writes exp(input - max) for every value, and returns their sum.
+typedef jpfloat_t (*SoftmaxExpFunction)(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output);
+
+typedef struct SSoftmaxTaskStruct {
+  Buffer* input;
+  Buffer* output;
+  int inputValuesCount;
+} SSoftmaxTask;
+
+static void softmax_images(void* cookie, int startImage, int endImage);
+static SoftmaxExpFunction softmax_exp_for_current_cpu();
+static jpfloat_t softmax_exp_generic(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output);
+static inline jpfloat_t fast_exp(jpfloat_t x);
+#if defined(USE_CPU_DISPATCH)
+static jpfloat_t softmax_exp_sse41(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output);
+static jpfloat_t softmax_exp_avx2(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output);
+static jpfloat_t softmax_exp_avx512(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output);
+#endif // USE_CPU_DISPATCH
 
 Buffer* matrix_softmax(Buffer* input) {
+  Buffer* output = new Buffer(input->_dims);
+  matrix_softmax_into(input, output);
+  return output;
+}
+
+// Safe to call with output and input pointing at the same data.
+void matrix_softmax_into(Buffer* input, Buffer* output) {
 
 #ifdef DO_LOG_OPERATIONS
   fprintf(stderr, "matrix_softmax(input=[%s])\n", input->debugString());
@@ -23,13 +75,32 @@ Buffer* matrix_softmax(Buffer* input) {
   const Dimensions inputDims = input->_dims;
   // We're expecting (# of images, # of values)
   assert(inputDims._length == 2);
+  assert(output->_dims == inputDims);
 
   const int imageCount = inputDims[0];
   const int inputValuesCount = inputDims[1];
 
-  Buffer* output = new Buffer(inputDims);
+  // Each image's values are normalized separately, so different images can be
+  // worked on by different threads.
+  SSoftmaxTask task;
+  task.input = input;
+  task.output = output;
+  task.inputValuesCount = inputValuesCount;
+  thread_pool_parallel_for(imageCount, 1, softmax_images, &task);
 
-  for (int imageIndex = 0; imageIndex < imageCount; imageIndex += 1) {
+#ifdef DO_LOG_OPERATIONS
+  fprintf(stderr, "matrix_soft_max() result=[%s]\n",
+    output->debugString());
+#endif // DO_LOG_OPERATIONS
+}
+
+void softmax_images(void* cookie, int startImage, int endImage) {
+  const SSoftmaxTask* task = (const SSoftmaxTask*)(cookie);
+  Buffer* input = task->input;
+  Buffer* output = task->output;
+  const int inputValuesCount = task->inputValuesCount;
+  const SoftmaxExpFunction expFunction = softmax_exp_for_current_cpu();
+  for (int imageIndex = startImage; imageIndex < endImage; imageIndex += 1) {
     const int imageOffset = (imageIndex * inputValuesCount);
     const jpfloat_t* const inputDataStart = (input->_data + imageOffset);
     const jpfloat_t* const inputDataEnd = (inputDataStart + inputValuesCount);
@@ -46,32 +117,169 @@ Buffer* matrix_softmax(Buffer* input) {
       inputData += 1;
     }
 
-    jpfloat_t sum = 0;
-    inputData = inputDataStart;
-    jpfloat_t* outputData = outputDataStart;
-    while (inputData < inputDataEnd) {
-      const jpfloat_t inputValue = *inputData;
-      const jpfloat_t normalized = (inputValue - max);
-      const jpfloat_t outputValue = exp(normalized);
-      *outputData = outputValue;
-      sum += outputValue;
-      inputData += 1;
-      outputData += 1;
-    }
+    const jpfloat_t sum = expFunction(inputDataStart, inputValuesCount, max, outputDataStart);
 
     jpfloat_t recipSum = (1.0 / sum);
 
-    outputData = outputDataStart;
+    jpfloat_t* outputData = outputDataStart;
     while (outputData < outputDataEnd) {
       *outputData *= recipSum;
       outputData += 1;
     }
   }
+}
+
+SoftmaxExpFunction softmax_exp_for_current_cpu() {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    return softmax_exp_avx512;
+  } else if (level >= JPCPULevelAVX2) {
+    return softmax_exp_avx2;
+  } else if (level >= JPCPULevelSSE41) {
+    return softmax_exp_sse41;
+  }
+#endif // USE_CPU_DISPATCH
+  return softmax_exp_generic;
+}
 
-#ifdef DO_LOG_OPERATIONS
-  fprintf(stderr, "matrix_soft_max() result=[%s]\n",
-    output->debugString());
-#endif // DO_LOG_OPERATIONS
+jpfloat_t softmax_exp_generic(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output) {
+  jpfloat_t sum = 0.0f;
+  for (int index = 0; index < count; index += 1) {
+    const jpfloat_t outputValue = fast_exp(input[index] - max);
+    output[index] = outputValue;
+    sum += outputValue;
+  }
+  return sum;
+}
 
-  return output;
+// Splits x into (n * ln(2)) + r, with r between -ln(2)/2 and ln(2)/2, and
+// then exp(x) is 2^n, built directly in the float's exponent bits, times a
+// polynomial approximation of exp(r).
+jpfloat_t fast_exp(jpfloat_t x) {
+  x = fmaxf(x, kSoftmaxMinExponent);
+  // Rounds down by truncating and then correcting negative values, which
+  // unlike floorf() the compiler can vectorize without SSE4.1.
+  const jpfloat_t shifted = ((x * kSoftmaxLog2E) + 0.5f);
+  int32_t nInt = (int32_t)(shifted);
+  nInt -= (shifted < (jpfloat_t)(nInt)) ? 1 : 0;
+  const jpfloat_t n = (jpfloat_t)(nInt);
+  const jpfloat_t r = ((x - (n * kSoftmaxLn2High)) - (n * kSoftmaxLn2Low));
+  jpfloat_t p = kSoftmaxP0;
+  p = ((p * r) + kSoftmaxP1);
+  p = ((p * r) + kSoftmaxP2);
+  p = ((p * r) + kSoftmaxP3);
+  p = ((p * r) + kSoftmaxP4);
+  p = ((p * r) + kSoftmaxP5);
+  p = ((p * r * r) + r + 1.0f);
+  union {
+    int32_t i;
+    jpfloat_t f;
+  } twoToN;
+  twoToN.i = ((nInt + 127) << 23);
+  return (p * twoToN.f);
 }
+
+#if defined(USE_CPU_DISPATCH)
+
+// The vector versions follow fast_exp() step by step, and leave whatever's
+// left over at the end to the plain version.
+
+JP_TARGET_SSE41 jpfloat_t softmax_exp_sse41(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output) {
+  const __m128 maxValue = _mm_set1_ps(max);
+  const __m128 minExponent = _mm_set1_ps(kSoftmaxMinExponent);
+  const __m128 log2E = _mm_set1_ps(kSoftmaxLog2E);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 ln2High = _mm_set1_ps(kSoftmaxLn2High);
+  const __m128 ln2Low = _mm_set1_ps(kSoftmaxLn2Low);
+  __m128 sum = _mm_setzero_ps();
+  int index = 0;
+  for (; index <= (count - 4); index += 4) {
+    const __m128 x = _mm_max_ps(_mm_sub_ps(_mm_loadu_ps(input + index), maxValue), minExponent);
+    const __m128 n = _mm_floor_ps(_mm_add_ps(_mm_mul_ps(x, log2E), half));
+    const __m128 r = _mm_sub_ps(_mm_sub_ps(x, _mm_mul_ps(n, ln2High)), _mm_mul_ps(n, ln2Low));
+    __m128 p = _mm_set1_ps(kSoftmaxP0);
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kSoftmaxP1));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kSoftmaxP2));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kSoftmaxP3));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kSoftmaxP4));
+    p = _mm_add_ps(_mm_mul_ps(p, r), _mm_set1_ps(kSoftmaxP5));
+    p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(p, r), r), r), one);
+    const __m128i twoToN = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23);
+    const __m128 result = _mm_mul_ps(p, _mm_castsi128_ps(twoToN));
+    _mm_storeu_ps((output + index), result);
+    sum = _mm_add_ps(sum, result);
+  }
+  jpfloat_t sums[4];
+  _mm_storeu_ps(sums, sum);
+  const jpfloat_t leftOverSum = softmax_exp_generic((input + index), (count - index), max, (output + index));
+  return (((sums[0] + sums[1]) + (sums[2] + sums[3])) + leftOverSum);
+}
+
+JP_TARGET_AVX2 jpfloat_t softmax_exp_avx2(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output) {
+  const __m256 maxValue = _mm256_set1_ps(max);
+  const __m256 minExponent = _mm256_set1_ps(kSoftmaxMinExponent);
+  const __m256 log2E = _mm256_set1_ps(kSoftmaxLog2E);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 minusLn2High = _mm256_set1_ps(-kSoftmaxLn2High);
+  const __m256 minusLn2Low = _mm256_set1_ps(-kSoftmaxLn2Low);
+  __m256 sum = _mm256_setzero_ps();
+  int index = 0;
+  for (; index <= (count - 8); index += 8) {
+    const __m256 x = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(input + index), maxValue), minExponent);
+    const __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(x, log2E, half));
+    const __m256 r = _mm256_fmadd_ps(n, minusLn2Low, _mm256_fmadd_ps(n, minusLn2High, x));
+    __m256 p = _mm256_set1_ps(kSoftmaxP0);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kSoftmaxP1));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kSoftmaxP2));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kSoftmaxP3));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kSoftmaxP4));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(kSoftmaxP5));
+    p = _mm256_add_ps(_mm256_fmadd_ps(_mm256_mul_ps(p, r), r, r), one);
+    const __m256i twoToN = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    const __m256 result = _mm256_mul_ps(p, _mm256_castsi256_ps(twoToN));
+    _mm256_storeu_ps((output + index), result);
+    sum = _mm256_add_ps(sum, result);
+  }
+  jpfloat_t sums[8];
+  _mm256_storeu_ps(sums, sum);
+  jpfloat_t total = softmax_exp_generic((input + index), (count - index), max, (output + index));
+  for (int lane = 0; lane < 8; lane += 1) {
+    total += sums[lane];
+  }
+  return total;
+}
+
+JP_TARGET_AVX512 jpfloat_t softmax_exp_avx512(const jpfloat_t* input, int count, jpfloat_t max, jpfloat_t* output) {
+  const __m512 maxValue = _mm512_set1_ps(max);
+  const __m512 minExponent = _mm512_set1_ps(kSoftmaxMinExponent);
+  const __m512 log2E = _mm512_set1_ps(kSoftmaxLog2E);
+  const __m512 half = _mm512_set1_ps(0.5f);
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 minusLn2High = _mm512_set1_ps(-kSoftmaxLn2High);
+  const __m512 minusLn2Low = _mm512_set1_ps(-kSoftmaxLn2Low);
+  __m512 sum = _mm512_setzero_ps();
+  int index = 0;
+  for (; index <= (count - 16); index += 16) {
+    const __m512 x = _mm512_max_ps(_mm512_sub_ps(_mm512_loadu_ps(input + index), maxValue), minExponent);
+    const __m512 n = _mm512_roundscale_ps(_mm512_fmadd_ps(x, log2E, half), (_MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+    const __m512 r = _mm512_fmadd_ps(n, minusLn2Low, _mm512_fmadd_ps(n, minusLn2High, x));
+    __m512 p = _mm512_set1_ps(kSoftmaxP0);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kSoftmaxP1));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kSoftmaxP2));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kSoftmaxP3));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kSoftmaxP4));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(kSoftmaxP5));
+    p = _mm512_add_ps(_mm512_fmadd_ps(_mm512_mul_ps(p, r), r, r), one);
+    const __m512i twoToN = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+    const __m512 result = _mm512_mul_ps(p, _mm512_castsi512_ps(twoToN));
+    _mm512_storeu_ps((output + index), result);
+    sum = _mm512_add_ps(sum, result);
+  }
+  const jpfloat_t leftOverSum = softmax_exp_generic((input + index), (count - index), max, (output + index));
+  return (_mm512_reduce_add_ps(sum) + leftOverSum);
+}
+
+#endif // USE_CPU_DISPATCH
@@ -0,0 +1,353 @@
+//
+//  matrix_sparse.cpp
+//  jpcnn
+//
+//  Pruned fully-connected layers, with most of their weights set to zero and
+//  the rest stored in compressed sparse row form. Each output neuron's value
+//  is the dot product of its row's remaining weights with the input values at
+//  their columns, which the AVX2 and AVX-512 kernels fetch with gathers. Only
+//  the weights that are left are read, so a layer with a tenth of its weights
+//  runs in a fraction of the time the dense one takes. Batches of images are
+//  transposed first, so that each weight multiplies a contiguous run of input
+//  values, one from each image, instead of needing a gather per image.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "matrix_ops.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "cpu_features.h"
+#include "thread_pool.h"
+
+#if defined(USE_CPU_DISPATCH)
+#include <immintrin.h>
+#endif // USE_CPU_DISPATCH
+
+// Column indices are stored in 16 bits, which limits how many inputs a
+// sparse layer can have.
+static const int kSparseMaxColumns = 65536;
+// Output neurons are handed out to threads in groups of this many rows.
+static const int kSparseRowsPerTask = 64;
+// How many images the batch kernels work on at once.
+static const int kSparseImagesPerBlock = 8;
+
+// Works out one row's dot product with a single image's input values.
+typedef jpfloat_t (*SparseDotKernelFunction)(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x);
+// Works out one row's dot products with up to kSparseImagesPerBlock images,
+// from transposed inputs where each column's values are ldx apart.
+typedef void (*SparseBlockKernelFunction)(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x, int ldx, int imagesCount, jpfloat_t* outTotals);
+
+typedef struct SSparseDotTaskStruct {
+  const SSparseMatrix* a;
+  int n;
+  const jpfloat_t* b;
+  int ldb;
+  jpfloat_t* c;
+  int ldc;
+  SparseDotKernelFunction kernel;
+  SparseBlockKernelFunction blockKernel;
+} SSparseDotTask;
+
+static jpfloat_t sparse_prune_threshold(const jpfloat_t* values, int count, jpfloat_t sparsity);
+static int compare_floats(const void* a, const void* b);
+static SparseDotKernelFunction sparse_kernel_for_current_cpu();
+static SparseBlockKernelFunction sparse_block_kernel_for_current_cpu();
+static void sparse_dot_task(void* cookie, int startIndex, int endIndex);
+static void sparse_dot_batch_task(void* cookie, int startIndex, int endIndex);
+static jpfloat_t sparse_dot_generic(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x);
+static void sparse_block_generic(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x, int ldx, int imagesCount, jpfloat_t* outTotals);
+#if defined(USE_CPU_DISPATCH)
+static jpfloat_t sparse_dot_avx2(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x);
+static jpfloat_t sparse_dot_avx512(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x);
+static void sparse_block_avx2(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x, int ldx, int imagesCount, jpfloat_t* outTotals);
+#endif // USE_CPU_DISPATCH
+
+SSparseMatrix* matrix_sparse_create(int rows, int columns, int nonZeroCount) {
+  assert(columns <= kSparseMaxColumns);
+  SSparseMatrix* result = (SSparseMatrix*)(malloc(sizeof(SSparseMatrix)));
+  result->rows = rows;
+  result->columns = columns;
+  result->nonZeroCount = nonZeroCount;
+  result->rowStarts = (int32_t*)(malloc(sizeof(int32_t) * (rows + 1)));
+  result->columnIndices = (uint16_t*)(malloc(sizeof(uint16_t) * MAX(1, nonZeroCount)));
+  result->values = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * MAX(1, nonZeroCount)));
+  return result;
+}
+
+void matrix_sparse_destroy(SSparseMatrix* matrix) {
+  free(matrix->rowStarts);
+  free(matrix->columnIndices);
+  free(matrix->values);
+  free(matrix);
+}
+
+size_t matrix_sparse_storage_bytes(const SSparseMatrix* matrix) {
+  return ((sizeof(int32_t) * (matrix->rows + 1)) +
+    ((sizeof(uint16_t) + sizeof(jpfloat_t)) * matrix->nonZeroCount));
+}
+
+SSparseMatrix* matrix_sparse_prune(Buffer* weights, bool areWeightsTransposed, jpfloat_t sparsity) {
+  assert(weights->_dims._length == 2);
+  const int rows = (areWeightsTransposed ? weights->_dims[0] : weights->_dims[1]);
+  const int columns = (areWeightsTransposed ? weights->_dims[1] : weights->_dims[0]);
+  if (columns > kSparseMaxColumns) {
+    fprintf(stderr, "matrix_sparse_prune() - %d inputs is more than the %d a sparse layer can have\n",
+      columns, kSparseMaxColumns);
+    return NULL;
+  }
+
+  Buffer* floatWeights = dequantize_buffer(weights);
+  const jpfloat_t* data = floatWeights->_data;
+  const int elementCount = (rows * columns);
+  const jpfloat_t threshold = sparse_prune_threshold(data, elementCount, sparsity);
+
+  // Untransposed weights have each row's values a whole row of the buffer
+  // apart, so they're picked out by stepping down the columns.
+  const int rowStep = (areWeightsTransposed ? columns : 1);
+  const int columnStep = (areWeightsTransposed ? 1 : rows);
+  int nonZeroCount = 0;
+  for (int index = 0; index < elementCount; index += 1) {
+    if (fabsf(data[index]) > threshold) {
+      nonZeroCount += 1;
+    }
+  }
+
+  SSparseMatrix* result = matrix_sparse_create(rows, columns, nonZeroCount);
+  int current = 0;
+  for (int row = 0; row < rows; row += 1) {
+    result->rowStarts[row] = current;
+    const jpfloat_t* rowData = (data + (row * rowStep));
+    for (int column = 0; column < columns; column += 1) {
+      const jpfloat_t value = rowData[column * columnStep];
+      if (fabsf(value) > threshold) {
+        result->columnIndices[current] = (uint16_t)(column);
+        result->values[current] = value;
+        current += 1;
+      }
+    }
+  }
+  result->rowStarts[rows] = current;
+  assert(current == nonZeroCount);
+
+  delete floatWeights;
+  return result;
+}
+
+Buffer* matrix_sparse_to_dense(const SSparseMatrix* matrix) {
+  Buffer* result = new Buffer(Dimensions(matrix->rows, matrix->columns));
+  jpfloat_t* data = result->_data;
+  memset(data, 0, result->_dims.byteCount());
+  for (int row = 0; row < matrix->rows; row += 1) {
+    jpfloat_t* rowData = (data + (row * matrix->columns));
+    for (int index = matrix->rowStarts[row]; index < matrix->rowStarts[row + 1]; index += 1) {
+      rowData[matrix->columnIndices[index]] = matrix->values[index];
+    }
+  }
+  return result;
+}
+
+size_t matrix_dot_sparse_scratch_bytes(const Dimensions& inputDims) {
+  const int imageCount = inputDims[0];
+  if (imageCount == 1) {
+    return 0;
+  }
+  return (imageCount * inputDims.removeDimensions(1).elementCount() * sizeof(jpfloat_t));
+}
+
+void matrix_dot_sparse_into(Buffer* input, const SSparseMatrix* weights, Buffer* output, Buffer* scratch, const SGemmEpilogue* epilogue) {
+  const Dimensions inputDims = input->_dims;
+  assert(inputDims._length == 2);
+  const int imageCount = inputDims[0];
+  const int inputValuesCount = inputDims[1];
+  assert(weights->columns == inputValuesCount);
+  const int outputChannels = weights->rows;
+  assert(output->_dims == Dimensions(imageCount, outputChannels));
+
+  SSparseDotTask task;
+  task.a = weights;
+  task.n = imageCount;
+  task.c = output->_data;
+  task.ldc = outputChannels;
+  task.kernel = sparse_kernel_for_current_cpu();
+  task.blockKernel = sparse_block_kernel_for_current_cpu();
+  if (imageCount == 1) {
+    task.b = input->_data;
+    task.ldb = inputValuesCount;
+    thread_pool_parallel_for(outputChannels, kSparseRowsPerTask, sparse_dot_task, &task);
+  } else {
+    assert((scratch->_dims.elementCount() * sizeof(jpfloat_t)) >= matrix_dot_sparse_scratch_bytes(inputDims));
+    jpfloat_t* transposed = scratch->_data;
+    for (int image = 0; image < imageCount; image += 1) {
+      const jpfloat_t* imageValues = (input->_data + (image * inputValuesCount));
+      for (int column = 0; column < inputValuesCount; column += 1) {
+        transposed[(column * imageCount) + image] = imageValues[column];
+      }
+    }
+    task.b = transposed;
+    task.ldb = imageCount;
+    thread_pool_parallel_for(outputChannels, kSparseRowsPerTask, sparse_dot_batch_task, &task);
+  }
+
+  if (epilogue != NULL) {
+    matrix_gemm_epilogue(outputChannels, imageCount, output->_data, outputChannels, epilogue);
+  }
+}
+
+// Returns the magnitude at or below which values should be dropped so that at
+// least the given fraction of them are. Zeros are always dropped.
+jpfloat_t sparse_prune_threshold(const jpfloat_t* values, int count, jpfloat_t sparsity) {
+  const int prunedCount = MIN(count, (int)(sparsity * count));
+  if (prunedCount <= 0) {
+    return 0.0f;
+  }
+  jpfloat_t* magnitudes = (jpfloat_t*)(malloc(sizeof(jpfloat_t) * count));
+  for (int index = 0; index < count; index += 1) {
+    magnitudes[index] = fabsf(values[index]);
+  }
+  qsort(magnitudes, count, sizeof(jpfloat_t), compare_floats);
+  const jpfloat_t result = magnitudes[prunedCount - 1];
+  free(magnitudes);
+  return result;
+}
+
+int compare_floats(const void* a, const void* b) {
+  const jpfloat_t aValue = *(const jpfloat_t*)(a);
+  const jpfloat_t bValue = *(const jpfloat_t*)(b);
+  if (aValue < bValue) {
+    return -1;
+  } else if (aValue > bValue) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+SparseDotKernelFunction sparse_kernel_for_current_cpu() {
+#if defined(USE_CPU_DISPATCH)
+  const int level = cpu_features_get_level();
+  if (level >= JPCPULevelAVX512) {
+    return sparse_dot_avx512;
+  } else if (level >= JPCPULevelAVX2) {
+    return sparse_dot_avx2;
+  }
+#endif // USE_CPU_DISPATCH
+  return sparse_dot_generic;
+}
+
+SparseBlockKernelFunction sparse_block_kernel_for_current_cpu() {
+#if defined(USE_CPU_DISPATCH)
+  if (cpu_features_get_level() >= JPCPULevelAVX2) {
+    return sparse_block_avx2;
+  }
+#endif // USE_CPU_DISPATCH
+  return sparse_block_generic;
+}
+
+void sparse_dot_task(void* cookie, int startIndex, int endIndex) {
+  const SSparseDotTask* task = (const SSparseDotTask*)(cookie);
+  const SSparseMatrix* a = task->a;
+  for (int row = startIndex; row < endIndex; row += 1) {
+    const int start = a->rowStarts[row];
+    const int count = (a->rowStarts[row + 1] - start);
+    task->c[row] = task->kernel((a->values + start), (a->columnIndices + start), count, task->b);
+  }
+}
+
+// Each row's weights are used for every block of images before moving on, so
+// they're only read from memory once however big the batch is.
+void sparse_dot_batch_task(void* cookie, int startIndex, int endIndex) {
+  const SSparseDotTask* task = (const SSparseDotTask*)(cookie);
+  const SSparseMatrix* a = task->a;
+  for (int row = startIndex; row < endIndex; row += 1) {
+    const int start = a->rowStarts[row];
+    const int count = (a->rowStarts[row + 1] - start);
+    for (int image = 0; image < task->n; image += kSparseImagesPerBlock) {
+      const int imagesCount = MIN(kSparseImagesPerBlock, (task->n - image));
+      jpfloat_t totals[kSparseImagesPerBlock];
+      task->blockKernel((a->values + start), (a->columnIndices + start), count, (task->b + image), task->ldb, imagesCount, totals);
+      for (int blockIndex = 0; blockIndex < imagesCount; blockIndex += 1) {
+        task->c[((image + blockIndex) * task->ldc) + row] = totals[blockIndex];
+      }
+    }
+  }
+}
+
+jpfloat_t sparse_dot_generic(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x) {
+  jpfloat_t total = 0.0f;
+  for (int index = 0; index < count; index += 1) {
+    total += (values[index] * x[columns[index]]);
+  }
+  return total;
+}
+
+void sparse_block_generic(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x, int ldx, int imagesCount, jpfloat_t* outTotals) {
+  jpfloat_t totals[kSparseImagesPerBlock] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+  for (int index = 0; index < count; index += 1) {
+    const jpfloat_t value = values[index];
+    const jpfloat_t* columnValues = (x + (columns[index] * ldx));
+    for (int image = 0; image < imagesCount; image += 1) {
+      totals[image] += (value * columnValues[image]);
+    }
+  }
+  for (int image = 0; image < imagesCount; image += 1) {
+    outTotals[image] = totals[image];
+  }
+}
+
+#if defined(USE_CPU_DISPATCH)
+
+// The vector kernels widen eight or sixteen column indices at a time to 32
+// bits, gather the input values they point to, and leave whatever's left over
+// at the end of the row to the plain version. There's no SSE4.1 kernel, since
+// it has no gather instruction to fetch the inputs with.
+
+JP_TARGET_AVX2 jpfloat_t sparse_dot_avx2(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x) {
+  __m256 total = _mm256_setzero_ps();
+  int index = 0;
+  for (; index <= (count - 8); index += 8) {
+    const __m256i offsets = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(columns + index)));
+    const __m256 inputs = _mm256_i32gather_ps(x, offsets, sizeof(jpfloat_t));
+    total = _mm256_fmadd_ps(_mm256_loadu_ps(values + index), inputs, total);
+  }
+  const __m128 pairs = _mm_add_ps(_mm256_castps256_ps128(total), _mm256_extractf128_ps(total, 1));
+  const __m128 quads = _mm_add_ps(pairs, _mm_movehl_ps(pairs, pairs));
+  const jpfloat_t result = _mm_cvtss_f32(_mm_add_ss(quads, _mm_shuffle_ps(quads, quads, 1)));
+  return (result + sparse_dot_generic((values + index), (columns + index), (count - index), x));
+}
+
+JP_TARGET_AVX512 jpfloat_t sparse_dot_avx512(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x) {
+  __m512 total = _mm512_setzero_ps();
+  int index = 0;
+  for (; index <= (count - 16); index += 16) {
+    const __m512i offsets = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(columns + index)));
+    const __m512 inputs = _mm512_i32gather_ps(offsets, x, sizeof(jpfloat_t));
+    total = _mm512_fmadd_ps(_mm512_loadu_ps(values + index), inputs, total);
+  }
+  const jpfloat_t result = _mm512_reduce_add_ps(total);
+  return (result + sparse_dot_generic((values + index), (columns + index), (count - index), x));
+}
+
+// A whole block of images fills a vector, so each weight is broadcast and
+// multiplied by the eight input values at its column.
+JP_TARGET_AVX2 void sparse_block_avx2(const jpfloat_t* values, const uint16_t* columns, int count, const jpfloat_t* x, int ldx, int imagesCount, jpfloat_t* outTotals) {
+  if (imagesCount != 8) {
+    sparse_block_generic(values, columns, count, x, ldx, imagesCount, outTotals);
+    return;
+  }
+  __m256 total = _mm256_setzero_ps();
+  for (int index = 0; index < count; index += 1) {
+    const __m256 columnValues = _mm256_loadu_ps(x + (columns[index] * ldx));
+    total = _mm256_fmadd_ps(_mm256_set1_ps(values[index]), columnValues, total);
+  }
+  _mm256_storeu_ps(outTotals, total);
+}
+
+#endif // USE_CPU_DISPATCH
@@ -1175,7 +1175,10 @@ void test_gl_gemm() {
     weightsFixed->_quantizedData,
     weightsMin,
     weightsMax,
+    NULL,
+    NULL,
     weightsBitsPerElement,
+    JPElementFormatLinear,
     lda,
     input->_data,
     ldb,
@@ -0,0 +1,94 @@
+//
+//  cpu_features.cpp
+//  jpcnn
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "cpu_features.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* g_levelNames[] = {
+  "generic",
+  "sse4.1",
+  "avx2",
+  "avx512",
+  "avx512vnni",
+};
+static const int kLevelsCount = (sizeof(g_levelNames) / sizeof(g_levelNames[0]));
+
+static pthread_once_t g_levelOnce = PTHREAD_ONCE_INIT;
+static int g_level = JPCPULevelGeneric;
+
+static void detect_level();
+static int supported_level();
+
+void cpu_features_initialize() {
+  pthread_once(&g_levelOnce, detect_level);
+}
+
+int cpu_features_get_level() {
+  pthread_once(&g_levelOnce, detect_level);
+  return g_level;
+}
+
+const char* cpu_features_get_level_name(int level) {
+  if ((level < 0) || (level >= kLevelsCount)) {
+    return "unknown";
+  }
+  return g_levelNames[level];
+}
+
+void detect_level() {
+  const int supportedLevel = supported_level();
+  g_level = supportedLevel;
+
+  const char* environmentValue = getenv("JPCNN_CPU");
+  if ((environmentValue == NULL) || (environmentValue[0] == '\0')) {
+    return;
+  }
+  int requestedLevel = -1;
+  for (int level = 0; level < kLevelsCount; level += 1) {
+    if (strcmp(environmentValue, g_levelNames[level]) == 0) {
+      requestedLevel = level;
+    }
+  }
+  if (requestedLevel < 0) {
+    fprintf(stderr, "jpcnn: unknown JPCNN_CPU value '%s', using '%s'\n",
+      environmentValue, g_levelNames[supportedLevel]);
+    return;
+  }
+  if (requestedLevel > supportedLevel) {
+    fprintf(stderr, "jpcnn: JPCNN_CPU asked for '%s', but this processor only supports '%s'\n",
+      environmentValue, g_levelNames[supportedLevel]);
+    return;
+  }
+  g_level = requestedLevel;
+}
+
+int supported_level() {
+#if defined(USE_CPU_DISPATCH)
+  // These also check that the operating system saves the larger registers
+  // across context switches.
+  __builtin_cpu_init();
+  const bool hasAVX2 = (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"));
+  if (hasAVX2 && __builtin_cpu_supports("avx512f")) {
+    if (__builtin_cpu_supports("avx512vnni")) {
+      return JPCPULevelAVX512VNNI;
+    }
+    return JPCPULevelAVX512;
+  }
+  if (hasAVX2) {
+    return JPCPULevelAVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return JPCPULevelSSE41;
+  }
+#endif // USE_CPU_DISPATCH
+  return JPCPULevelGeneric;
+}
@@ -0,0 +1,48 @@
+//
+//  cpu_features.h
+//  jpcnn
+//
+//  Works out which x86 vector instructions the processor we're running on
+//  supports, so that one build of the library can pick the fastest versions
+//  of its inner loops at run time rather than being compiled for the oldest
+//  machine it might end up on. The kernels that have per-instruction-set
+//  variants are compiled with the function attributes below, and switch on
+//  cpu_features_get_level() to pick one.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#ifndef INCLUDE_CPU_FEATURES_H
+#define INCLUDE_CPU_FEATURES_H
+
+// Each level includes everything from the ones before it. Every processor
+// with AVX2 also has the F16C half-precision conversions, so they're treated
+// as part of that level.
+enum JPCPU_LEVEL {
+  JPCPULevelGeneric = 0,
+  JPCPULevelSSE41 = 1,
+  JPCPULevelAVX2 = 2,
+  JPCPULevelAVX512 = 3,
+  JPCPULevelAVX512VNNI = 4
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_CPU_DISPATCH
+#define JP_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define JP_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define JP_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma,f16c")))
+#define JP_TARGET_AVX512VNNI __attribute__((target("avx512f,avx512vnni,avx2,fma,f16c")))
+#endif // __GNUC__ && (__x86_64__ || __i386__)
+
+// Detects what the processor supports, and then lowers that to the level in
+// the JPCNN_CPU environment variable if it's set to one of "generic",
+// "sse4.1", "avx2", "avx512" or "avx512vnni", so that every path can be
+// tested on one machine. This only does any work the first time it's called,
+// and is run when a network is created, though the level is also looked up on
+// demand if a kernel is called before that.
+void cpu_features_initialize();
+int cpu_features_get_level();
+const char* cpu_features_get_level_name(int level);
+
+#endif // INCLUDE_CPU_FEATURES_H
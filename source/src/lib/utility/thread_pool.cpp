@@ -0,0 +1,330 @@
+//
+//  thread_pool.cpp
+//  jpcnn
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include "thread_pool.h"
+
+#include <assert.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif // __linux__
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "jpcnn.h"
+
+static const int kMaxThreadCount = 64;
+
+// Each thread works through its own contiguous run of tasks from the front,
+// and other threads that have run out steal from the back.
+typedef struct STaskQueueStruct {
+  pthread_mutex_t lock;
+  int nextTask;
+  int endTask;
+  // Keeps neighboring queues' locks off the same cache line.
+  char padding[64];
+} STaskQueue;
+
+typedef struct SThreadPoolStruct {
+  // Includes the thread that calls thread_pool_parallel_for().
+  int threadCount;
+  pthread_t* workers;
+  STaskQueue* queues;
+
+  pthread_mutex_t stateLock;
+  pthread_cond_t workReady;
+  pthread_cond_t workDone;
+  int generation;
+  int busyWorkersCount;
+  bool shouldQuit;
+
+  ThreadPoolTaskFunction function;
+  void* cookie;
+  int itemsCount;
+  int itemsPerTask;
+} SThreadPool;
+
+typedef struct SWorkerArgsStruct {
+  SThreadPool* pool;
+  int index;
+} SWorkerArgs;
+
+// Held for as long as a loop is running on the pool, or while it's being
+// rebuilt with a different number of threads.
+static pthread_mutex_t g_poolLock = PTHREAD_MUTEX_INITIALIZER;
+static SThreadPool* g_pool = NULL;
+static int g_requestedThreadCount = 0;
+static bool g_isPinned = false;
+
+static int default_thread_count();
+static SThreadPool* create_thread_pool(int threadCount);
+static void destroy_thread_pool(SThreadPool* pool);
+static void* worker_main(void* cookie);
+static void run_tasks(SThreadPool* pool, int queueIndex);
+static void run_inline(int itemsCount, int itemsPerTask, ThreadPoolTaskFunction function, void* cookie);
+
+void thread_pool_set_thread_count(int threadCount) {
+  pthread_mutex_lock(&g_poolLock);
+  if (g_pool != NULL) {
+    destroy_thread_pool(g_pool);
+    g_pool = NULL;
+  }
+  g_requestedThreadCount = MIN(threadCount, kMaxThreadCount);
+  pthread_mutex_unlock(&g_poolLock);
+}
+
+void thread_pool_set_pinned(bool isPinned) {
+  pthread_mutex_lock(&g_poolLock);
+  if (g_pool != NULL) {
+    destroy_thread_pool(g_pool);
+    g_pool = NULL;
+  }
+  g_isPinned = isPinned;
+  pthread_mutex_unlock(&g_poolLock);
+  if (isPinned) {
+    thread_pool_pin_current_thread(0);
+  }
+}
+
+bool thread_pool_pin_current_thread(int processorIndex) {
+#if defined(__linux__)
+  const long processorsCount = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET((processorIndex % MAX(processorsCount, 1)), &cpuSet);
+  return (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) == 0);
+#else // __linux__
+  return false;
+#endif // __linux__
+}
+
+int thread_pool_get_thread_count() {
+  if (g_requestedThreadCount > 0) {
+    return g_requestedThreadCount;
+  }
+  return default_thread_count();
+}
+
+void thread_pool_parallel_for(int itemsCount, int itemsPerTask, ThreadPoolTaskFunction function, void* cookie) {
+  assert(itemsPerTask > 0);
+  if (itemsCount <= 0) {
+    return;
+  }
+  const int tasksCount = (((itemsCount - 1) / itemsPerTask) + 1);
+  if (tasksCount == 1) {
+    function(cookie, 0, itemsCount);
+    return;
+  }
+  if (pthread_mutex_trylock(&g_poolLock) != 0) {
+    run_inline(itemsCount, itemsPerTask, function, cookie);
+    return;
+  }
+  if (g_pool == NULL) {
+    const int threadCount = thread_pool_get_thread_count();
+    if (threadCount > 1) {
+      g_pool = create_thread_pool(threadCount);
+    }
+  }
+  SThreadPool* pool = g_pool;
+  if (pool == NULL) {
+    pthread_mutex_unlock(&g_poolLock);
+    run_inline(itemsCount, itemsPerTask, function, cookie);
+    return;
+  }
+
+  const int threadCount = pool->threadCount;
+  const int busyQueuesCount = MIN(threadCount, tasksCount);
+  for (int index = 0; index < threadCount; index += 1) {
+    STaskQueue* queue = &pool->queues[index];
+    if (index < busyQueuesCount) {
+      queue->nextTask = ((tasksCount * index) / busyQueuesCount);
+      queue->endTask = ((tasksCount * (index + 1)) / busyQueuesCount);
+    } else {
+      queue->nextTask = 0;
+      queue->endTask = 0;
+    }
+  }
+
+  pthread_mutex_lock(&pool->stateLock);
+  pool->function = function;
+  pool->cookie = cookie;
+  pool->itemsCount = itemsCount;
+  pool->itemsPerTask = itemsPerTask;
+  pool->generation += 1;
+  pool->busyWorkersCount = (threadCount - 1);
+  pthread_cond_broadcast(&pool->workReady);
+  pthread_mutex_unlock(&pool->stateLock);
+
+  run_tasks(pool, 0);
+
+  pthread_mutex_lock(&pool->stateLock);
+  while (pool->busyWorkersCount > 0) {
+    pthread_cond_wait(&pool->workDone, &pool->stateLock);
+  }
+  pthread_mutex_unlock(&pool->stateLock);
+
+  pthread_mutex_unlock(&g_poolLock);
+}
+
+int default_thread_count() {
+  const char* environmentValue = getenv("JPCNN_THREADS");
+  if ((environmentValue != NULL) && (atoi(environmentValue) > 0)) {
+    return MIN(atoi(environmentValue), kMaxThreadCount);
+  }
+  const long processorsCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if (processorsCount < 1) {
+    return 1;
+  }
+  return (int)(MIN(processorsCount, kMaxThreadCount));
+}
+
+SThreadPool* create_thread_pool(int threadCount) {
+  SThreadPool* pool = (SThreadPool*)(malloc(sizeof(SThreadPool)));
+  pool->threadCount = threadCount;
+  pool->workers = (pthread_t*)(malloc(sizeof(pthread_t) * threadCount));
+  pool->queues = (STaskQueue*)(malloc(sizeof(STaskQueue) * threadCount));
+  for (int index = 0; index < threadCount; index += 1) {
+    pthread_mutex_init(&pool->queues[index].lock, NULL);
+    pool->queues[index].nextTask = 0;
+    pool->queues[index].endTask = 0;
+  }
+  pthread_mutex_init(&pool->stateLock, NULL);
+  pthread_cond_init(&pool->workReady, NULL);
+  pthread_cond_init(&pool->workDone, NULL);
+  pool->generation = 0;
+  pool->busyWorkersCount = 0;
+  pool->shouldQuit = false;
+  pool->function = NULL;
+  pool->cookie = NULL;
+  pool->itemsCount = 0;
+  pool->itemsPerTask = 1;
+
+  // The calling thread does its share of the work as queue zero, so only the
+  // other threads need to be started.
+  for (int index = 1; index < threadCount; index += 1) {
+    SWorkerArgs* args = (SWorkerArgs*)(malloc(sizeof(SWorkerArgs)));
+    args->pool = pool;
+    args->index = index;
+    if (pthread_create(&pool->workers[index], NULL, worker_main, args) != 0) {
+      fprintf(stderr, "thread_pool: Couldn't start worker thread %d, running with %d threads\n", index, index);
+      free(args);
+      pool->threadCount = index;
+      break;
+    }
+  }
+
+  return pool;
+}
+
+void destroy_thread_pool(SThreadPool* pool) {
+  pthread_mutex_lock(&pool->stateLock);
+  pool->shouldQuit = true;
+  pthread_cond_broadcast(&pool->workReady);
+  pthread_mutex_unlock(&pool->stateLock);
+  for (int index = 1; index < pool->threadCount; index += 1) {
+    pthread_join(pool->workers[index], NULL);
+  }
+  for (int index = 0; index < pool->threadCount; index += 1) {
+    pthread_mutex_destroy(&pool->queues[index].lock);
+  }
+  pthread_mutex_destroy(&pool->stateLock);
+  pthread_cond_destroy(&pool->workReady);
+  pthread_cond_destroy(&pool->workDone);
+  free(pool->queues);
+  free(pool->workers);
+  free(pool);
+}
+
+void* worker_main(void* cookie) {
+  SWorkerArgs* args = (SWorkerArgs*)(cookie);
+  SThreadPool* pool = args->pool;
+  const int index = args->index;
+  free(args);
+
+  if (g_isPinned) {
+    thread_pool_pin_current_thread(index);
+  }
+
+  // The first loop may already have been posted by the time this thread gets
+  // going, so start from the generation the pool was created with.
+  int lastGeneration = 0;
+  pthread_mutex_lock(&pool->stateLock);
+  while (true) {
+    while (!pool->shouldQuit && (pool->generation == lastGeneration)) {
+      pthread_cond_wait(&pool->workReady, &pool->stateLock);
+    }
+    if (pool->shouldQuit) {
+      break;
+    }
+    lastGeneration = pool->generation;
+    pthread_mutex_unlock(&pool->stateLock);
+
+    run_tasks(pool, index);
+
+    pthread_mutex_lock(&pool->stateLock);
+    pool->busyWorkersCount -= 1;
+    if (pool->busyWorkersCount == 0) {
+      pthread_cond_signal(&pool->workDone);
+    }
+  }
+  pthread_mutex_unlock(&pool->stateLock);
+
+  return NULL;
+}
+
+static bool take_first_task(STaskQueue* queue, int* outTask) {
+  bool result = false;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->nextTask < queue->endTask) {
+    *outTask = queue->nextTask;
+    queue->nextTask += 1;
+    result = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return result;
+}
+
+static bool steal_last_task(STaskQueue* queue, int* outTask) {
+  bool result = false;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->nextTask < queue->endTask) {
+    queue->endTask -= 1;
+    *outTask = queue->endTask;
+    result = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return result;
+}
+
+void run_tasks(SThreadPool* pool, int queueIndex) {
+  const int threadCount = pool->threadCount;
+  const int itemsCount = pool->itemsCount;
+  const int itemsPerTask = pool->itemsPerTask;
+  while (true) {
+    int task;
+    bool foundTask = take_first_task(&pool->queues[queueIndex], &task);
+    for (int offset = 1; (!foundTask && (offset < threadCount)); offset += 1) {
+      const int victimIndex = ((queueIndex + offset) % threadCount);
+      foundTask = steal_last_task(&pool->queues[victimIndex], &task);
+    }
+    if (!foundTask) {
+      break;
+    }
+    const int startIndex = (task * itemsPerTask);
+    const int endIndex = MIN((startIndex + itemsPerTask), itemsCount);
+    pool->function(pool->cookie, startIndex, endIndex);
+  }
+}
+
+void run_inline(int itemsCount, int itemsPerTask, ThreadPoolTaskFunction function, void* cookie) {
+  for (int startIndex = 0; startIndex < itemsCount; startIndex += itemsPerTask) {
+    const int endIndex = MIN((startIndex + itemsPerTask), itemsCount);
+    function(cookie, startIndex, endIndex);
+  }
+}
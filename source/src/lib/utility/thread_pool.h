@@ -0,0 +1,40 @@
+//
+//  thread_pool.h
+//  jpcnn
+//
+//  A small pool of worker threads that the math kernels use to split loops
+//  over independent output rows, channels or images across cores. Loops are
+//  always cut into the same tasks however many threads there are, and each
+//  task only writes its own outputs, so results are identical whatever the
+//  thread count. Idle threads steal tasks from the end of busier threads'
+//  queues, so uneven tasks still keep every core occupied.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#ifndef INCLUDE_THREAD_POOL_H
+#define INCLUDE_THREAD_POOL_H
+
+typedef void (*ThreadPoolTaskFunction)(void* cookie, int startIndex, int endIndex);
+
+// A count of zero or less goes back to the default, which is the JPCNN_THREADS
+// environment variable if it's set, or the number of online processors.
+void thread_pool_set_thread_count(int threadCount);
+int thread_pool_get_thread_count();
+
+// Binds each worker thread to its own processor, and the calling thread to
+// the first one, so that timings aren't disturbed by the scheduler moving
+// threads around. This only has an effect on Linux, and is mostly useful for
+// benchmarking.
+void thread_pool_set_pinned(bool isPinned);
+bool thread_pool_pin_current_thread(int processorIndex);
+
+// Calls function() on consecutive ranges of at most itemsPerTask items until
+// everything in [0, itemsCount) is covered, and returns once all of them have
+// finished. If the pool is already busy, for example because this is called
+// from inside another task or from a second session's thread, the ranges are
+// run one after another on the calling thread instead.
+void thread_pool_parallel_for(int itemsCount, int itemsPerTask, ThreadPoolTaskFunction function, void* cookie);
+
+#endif // INCLUDE_THREAD_POOL_H
@@ -0,0 +1,223 @@
+//
+//  alloc_test.cpp
+//  jpcnn
+//
+//  Checks that classifying doesn't touch the heap once a session has seen a
+//  combination of batch size, flags and layer offset. Every call to malloc,
+//  calloc, realloc and operator new in the process is counted, each case is
+//  run once to warm up, and then run again with the counter switched on.
+//
+//  Created by Peter Warden on 1/9/14.
+//  Copyright (c) 2014 Jetpac, Inc. All rights reserved.
+//
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libjpcnn.h"
+
+#define STATIC_ARRAY_LEN(x) ((int)(sizeof(x) / sizeof(x[0])))
+
+static const char* kDefaultNetworkFilename = "../networks/jetpac.ntwk";
+static const char* kDefaultImageFilename = "data/dog.jpg";
+static const int kBatchSize = 4;
+static const int kTopKCount = 5;
+
+typedef enum {
+  EClassifyImage,
+  EClassifyImages,
+  EClassifyImageTopK,
+} EAllocTestCall;
+
+typedef struct SAllocTestCaseStruct {
+  const char* name;
+  EAllocTestCall call;
+  unsigned int flags;
+  int layerOffset;
+} SAllocTestCase;
+
+static const SAllocTestCase g_testCases[] = {
+  {"image", EClassifyImage, 0, 0},
+  {"image, multisample", EClassifyImage, JPCNN_MULTISAMPLE, 0},
+  {"image, features", EClassifyImage, 0, -2},
+  {"image, features, multisample", EClassifyImage, JPCNN_MULTISAMPLE, -2},
+  {"batch", EClassifyImages, 0, 0},
+  {"batch, multisample", EClassifyImages, JPCNN_MULTISAMPLE, 0},
+  {"batch, features", EClassifyImages, 0, -2},
+  {"top-k", EClassifyImageTopK, 0, 0},
+  {"top-k, skip softmax", EClassifyImageTopK, JPCNN_SKIP_SOFTMAX, 0},
+  {"top-k, multisample", EClassifyImageTopK, JPCNN_MULTISAMPLE, 0},
+};
+
+static bool g_isCounting = false;
+static int g_allocationsCount = 0;
+
+static int run_test_cases(void* network, void* session, void** imageHandles, const char* sessionName);
+static void run_test_case(void* network, void* session, void** imageHandles, const SAllocTestCase* testCase);
+static void* counted_malloc(size_t size);
+
+#if defined(__GLIBC__)
+
+// glibc exports its own allocator under these names, so the replacements
+// below can count a call and then hand it straight on.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+
+extern "C" void* malloc(size_t size) {
+  if (g_isCounting) {
+    g_allocationsCount += 1;
+  }
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  if (g_isCounting) {
+    g_allocationsCount += 1;
+  }
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size) {
+  if (g_isCounting) {
+    g_allocationsCount += 1;
+  }
+  return __libc_realloc(pointer, size);
+}
+
+#else // __GLIBC__
+
+#warning "Only operator new can be counted on this platform, not malloc"
+
+#endif // __GLIBC__
+
+void* operator new(size_t size) {
+  void* result = counted_malloc(size);
+  if (result == NULL) {
+    throw std::bad_alloc();
+  }
+  return result;
+}
+
+void* operator new[](size_t size) {
+  void* result = counted_malloc(size);
+  if (result == NULL) {
+    throw std::bad_alloc();
+  }
+  return result;
+}
+
+void operator delete(void* pointer) noexcept {
+  free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept {
+  free(pointer);
+}
+
+int main(int argc, const char* argv[]) {
+  if (argc > 3) {
+    fprintf(stderr, "Usage: %s [network file] [image file]\n", argv[0]);
+    return 1;
+  }
+  const char* networkFilename = ((argc > 1) ? argv[1] : kDefaultNetworkFilename);
+  const char* imageFilename = ((argc > 2) ? argv[2] : kDefaultImageFilename);
+
+  void* network = jpcnn_create_network(networkFilename);
+  if (network == NULL) {
+    fprintf(stderr, "Couldn't load network '%s'\n", networkFilename);
+    return 1;
+  }
+  void* imageHandles[kBatchSize];
+  for (int index = 0; index < kBatchSize; index += 1) {
+    imageHandles[index] = jpcnn_create_image_buffer_from_file(imageFilename);
+    if (imageHandles[index] == NULL) {
+      fprintf(stderr, "Couldn't load image '%s'\n", imageFilename);
+      return 1;
+    }
+  }
+  void* session = jpcnn_create_session(network);
+
+  int failuresCount = 0;
+  failuresCount += run_test_cases(network, NULL, imageHandles, "default session");
+  failuresCount += run_test_cases(network, session, imageHandles, "created session");
+
+  jpcnn_destroy_session(session);
+  for (int index = 0; index < kBatchSize; index += 1) {
+    jpcnn_destroy_image_buffer(imageHandles[index]);
+  }
+  jpcnn_destroy_network(network);
+
+  if (failuresCount > 0) {
+    fprintf(stderr, "%d cases allocated memory after warming up\n", failuresCount);
+    return 1;
+  }
+  fprintf(stdout, "No allocations after warming up\n");
+  return 0;
+}
+
+int run_test_cases(void* network, void* session, void** imageHandles, const char* sessionName) {
+  int failuresCount = 0;
+  const int testCasesCount = STATIC_ARRAY_LEN(g_testCases);
+  for (int index = 0; index < testCasesCount; index += 1) {
+    const SAllocTestCase* testCase = &g_testCases[index];
+    run_test_case(network, session, imageHandles, testCase);
+    g_allocationsCount = 0;
+    g_isCounting = true;
+    run_test_case(network, session, imageHandles, testCase);
+    g_isCounting = false;
+    const bool didPass = (g_allocationsCount == 0);
+    const int inputsCount = ((testCase->call == EClassifyImages) ? kBatchSize : 1);
+    const size_t plannedBytes = jpcnn_get_planned_memory_size(network, inputsCount, testCase->flags, testCase->layerOffset);
+    fprintf(stdout, "%s - %s: %s (%d allocations, %zu bytes planned)\n", sessionName, testCase->name, (didPass ? "ok" : "FAILED"), g_allocationsCount, plannedBytes);
+    if (!didPass) {
+      failuresCount += 1;
+    }
+  }
+  return failuresCount;
+}
+
+void run_test_case(void* network, void* session, void** imageHandles, const SAllocTestCase* testCase) {
+  float* predictions;
+  int predictionsLength;
+  char** predictionsLabels;
+  int predictionsLabelsLength;
+  JPCNNPrediction topK[kTopKCount];
+  // A NULL session means the network's built-in one, through the calls that
+  // don't take a session.
+  switch (testCase->call) {
+    case EClassifyImage: {
+      if (session == NULL) {
+        jpcnn_classify_image(network, imageHandles[0], testCase->flags, testCase->layerOffset, &predictions, &predictionsLength, &predictionsLabels, &predictionsLabelsLength);
+      } else {
+        jpcnn_classify_image_in_session(session, imageHandles[0], testCase->flags, testCase->layerOffset, &predictions, &predictionsLength, &predictionsLabels, &predictionsLabelsLength);
+      }
+    } break;
+    case EClassifyImages: {
+      if (session == NULL) {
+        jpcnn_classify_images(network, imageHandles, kBatchSize, testCase->flags, testCase->layerOffset, &predictions, &predictionsLength, &predictionsLabels, &predictionsLabelsLength);
+      } else {
+        jpcnn_classify_images_in_session(session, imageHandles, kBatchSize, testCase->flags, testCase->layerOffset, &predictions, &predictionsLength, &predictionsLabels, &predictionsLabelsLength);
+      }
+    } break;
+    case EClassifyImageTopK: {
+      if (session == NULL) {
+        jpcnn_classify_image_topk(network, imageHandles[0], testCase->flags, testCase->layerOffset, kTopKCount, topK);
+      } else {
+        jpcnn_classify_image_topk_in_session(session, imageHandles[0], testCase->flags, testCase->layerOffset, kTopKCount, topK);
+      }
+    } break;
+  }
+}
+
+void* counted_malloc(size_t size) {
+  if (g_isCounting) {
+    g_allocationsCount += 1;
+  }
+#if defined(__GLIBC__)
+  return __libc_malloc(size);
+#else // __GLIBC__
+  return malloc(size);
+#endif // __GLIBC__
+}
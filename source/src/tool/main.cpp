@@ -22,7 +22,7 @@
 
 #define STATIC_ARRAY_LEN(x) (sizeof(x) / sizeof(x[0]))
 
-enum EToolMode {eSingleImage, eLibSvmTrain, eLibSvmTest, eLibSvmPredict};
+enum EToolMode {eSingleImage, eLibSvmTrain, eLibSvmTest, eLibSvmPredict, eCalibrate, eConvert};
 typedef struct SToolArgumentValuesStruct {
   const char* networkFilename;
   const char* inputImageFilename;
@@ -31,12 +31,22 @@ typedef struct SToolArgumentValuesStruct {
   const char* negativeDirectory;
   const char* inputDirectory;
   const char* outputDirectory;
+  const char* outputNetworkFilename;
   int doMultisample;
   EToolMode mode;
   int doTime;
   float threshold;
   int layerOffset;
   int doDebugLogging;
+  int threadCount;
+  int topCount;
+  const char* halfLayers;
+  int halfFormat;
+  const char* pruneLayers;
+  float sparsity;
+  const char* factorizeLayers;
+  int rank;
+  float energy;
 } SToolArgumentValues;
 
 typedef struct SToolOptionStruct {
@@ -49,6 +59,7 @@ typedef struct SToolOptionStruct {
 } SToolOption;
 
 typedef void (*ClassifyImagesFunctionPtr)(void* cookie, float* predictions, int predictionsLength, const char* basename, const char* directoryName, const char* fullPath);
+typedef int (*LayerFunctionPtr)(void* network, const char* layerName, void* cookie);
 
 typedef struct STrainingCookieStruct {
   float label;
@@ -71,29 +82,65 @@ typedef struct SPredictionCookieStruct {
   void* predictor;
 } SPredictionCookie;
 
+typedef struct SFactorizeCookieStruct {
+  int rank;
+  float energy;
+} SFactorizeCookie;
+
+typedef struct SComparisonCookieStruct {
+  void* originalNetwork;
+  SToolArgumentValues* argValues;
+  const char* expectedLabel;
+  int total;
+  int agreedCount;
+  int labeledCount;
+  int originalCorrectCount;
+  int convertedCorrectCount;
+} SComparisonCookie;
+
 static void parse_command_line_args(int argc, const char* argv[], SToolArgumentValues* outValues);
 static void print_usage_and_exit(int argc, const char* argv[]);
 static void do_classify_image(void* network, const char* inputFilename, int doMultisample, int layerOffset, float** predictions, int* predictionsLength, char*** predictionsLabels, long* outDuration);
+static void do_classify_image_topk(void* network, const char* inputFilename, int doMultisample, int layerOffset, int topCount);
+static void print_layer_stats(void* network);
 static int has_image_suffix(const char* basename);
 static void classify_images_in_directory(void* network, const char* directoryName, SToolArgumentValues* argValues, ClassifyImagesFunctionPtr callback, void* callbackCookie);
+static int calibrate_images_in_directory(void* network, const char* directoryName, SToolArgumentValues* argValues);
+static int apply_to_layers(void* network, const char* layerNames, LayerFunctionPtr function, void* cookie);
+static int set_half_layer(void* network, const char* layerName, void* cookie);
+static int prune_layer(void* network, const char* layerName, void* cookie);
+static int factorize_layer(void* network, const char* layerName, void* cookie);
+static void compare_networks_in_directory(void* originalNetwork, void* convertedNetwork, const char* directoryName, SToolArgumentValues* argValues);
+static int index_of_largest(const float* values, int valuesLength);
 static void training_callback(void* cookie, float* predictions, int predictionsLength, const char* basename, const char* directoryName, const char* fullPath);
 static void testing_callback(void* cookie, float* predictions, int predictionsLength, const char* basename, const char* directoryName, const char* fullPath);
 static void prediction_callback(void* cookie, float* predictions, int predictionsLength, const char* basename, const char* directoryName, const char* fullPath);
+static void comparison_callback(void* cookie, float* predictions, int predictionsLength, const char* basename, const char* directoryName, const char* fullPath);
 
 static SToolOption g_toolOptions[] = {
   {"network", 'n', 1, 1, NULL, "The path to the neural network parameter file."},
-  {"mode", 'm', 1, 1, NULL, "Which operation to perform. Can be 'single'/'s' to analyze one image, 'train'/'t' to produce a prediction model from folders of positive and negative images, 'test'/'e' to load a previously-created prediction model and run it against known positive and negative images, or 'predict'/'p' to run a prediction model against a folder of images."},
+  {"mode", 'm', 1, 1, NULL, "Which operation to perform. Can be 'single'/'s' to analyze one image, 'train'/'t' to produce a prediction model from folders of positive and negative images, 'test'/'e' to load a previously-created prediction model and run it against known positive and negative images, 'predict'/'p' to run a prediction model against a folder of images, 'calibrate'/'c' to record the range of values going into each fully-connected layer for a folder of images, so they can run with 8-bit arithmetic, or 'convert'/'v' to save a copy of the network with some layers' weights stored as 16-bit floats, either IEEE half-precision or bfloat16, pruned, or factorized."},
   {"input", 'i', 0, 1, "", "The path to a single input image."},
   {"positive", 'p', 0, 1, NULL, "The path to a folder of positive images."},
   {"negative", 'e', 0, 1, NULL, "The path to a folder of negative images."},
   {"multisample", 's', 0, 0, "0", "Whether to use a higher-quality but slower strategy of running the detection against ten different transforms of the image."},
-  {"time", 't', 0, 0, "0", "Whether to print the time taken by the classification algorithm to stderr."},
+  {"time", 't', 0, 0, "0", "Whether to print the time taken by the classification algorithm to stderr. In single mode this also prints the time, arithmetic and memory traffic of each layer."},
   {"model", 'o', 0, 1, NULL, "The prediction model file."},
   {"threshold", 'h', 0, 1, "0.5", "Tunes the sensitivity of the prediction, with extreme values of 0.0 (accepts everything) to 1.0 (accepts nothing)."},
   {"layer", 'l', 0, 1, "0", "If specified, use a lower layer from the neural network."},
-  {"inputdir", 'i', 0, 1, "", "The path to a folder containing images to run the predict mode analysis against."},
+  {"inputdir", 'i', 0, 1, "", "The path to a folder containing images to run the predict or calibrate mode analysis against. In convert mode, the saved network's results on these are compared with the original's, and any images in subfolders named after one of the network's labels are used to measure the change in accuracy."},
   {"outputdir", 'i', 0, 1, "", "The path to a folder that will be filled with symbolic links to the predict mode input files, with the predicted value as the sortable prefix to the file name."},
   {"debug", 'd', 0, 0, "0", "Whether to log extra debug information."},
+  {"savenetwork", 'w', 0, 1, NULL, "Where calibrate and convert modes write the network file. Calibrate mode adds the recorded ranges, and convert mode applies the layer changes it was asked for. Other modes don't write one."},
+  {"threads", 'r', 0, 1, "0", "How many threads to spread the classification across. Zero uses the JPCNN_THREADS environment variable if it's set, or one thread per processor."},
+  {"top", 'k', 0, 1, "0", "If above zero, single mode prints this many of the best predictions, rather than every one above 0.01."},
+  {"halflayers", 'f', 0, 1, "", "A comma-separated list of the layers whose weights convert mode stores as 16-bit floats, in the format chosen by the halfformat option. The debug option prints the layer names."},
+  {"halfformat", 'b', 0, 1, "float16", "The 16-bit float format convert mode uses, either 'float16' for IEEE half-precision, or 'bfloat16' to keep the full range of 32-bit floats with less precision."},
+  {"prunelayers", 'x', 0, 1, "", "A comma-separated list of the fully-connected layers that convert mode prunes, keeping only their largest weights in sparse form."},
+  {"sparsity", 'y', 0, 1, "0.9", "The fraction of each pruned layer's weights that convert mode sets to zero."},
+  {"factorizelayers", 'z', 0, 1, "", "A comma-separated list of the fully-connected layers that convert mode replaces with two smaller ones, from a truncated singular value decomposition of their weights."},
+  {"rank", 'a', 0, 1, "0", "The rank convert mode factorizes layers at. Zero picks the smallest one that keeps the fraction of each layer's energy given by the energy option."},
+  {"energy", 'g', 0, 1, "0.9", "The fraction of the energy, the sum of the squared weights, that factorized layers keep when no rank is given."},
 };
 const int g_toolOptionsLength = STATIC_ARRAY_LEN(g_toolOptions);
 
@@ -196,6 +243,12 @@ void parse_command_line_args(int argc, const char* argv[], SToolArgumentValues*
       } else if ((strcasecmp("predict", optionStringValue) == 0) ||
         (strcasecmp("p", optionStringValue) == 0)) {
         outValues->mode = eLibSvmPredict;
+      } else if ((strcasecmp("calibrate", optionStringValue) == 0) ||
+        (strcasecmp("c", optionStringValue) == 0)) {
+        outValues->mode = eCalibrate;
+      } else if ((strcasecmp("convert", optionStringValue) == 0) ||
+        (strcasecmp("v", optionStringValue) == 0)) {
+        outValues->mode = eConvert;
       } else {
         fprintf(stderr, "Unknown argument to --mode/-m: '%s'\n", optionStringValue);
         print_usage_and_exit(argc, argv);
@@ -224,9 +277,41 @@ void parse_command_line_args(int argc, const char* argv[], SToolArgumentValues*
       outValues->inputDirectory = optionStringValue;
     } else if (strcmp("outputdir", longName) == 0) {
       outValues->outputDirectory = optionStringValue;
+    } else if (strcmp("savenetwork", longName) == 0) {
+      outValues->outputNetworkFilename = optionStringValue;
     } else if (strcmp("debug", longName) == 0) {
       const int optionIntValue = atoi(optionStringValue);
       outValues->doDebugLogging = optionIntValue;
+    } else if (strcmp("threads", longName) == 0) {
+      const int optionIntValue = atoi(optionStringValue);
+      outValues->threadCount = optionIntValue;
+    } else if (strcmp("top", longName) == 0) {
+      const int optionIntValue = atoi(optionStringValue);
+      outValues->topCount = optionIntValue;
+    } else if (strcmp("halflayers", longName) == 0) {
+      outValues->halfLayers = optionStringValue;
+    } else if (strcmp("halfformat", longName) == 0) {
+      if (strcasecmp("float16", optionStringValue) == 0) {
+        outValues->halfFormat = JPCNN_WEIGHTS_FLOAT16;
+      } else if (strcasecmp("bfloat16", optionStringValue) == 0) {
+        outValues->halfFormat = JPCNN_WEIGHTS_BFLOAT16;
+      } else {
+        fprintf(stderr, "Unknown argument to --halfformat/-b: '%s'\n", optionStringValue);
+        print_usage_and_exit(argc, argv);
+      }
+    } else if (strcmp("prunelayers", longName) == 0) {
+      outValues->pruneLayers = optionStringValue;
+    } else if (strcmp("sparsity", longName) == 0) {
+      const float optionFloatValue = atof(optionStringValue);
+      outValues->sparsity = optionFloatValue;
+    } else if (strcmp("factorizelayers", longName) == 0) {
+      outValues->factorizeLayers = optionStringValue;
+    } else if (strcmp("rank", longName) == 0) {
+      const int optionIntValue = atoi(optionStringValue);
+      outValues->rank = optionIntValue;
+    } else if (strcmp("energy", longName) == 0) {
+      const float optionFloatValue = atof(optionStringValue);
+      outValues->energy = optionFloatValue;
     } else {
       assert(false); // Should never get here
     }
@@ -296,6 +381,63 @@ void do_classify_image(void* network, const char* inputFilename, int doMultisamp
   }
 }
 
+void do_classify_image_topk(void* network, const char* inputFilename, int doMultisample, int layerOffset, int topCount) {
+  void* input = jpcnn_create_image_buffer_from_file(inputFilename);
+  if (input == NULL) {
+    return;
+  }
+  uint32_t flags = 0;
+  if (doMultisample) {
+    flags = (flags | JPCNN_MULTISAMPLE);
+  }
+  JPCNNPrediction* predictions = (JPCNNPrediction*)(malloc(sizeof(JPCNNPrediction) * topCount));
+  const int predictionsCount = jpcnn_classify_image_topk(network, input, flags, layerOffset, topCount, predictions);
+  jpcnn_destroy_image_buffer(input);
+  for (int index = 0; index < predictionsCount; index += 1) {
+    const JPCNNPrediction* prediction = &predictions[index];
+    if (prediction->name != NULL) {
+      fprintf(stdout, "%f\t%s\n", prediction->value, prediction->name);
+    } else {
+      fprintf(stdout, "%f\t%d\n", prediction->value, prediction->index);
+    }
+  }
+  free(predictions);
+}
+
+void print_layer_stats(void* network) {
+  JPCNNLayerStats* stats;
+  int statsLength;
+  jpcnn_get_layer_stats(network, &stats, &statsLength);
+  fprintf(stderr, "%-32s %10s %10s %10s %12s %12s  %s\n",
+    "Layer", "Time (ms)", "MFLOPs", "GFLOP/s", "Read (KB)", "Written (KB)", "Output");
+  float totalMilliseconds = 0.0f;
+  double totalFlops = 0.0;
+  for (int index = 0; index < statsLength; index += 1) {
+    const JPCNNLayerStats* layer = &stats[index];
+    char outputShape[128];
+    int shapeLength = 0;
+    for (int dimIndex = 0; dimIndex < layer->outputDimsLength; dimIndex += 1) {
+      shapeLength += snprintf((outputShape + shapeLength), (sizeof(outputShape) - shapeLength),
+        "%s%d", ((dimIndex == 0) ? "" : "x"), layer->outputDims[dimIndex]);
+    }
+    double gflopsPerSecond = 0.0;
+    if (layer->milliseconds > 0.0f) {
+      gflopsPerSecond = (layer->flops / (layer->milliseconds * 1000000.0));
+    }
+    fprintf(stderr, "%-32s %10.2f %10.2f %10.2f %12.1f %12.1f  %s\n",
+      layer->name,
+      layer->milliseconds,
+      (layer->flops / 1000000.0),
+      gflopsPerSecond,
+      (layer->bytesRead / 1024.0),
+      (layer->bytesWritten / 1024.0),
+      outputShape);
+    totalMilliseconds += layer->milliseconds;
+    totalFlops += layer->flops;
+  }
+  fprintf(stderr, "%-32s %10.2f %10.2f\n", "Total", totalMilliseconds, (totalFlops / 1000000.0));
+}
+
 int has_image_suffix(const char* basename) {
   const size_t basenameLength = strlen(basename);
   const char* knownSuffixes[] = {
@@ -373,6 +515,166 @@ void classify_images_in_directory(void* network, const char* directoryName, SToo
   }
 }
 
+int calibrate_images_in_directory(void* network, const char* directoryName, SToolArgumentValues* argValues) {
+  DIR* dir = opendir(directoryName);
+  if (dir == NULL) {
+    fprintf(stderr, "Couldn't open image directory '%s'\n", directoryName);
+    return 0;
+  }
+
+  uint32_t flags = 0;
+  if (argValues->doMultisample) {
+    flags = (flags | JPCNN_MULTISAMPLE);
+  }
+
+  const size_t directoryNameLength = strlen(directoryName);
+  int filesRead = 0;
+  struct dirent* dirEntry;
+  while ((dirEntry = readdir(dir)) != NULL) {
+    const char* basename = dirEntry->d_name;
+    if (!has_image_suffix(basename)) {
+      continue;
+    }
+    const size_t basenameLength = strlen(basename);
+    const size_t fullPathLength = directoryNameLength + 1 + basenameLength;
+    char* fullPath = (char*)(malloc(fullPathLength + 1));
+    snprintf(fullPath, (fullPathLength + 1), "%s/%s", directoryName, basename);
+
+    void* input = jpcnn_create_image_buffer_from_file(fullPath);
+    free(fullPath);
+    if (input == NULL) {
+      continue;
+    }
+    jpcnn_calibrate_image(network, input, flags);
+    jpcnn_destroy_image_buffer(input);
+    filesRead += 1;
+  }
+  closedir(dir);
+  if (filesRead == 0) {
+    fprintf(stderr, "No image files were found in directory '%s'\n", directoryName);
+  }
+  return filesRead;
+}
+
+// Calls the function on each layer in a comma-separated list of names, and
+// returns how many there were, or -1 if the function failed for any of them.
+int apply_to_layers(void* network, const char* layerNames, LayerFunctionPtr function, void* cookie) {
+  int layersCount = 0;
+  const char* current = layerNames;
+  while (*current != '\0') {
+    const char* comma = strchr(current, ',');
+    const size_t nameLength = ((comma != NULL) ? (size_t)(comma - current) : strlen(current));
+    if (nameLength > 0) {
+      char* layerName = strndup(current, nameLength);
+      const int functionResult = function(network, layerName, cookie);
+      free(layerName);
+      if (!functionResult) {
+        return -1;
+      }
+      layersCount += 1;
+    }
+    current += nameLength;
+    if (*current == ',') {
+      current += 1;
+    }
+  }
+  return layersCount;
+}
+
+int set_half_layer(void* network, const char* layerName, void* cookie) {
+  const int* format = (const int*)(cookie);
+  return jpcnn_set_layer_weights_format(network, layerName, *format);
+}
+
+int prune_layer(void* network, const char* layerName, void* cookie) {
+  const float* sparsity = (const float*)(cookie);
+  return jpcnn_prune_layer(network, layerName, *sparsity);
+}
+
+int factorize_layer(void* network, const char* layerName, void* cookie) {
+  const SFactorizeCookie* cookieData = (const SFactorizeCookie*)(cookie);
+  const int usedRank = jpcnn_factorize_layer(network, layerName, cookieData->rank, cookieData->energy);
+  if (usedRank > 0) {
+    fprintf(stderr, "Factorized layer '%s' at rank %d\n", layerName, usedRank);
+  }
+  return usedRank;
+}
+
+// Classifies every image in the directory with both networks. Images in
+// subdirectories are expected to be of the label the subdirectory is named
+// after, and images at the top level only count towards how often the two
+// networks agree.
+void compare_networks_in_directory(void* originalNetwork, void* convertedNetwork, const char* directoryName, SToolArgumentValues* argValues) {
+  DIR* dir = opendir(directoryName);
+  if (dir == NULL) {
+    fprintf(stderr, "Couldn't open image directory '%s'\n", directoryName);
+    return;
+  }
+
+  SComparisonCookie cookieData;
+  void* cookie = (void*)(&cookieData);
+  cookieData.originalNetwork = originalNetwork;
+  cookieData.argValues = argValues;
+  cookieData.total = 0;
+  cookieData.agreedCount = 0;
+  cookieData.labeledCount = 0;
+  cookieData.originalCorrectCount = 0;
+  cookieData.convertedCorrectCount = 0;
+
+  const size_t directoryNameLength = strlen(directoryName);
+  int hasTopLevelImages = 0;
+  struct dirent* dirEntry;
+  while ((dirEntry = readdir(dir)) != NULL) {
+    const char* basename = dirEntry->d_name;
+    if (has_image_suffix(basename)) {
+      hasTopLevelImages = 1;
+      continue;
+    }
+    if ((dirEntry->d_type != DT_DIR) || (basename[0] == '.')) {
+      continue;
+    }
+    const size_t basenameLength = strlen(basename);
+    const size_t fullPathLength = directoryNameLength + 1 + basenameLength;
+    char* fullPath = (char*)(malloc(fullPathLength + 1));
+    snprintf(fullPath, (fullPathLength + 1), "%s/%s", directoryName, basename);
+    cookieData.expectedLabel = basename;
+    classify_images_in_directory(convertedNetwork, fullPath, argValues, comparison_callback, cookie);
+    free(fullPath);
+  }
+  closedir(dir);
+
+  if (hasTopLevelImages) {
+    cookieData.expectedLabel = NULL;
+    classify_images_in_directory(convertedNetwork, directoryName, argValues, comparison_callback, cookie);
+  }
+
+  const int total = cookieData.total;
+  if (total == 0) {
+    return;
+  }
+  fprintf(stderr, "Top prediction matches the original = %.2f%% (%d/%d)\n",
+    ((cookieData.agreedCount * 100.0f) / total), cookieData.agreedCount, total);
+  const int labeledCount = cookieData.labeledCount;
+  if (labeledCount == 0) {
+    return;
+  }
+  const float originalAccuracy = ((cookieData.originalCorrectCount * 100.0f) / labeledCount);
+  const float convertedAccuracy = ((cookieData.convertedCorrectCount * 100.0f) / labeledCount);
+  fprintf(stderr, "Original accuracy = %.2f%% (%d/%d)\n", originalAccuracy, cookieData.originalCorrectCount, labeledCount);
+  fprintf(stderr, "Converted accuracy = %.2f%% (%d/%d)\n", convertedAccuracy, cookieData.convertedCorrectCount, labeledCount);
+  fprintf(stderr, "Accuracy change = %+.2f%%\n", (convertedAccuracy - originalAccuracy));
+}
+
+int index_of_largest(const float* values, int valuesLength) {
+  int result = 0;
+  for (int index = 1; index < valuesLength; index += 1) {
+    if (values[index] > values[result]) {
+      result = index;
+    }
+  }
+  return result;
+}
+
 void training_callback(void* cookie, float* predictions, int predictionsLength, const char* basename, const char* directoryName, const char* fullPath) {
   STrainingCookie* cookieData = (STrainingCookie*)(cookie);
   jpcnn_train(cookieData->trainer, cookieData->label, predictions, predictionsLength);
@@ -434,11 +736,55 @@ void prediction_callback(void* cookie, float* predictions, int predictionsLength
   free(outPath);
 }
 
+void comparison_callback(void* cookie, float* predictions, int predictionsLength, const char* basename, const char* directoryName, const char* fullPath) {
+  SComparisonCookie* cookieData = (SComparisonCookie*)(cookie);
+  SToolArgumentValues* argValues = cookieData->argValues;
+
+  float* originalPredictions;
+  int originalPredictionsLength;
+  char** originalPredictionsLabels;
+  long duration;
+  do_classify_image(cookieData->originalNetwork,
+    fullPath,
+    argValues->doMultisample,
+    argValues->layerOffset,
+    &originalPredictions,
+    &originalPredictionsLength,
+    &originalPredictionsLabels,
+    &duration);
+  if (originalPredictions == NULL) {
+    return;
+  }
+
+  const int convertedIndex = index_of_largest(predictions, predictionsLength);
+  const int originalIndex = index_of_largest(originalPredictions, originalPredictionsLength);
+  cookieData->total += 1;
+  if (convertedIndex == originalIndex) {
+    cookieData->agreedCount += 1;
+  }
+
+  const char* expectedLabel = cookieData->expectedLabel;
+  if ((expectedLabel == NULL) || (originalPredictionsLabels == NULL)) {
+    return;
+  }
+  cookieData->labeledCount += 1;
+  if (strcasecmp(originalPredictionsLabels[originalIndex], expectedLabel) == 0) {
+    cookieData->originalCorrectCount += 1;
+  }
+  if (strcasecmp(originalPredictionsLabels[convertedIndex], expectedLabel) == 0) {
+    cookieData->convertedCorrectCount += 1;
+  }
+}
+
 int main(int argc, const char * argv[]) {
 
   SToolArgumentValues argValues;
   parse_command_line_args(argc, argv, &argValues);
 
+  if (argValues.threadCount > 0) {
+    jpcnn_set_thread_count(argValues.threadCount);
+  }
+
   void* network = jpcnn_create_network(argValues.networkFilename);
 
   if (argValues.doDebugLogging) {
@@ -452,6 +798,18 @@ int main(int argc, const char * argv[]) {
       char** predictionsLabels;
       long duration;
 
+      if (argValues.doTime) {
+        jpcnn_enable_profiling(network, 1);
+      }
+
+      if (argValues.topCount > 0) {
+        do_classify_image_topk(network, argValues.inputImageFilename, argValues.doMultisample, argValues.layerOffset, argValues.topCount);
+        if (argValues.doTime) {
+          print_layer_stats(network);
+        }
+        break;
+      }
+
       do_classify_image(network,
         argValues.inputImageFilename,
         argValues.doMultisample,
@@ -471,6 +829,7 @@ int main(int argc, const char * argv[]) {
       }
       if (argValues.doTime) {
         fprintf(stderr, "Classification took %ld milliseconds\n", duration);
+        print_layer_stats(network);
       }
     } break;
 
@@ -547,6 +906,62 @@ int main(int argc, const char * argv[]) {
       jpcnn_destroy_predictor(predictor);
     } break;
 
+    case eCalibrate: {
+      if (argValues.outputNetworkFilename == NULL) {
+        fprintf(stderr, "Calibrate mode needs --savenetwork/-w\n");
+        print_usage_and_exit(argc, argv);
+      }
+      const int filesRead = calibrate_images_in_directory(network, argValues.inputDirectory, &argValues);
+      if (filesRead == 0) {
+        print_usage_and_exit(argc, argv);
+      }
+      const int saveResult = jpcnn_save_network(argValues.outputNetworkFilename, network);
+      if (!saveResult) {
+        fprintf(stderr, "Couldn't save network file to '%s'\n", argValues.outputNetworkFilename);
+        print_usage_and_exit(argc, argv);
+      }
+      fprintf(stderr, "Calibrated on %d images, saved to '%s'\n", filesRead, argValues.outputNetworkFilename);
+    } break;
+
+    case eConvert: {
+      if (argValues.outputNetworkFilename == NULL) {
+        fprintf(stderr, "Convert mode needs --savenetwork/-w\n");
+        print_usage_and_exit(argc, argv);
+      }
+      const int halfLayersCount = apply_to_layers(network, argValues.halfLayers, set_half_layer, &argValues.halfFormat);
+      if (halfLayersCount < 0) {
+        print_usage_and_exit(argc, argv);
+      }
+      const int prunedLayersCount = apply_to_layers(network, argValues.pruneLayers, prune_layer, &argValues.sparsity);
+      if (prunedLayersCount < 0) {
+        print_usage_and_exit(argc, argv);
+      }
+      SFactorizeCookie factorizeCookie;
+      factorizeCookie.rank = argValues.rank;
+      factorizeCookie.energy = argValues.energy;
+      const int factorizedLayersCount = apply_to_layers(network, argValues.factorizeLayers, factorize_layer, &factorizeCookie);
+      if (factorizedLayersCount < 0) {
+        print_usage_and_exit(argc, argv);
+      }
+      const int layersCount = (halfLayersCount + prunedLayersCount + factorizedLayersCount);
+      const int saveResult = jpcnn_save_network(argValues.outputNetworkFilename, network);
+      if (!saveResult) {
+        fprintf(stderr, "Couldn't save network file to '%s'\n", argValues.outputNetworkFilename);
+        print_usage_and_exit(argc, argv);
+      }
+      fprintf(stderr, "Converted %d layers, saved to '%s'\n", layersCount, argValues.outputNetworkFilename);
+
+      // The comparison runs the saved file rather than the network in memory,
+      // so that any precision lost in storing the weights is counted too.
+      if (argValues.inputDirectory[0] != '\0') {
+        jpcnn_destroy_network(network);
+        network = jpcnn_create_network(argValues.outputNetworkFilename);
+        void* originalNetwork = jpcnn_create_network(argValues.networkFilename);
+        compare_networks_in_directory(originalNetwork, network, argValues.inputDirectory, &argValues);
+        jpcnn_destroy_network(originalNetwork);
+      }
+    } break;
+
     default: {
       assert(false); // Should never get here
     } break;